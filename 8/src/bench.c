@@ -0,0 +1,661 @@
+/* measures the fs core without FUSE: runs reproducible workloads against a
+ * freshly formatted image and prints, as JSON on stdout, the ops/s and the
+ * latency percentiles of each
+ *
+ * the workloads are
+ *     seqwrite, seqread    @io_size chunks of one file, in order
+ *     randwrite, randread  @io_size chunks of the same file, in an order
+ *                          drawn from @seed
+ *     create, unlink       empty files in one directory
+ *     lookup               a path PATH_DEPTH_MAX - 1 directories deep
+ *     readdir              whole listings of the directory of create
+ *     replay               the operations of a trace file (see bench_replay())
+ *
+ * the reads start with a cold cache: the image is remounted before them. Each
+ * chunk is written with a pattern of its own, and the reads count a chunk that
+ * does not hold it as an error. With -c, the image is mounted with compression
+ * (see MOUNT_COMPRESS). As in test.c, the fs functions are called directly,
+ * so the fuse context they get their state from is provided here. */
+
+#include "params.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "fs_functions.h"
+#include "logger.h"
+
+#define BENCH_IMAGE "bench.img"
+#define BENCH_FS_SIZE "64M"
+#define BENCH_OPS 1000
+#define BENCH_IO_SIZE 4096
+
+/* the file of the read/write workloads, and the directory of create, unlink
+   and readdir */
+#define BENCH_FILE "/seq"
+#define BENCH_DIR "/c"
+
+/* no. of files a trace may have open at once */
+#define BENCH_REPLAY_FILES 64
+
+static struct bb_state bench_state;
+static struct fuse_context bench_context = { .private_data = &bench_state };
+
+struct fuse_context * fuse_get_context(void) {
+    return &bench_context;
+}
+
+/* a workload: @setup prepares the fs for it, untimed, and returns the no. of
+ * operations to time, else -errno; @op runs operation @i, and returns the
+ * amount of @unit it handled, else -errno; @teardown, untimed, undoes what
+ * @setup did */
+typedef struct {
+    const char * name;
+    const char * unit;
+    long (*setup)(void);
+    int (*op)(unsigned long i);
+    void (*teardown)(void);
+} bench_workload_t;
+
+/* the options, and the state shared by the workloads */
+static const char * image = BENCH_IMAGE;
+static unsigned long nops = BENCH_OPS;
+static size_t io_size = BENCH_IO_SIZE;
+static uint64_t seed = 1;
+static const char * trace_path;
+
+static char * io_buf, * io_expect;
+static int bench_fd = -1;
+static uint64_t rng;
+static FILE * trace;
+
+/* internal functions */
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift64*, so that a seed gives the same offsets on every machine */
+
+static uint64_t bench_rand(void) {
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng * 0x2545f4914f6cdd1dULL;
+}
+
+/* fill @buf with the contents of chunk @chunk of BENCH_FILE: a byte drawn
+   from @chunk, with @chunk itself at the start, so that a read of the wrong
+   chunk shows too */
+
+static void bench_pattern(char * buf, unsigned long chunk) {
+    memset(buf, 'a' + chunk % 26, io_size);
+    memcpy(buf, &chunk, io_size < sizeof(chunk) ? io_size : sizeof(chunk));
+}
+
+/* read chunk @chunk, and check it holds what the writes put there
+ *
+ * @return          the no. of bytes read, else -errno, or -EIO if they are
+ *                  not what was written */
+
+static int bench_read_chunk(unsigned long chunk) {
+    int ret = mypread(bench_fd, io_buf, io_size, (offset_t) chunk * io_size);
+
+    if (ret < 0)
+        return ret;
+    bench_pattern(io_expect, chunk);
+    if ((size_t) ret != io_size || memcmp(io_buf, io_expect, io_size) != 0)
+        return -EIO;
+    return ret;
+}
+
+static int bench_write_chunk(unsigned long chunk) {
+    bench_pattern(io_buf, chunk);
+    return mypwrite(bench_fd, io_buf, io_size, (offset_t) chunk * io_size);
+}
+
+/* unmount and mount the image again, leaving the cache cold */
+
+static int bench_remount(void) {
+    myunmount(image);
+    return mymount(image) == 0 ? 0 : -EIO;
+}
+
+/* make BENCH_FILE hold @nops chunks, and open it, after a remount if @cold */
+
+static long bench_file_open(int cold) {
+    inode_t inode;
+    unsigned long i;
+    int fd;
+
+    if (get_inode_from_path(BENCH_FILE, &inode) == 0 || inode.attr.size < nops * io_size) {
+        fd = myopen(BENCH_FILE, "w");
+        if (fd < 0)
+            return fd;
+        for (i = 0; i < nops; i++) {
+            bench_pattern(io_buf, i);
+            if (mypwrite(fd, io_buf, io_size, (offset_t) i * io_size) != (int) io_size)
+                break;
+        }
+        myfsync(fd);
+        myclose(fd);
+        if (i < nops)
+            return -ENOSPC;
+    }
+
+    if (cold && bench_remount() != 0)
+        return -EIO;
+
+    bench_fd = myopen(BENCH_FILE, "w");
+    if (bench_fd < 0)
+        return bench_fd;
+
+    rng = seed;
+    return nops;
+}
+
+static long bench_file_write_setup(void) {
+    bench_fd = myopen(BENCH_FILE, "w");
+    rng = seed;
+    return bench_fd < 0 ? bench_fd : (long) nops;
+}
+
+static long bench_file_read_setup(void) {
+    return bench_file_open(1);
+}
+
+static long bench_file_rewrite_setup(void) {
+    return bench_file_open(0);
+}
+
+static void bench_file_close(void) {
+    myfsync(bench_fd);
+    myclose(bench_fd);
+    bench_fd = -1;
+}
+
+static int bench_seq_write(unsigned long i) {
+    return bench_write_chunk(i);
+}
+
+static int bench_seq_read(unsigned long i) {
+    return bench_read_chunk(i);
+}
+
+static int bench_rand_write(unsigned long i) {
+    (void) i;
+    return bench_write_chunk(bench_rand() % nops);
+}
+
+static int bench_rand_read(unsigned long i) {
+    (void) i;
+    return bench_read_chunk(bench_rand() % nops);
+}
+
+/* the directory workloads */
+
+static void bench_dir_path(char * path, unsigned long i) {
+    sprintf(path, BENCH_DIR "/f%lu", i);
+}
+
+static int bench_create(unsigned long i) {
+    char path[PATH_LEN_MAX];
+    int fd;
+
+    bench_dir_path(path, i);
+    fd = myopen(path, "w");
+    if (fd < 0)
+        return fd;
+    myclose(fd);
+    return 1;
+}
+
+static int bench_unlink(unsigned long i) {
+    char path[PATH_LEN_MAX];
+    int ret;
+
+    bench_dir_path(path, i);
+    ret = myrm(path);
+    return ret < 0 ? ret : 1;
+}
+
+static long bench_create_setup(void) {
+    inode_t inode;
+
+    if (get_inode_from_path(BENCH_DIR, &inode) == 0 && mymkdir(BENCH_DIR) != 0)
+        return -EIO;
+    return nops;
+}
+
+/* make sure all the files of create are there */
+
+static long bench_dir_fill(void) {
+    char path[PATH_LEN_MAX];
+    inode_t inode;
+    unsigned long i;
+    int ret;
+
+    if (bench_create_setup() < 0)
+        return -EIO;
+
+    for (i = 0; i < nops; i++) {
+        bench_dir_path(path, i);
+        if (get_inode_from_path(path, &inode) == 0 && (ret = bench_create(i)) < 0)
+            return ret;
+    }
+
+    return nops;
+}
+
+static int bench_count_entry(void * buf, const char * name, const inode_t * inode, offset_t next) {
+    (void) name;
+    (void) inode;
+    (void) next;
+    (*(unsigned long *) buf)++;
+    return 0;
+}
+
+static int bench_readdir(unsigned long i) {
+    unsigned long count = 0;
+    int ret;
+
+    (void) i;
+    ret = myreaddir(BENCH_DIR, 0, bench_count_entry, &count);
+    return ret < 0 ? ret : (int) count;
+}
+
+/* each listing visits every entry, so list the directory a tenth as often */
+
+static long bench_readdir_setup(void) {
+    long ret = bench_dir_fill();
+    return ret < 0 ? ret : ret / 10 + 1;
+}
+
+/* the path of lookup: "/d/d/.../d/f" */
+
+static char deep_path[PATH_LEN_MAX];
+
+static long bench_lookup_setup(void) {
+    inode_t inode;
+    int depth, fd;
+
+    deep_path[0] = '\0';
+    for (depth = 0; depth < PATH_DEPTH_MAX - 1; depth++) {
+        strcat(deep_path, "/d");
+        if (get_inode_from_path(deep_path, &inode) == 0 && mymkdir(deep_path) != 0)
+            return -EIO;
+    }
+
+    strcat(deep_path, "/f");
+    fd = myopen(deep_path, "w");
+    if (fd < 0)
+        return fd;
+    myclose(fd);
+
+    return nops;
+}
+
+static int bench_lookup(unsigned long i) {
+    inode_t inode;
+
+    (void) i;
+    return get_inode_from_path(deep_path, &inode) == 0 ? -ENOENT : 1;
+}
+
+/* replay a trace: one operation per line, which is one of
+ *     open PATH                   create PATH if need be, and keep it open
+ *     close PATH
+ *     read PATH OFFSET LENGTH     of a file opened before, LENGTH cut to
+ *                                 @io_size
+ *     write PATH OFFSET LENGTH    likewise
+ *     fsync PATH                  likewise
+ *     mkdir PATH
+ *     rmdir PATH
+ *     unlink PATH
+ *     lookup PATH
+ *     readdir PATH
+ * with blank lines and lines starting with '#' skipped */
+
+static struct {
+    char path[PATH_LEN_MAX + 1];
+    int fd;
+} replay_files[BENCH_REPLAY_FILES];
+
+/* the fd of the open file @path, else -EBADF */
+
+static int bench_replay_fd(const char * path) {
+    int i;
+
+    for (i = 0; i < BENCH_REPLAY_FILES; i++)
+        if (replay_files[i].path[0] != '\0' && strcmp(replay_files[i].path, path) == 0)
+            return replay_files[i].fd;
+
+    return -EBADF;
+}
+
+static int bench_replay_open(const char * path) {
+    int i, fd;
+
+    if (bench_replay_fd(path) >= 0)
+        return 0;
+
+    for (i = 0; i < BENCH_REPLAY_FILES && replay_files[i].path[0] != '\0'; i++)
+        ;
+    if (i == BENCH_REPLAY_FILES)
+        return -EMFILE;
+
+    fd = myopen(path, "w");
+    if (fd < 0)
+        return fd;
+
+    strcpy(replay_files[i].path, path);
+    replay_files[i].fd = fd;
+    return 0;
+}
+
+static int bench_replay_close(const char * path) {
+    int i;
+
+    for (i = 0; i < BENCH_REPLAY_FILES; i++) {
+        if (replay_files[i].path[0] != '\0' && strcmp(replay_files[i].path, path) == 0) {
+            myclose(replay_files[i].fd);
+            replay_files[i].path[0] = '\0';
+            return 0;
+        }
+    }
+
+    return -EBADF;
+}
+
+static long bench_replay_setup(void) {
+    char line[PATH_LEN_MAX + 64];
+    long count = 0;
+
+    if (trace_path == NULL)
+        return -EINVAL;
+    trace = fopen(trace_path, "r");
+    if (trace == NULL)
+        return -errno;
+
+    while (fgets(line, sizeof(line), trace) != NULL)
+        if (line[0] != '\n' && line[0] != '#')
+            count++;
+    rewind(trace);
+
+    return count;
+}
+
+static int bench_replay(unsigned long i) {
+    char line[PATH_LEN_MAX + 64], cmd[16], path[PATH_LEN_MAX + 1];
+    unsigned long long offset = 0, length = 0;
+    inode_t inode;
+    unsigned long count = 0;
+    int fd, ret;
+
+    (void) i;
+    do {
+        if (fgets(line, sizeof(line), trace) == NULL)
+            return -EIO;
+    } while (line[0] == '\n' || line[0] == '#');
+
+    if (sscanf(line, "%15s %255s %llu %llu", cmd, path, &offset, &length) < 2)
+        return -EINVAL;
+
+    if (strcmp(cmd, "read") == 0 || strcmp(cmd, "write") == 0) {
+        if ((fd = bench_replay_fd(path)) < 0)
+            return fd;
+        if (length > io_size)
+            length = io_size;
+        return cmd[0] == 'r' ? mypread(fd, io_buf, length, offset)
+                             : mypwrite(fd, io_buf, length, offset);
+    }
+    if (strcmp(cmd, "fsync") == 0)
+        return (fd = bench_replay_fd(path)) < 0 ? fd : myfsync(fd);
+    if (strcmp(cmd, "open") == 0)
+        return bench_replay_open(path);
+    if (strcmp(cmd, "close") == 0)
+        return bench_replay_close(path);
+    if (strcmp(cmd, "mkdir") == 0)
+        return mymkdir(path);
+    if (strcmp(cmd, "rmdir") == 0)
+        return myrmdir(path);
+    if (strcmp(cmd, "unlink") == 0)
+        return myrm(path);
+    if (strcmp(cmd, "lookup") == 0)
+        return get_inode_from_path(path, &inode) == 0 ? -ENOENT : 0;
+    if (strcmp(cmd, "readdir") == 0)
+        return (ret = myreaddir(path, 0, bench_count_entry, &count)) < 0 ? ret : 0;
+
+    return -EINVAL;
+}
+
+static void bench_replay_teardown(void) {
+    int i;
+
+    for (i = 0; i < BENCH_REPLAY_FILES; i++)
+        if (replay_files[i].path[0] != '\0')
+            bench_replay_close(replay_files[i].path);
+    fclose(trace);
+    trace = NULL;
+}
+
+static const bench_workload_t workloads[] = {
+    { "seqwrite",  "bytes",   bench_file_write_setup,   bench_seq_write,  bench_file_close },
+    { "seqread",   "bytes",   bench_file_read_setup,    bench_seq_read,   bench_file_close },
+    { "randwrite", "bytes",   bench_file_rewrite_setup, bench_rand_write, bench_file_close },
+    { "randread",  "bytes",   bench_file_read_setup,    bench_rand_read,  bench_file_close },
+    { "create",    "files",   bench_create_setup,       bench_create,     NULL },
+    { "lookup",    "lookups", bench_lookup_setup,       bench_lookup,     NULL },
+    { "readdir",   "entries", bench_readdir_setup,      bench_readdir,    NULL },
+    { "unlink",    "files",   bench_dir_fill,           bench_unlink,     NULL },
+    { "replay",    "bytes",   bench_replay_setup,       bench_replay,     bench_replay_teardown }
+};
+
+#define BENCH_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+static int cmp_u64(const void * a, const void * b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* the latency under which @fraction of the @n sorted latencies fall, in us */
+
+static double percentile(const uint64_t * sorted, unsigned long n, double fraction) {
+    unsigned long i = (unsigned long) (fraction * n);
+    return sorted[i < n ? i : n - 1] / 1000.0;
+}
+
+/* run @w and print its results as a JSON object
+ *
+ * @return          0 on success, else -errno if its setup failed */
+
+static int bench_run(const bench_workload_t * w, int first) {
+    uint64_t * latency, start, total_ns = 0, amount = 0;
+    unsigned long i, errors = 0;
+    long count;
+    int ret;
+
+    fprintf(stderr, "bench: %s\n", w->name);
+
+    count = w->setup();
+    if (count < 0)
+        return count;
+
+    latency = (uint64_t *) malloc((count > 0 ? count : 1) * sizeof(uint64_t));
+    if (latency == NULL)
+        return -ENOMEM;
+
+    for (i = 0; i < (unsigned long) count; i++) {
+        start = now_ns();
+        ret = w->op(i);
+        latency[i] = now_ns() - start;
+        total_ns += latency[i];
+
+        if (ret < 0)
+            errors++;
+        else
+            amount += ret;
+    }
+
+    if (w->teardown != NULL)
+        w->teardown();
+
+    qsort(latency, count, sizeof(uint64_t), cmp_u64);
+
+    printf("%s\n    { \"name\": \"%s\", \"ops\": %ld, \"errors\": %lu, \"%s\": %llu,"
+           " \"secs\": %.6f, \"ops_per_sec\": %.1f,\n"
+           "      \"latency_us\": { \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f } }",
+           first ? "" : ",", w->name, count, errors, w->unit, (unsigned long long) amount,
+           total_ns / 1e9, total_ns > 0 ? count / (total_ns / 1e9) : 0.0,
+           count > 0 ? percentile(latency, count, 0.5) : 0.0,
+           count > 0 ? percentile(latency, count, 0.9) : 0.0,
+           count > 0 ? percentile(latency, count, 0.99) : 0.0,
+           count > 0 ? latency[count - 1] / 1000.0 : 0.0);
+
+    free(latency);
+    return 0;
+}
+
+/* whether @w is in the comma-separated list @only; all of them are if @only
+ * is NULL, but replay only if given a trace */
+
+static bool bench_selected(const bench_workload_t * w, const char * only) {
+    size_t len = strlen(w->name);
+    const char * p;
+
+    if (only == NULL)
+        return w->setup != bench_replay_setup || trace_path != NULL;
+
+    for (p = only; p != NULL; p = strchr(p, ',')) {
+        if (*p == ',')
+            p++;
+        if (strncmp(p, w->name, len) == 0 && (p[len] == '\0' || p[len] == ','))
+            return true;
+    }
+
+    return false;
+}
+
+static void usage(void) {
+    unsigned int i;
+
+    fprintf(stderr, "Usage: ./bench [-b block_size] [-c] [-s fs_size] [-i inode_count] [-n ops] [-o io_size]\n"
+                    "               [-r seed] [-t trace] [-w workload,...] [image]\n"
+                    "workloads:");
+    for (i = 0; i < BENCH_WORKLOADS; i++)
+        fprintf(stderr, " %s", workloads[i].name);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char * argv[]) {
+    const char * blk_size = "4096", * fs_size = BENCH_FS_SIZE, * only = NULL;
+    unsigned long inode_count = 0;
+    char command[PATH_LEN_MAX + 128];
+    unsigned int i;
+    int opt, first = 1, ret = 0;
+
+    while ((opt = getopt(argc, argv, "b:cs:i:n:o:r:t:w:")) != -1) {
+        switch (opt) {
+        case 'c':
+            bench_state.mount_flags |= MOUNT_COMPRESS;
+            break;
+        case 'b':
+            blk_size = optarg;
+            break;
+        case 's':
+            fs_size = optarg;
+            break;
+        case 'i':
+            inode_count = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            nops = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            io_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 't':
+            trace_path = optarg;
+            break;
+        case 'w':
+            only = optarg;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (argc - optind > 1 || nops == 0 || io_size == 0 || seed == 0) {
+        usage();
+        return 1;
+    }
+    if (argc - optind == 1)
+        image = argv[optind];
+
+    for (i = 0; i < BENCH_WORKLOADS && !bench_selected(&workloads[i], only); i++)
+        ;
+    if (i == BENCH_WORKLOADS) {
+        usage();
+        return 1;
+    }
+
+    /* room for the files of create, and the directories of lookup */
+    if (inode_count == 0)
+        inode_count = nops + PATH_DEPTH_MAX + 16;
+
+    /* logging every call would dominate the timings */
+    bench_state.logfile = fopen("/dev/null", "w");
+    log_level = LOG_ERROR;
+
+    io_buf = (char *) malloc(io_size);
+    io_expect = (char *) malloc(io_size);
+    if (io_buf == NULL || io_expect == NULL) {
+        fprintf(stderr, "bench: out of memory\n");
+        return 1;
+    }
+    memset(io_buf, 'x', io_size);
+
+    snprintf(command, sizeof(command), "./format -b %s -s %s -i %lu %s",
+             blk_size, fs_size, inode_count, image);
+    if (system(command) != 0) {
+        fprintf(stderr, "bench: cannot format %s\n", image);
+        return 1;
+    }
+    if (mymount(image) != 0) {
+        fprintf(stderr, "bench: cannot mount %s\n", image);
+        return 1;
+    }
+
+    printf("{ \"block_size\": %u, \"fs_size\": %llu, \"ops\": %lu, \"io_size\": %zu, \"seed\": %llu,\n"
+           "  \"workloads\": [",
+           BLK_SIZE, (unsigned long long) FS_SIZE, nops, io_size, (unsigned long long) seed);
+
+    for (i = 0; i < BENCH_WORKLOADS; i++) {
+        if (!bench_selected(&workloads[i], only))
+            continue;
+
+        if ((ret = bench_run(&workloads[i], first)) != 0) {
+            fprintf(stderr, "bench: %s: %s\n", workloads[i].name, strerror(-ret));
+            break;
+        }
+        first = 0;
+    }
+
+    printf("\n  ] }\n");
+
+    myunmount(image);
+    free(io_buf);
+    free(io_expect);
+
+    return ret == 0 ? 0 : 1;
+}
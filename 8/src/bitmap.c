@@ -0,0 +1,120 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bitmap.h"
+
+/* mask of the bits [@lo, @hi) within one word; 0 <= @lo < @hi <= 64 */
+#define WORD_MASK(lo, hi) \
+    ((((hi) == BITMAP_WORD_BITS) ? ~(bitmap_word_t) 0 : (((bitmap_word_t) 1 << (hi)) - 1)) & \
+     ~(((bitmap_word_t) 1 << (lo)) - 1))
+
+/* internal function prototypes */
+
+long bitmap_find_clear_range(const bitmap_word_t * map, unsigned long from, unsigned long to);
+
+bool bitmap_test(const bitmap_word_t * map, unsigned long bit) {
+    return (map[bit / BITMAP_WORD_BITS] >> (bit % BITMAP_WORD_BITS)) & 1;
+}
+
+void bitmap_set(bitmap_word_t * map, unsigned long start, unsigned long count) {
+    unsigned long end = start + count, word_end;
+
+    while (start < end) {
+        word_end = (start / BITMAP_WORD_BITS + 1) * BITMAP_WORD_BITS;
+        if (word_end > end)
+            word_end = end;
+
+        map[start / BITMAP_WORD_BITS] |= WORD_MASK(start % BITMAP_WORD_BITS,
+                                                   word_end - (start / BITMAP_WORD_BITS) * BITMAP_WORD_BITS);
+        start = word_end;
+    }
+}
+
+void bitmap_clear(bitmap_word_t * map, unsigned long start, unsigned long count) {
+    unsigned long end = start + count, word_end;
+
+    while (start < end) {
+        word_end = (start / BITMAP_WORD_BITS + 1) * BITMAP_WORD_BITS;
+        if (word_end > end)
+            word_end = end;
+
+        map[start / BITMAP_WORD_BITS] &= ~WORD_MASK(start % BITMAP_WORD_BITS,
+                                                    word_end - (start / BITMAP_WORD_BITS) * BITMAP_WORD_BITS);
+        start = word_end;
+    }
+}
+
+long bitmap_find_clear(const bitmap_word_t * map, unsigned long nbits, unsigned long start) {
+    long bit;
+
+    if (start >= nbits)
+        start = 0;
+
+    bit = bitmap_find_clear_range(map, start, nbits);
+    if (bit < 0 && start > 0)
+        bit = bitmap_find_clear_range(map, 0, start);
+
+    return bit;
+}
+
+long bitmap_find_set(const bitmap_word_t * map, unsigned long nbits, unsigned long start) {
+    unsigned long bit = start;
+    bitmap_word_t word;
+
+    while (bit < nbits) {
+        /* shift the bits before @bit out, so that they are skipped */
+        word = map[bit / BITMAP_WORD_BITS] >> (bit % BITMAP_WORD_BITS);
+        if (word != 0) {
+            bit += __builtin_ctzll(word);
+            return bit < nbits ? (long) bit : -1;
+        }
+        bit = (bit / BITMAP_WORD_BITS + 1) * BITMAP_WORD_BITS;
+    }
+
+    return -1;
+}
+
+unsigned long bitmap_clear_run(const bitmap_word_t * map, unsigned long nbits,
+                               unsigned long start, unsigned long max) {
+    unsigned long bit = start, end = start + max;
+    bitmap_word_t word;
+
+    if (end > nbits)
+        end = nbits;
+
+    while (bit < end) {
+        /* shift the bits before @bit out, and look for the first set bit */
+        word = map[bit / BITMAP_WORD_BITS] >> (bit % BITMAP_WORD_BITS);
+        if (word != 0) {
+            bit += __builtin_ctzll(word);
+            break;
+        }
+        bit = (bit / BITMAP_WORD_BITS + 1) * BITMAP_WORD_BITS;
+    }
+
+    return (bit < end ? bit : end) - start;
+}
+
+
+/* internal functions */
+
+/* find the first clear bit in [@from, @to), skipping full words at once
+ *
+ * @return          the index of the clear bit, else -1 */
+
+long bitmap_find_clear_range(const bitmap_word_t * map, unsigned long from, unsigned long to) {
+    unsigned long bit = from;
+    bitmap_word_t word;
+
+    while (bit < to) {
+        /* set the bits before @bit, so that they are skipped */
+        word = map[bit / BITMAP_WORD_BITS] | ((((bitmap_word_t) 1) << (bit % BITMAP_WORD_BITS)) - 1);
+        if (word != ~(bitmap_word_t) 0) {
+            bit = (bit / BITMAP_WORD_BITS) * BITMAP_WORD_BITS + __builtin_ctzll(~word);
+            return bit < to ? (long) bit : -1;
+        }
+        bit = (bit / BITMAP_WORD_BITS + 1) * BITMAP_WORD_BITS;
+    }
+
+    return -1;
+}
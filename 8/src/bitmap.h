@@ -0,0 +1,46 @@
+/* this header file exposes the word-at-a-time bitmap operations used for free
+ * space management */
+/* nothing else should go in here */
+
+#ifndef _BITMAP_H_
+#define _BITMAP_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* bitmaps are arrays of 64-bit words; bit @i lives in word @i / 64 */
+typedef uint64_t bitmap_word_t;
+
+#define BITMAP_WORD_BITS 64
+
+/* no. of words needed for a bitmap of @nbits bits */
+#define BITMAP_WORDS(nbits) (((nbits) + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS)
+
+bool bitmap_test(const bitmap_word_t * map, unsigned long bit);
+
+/* set/clear @count bits, starting at bit @start */
+
+void bitmap_set(bitmap_word_t * map, unsigned long start, unsigned long count);
+void bitmap_clear(bitmap_word_t * map, unsigned long start, unsigned long count);
+
+/* find the first clear bit at or after @start, wrapping around to the
+ * beginning of the bitmap if required
+ *
+ * @return          the index of the clear bit, else -1 if all @nbits bits are
+ *                  set */
+
+long bitmap_find_clear(const bitmap_word_t * map, unsigned long nbits, unsigned long start);
+
+/* find the first set bit at or after @start, without wrapping around
+ *
+ * @return          the index of the set bit, else -1 */
+
+long bitmap_find_set(const bitmap_word_t * map, unsigned long nbits, unsigned long start);
+
+/* count the clear bits starting at bit @start, stopping at the first set bit,
+ * at @nbits, or after @max bits, whichever comes first */
+
+unsigned long bitmap_clear_run(const bitmap_word_t * map, unsigned long nbits,
+                               unsigned long start, unsigned long max);
+
+#endif /* _BITMAP_H_ */
@@ -0,0 +1,647 @@
+#include "params.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "config.h"
+#include "structs.h"
+#include "cache.h"
+
+/* the cache of the mounted fs */
+#define CACHE (BB_DATA->cache)
+
+/* the shard holding the block at @addr */
+#define CACHE_SHARD(addr) (&CACHE->shards[(addr) % CACHE->shard_count])
+
+/* hash bucket of the block at @addr within its shard @shard */
+#define CACHE_HASH(shard, addr) (((addr) / CACHE->shard_count) % (shard)->bucket_count)
+
+/* internal function prototypes */
+
+cache_block_t * cache_get(cache_shard_t * shard, blk_addr_t addr, bool load);
+cache_block_t * cache_lookup(cache_shard_t * shard, blk_addr_t addr);
+cache_block_t * cache_evict(cache_shard_t * shard);
+void cache_hash_insert(cache_shard_t * shard, cache_block_t * cb);
+void cache_hash_remove(cache_shard_t * shard, cache_block_t * cb);
+void cache_block_load(cache_block_t * cb);
+void cache_mark_dirty(cache_shard_t * shard, cache_block_t * cb);
+int cache_write_run(cache_block_t ** run, unsigned int count);
+int compar_cache_addr(const void * a, const void * b);
+size_t pread_full(int fd, void * buf, size_t len, offset_t pos);
+int pwritev_full(int fd, struct iovec * iov, int count, offset_t pos);
+
+int cache_init(int fd, unsigned int count) {
+    block_cache_t * cache;
+    cache_shard_t * shard;
+    unsigned int i, per_shard;
+
+    cache = (block_cache_t *) calloc(1, sizeof(block_cache_t));
+    if (cache == NULL)
+        return -ENOMEM;
+
+    /* every shard gets the same no. of slots */
+    cache->shard_count = CACHE_SHARDS;
+    per_shard = (count + CACHE_SHARDS - 1) / CACHE_SHARDS;
+    if (per_shard == 0)
+        per_shard = 1;
+    count = per_shard * CACHE_SHARDS;
+
+    cache->fd = fd;
+    cache->count = count;
+    cache->shards = (cache_shard_t *) calloc(CACHE_SHARDS, sizeof(cache_shard_t));
+    cache->blocks = (cache_block_t *) calloc(count, sizeof(cache_block_t));
+    cache->buckets = (cache_block_t **) calloc(count, sizeof(cache_block_t *));
+    cache->data = malloc((size_t) count * BLK_SIZE);
+
+    if (cache->shards == NULL || cache->blocks == NULL || cache->buckets == NULL || cache->data == NULL) {
+        free(cache->shards);
+        free(cache->blocks);
+        free(cache->buckets);
+        free(cache->data);
+        free(cache);
+        return -ENOMEM;
+    }
+
+    /* every cache slot owns one block-sized chunk of @cache->data */
+    for (i = 0; i < count; i++)
+        cache->blocks[i].data = cache->data + (size_t) i * BLK_SIZE;
+
+    /* and every shard a slice of the slots and of the hash buckets */
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        shard = &cache->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->count = per_shard;
+        shard->bucket_count = per_shard;
+        shard->blocks = cache->blocks + i * per_shard;
+        shard->buckets = cache->buckets + i * per_shard;
+    }
+
+    CACHE = cache;
+    return 0;
+}
+
+void cache_destroy(void) {
+    unsigned int i;
+
+    if (CACHE == NULL)
+        return;
+
+    cache_flush();
+
+    for (i = 0; i < CACHE->shard_count; i++)
+        pthread_mutex_destroy(&CACHE->shards[i].lock);
+
+    free(CACHE->shards);
+    free(CACHE->blocks);
+    free(CACHE->buckets);
+    free(CACHE->data);
+    free(CACHE);
+    CACHE = NULL;
+}
+
+void cache_read(offset_t pos, void * buf, size_t len) {
+    cache_shard_t * shard;
+    cache_block_t * cb;
+    unsigned int block_offset, n;
+
+    while (len > 0) {
+        block_offset = pos % BLK_SIZE;
+        n = BLK_SIZE - block_offset;
+        if (n > len)
+            n = len;
+
+        shard = CACHE_SHARD(pos / BLK_SIZE);
+        pthread_mutex_lock(&shard->lock);
+        cb = cache_get(shard, pos / BLK_SIZE, true);
+        memcpy(buf, cb->data + block_offset, n);
+        pthread_mutex_unlock(&shard->lock);
+
+        buf = (char *) buf + n;
+        pos += n;
+        len -= n;
+    }
+}
+
+void cache_read_bulk(offset_t pos, void * buf, size_t len) {
+    cache_shard_t * shard;
+    cache_block_t * cb;
+    blk_addr_t addr;
+    offset_t end = pos + len, block_start, from, to;
+    size_t n;
+
+    n = pread_full(CACHE->fd, buf, len, pos);
+    if (n < len)
+        memset((char *) buf + n, 0, len - n);
+
+    /* the cached copy of a block is at least as recent as the one on disk */
+    for (addr = pos / BLK_SIZE; (offset_t) addr * BLK_SIZE < end; addr++) {
+        shard = CACHE_SHARD(addr);
+        pthread_mutex_lock(&shard->lock);
+
+        cb = cache_lookup(shard, addr);
+        if (cb != NULL) {
+            block_start = (offset_t) addr * BLK_SIZE;
+            from = block_start > pos ? block_start : pos;
+            to = block_start + BLK_SIZE < end ? block_start + BLK_SIZE : end;
+            memcpy((char *) buf + (from - pos), cb->data + (from - block_start), to - from);
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void cache_prefetch(blk_addr_t addr, unsigned int count) {
+    cache_shard_t * shard;
+    cache_block_t * cb;
+    unsigned int i, j, run;
+    bool cached;
+    char * buf;
+    size_t n;
+
+    for (i = 0; i < count; i += run) {
+        run = 0;
+        do {
+            shard = CACHE_SHARD(addr + i + run);
+            pthread_mutex_lock(&shard->lock);
+            cached = cache_lookup(shard, addr + i + run) != NULL;
+            pthread_mutex_unlock(&shard->lock);
+        } while (! cached && i + ++run < count);
+
+        if (run == 0) {
+            run = 1;
+            continue;
+        }
+
+        buf = malloc((size_t) run * BLK_SIZE);
+        if (buf == NULL)
+            return;
+
+        /* read without holding any lock */
+        n = pread_full(CACHE->fd, buf, (size_t) run * BLK_SIZE, (offset_t) (addr + i) * BLK_SIZE);
+        if (n < (size_t) run * BLK_SIZE)
+            memset(buf + n, 0, (size_t) run * BLK_SIZE - n);
+
+        /* a block which was brought in (and maybe changed) in the meantime is
+           newer than what was read */
+        for (j = 0; j < run; j++) {
+            shard = CACHE_SHARD(addr + i + j);
+            pthread_mutex_lock(&shard->lock);
+            if (cache_lookup(shard, addr + i + j) == NULL) {
+                cb = cache_get(shard, addr + i + j, false);
+                memcpy(cb->data, buf + (size_t) j * BLK_SIZE, BLK_SIZE);
+            }
+            pthread_mutex_unlock(&shard->lock);
+        }
+
+        free(buf);
+    }
+}
+
+void cache_write(offset_t pos, const void * buf, size_t len) {
+    cache_shard_t * shard;
+    cache_block_t * cb;
+    unsigned int block_offset, n;
+
+    while (len > 0) {
+        block_offset = pos % BLK_SIZE;
+        n = BLK_SIZE - block_offset;
+        if (n > len)
+            n = len;
+
+        shard = CACHE_SHARD(pos / BLK_SIZE);
+        pthread_mutex_lock(&shard->lock);
+
+        /* a block which is overwritten completely need not be read first */
+        cb = cache_get(shard, pos / BLK_SIZE, n != BLK_SIZE);
+        memcpy(cb->data + block_offset, buf, n);
+        cache_mark_dirty(shard, cb);
+
+        pthread_mutex_unlock(&shard->lock);
+
+        buf = (const char *) buf + n;
+        pos += n;
+        len -= n;
+    }
+}
+
+int cache_write_blocks(blk_addr_t addr, char * const * blocks, unsigned int count) {
+    struct iovec iov[IOV_MAX];
+    cache_shard_t * shard;
+    cache_block_t * cb;
+    unsigned int i, n;
+    int ret = 0;
+
+    /* bring the cached copies up to date first, so that none of them can be
+       written back over the blocks once they are on disk. The write itself
+       holds no lock: the caller keeps the readers of the blocks out, so no
+       stale copy is read in meanwhile. */
+    for (i = 0; i < count; i++) {
+        shard = CACHE_SHARD(addr + i);
+        pthread_mutex_lock(&shard->lock);
+        cb = cache_lookup(shard, addr + i);
+        if (cb != NULL) {
+            memcpy(cb->data, blocks[i], BLK_SIZE);
+            if (cb->dirty) {
+                cb->dirty = false;
+                shard->dirty_count--;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    for (i = 0; i < count; i += n) {
+        for (n = 0; n < IOV_MAX && i + n < count; n++) {
+            iov[n].iov_base = blocks[i + n];
+            iov[n].iov_len = BLK_SIZE;
+        }
+
+        if (pwritev_full(CACHE->fd, iov, n, (offset_t) (addr + i) * BLK_SIZE) != 0)
+            ret = -EIO;
+
+        shard = CACHE_SHARD(addr + i);
+        pthread_mutex_lock(&shard->lock);
+        shard->writes++;
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    return ret;
+}
+
+void cache_zero(blk_addr_t addr) {
+    cache_shard_t * shard = CACHE_SHARD(addr);
+    cache_block_t * cb;
+
+    pthread_mutex_lock(&shard->lock);
+
+    cb = cache_get(shard, addr, false);
+    memset(cb->data, 0, BLK_SIZE);
+    cache_mark_dirty(shard, cb);
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+bool cache_pin(blk_addr_t addr) {
+    cache_shard_t * shard = CACHE_SHARD(addr);
+    cache_block_t * cb;
+    bool pinned = true;
+
+    pthread_mutex_lock(&shard->lock);
+
+    cb = cache_lookup(shard, addr);
+    if (cb == NULL || ! cb->pinned) {
+        if (shard->pinned_count >= shard->count / 2) {
+            pinned = false;
+        }
+        else {
+            cache_get(shard, addr, true)->pinned = true;
+            shard->pinned_count++;
+        }
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+    return pinned;
+}
+
+void cache_unpin(blk_addr_t addr) {
+    cache_shard_t * shard = CACHE_SHARD(addr);
+    cache_block_t * cb;
+
+    pthread_mutex_lock(&shard->lock);
+    cb = cache_lookup(shard, addr);
+    if (cb != NULL && cb->pinned) {
+        cb->pinned = false;
+        shard->pinned_count--;
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void cache_stats(unsigned long * hits, unsigned long * misses, unsigned long * writes) {
+    cache_shard_t * shard;
+    unsigned int i;
+
+    *hits = *misses = *writes = 0;
+    for (i = 0; i < CACHE->shard_count; i++) {
+        shard = &CACHE->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        *hits += shard->hits;
+        *misses += shard->misses;
+        *writes += shard->writes;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void cache_discard(blk_addr_t addr, unsigned int count) {
+    cache_shard_t * shard;
+    cache_block_t * cb;
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        shard = CACHE_SHARD(addr + i);
+        pthread_mutex_lock(&shard->lock);
+
+        cb = cache_lookup(shard, addr + i);
+        if (cb != NULL) {
+            if (cb->dirty)
+                shard->dirty_count--;
+            if (cb->pinned)
+                shard->pinned_count--;
+            cache_hash_remove(shard, cb);
+            cb->valid = false;
+            cb->dirty = false;
+            cb->pinned = false;
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+int cache_flush(void) {
+    cache_block_t ** dirty;
+    unsigned int i, n = 0, run_start, dirty_count = 0;
+    int ret = 0;
+
+    /* hold every shard while the dirty blocks are gathered and written */
+    for (i = 0; i < CACHE->shard_count; i++) {
+        pthread_mutex_lock(&CACHE->shards[i].lock);
+        dirty_count += CACHE->shards[i].dirty_count;
+        if (CACHE->shards[i].error != 0) {
+            ret = CACHE->shards[i].error;
+            CACHE->shards[i].error = 0;
+        }
+    }
+
+    if (dirty_count > 0) {
+        dirty = (cache_block_t **) malloc(dirty_count * sizeof(cache_block_t *));
+        if (dirty == NULL) {
+            ret = -EIO;
+            goto out;
+        }
+
+        for (i = 0; i < CACHE->count; i++)
+            if (CACHE->blocks[i].valid && CACHE->blocks[i].dirty)
+                dirty[n++] = &CACHE->blocks[i];
+
+        /* write the dirty blocks in disk order, one write per run of adjacent
+           block addresses */
+        qsort(dirty, n, sizeof(cache_block_t *), compar_cache_addr);
+
+        for (run_start = 0, i = 1; i <= n; i++) {
+            if (i == n || dirty[i]->addr != dirty[i - 1]->addr + 1) {
+                if (cache_write_run(&dirty[run_start], i - run_start) != 0)
+                    ret = -EIO;
+                run_start = i;
+            }
+        }
+
+        free(dirty);
+    }
+
+    if (fsync(CACHE->fd) != 0)
+        ret = -EIO;
+
+ out:
+    for (i = 0; i < CACHE->shard_count; i++)
+        pthread_mutex_unlock(&CACHE->shards[i].lock);
+
+    return ret;
+}
+
+
+/* internal functions */
+
+/* get the cache slot holding the block at @addr, bringing the block into the
+ * cache if it is not there already; the caller holds the lock of @shard, the
+ * shard of @addr
+ *
+ * @param load      whether the block contents have to be read from disk on a
+ *                  miss; pass false if the caller overwrites the whole block */
+
+cache_block_t * cache_get(cache_shard_t * shard, blk_addr_t addr, bool load) {
+    cache_block_t * cb = cache_lookup(shard, addr);
+
+    if (cb != NULL) {
+        shard->hits++;
+        cb->referenced = true;
+        return cb;
+    }
+
+    shard->misses++;
+
+    cb = cache_evict(shard);
+    cb->addr = addr;
+    cb->valid = true;
+    cb->dirty = false;
+    cb->referenced = true;
+    cb->pinned = false;
+
+    if (load)
+        cache_block_load(cb);
+
+    cache_hash_insert(shard, cb);
+    return cb;
+}
+
+/* find the block at @addr in its shard @shard, or NULL */
+
+cache_block_t * cache_lookup(cache_shard_t * shard, blk_addr_t addr) {
+    cache_block_t * cb;
+
+    for (cb = shard->buckets[CACHE_HASH(shard, addr)]; cb != NULL; cb = cb->hash_next)
+        if (cb->addr == addr)
+            return cb;
+
+    return NULL;
+}
+
+/* pick a free slot of @shard using the CLOCK algorithm, writing back its
+ * previous contents if they are dirty. Pinned blocks are passed over, unless
+ * the whole shard is pinned, and so are blocks which fail to write, unless
+ * none of the shard can be written; the block is lost then, and the next
+ * cache_flush() fails. */
+
+cache_block_t * cache_evict(cache_shard_t * shard) {
+    cache_block_t * cb;
+    unsigned int scanned;
+
+    for (scanned = 0; ; scanned++) {
+        cb = &shard->blocks[shard->hand];
+        shard->hand = (shard->hand + 1) % shard->count;
+
+        if (! cb->valid)
+            return cb;
+
+        /* give recently used blocks a second chance */
+        if (cb->referenced) {
+            cb->referenced = false;
+            continue;
+        }
+
+        if (cb->pinned && scanned < 2 * shard->count)
+            continue;
+
+        if (cb->dirty && cache_write_run(&cb, 1) != 0) {
+            if (scanned < 4 * shard->count)
+                continue;
+            cb->dirty = false;
+            shard->dirty_count--;
+            shard->error = -EIO;
+        }
+
+        if (cb->pinned)
+            shard->pinned_count--;
+        cache_hash_remove(shard, cb);
+        cb->valid = false;
+        cb->pinned = false;
+        return cb;
+    }
+}
+
+void cache_hash_insert(cache_shard_t * shard, cache_block_t * cb) {
+    cache_block_t ** bucket = &shard->buckets[CACHE_HASH(shard, cb->addr)];
+
+    cb->hash_next = *bucket;
+    *bucket = cb;
+}
+
+void cache_hash_remove(cache_shard_t * shard, cache_block_t * cb) {
+    cache_block_t ** p = &shard->buckets[CACHE_HASH(shard, cb->addr)];
+
+    while (*p != NULL && *p != cb)
+        p = &(*p)->hash_next;
+
+    if (*p != NULL)
+        *p = cb->hash_next;
+}
+
+/* read the block of @cb from disk; whatever lies past the end of the storage
+ * file reads as zeroes */
+
+void cache_block_load(cache_block_t * cb) {
+    size_t n = pread_full(CACHE->fd, cb->data, BLK_SIZE, (offset_t) cb->addr * BLK_SIZE);
+
+    if (n < BLK_SIZE)
+        memset(cb->data + n, 0, BLK_SIZE - n);
+}
+
+void cache_mark_dirty(cache_shard_t * shard, cache_block_t * cb) {
+    if (! cb->dirty) {
+        cb->dirty = true;
+        shard->dirty_count++;
+    }
+}
+
+/* write @count dirty blocks with consecutive addresses, starting at @run[0],
+ * to disk in a single write, and mark them clean if it succeeds; the caller
+ * holds the locks of their shards */
+
+int cache_write_run(cache_block_t ** run, unsigned int count) {
+    char * buf;
+    unsigned int i;
+    size_t len = (size_t) count * BLK_SIZE;
+    ssize_t n;
+    offset_t pos = (offset_t) run[0]->addr * BLK_SIZE;
+    int ret = 0;
+
+    if (count == 1) {
+        buf = run[0]->data;
+    }
+    else {
+        buf = malloc(len);
+        if (buf == NULL)
+            return -EIO;
+        for (i = 0; i < count; i++)
+            memcpy(buf + (size_t) i * BLK_SIZE, run[i]->data, BLK_SIZE);
+    }
+
+    for (i = 0; i < len; i += n) {
+        n = pwrite(CACHE->fd, buf + i, len - i, pos + i);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            ret = -EIO;
+            break;
+        }
+    }
+
+    if (count > 1)
+        free(buf);
+
+    CACHE_SHARD(run[0]->addr)->writes++;
+
+    if (ret != 0)
+        return ret;
+
+    for (i = 0; i < count; i++) {
+        run[i]->dirty = false;
+        CACHE_SHARD(run[i]->addr)->dirty_count--;
+    }
+
+    return ret;
+}
+
+int compar_cache_addr(const void * a, const void * b) {
+    const cache_block_t * cb1 = *(const cache_block_t * const *) a;
+    const cache_block_t * cb2 = *(const cache_block_t * const *) b;
+
+    return (cb1->addr > cb2->addr) - (cb1->addr < cb2->addr);
+}
+
+/* read @len bytes at @pos of @fd into @buf, retrying short reads
+ *
+ * @return          the no. of bytes read, which is less than @len only at the
+ *                  end of the file or on error */
+
+size_t pread_full(int fd, void * buf, size_t len, offset_t pos) {
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        n = pread(fd, (char *) buf + done, len - done, pos + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+
+    return done;
+}
+
+/* write the @count buffers of @iov at byte offset @pos of @fd, in as few
+ * writes as it takes
+ *
+ * @return          0 on success, else -EIO */
+
+int pwritev_full(int fd, struct iovec * iov, int count, offset_t pos) {
+    ssize_t n;
+
+    while (count > 0) {
+        n = pwritev(fd, iov, count, pos);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -EIO;
+
+        /* pick up where a short write stopped */
+        pos += n;
+        while (count > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
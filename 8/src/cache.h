@@ -0,0 +1,90 @@
+/* this header file exposes the block cache that sits between fs_functions.c
+ * and the storage file of the filesystem */
+/* nothing else should go in here */
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include "structs.h"
+
+/* set up a cache of (about) @count blocks in front of the storage file open
+ * as @fd. All the functions below may be called from any no. of threads at
+ * once; the cache is split into shards with a lock each, and the storage
+ * file is only accessed with pread()/pwrite(). */
+
+/* @return          0 on success, else -ENOMEM */
+
+int cache_init(int fd, unsigned int count);
+
+/* write back all dirty blocks and free the cache */
+
+void cache_destroy(void);
+
+/* read @len bytes at byte offset @pos on the fs into @buf; the range may span
+ * more than one block */
+
+void cache_read(offset_t pos, void * buf, size_t len);
+
+/* read @len bytes at byte offset @pos on the fs into @buf with a single read
+ * of the storage file, without bringing the blocks into the cache; blocks
+ * which are already cached are taken from the cache */
+
+void cache_read_bulk(offset_t pos, void * buf, size_t len);
+
+/* bring the @count blocks starting at @addr into the cache ahead of their
+ * use; each run of blocks which are not cached yet is read with one read */
+
+void cache_prefetch(blk_addr_t addr, unsigned int count);
+
+/* write @len bytes from @buf at byte offset @pos on the fs; the blocks touched
+ * are only marked dirty, and reach the disk on eviction or cache_flush() */
+
+void cache_write(offset_t pos, const void * buf, size_t len);
+
+/* write the @count whole blocks at @blocks, one buffer each, to the blocks
+ * starting at @addr with a single write of the storage file, rather than
+ * through the cache; copies of them which are cached are brought up to date.
+ * No lock of the cache is held during the write, so the caller has to keep
+ * anyone else from reading the blocks until this returns.
+ *
+ * @return          0 on success, else -EIO */
+
+int cache_write_blocks(blk_addr_t addr, char * const * blocks, unsigned int count);
+
+/* fill the block at @addr with zeroes, without reading it from disk first */
+
+void cache_zero(blk_addr_t addr);
+
+/* keep the block at @addr in the cache, and off the disk, until it is
+ * unpinned; the journal pins the blocks of a transaction until it commits.
+ * The block is brought into the cache if it is not there. At most half the
+ * slots of a shard are pinned, so that the others can still be evicted.
+ *
+ * @return          true if the block is pinned, else false if its shard has
+ *                  no more slots to pin */
+
+bool cache_pin(blk_addr_t addr);
+
+void cache_unpin(blk_addr_t addr);
+
+/* add up the hits, misses and writes of all shards since the cache was set
+ * up */
+
+void cache_stats(unsigned long * hits, unsigned long * misses, unsigned long * writes);
+
+/* drop the @count blocks starting at @addr from the cache, without writing
+ * them back; for blocks whose contents no longer matter */
+
+void cache_discard(blk_addr_t addr, unsigned int count);
+
+/* write all dirty blocks back to disk, coalescing runs of adjacent blocks into
+ * single writes, and sync the storage file; blocks which fail to write stay
+ * dirty
+ *
+ * @return          0 on success, else -EIO, also if a dirty block has been
+ *                  lost since the last call because it could not be written
+ *                  back on eviction */
+
+int cache_flush(void);
+
+#endif /* _CACHE_H_ */
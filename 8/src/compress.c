@@ -0,0 +1,399 @@
+#include "params.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "structs.h"
+#include "compress.h"
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+/* the cluster cache of the mounted fs */
+#define CLUSTERS (BB_DATA->clusters)
+
+#ifdef HAVE_LZ4
+
+size_t compress_buffer(const char * src, size_t len, char * dst, size_t max) {
+    int n = LZ4_compress_default(src, dst, (int) len, (int) max);
+
+    return n > 0 ? (size_t) n : 0;
+}
+
+int decompress_buffer(const char * src, size_t len, char * dst, size_t max) {
+    int n = LZ4_decompress_safe(src, dst, (int) len, (int) max);
+
+    return n >= 0 ? n : -1;
+}
+
+#else
+
+/* the LZ4 block format: a sequence of a token byte, whose high nibble is the
+   no. of literals and low nibble the match length (less LZ4_MIN_MATCH), each
+   going on in extra bytes while they are 15, then the literals, then the
+   2-byte little-endian offset of the match back from where it is copied to,
+   and the extra bytes of the match length. The last sequence has literals
+   only: the last LZ4_LAST_LITERALS bytes are always literals, and no match
+   starts less than LZ4_MATCH_LIMIT bytes from the end. */
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MATCH_LIMIT 12
+#define LZ4_MAX_OFFSET 65535
+
+/* no. of bits of the hash of 4 bytes, which indexes the table of the last
+   position each was seen at */
+#define LZ4_HASH_BITS 12
+
+/* internal function prototypes */
+
+uint32_t lz4_read32(const unsigned char * p);
+uint64_t lz4_read64(const unsigned char * p);
+unsigned int lz4_hash(uint32_t v);
+size_t lz4_count(const unsigned char * p, const unsigned char * ref, const unsigned char * limit);
+unsigned char * lz4_put_length(unsigned char * op, size_t n);
+unsigned char * lz4_repeat(unsigned char * op, const unsigned char * ref, size_t len);
+
+uint32_t lz4_read32(const unsigned char * p) {
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint64_t lz4_read64(const unsigned char * p) {
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+unsigned int lz4_hash(uint32_t v) {
+    return (v * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+/* count the bytes from @p on, up to @limit, which are the same as those from
+ * @ref on; 8 at a time, and on a little-endian machine the first which differs
+ * among 8 is found from the bits of their difference */
+
+size_t lz4_count(const unsigned char * p, const unsigned char * ref, const unsigned char * limit) {
+    const unsigned char * start = p;
+    uint64_t diff;
+
+    for (; p + 8 <= limit; p += 8, ref += 8) {
+        if ((diff = lz4_read64(p) ^ lz4_read64(ref)) != 0) {
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return p - start + __builtin_ctzll(diff) / 8;
+#else
+            break;
+#endif
+        }
+    }
+
+    for (; p < limit && *p == *ref; p++, ref++)
+        ;
+
+    return p - start;
+}
+
+/* write the extra bytes of a length of @n past 15 at @op
+ *
+ * @return          the byte after them */
+
+unsigned char * lz4_put_length(unsigned char * op, size_t n) {
+    for (; n >= 255; n -= 255)
+        *op++ = 255;
+    *op++ = (unsigned char) n;
+
+    return op;
+}
+
+/* copy @len bytes from @ref on to @op, which they overlap: the bytes between
+ * them repeat, and are copied in pieces which double as the copy goes on
+ *
+ * @return          the byte after the copy */
+
+unsigned char * lz4_repeat(unsigned char * op, const unsigned char * ref, size_t len) {
+    unsigned char * end = op + len;
+    size_t n;
+
+    for (; op < end; op += n) {
+        n = (size_t) (op - ref) < (size_t) (end - op) ? (size_t) (op - ref) : (size_t) (end - op);
+        memcpy(op, ref, n);
+    }
+
+    return end;
+}
+
+size_t compress_buffer(const char * src, size_t len, char * dst, size_t max) {
+    const unsigned char * base = (const unsigned char *) src, * end = base + len;
+    const unsigned char * ip = base, * anchor = base, * ref;
+    unsigned char * op = (unsigned char *) dst, * oend = op + max;
+    uint32_t table[1 << LZ4_HASH_BITS];
+    size_t literals, match, step;
+    unsigned int h;
+
+    memset(table, 0, sizeof(table));
+
+    /* find each match greedily, by looking up the last position the next 4
+       bytes were seen at; the further the last match is behind, the more
+       bytes are skipped, so that data which does not compress is got through
+       fast */
+    if (len > LZ4_MATCH_LIMIT) {
+        for (ip = base + 1, step = 1; ip + LZ4_MATCH_LIMIT <= end; ip += step) {
+            h = lz4_hash(lz4_read32(ip));
+            ref = base + table[h];
+            table[h] = ip - base;
+
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || lz4_read32(ref) != lz4_read32(ip)) {
+                step = 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            /* extend the match both ways */
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            match = LZ4_MIN_MATCH + lz4_count(ip + LZ4_MIN_MATCH, ref + LZ4_MIN_MATCH, end - LZ4_LAST_LITERALS);
+
+            literals = ip - anchor;
+            if (op + 1 + literals / 255 + 1 + literals + 2 + (match - LZ4_MIN_MATCH) / 255 + 1 > oend)
+                return 0;
+
+            *op++ = (unsigned char) ((literals >= 15 ? 15 : literals) << 4 |
+                                     (match - LZ4_MIN_MATCH >= 15 ? 15 : match - LZ4_MIN_MATCH));
+            if (literals >= 15)
+                op = lz4_put_length(op, literals - 15);
+            memcpy(op, anchor, literals);
+            op += literals;
+
+            *op++ = (unsigned char) ((ip - ref) & 0xff);
+            *op++ = (unsigned char) ((ip - ref) >> 8);
+            if (match - LZ4_MIN_MATCH >= 15)
+                op = lz4_put_length(op, match - LZ4_MIN_MATCH - 15);
+
+            ip += match;
+            anchor = ip;
+            step = 0;
+
+            /* the position just before the next search is likely to be
+               matched again */
+            if (ip + LZ4_MATCH_LIMIT <= end)
+                table[lz4_hash(lz4_read32(ip - 2))] = ip - 2 - base;
+        }
+    }
+
+    /* and the bytes left over as literals */
+    literals = end - anchor;
+    if (op + 1 + literals / 255 + 1 + literals > oend)
+        return 0;
+
+    *op++ = (unsigned char) ((literals >= 15 ? 15 : literals) << 4);
+    if (literals >= 15)
+        op = lz4_put_length(op, literals - 15);
+    memcpy(op, anchor, literals);
+    op += literals;
+
+    return op - (unsigned char *) dst;
+}
+
+int decompress_buffer(const char * src, size_t len, char * dst, size_t max) {
+    const unsigned char * ip = (const unsigned char *) src, * iend = ip + len;
+    unsigned char * op = (unsigned char *) dst, * oend = op + max, * ref, * end;
+    size_t literals, match, offset;
+    unsigned char token, b;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        literals = token >> 4;
+        if (literals == 15) {
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                literals += b;
+            } while (b == 255);
+        }
+        if (literals > (size_t) (iend - ip) || literals > (size_t) (oend - op))
+            return -1;
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+
+        /* the last sequence has no match */
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | (size_t) ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t) (op - (unsigned char *) dst))
+            return -1;
+
+        match = token & 15;
+        if (match == 15) {
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                match += b;
+            } while (b == 255);
+        }
+        match += LZ4_MIN_MATCH;
+        if (match > (size_t) (oend - op))
+            return -1;
+
+        /* a match which is 8 bytes or more back is copied 8 bytes at a time,
+           which may run past its end, if there is room for that; one which
+           overlaps the bytes it produces repeats the @offset bytes before it,
+           which are copied in pieces that double as the copy goes on */
+        ref = op - offset;
+        if (offset >= 8 && match + 8 <= (size_t) (oend - op)) {
+            for (end = op + match; op < end; op += 8, ref += 8)
+                memcpy(op, ref, 8);
+            op = end;
+        }
+        else if (match < 64) {
+            while (match-- > 0)
+                *op++ = *ref++;
+        }
+        else {
+            op = lz4_repeat(op, ref, match);
+        }
+    }
+
+    return op - (unsigned char *) dst;
+}
+
+#endif /* HAVE_LZ4 */
+
+int cluster_cache_init(unsigned int count, size_t size) {
+    cluster_cache_t * cache;
+    unsigned int i;
+
+    cache = (cluster_cache_t *) calloc(1, sizeof(cluster_cache_t));
+    if (cache == NULL)
+        return -ENOMEM;
+
+    if (count == 0)
+        count = 1;
+    cache->count = count;
+    cache->slot_size = size;
+    cache->slots = (cluster_slot_t *) calloc(count, sizeof(cluster_slot_t));
+    cache->data = (char *) malloc(count * size);
+
+    if (cache->slots == NULL || cache->data == NULL) {
+        free(cache->slots);
+        free(cache->data);
+        free(cache);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < count; i++)
+        cache->slots[i].data = cache->data + i * size;
+    pthread_mutex_init(&cache->lock, NULL);
+
+    CLUSTERS = cache;
+    return 0;
+}
+
+void cluster_cache_destroy(void) {
+    if (CLUSTERS == NULL)
+        return;
+
+    pthread_mutex_destroy(&CLUSTERS->lock);
+    free(CLUSTERS->slots);
+    free(CLUSTERS->data);
+    free(CLUSTERS);
+    CLUSTERS = NULL;
+}
+
+bool cluster_cache_read(blk_addr_t addr, size_t pos, void * buf, size_t len) {
+    cluster_slot_t * slot;
+    unsigned int i;
+
+    if (CLUSTERS == NULL)
+        return false;
+
+    pthread_mutex_lock(&CLUSTERS->lock);
+
+    /* the cache holds few clusters, so a scan is as fast as any lookup */
+    for (i = 0; i < CLUSTERS->count; i++) {
+        slot = &CLUSTERS->slots[i];
+        if (slot->addr == addr && pos + len <= slot->len) {
+            memcpy(buf, slot->data + pos, len);
+            slot->referenced = true;
+            CLUSTERS->hits++;
+            pthread_mutex_unlock(&CLUSTERS->lock);
+            return true;
+        }
+    }
+
+    CLUSTERS->misses++;
+    pthread_mutex_unlock(&CLUSTERS->lock);
+    return false;
+}
+
+void cluster_cache_insert(blk_addr_t addr, const char * data, size_t len) {
+    cluster_slot_t * slot;
+    unsigned int i;
+
+    if (CLUSTERS == NULL || len > CLUSTERS->slot_size)
+        return;
+
+    pthread_mutex_lock(&CLUSTERS->lock);
+
+    /* another reader may have brought the cluster in meanwhile */
+    for (i = 0; i < CLUSTERS->count; i++) {
+        if (CLUSTERS->slots[i].addr == addr) {
+            pthread_mutex_unlock(&CLUSTERS->lock);
+            return;
+        }
+    }
+
+    /* the CLOCK hand passes over the slots used since it last came by */
+    for (;;) {
+        slot = &CLUSTERS->slots[CLUSTERS->hand];
+        CLUSTERS->hand = (CLUSTERS->hand + 1) % CLUSTERS->count;
+        if (! slot->referenced)
+            break;
+        slot->referenced = false;
+    }
+
+    slot->addr = addr;
+    slot->len = len;
+    slot->referenced = true;
+    memcpy(slot->data, data, len);
+
+    pthread_mutex_unlock(&CLUSTERS->lock);
+}
+
+void cluster_cache_forget(blk_addr_t addr) {
+    unsigned int i;
+
+    if (CLUSTERS == NULL)
+        return;
+
+    pthread_mutex_lock(&CLUSTERS->lock);
+    for (i = 0; i < CLUSTERS->count; i++) {
+        if (CLUSTERS->slots[i].addr == addr) {
+            CLUSTERS->slots[i].addr = 0;
+            CLUSTERS->slots[i].referenced = false;
+        }
+    }
+    pthread_mutex_unlock(&CLUSTERS->lock);
+}
+
+void cluster_cache_stats(unsigned long * hits, unsigned long * misses) {
+    pthread_mutex_lock(&CLUSTERS->lock);
+    *hits = CLUSTERS->hits;
+    *misses = CLUSTERS->misses;
+    pthread_mutex_unlock(&CLUSTERS->lock);
+}
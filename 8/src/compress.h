@@ -0,0 +1,65 @@
+/* this header file exposes the codec the data of compressed files is stored
+ * with, and the cache of decompressed clusters kept in front of it (see
+ * INODE_F_COMPRESS in structs.h) */
+/* nothing else should go in here */
+
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "structs.h"
+
+/* the data is stored in the LZ4 block format: with liblz4 if built with
+ * -DHAVE_LZ4, else with the codec built in, which reads and writes the same
+ * format */
+
+/* compress the @len bytes at @src into at most @max bytes at @dst
+ *
+ * @return          the size of the compressed data, else 0 if it does not fit
+ *                  in @max bytes */
+
+size_t compress_buffer(const char * src, size_t len, char * dst, size_t max);
+
+/* decompress the @len bytes of compressed data at @src into at most @max bytes
+ * at @dst; corrupt data is detected, and never read or written past the
+ * buffers
+ *
+ * @return          the size of the data, else -1 if @src is corrupt or its
+ *                  data does not fit in @max bytes */
+
+int decompress_buffer(const char * src, size_t len, char * dst, size_t max);
+
+/* set up a cache of @count decompressed clusters of at most @size bytes each.
+ * The clusters are known by the address of their compressed data, which is
+ * unique while they are allocated. All the functions below may be called from
+ * any no. of threads at once, and do nothing (and miss) if there is no
+ * cache. */
+
+/* @return          0 on success, else -ENOMEM */
+
+int cluster_cache_init(unsigned int count, size_t size);
+
+void cluster_cache_destroy(void);
+
+/* copy @len bytes at byte @pos of the cluster at @addr into @buf
+ *
+ * @return          true if the cluster was in the cache, else false */
+
+bool cluster_cache_read(blk_addr_t addr, size_t pos, void * buf, size_t len);
+
+/* add the @len bytes at @data, decompressed from the cluster at @addr, to the
+ * cache; a cluster larger than the slots is not cached */
+
+void cluster_cache_insert(blk_addr_t addr, const char * data, size_t len);
+
+/* drop the cluster at @addr from the cache; for clusters being freed */
+
+void cluster_cache_forget(blk_addr_t addr);
+
+/* the hits and misses of cluster_cache_read() since the cache was set up */
+
+void cluster_cache_stats(unsigned long * hits, unsigned long * misses);
+
+#endif /* _COMPRESS_H_ */
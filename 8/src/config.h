@@ -4,17 +4,34 @@
 #ifndef _CONFIG_H_
 #define _CONFIG_H_
 
+/* the geometry of a fs (block size, block count, inode count) is chosen when
+   it is formatted, and recorded in its super block; the parameters below
+   which depend on it are read from FS_SUPER, the super block of the fs being
+   worked on. FS_SUPER is defined by params.h for the mounted fs, and by
+   format.c for the fs being formatted. */
+
+
 /* filesystem-wide parameters */
 /* -------------------------- */
 
+/* identifies a formatted image, and the version of its on-disk format */
+#define FS_MAGIC 0x62626673
+#define FS_VERSION 8
+
 /* max length of fs name */
 #define FS_NAME_MAX 255
 
 /* Inode number of root */
 #define ROOT_INODE_NUMBER 1
 
+/* inumber format gives the directory of snapshots */
+#define SNAPSHOTS_INODE_NUMBER 2
+
 /* fs size in bytes */
-#define FS_SIZE (100 * 1024)
+#define FS_SIZE (FS_SUPER->fs_size)
+
+/* fs size in bytes used by format when none is given */
+#define FS_SIZE_DEFAULT (16 * 1024 * 1024)
 
 /* max length of a filename */
 #define FILE_NAME_MAX 10
@@ -25,30 +42,52 @@
 /* max length of a path */
 #define PATH_LEN_MAX 255
 
-/* no of max open files at one time */
-#define MAX_OPEN_FILES (INODE_COUNT)
+/* no of max open files at one time; any no. of them may be open on the same
+   file */
+#define MAX_OPEN_FILES 65536
 
 
 /* block parameters */
 /* ---------------- */
 
-/* block size in bytes */
-#define BLK_SIZE 64
+/* block size in bytes; a power of 2 in [BLK_SIZE_MIN, BLK_SIZE_MAX] */
+#define BLK_SIZE (FS_SUPER->blk_size)
 
-/* no. of blocks on fs */
-#define BLK_COUNT (FS_SIZE / BLK_SIZE)
+#define BLK_SIZE_MIN 512
+#define BLK_SIZE_MAX (64 * 1024)
+
+/* block size in bytes used by format when none is given */
+#define BLK_SIZE_DEFAULT 4096
 
-/* no. of boot blocks */
-#define BLK_BOOT_COUNT 1
+/* no. of blocks on fs */
+#define BLK_COUNT (FS_SUPER->blk_count)
 
-/* no. of super blocks */
-#define BLK_SUPER_COUNT (((FS_NAME_MAX + 1) / BLK_SIZE) + 1)
+/* no. of blocks before the inode list: the boot area and the super block */
+#define BLK_RESERVED_COUNT ((BLK_SUPER_ADDR + sizeof(super_block_t) + BLK_SIZE - 1) / BLK_SIZE)
 
 /* no. of inode blocks; 1 inode == 1 block */
 #define BLK_INODE_COUNT INODE_COUNT
 
+/* size in bytes of the free block bitmap; one bit per data block, rounded up
+   to a whole no. of 64-bit words (BLK_COUNT is used as an upper bound on the
+   no. of data blocks) */
+#define BITMAP_SIZE ((((offset_t) BLK_COUNT + 63) / 64) * 8)
+
+/* no. of free block bitmap blocks */
+#define BLK_BITMAP_COUNT ((BITMAP_SIZE + BLK_SIZE - 1) / BLK_SIZE)
+
+/* size in bytes of the share table; one share_count_t per data block
+   (BLK_COUNT is used as an upper bound on the no. of data blocks) */
+#define SHARES_SIZE ((offset_t) BLK_COUNT * sizeof(share_count_t))
+
+/* no. of share table blocks */
+#define BLK_SHARES_COUNT ((SHARES_SIZE + BLK_SIZE - 1) / BLK_SIZE)
+
 /* no. of data blocks */
-#define BLK_DATA_COUNT (BLK_COUNT - (BLK_BOOT_COUNT + BLK_SUPER_COUNT + INODE_COUNT))
+#define BLK_DATA_COUNT (FS_SUPER->data_count)
+
+/* no. of journal blocks */
+#define BLK_JOURNAL_COUNT (FS_SUPER->journal_count)
 
 /* max file entries in one block */
 #define MAX_FILES_PER_BLOCK (BLK_SIZE/sizeof(file_entry_t))
@@ -57,14 +96,193 @@
 #define MAX_ADDR_PER_BLOCK (BLK_SIZE/sizeof(blk_addr_t))
 
 
+/* directory parameters */
+/* -------------------- */
+
+/* max entries in a directory index block */
+#define DIR_INDEX_MAX (BLK_SIZE / sizeof(dir_index_t) - 1)
+
+/* max index levels below the root of a directory's hash tree; with 2 levels
+   of index blocks, a directory holds more than 100,000 entries even with
+   512 byte blocks */
+#define DIR_LEVELS_MAX 1
+
+
+/* block cache parameters */
+/* ---------------------- */
+
+/* size in bytes of the in-memory block cache; it holds CACHE_SIZE / BLK_SIZE
+   blocks */
+#define CACHE_SIZE (4 * 1024 * 1024)
+
+/* no. of independently locked shards the block cache is split into */
+#define CACHE_SHARDS 16
+
+
+/* readahead parameters */
+/* --------------------- */
+
+/* readahead window of a sequential read stream, in blocks; the window starts
+   at RA_BLKS_MIN and doubles with every sequential read, up to RA_BLKS_MAX */
+#define RA_BLKS_MIN 4
+#define RA_BLKS_MAX 32
+
+
+/* journal parameters */
+/* ------------------ */
+
+/* identifies the blocks written to the journal */
+#define JOURNAL_MAGIC 0x626a726e
+
+/* size of the journal made by format, as a fraction (1 / JOURNAL_FRACTION) of
+   the blocks on the fs, but at least JOURNAL_BLKS_MIN blocks */
+#define JOURNAL_FRACTION 64
+#define JOURNAL_BLKS_MIN 32
+
+/* max block addresses in a descriptor block */
+#define JOURNAL_DESC_MAX ((BLK_SIZE - sizeof(journal_descriptor_t)) / sizeof(blk_addr_t))
+
+/* max blocks in one transaction: it has to fit in the journal after the
+   header and descriptor blocks and before the commit block, its addresses in
+   the descriptor block, and since its blocks stay pinned in the cache until
+   it commits, it may take at most a quarter of the cache. The blocks may still
+   crowd one shard of the cache; cache_pin() refuses them then. */
+#define JOURNAL_TXN_FIT(n, max) ((n) < (max) ? (n) : (max))
+#define JOURNAL_TXN_MAX JOURNAL_TXN_FIT(JOURNAL_TXN_FIT((offset_t) BLK_JOURNAL_COUNT - 3, JOURNAL_DESC_MAX), \
+                                        CACHE_SIZE / BLK_SIZE / 4)
+
+
+/* logging parameters */
+/* ------------------ */
+
+/* most verbose log level (see logger.h) compiled in; calls to log messages
+   above it are dropped by the compiler. Build with e.g.
+   -DLOG_LEVEL_MAX=LOG_ERROR to take the trace of every call out of the hot
+   path. */
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_DEBUG
+#endif
+
+/* log level used when the mount options give none */
+#define LOG_LEVEL_DEFAULT LOG_INFO
+
+/* no. of messages the log ring holds; a power of 2. Messages logged while
+   the ring is full are dropped, and counted. */
+#define LOG_RING_SIZE 4096
+
+/* max length of a message; longer ones are cut short */
+#define LOG_LINE_MAX 256
+
+/* how long the log flusher thread sleeps when the ring is empty, in ms */
+#define LOG_FLUSH_MS 50
+
+
+/* statistics parameters */
+/* --------------------- */
+
+/* path of the virtual file the statistics are read from */
+#define STATS_PATH "/.stats"
+
+/* latency histograms have 2^STATS_SUB_BITS buckets per power of 2 of
+   nanoseconds, so that the value reported for a bucket is within
+   1/2^STATS_SUB_BITS of the latencies in it */
+#define STATS_SUB_BITS 3
+#define STATS_SUB_COUNT (1 << STATS_SUB_BITS)
+
+/* no. of buckets in a latency histogram, enough for any 64-bit value */
+#define STATS_BUCKETS (STATS_SUB_COUNT * (64 - STATS_SUB_BITS + 1))
+
+
+/* open file table parameters */
+/* ---------------------------- */
+
+/* the slots of the open file table are allocated FILE_TABLE_CHUNK at a time,
+   as more files are open at once; a chunk is never moved nor freed, so that an
+   fd can be looked up without a lock */
+#define FILE_TABLE_CHUNK 256
+#define FILE_TABLE_CHUNKS ((MAX_OPEN_FILES + FILE_TABLE_CHUNK - 1) / FILE_TABLE_CHUNK)
+
+/* no. of hash buckets of the inodes open through the file table */
+#define OPEN_INODE_BUCKETS 1024
+
+/* no. of file table entries (or open inodes) allocated at once by the slab
+   allocator */
+#define FILE_TABLE_SLAB 64
+
+
+/* delayed allocation parameters */
+/* ------------------------------- */
+
+/* max bytes of data past its last block a file holds back from allocation;
+   the data is written out once it would grow past that */
+#define DELALLOC_FILE_MAX (4 * 1024 * 1024)
+
+/* max bytes of data all the open files hold back together */
+#define DELALLOC_TOTAL_MAX (32 * 1024 * 1024)
+
+/* no. of blocks of memory for data held back allocated at once by the slab
+   allocator */
+#define DELALLOC_SLAB 64
+
+
+/* compression parameters */
+/* ---------------------- */
+
+/* the data a compressed file holds back from allocation is compressed as it
+   is written out, a cluster of COMPRESS_CLUSTER_BLKS blocks at a time: about
+   COMPRESS_CLUSTER_SIZE bytes, but at least 2 blocks, as a cluster is only
+   kept compressed if that saves a block */
+#define COMPRESS_CLUSTER_SIZE (32 * 1024)
+#define COMPRESS_CLUSTER_BLKS (COMPRESS_CLUSTER_SIZE / BLK_SIZE > 2 ? COMPRESS_CLUSTER_SIZE / BLK_SIZE : 2)
+
+/* each compressed cluster is an extent of its own; a file stops compressing
+   once it has that many extents, so as to leave some for the rest of it */
+#define COMPRESS_EXTENTS_MAX (EXTENTS_MAX / 2)
+
+/* size in bytes of the cache of decompressed clusters */
+#define CLUSTER_CACHE_SIZE (1024 * 1024)
+
+
+/* snapshot parameters */
+/* ------------------- */
+
+/* name the directory of snapshots shows up under in the root directory,
+   which has no entry for it */
+#define SNAPSHOTS_NAME ".snapshots"
+
+/* max no. of snapshots; a data block is shared by at most one file outside
+   them and one in each, so its share count (see share_count_t) is at most
+   this */
+#define SNAPSHOTS_MAX 65535
+
+
+/* directory entry cache parameters */
+/* ---------------------------------- */
+
+/* no. of (parent, name) -> inumber entries in the directory entry cache */
+#define DCACHE_ENTRIES 1024
+
+
 /* inode parameters */
 /* ---------------- */
 
-/* NOTE: (BLKS_DIRECT + BLKS_INDIRECT) * sizeof(blk_addr_t) + size of other
-   meta-data in 'struct inode_t' <= FS_SIZE */
+/* NOTE: sizeof(inode_t) <= BLK_SIZE_MIN */
+
+/* total no. of inodes */
+#define INODE_COUNT (FS_SUPER->inode_count)
+
+/* no. of inodes created by format when none is given, as a % of the total
+   block count; 1 inode == 1 block */
+#define INODE_PERCENT_DEFAULT 5
+
+/* bytes of the inode list read at a time when it is loaded into the inode
+   table at mount */
+#define INODE_LOAD_SIZE (1024 * 1024)
 
-/* total no. of inodes, as a % of total block count; 1 inode == 1 block */
-#define INODE_COUNT (int) (0.05 * BLK_COUNT)
+/* max size of a file whose data is kept inline, in the spare bytes of its
+   inode's block after the inode itself; a file is moved out to data blocks the
+   first time it is written past that */
+#define INODE_INLINE_MAX (BLK_SIZE - sizeof(inode_t))
 
 /* number of direct blocks per inode */
 #define BLKS_DIRECT 8
@@ -72,22 +290,50 @@
 /* number of indirect blocks per inode */
 #define BLKS_INDIRECT 2
 
-/* maximum file size */
-#define FILE_SIZE_MAX (BLK_SIZE * (BLKS_DIRECT + BLKS_INDIRECT * \
-                                   MAX_ADDR_PER_BLOCK))
+/* maximum no. of blocks in a file mapped by direct and indirect blocks */
+#define FILE_BLKS_MAX (BLKS_DIRECT + BLKS_INDIRECT * MAX_ADDR_PER_BLOCK)
+
+/* maximum size of a file mapped by direct and indirect blocks */
+#define FILE_SIZE_MAX ((offset_t) BLK_SIZE * FILE_BLKS_MAX)
+
+/* no. of extents kept in the inode itself, for files mapped by extents */
+#define INODE_EXTENTS 4
+
+/* no. of extent blocks per inode, which hold the extents past the first
+   INODE_EXTENTS */
+#define INODE_EXTENT_BLOCKS 4
+
+/* max extents in one extent block */
+#define EXTENTS_PER_BLOCK (BLK_SIZE/sizeof(extent_t))
+
+/* maximum no. of extents of a file */
+#define EXTENTS_MAX (INODE_EXTENTS + INODE_EXTENT_BLOCKS * EXTENTS_PER_BLOCK)
 
 
 /* important disk locations */
 /* ------------------------ */
 
-/* location of super block on disk */
-#define BLK_SUPER_ADDR (BLK_SIZE * BLK_BOOT_COUNT)
+/* location of super block on disk; it does not depend on the block size, so
+   that the super block can be read before the block size is known */
+#define BLK_SUPER_ADDR 1024
 
 /* location of inode list on disk */
-#define INODE_LIST_ADDR (BLK_SIZE * (BLK_BOOT_COUNT + BLK_SUPER_COUNT))
+#define INODE_LIST_ADDR ((offset_t) FS_SUPER->inode_list * BLK_SIZE)
+
+/* location of the free block bitmap on disk */
+#define BLK_BITMAP_ADDR (FS_SUPER->block_bitmap)
+
+/* location of the share table on disk */
+#define BLK_SHARES_ADDR ((offset_t) FS_SUPER->share_start * BLK_SIZE)
+
+/* block address of the journal */
+#define BLK_JOURNAL_START (FS_SUPER->journal_start)
+
+/* block address of the first data block */
+#define BLK_DATA_START (FS_SUPER->data_start)
 
 /* location of data blocks on disk */
-#define BLK_DATA_ADDR (BLK_SIZE * (BLK_BOOT_COUNT + BLK_SUPER_COUNT + BLK_INODE_COUNT))
+#define BLK_DATA_ADDR ((offset_t) BLK_DATA_START * BLK_SIZE)
 
 
 #endif /* _CONFIG_H_ */
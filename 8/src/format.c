@@ -1,93 +1,128 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include <libgen.h>
 
 #include "config.h"
 #include "structs.h"
 
-void super_init(const char * fs_name,super_block_t * super);
-void block_seek_next(FILE * fs);
-blk_addr_t block_get_next(FILE * fs);
-void write_zeroes(FILE * fs, int count);
+/* the super block of the fs being formatted, which holds its geometry (see
+   config.h) */
+static super_block_t format_super;
+#define FS_SUPER (&format_super)
 
-void myformat(const char * fs_name) {
-    int i;
-    long data_blocks_pos;
-    blk_addr_t next;
-    FILE * fs;
+int super_init(const char * fs_name, super_block_t * super, unsigned int blk_size,
+               offset_t fs_size, inumber_t inode_count);
+int write_all(int fd, const void * buf, size_t len, offset_t pos);
+offset_t parse_size(const char * str);
+
+/* format the fs image @fs_name with blocks of @blk_size bytes, a total size of
+ * @fs_size bytes and @inode_count inodes; @inode_count == 0 picks
+ * INODE_PERCENT_DEFAULT % of the blocks
+ *
+ * @return          0 on success, else -1 if the geometry is invalid or the
+ *                  image cannot be written */
+
+int myformat(const char * fs_name, unsigned int blk_size, offset_t fs_size, inumber_t inode_count) {
+    journal_header_t header = { JOURNAL_MAGIC, 1 };
+    inode_t * rootdir, * snapshots;
+    char * meta;
+    size_t meta_size;
+    int fd, ret = 0;
 
     /* setup data structures */
-    super_block_t super;
-    super_init(fs_name,&super);
-
-    /* create storage if it does not already exist, else re-format it */
-    fs = fopen(fs_name, "wb");
-
-    /* write 0s to entir filesystem */
-    write_zeroes(fs, FS_SIZE);
-    fseek(fs, 0, SEEK_SET);
-
-    /* write 0s to boot block */
-    write_zeroes(fs, BLK_SIZE);
-
-    /* write super blocks */
-    fwrite(&super, sizeof(super_block_t), 1, fs);
-    block_seek_next(fs);
-
-    /*Write the rootdir structure to the superblock */
-    inode_t rootdir;
-    rootdir.inumber = 1;
-    rootdir.used = true;
-    rootdir.attr.size = 0;
-    rootdir.attr.type = DIR_T;
-    rootdir.attr.creation_time = time(NULL);
-    for(i = 0; i<BLKS_DIRECT; i++)
-        rootdir.blocks_direct[i] = 0;
-    for(i = 0; i<BLKS_INDIRECT; i++)
-        rootdir.blocks_indirect[i] = 0;
-    fwrite(&rootdir,sizeof(inode_t),1,fs);
-    block_seek_next(fs);
-    /* write the rest of the inodes to inode list blocks */
-    inode_t inode;
-    int j;
-    for(j = 1;j<INODE_COUNT;j++) {
-        inode.inumber = j+1;
-        inode.used = false;
-        inode.attr.type = 0;
-        inode.attr.mode = 0;
-        inode.attr.creation_time = 0;
-        inode.attr.size = 0;
-        for(i = 0; i<BLKS_DIRECT; i++)
-            rootdir.blocks_direct[i] = 0;
-        for(i = 0; i<BLKS_INDIRECT; i++)
-            rootdir.blocks_indirect[i] = 0;
-        fwrite(&inode,sizeof(inode_t),1,fs);
-        block_seek_next(fs);
+    if (super_init(fs_name, &format_super, blk_size, fs_size, inode_count) != 0)
+        return -1;
+
+    /* create storage if it does not already exist, else re-format it; the
+       image starts out as one big hole, which reads as zeroes, so only the
+       blocks which must not be all zeroes are written below. An all-zero
+       bitmap marks every data block as free, and an all-zero inode is an
+       unused one (mymount() fills in the inumbers). */
+    fd = open(fs_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, FS_SIZE) != 0) {
+        close(fd);
+        return -1;
     }
-    /* write 0s to data blocks */
-    data_blocks_pos = ftell(fs);
-    write_zeroes(fs, BLK_DATA_COUNT * BLK_SIZE);
-
-    /* make every data block point to the next one, for free space mgmt */
-    fseek(fs, data_blocks_pos, SEEK_SET);
-    for (i = 0; i < BLK_DATA_COUNT; i++) {
-        next = block_get_next(fs);
-        fwrite(&next, sizeof(next), 1, fs);
-        block_seek_next(fs);
+
+    /* build the boot area, the super block, the root inode and the directory
+       of snapshots (the first blocks of the inode list) in memory, and write
+       them with one write; an all-zero share table shares no block */
+    meta_size = INODE_LIST_ADDR + 2 * BLK_SIZE;
+    meta = calloc(1, meta_size);
+    if (meta == NULL) {
+        close(fd);
+        return -1;
     }
 
-    fclose(fs);
+    memcpy(meta + BLK_SUPER_ADDR, &format_super, sizeof(super_block_t));
+
+    rootdir = (inode_t *) (meta + INODE_LIST_ADDR);
+    rootdir->inumber = ROOT_INODE_NUMBER;
+    rootdir->used = true;
+    rootdir->attr.size = 0;
+    rootdir->attr.type = DIR_T;
+    rootdir->attr.creation_time = time(NULL);
+
+    snapshots = (inode_t *) (meta + INODE_LIST_ADDR + (SNAPSHOTS_INODE_NUMBER - 1) * BLK_SIZE);
+    *snapshots = *rootdir;
+    snapshots->inumber = SNAPSHOTS_INODE_NUMBER;
+    snapshots->flags = INODE_F_SNAPSHOT;
+
+    if (write_all(fd, meta, meta_size, 0) != 0)
+        ret = -1;
+
+    /* start the journal with no transaction in it */
+    if (write_all(fd, &header, sizeof(journal_header_t), (offset_t) BLK_JOURNAL_START * BLK_SIZE) != 0)
+        ret = -1;
+
+    free(meta);
+
+    if (fsync(fd) != 0 || close(fd) != 0)
+        ret = -1;
+
+    return ret;
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        printf("Usage: ./format <filesystem_name>\n");
+    unsigned int blk_size = BLK_SIZE_DEFAULT;
+    offset_t fs_size = FS_SIZE_DEFAULT;
+    inumber_t inode_count = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:s:i:")) != -1) {
+        switch (opt) {
+        case 'b':
+            blk_size = parse_size(optarg);
+            break;
+        case 's':
+            fs_size = parse_size(optarg);
+            break;
+        case 'i':
+            inode_count = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+
+    if (argc - optind != 1) {
+        printf("Usage: ./format [-b block_size] [-s fs_size] [-i inode_count] <filesystem_name>\n");
         return -1;
     }
 
-    myformat(argv[1]);
+    if (myformat(argv[optind], blk_size, fs_size, inode_count) != 0) {
+        fprintf(stderr, "format: cannot format %s with block size %u, size %llu\n",
+                argv[optind], blk_size, (unsigned long long) fs_size);
+        return -1;
+    }
 
     return 0;
 }
@@ -95,51 +130,104 @@ int main(int argc, char *argv[]) {
 
 /* internal functions */
 
-/* initialize the super block data structure (@super)
+/* initialize the super block data structure (@super), and lay out the fs
  *
- * @param fs_name   the name to be given to the fs */
+ * @param fs_name   the name to be given to the fs
+ * @return          0 on success, else -1 if the geometry is invalid */
 
-void super_init(const char * fs_name,super_block_t * super) {
-    strcpy(super->fs_name, fs_name);
-    super->fs_size = FS_SIZE;
+int super_init(const char * fs_name, super_block_t * super, unsigned int blk_size,
+               offset_t fs_size, inumber_t inode_count) {
+    memset(super, 0, sizeof(super_block_t));
+    super->magic = FS_MAGIC;
+    super->version = FS_VERSION;
 
-    super->block_used_count = 0;
-    super->block_free_count = BLK_DATA_COUNT;
-    super->inode_free_count = INODE_COUNT;
+    /* the block size has to be a power of 2 in range */
+    if (blk_size < BLK_SIZE_MIN || blk_size > BLK_SIZE_MAX || (blk_size & (blk_size - 1)) != 0)
+        return -1;
+    if (fs_size / blk_size > (blk_addr_t) -1)
+        return -1;
+
+    super->blk_size = blk_size;
+    super->blk_count = fs_size / blk_size;
+    super->fs_size = (offset_t) super->blk_count * blk_size;
+
+    if (inode_count == 0)
+        inode_count = super->blk_count / 100 * INODE_PERCENT_DEFAULT;
+    if (inode_count < 2)
+        inode_count = 2;     /* the root and the directory of snapshots */
+    super->inode_count = inode_count;
+
+    strncpy(super->fs_name, fs_name, FS_NAME_MAX);
 
     /* inumber of root directory = 1 (0 is a special value) */
     super->root = 1;
+    super->snapshots = SNAPSHOTS_INODE_NUMBER;
 
-    /* block address of inode list */
-    super->inode_list = INODE_LIST_ADDR;
+    /* block address of inode list: just after the super block */
+    super->inode_list = BLK_RESERVED_COUNT;
 
-    /* location of first free block: just after the inode list */
-    super->first_free_block = BLK_DATA_ADDR / BLK_SIZE;
-}
+    /* location of the free block bitmap: just after the inode list */
+    super->block_bitmap = (offset_t) (super->inode_list + BLK_INODE_COUNT) * BLK_SIZE;
 
-/* seek to the next block on @fs
- *
- * @param fs        the storage file for the fs */
-void block_seek_next(FILE * fs) {
-    blk_addr_t current = ftell(fs) / BLK_SIZE;
-    fseek(fs, (current + 1) * BLK_SIZE, SEEK_SET);
+    /* the share table: just after the free block bitmap */
+    super->share_start = super->inode_list + BLK_INODE_COUNT + BLK_BITMAP_COUNT;
+
+    /* the journal: just after the share table */
+    super->journal_start = super->share_start + BLK_SHARES_COUNT;
+    super->journal_count = super->blk_count / JOURNAL_FRACTION;
+    if (super->journal_count < JOURNAL_BLKS_MIN)
+        super->journal_count = JOURNAL_BLKS_MIN;
+
+    /* the data blocks take up the rest of the fs */
+    super->data_start = super->journal_start + super->journal_count;
+    if (super->data_start >= super->blk_count)
+        return -1;
+    super->data_count = super->blk_count - super->data_start;
+
+    super->block_used_count = 0;
+    super->block_free_count = BLK_DATA_COUNT;
+    super->inode_free_count = INODE_COUNT - 2;      /* all but the root and the
+                                                       directory of snapshots */
+
+    return 0;
 }
 
-/* get the block address of the next block on @fs
+/* write all the @len bytes at @buf at byte offset @pos of @fd
  *
- * @param fs        the storage file for the fs */
-blk_addr_t block_get_next(FILE * fs) {
-    blk_addr_t current = ftell(fs) / BLK_SIZE;
-    return (current + 1);
+ * @return          0 on success, else -1 */
+int write_all(int fd, const void * buf, size_t len, offset_t pos) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = pwrite(fd, buf, len, pos);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf = (const char *) buf + n;
+        pos += n;
+        len -= n;
+    }
+
+    return 0;
 }
 
-/* write @count zeroes to @fs, starting from the current offset
- *
- * @param fs        the storage file for the fs
- * @param count     the number of times to write zeroes */
-void write_zeroes(FILE * fs, int count) {
-    int i;
-    for (i = 0; i < count; i++) {
-        fprintf(fs, "%c", '\x00');
+/* parse a size in bytes, with an optional K, M or G suffix */
+offset_t parse_size(const char * str) {
+    char * end;
+    offset_t size = strtoull(str, &end, 10);
+
+    switch (*end) {
+    case 'G': case 'g':
+        size *= 1024;
+        /* fall through */
+    case 'M': case 'm':
+        size *= 1024;
+        /* fall through */
+    case 'K': case 'k':
+        size *= 1024;
+        break;
     }
+
+    return size;
 }
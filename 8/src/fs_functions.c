@@ -7,79 +7,308 @@
 #include <libgen.h>
 #include <math.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "config.h"
 #include "structs.h"
 #include "logger.h"
 #include "macros.h"
+#include "cache.h"
+#include "bitmap.h"
+#include "journal.h"
+#include "stats.h"
+#include "slab.h"
+#include "compress.h"
 
 /* internal function prototypes */
 
 void dir_entry_delete(const char * path);
-blk_addr_t dir_entry_move_last(inode_t * inode, file_entry_t * entry);
+int dir_entry_add(inode_t * dir, const char * name, inumber_t inumber);
+int dir_entry_remove(inode_t * dir, const char * name);
+uint32_t dir_hash(const char * name);
+int dir_entry_cmp(const void * a, const void * b);
+blk_addr_t dir_leaf_find(inode_t * dir, uint32_t hash, blk_addr_t * addrs, unsigned int * pos, unsigned int * depth);
+int dir_index_create(inode_t * dir);
+int dir_index_split(inode_t * dir, blk_addr_t * addrs, unsigned int * pos, unsigned int d);
+int dir_leaf_split(inode_t * dir, blk_addr_t leaf, blk_addr_t * addrs, unsigned int * pos, unsigned int depth);
+void dir_blocks_free(inode_t * dir);
+void dir_index_free(blk_addr_t addr, unsigned int levels);
+int dir_index_list(blk_addr_t addr, unsigned int levels, offset_t offset, dir_filler_t filler, void * buf);
+int dir_leaf_list(blk_addr_t addr, offset_t offset, dir_filler_t filler, void * buf);
+int dir_print_entry(void * buf, const char * name, const inode_t * inode, offset_t next);
 void inode_free(inode_t * inode);
 void block_free(blk_addr_t addr);
+void extent_free(blk_addr_t addr, unsigned int count);
 void block_load_next(int fd);
-blk_addr_t block_allocate(int fd);
-void write_zeroes(FILE * fs, int count);
+void dir_print(const char * name);
+int dir_list(const char * name, offset_t offset, dir_filler_t filler, void * buf);
+int dir_inode_list(const inode_t * inode, offset_t offset, dir_filler_t filler, void * buf);
+void block_load_current(table_entry_t * table_entry);
+void block_load(table_entry_t * table_entry, unsigned int block_no);
+blk_addr_t file_block_map(table_entry_t * table_entry, unsigned int block_no);
+void file_readahead(table_entry_t * table_entry, offset_t offset, size_t nbytes);
+int file_read(int fd, void * buf, size_t nbytes);
+blk_addr_t block_map(inode_t * inode, unsigned int block_no);
+void block_map_range(inode_t * inode, unsigned int first, unsigned int count, blk_addr_t * addrs);
+unsigned int inode_blocks_extend(inode_t * inode, unsigned int end, bool zero);
+unsigned int blocks_needed(inode_t * inode, unsigned int have, unsigned int end);
+void extent_get(inode_t * inode, unsigned int i, extent_t * extent);
+void extent_put(inode_t * inode, unsigned int i, const extent_t * extent);
+int extent_lookup(inode_t * inode, blk_addr_t block_no, extent_t * extent);
+bool extent_append(inode_t * inode, blk_addr_t addr, unsigned int count, unsigned int stored);
+blk_addr_t extent_next(inode_t * inode);
+bool extent_replace(inode_t * inode, unsigned int i, const extent_t * with, unsigned int n);
+int inode_uncompress(inode_t * inode, unsigned int first, unsigned int count);
+int inode_unshare(inode_t * inode, offset_t offset, offset_t end);
+int extent_unshare(inode_t * inode, unsigned int i, const extent_t * extent, offset_t offset, offset_t end);
+int extent_uncompress(inode_t * inode, unsigned int i, const extent_t * extent);
+int cluster_read(const extent_t * extent, offset_t pos, void * buf, size_t len);
+int cluster_load(const extent_t * extent, char * data);
+int inode_write(inode_t * inode, const void * buf, size_t nbytes, offset_t offset);
+int inode_inline_write(inode_t * inode, const void * buf, size_t nbytes, offset_t offset);
+int inode_inline_promote(inode_t * inode);
+int delalloc_write(open_inode_t * file, const void * buf, size_t nbytes, offset_t offset);
+int delalloc_grow(open_inode_t * file, unsigned int count);
+int delalloc_flush(open_inode_t * file);
+int delalloc_compress(open_inode_t * file, unsigned int i, char * buf);
+void delalloc_flush_all(void);
+bool delalloc_reserve(unsigned int count);
+void delalloc_release(unsigned int count);
 void error_exit(char * errorStr);
-blk_addr_t get_first_free_dir_block(inode_t * inode);
 blk_addr_t get_free_block(void);
+blk_addr_t get_free_extent(blk_addr_t goal, unsigned int count, unsigned int * got, bool zero);
+void block_bitmap_sync(unsigned long start, unsigned long count);
+void extent_share(blk_addr_t addr, unsigned int count);
+void block_shares_sync(unsigned long start, unsigned long count);
+int block_shares_load(void);
+void block_zero_scan(void);
+void block_discard_freed(void);
 inumber_t get_free_inode(inode_t * free_inode);
-inumber_t get_inode_in_block(blk_addr_t block_offset,char * name,int * count,file_type_t file_type);
+int inode_table_load(void);
+void inode_table_read(inumber_t inumber, inode_t * inode);
+void inode_table_write(inumber_t inumber, inode_t * inode);
+void inode_table_flush(void);
 inumber_t get_inode_from_name(inumber_t parent_inode_no,char * name,file_type_t file_type);
-inumber_t get_inode_from_path(const char * filepath, inode_t * inode);
-int strsplit(char *str , char * delim, char ** arr);
+inumber_t dir_lookup(inumber_t parent_inode_no, char * name);
+bool dcache_lookup(inumber_t parent, const char * name, inumber_t * inumber);
+void dcache_insert(inumber_t parent, const char * name, inumber_t inumber);
+void dcache_purge_dir(inumber_t parent);
+unsigned int dcache_hash(inumber_t parent, const char * name);
+inumber_t path_lookup(const char * filepath, inode_t * inode);
 int is_filetype_same(inumber_t inode_no,file_type_t file_type);
 int file_table_insert(inumber_t inode);
 int file_table_delete(int fd);
+table_entry_t * file_table_get(int fd);
+int file_table_grow(file_table_t * table);
+bool file_table_busy(inumber_t inumber);
+void file_table_init(void);
+void file_table_destroy(void);
 inumber_t create_file(inode_t parent_inode,char * name,file_type_t file_type,file_mode_t mode);
 void fs_check_mounted(void);
-void print_filenames_in_block(blk_addr_t offset,int * count);
-void get_filenames_in_block(blk_addr_t block_offset,int * file_count, char *files[], int * count);
-int delete_filename_in_block(blk_addr_t addr,unsigned int * entry_count,inode_t * parent_inode,char * name);
+void fs_op_begin(void);
+void fs_op_end(void);
+int fs_commit(void);
+int fs_commit_frozen(void);
+int super_block_read(int fd, super_block_t * super);
+int fs_locks_init(void);
+void fs_locks_destroy(void);
+bool super_block_valid(const super_block_t * super);
+int snapshot_tree(inumber_t * copy);
+int snapshot_inode(inumber_t inumber, inumber_t * copy);
+int snapshot_entry(void * buf, const char * name, const inode_t * inode, offset_t next);
+int snapshot_free(inumber_t root);
+int snapshot_collect(void * buf, const char * name, const inode_t * inode, offset_t next);
+int snapshot_walk_push(snapshot_walk_t * walk, inumber_t from, inumber_t to);
 
 int mymount(char * fs_name) {
     if(BB_DATA->super_blk != NULL)
         return 1;
 
     /* Load the superblock in memory */
-    BB_DATA->super_blk = (super_block_t *)malloc(sizeof(super_block_t));
     BB_DATA->fs = fopen(fs_name,"r+");
-    fseek(BB_DATA->fs,BLK_SUPER_ADDR,SEEK_SET);
-    fread(BB_DATA->super_blk,sizeof(super_block_t),1,BB_DATA->fs);
+    if (BB_DATA->fs == NULL)
+        return -errno;
+
+    /* Load the superblock in memory first: it records the geometry of the fs,
+       which everything below depends on */
+    BB_DATA->super_blk = (super_block_t *)malloc(sizeof(super_block_t));
+    if (super_block_read(fileno(BB_DATA->fs), BB_DATA->super_blk) != 0) {
+        free(BB_DATA->super_blk);
+        BB_DATA->super_blk = NULL;
+        fclose(BB_DATA->fs);
+        return -EINVAL;
+    }
+
+    /* Finish what the last mount committed to the journal but did not get to
+       write in place; this may change the super block itself */
+    int replayed = journal_replay(fileno(BB_DATA->fs));
+    if (replayed < 0 || (replayed > 0 && super_block_read(fileno(BB_DATA->fs), BB_DATA->super_blk) != 0)) {
+        free(BB_DATA->super_blk);
+        BB_DATA->super_blk = NULL;
+        fclose(BB_DATA->fs);
+        return -EIO;
+    }
+
+    /* Map the whole image into memory, or else put the block cache in front
+       of the storage file */
+    BB_DATA->map = NULL;
+    if (BB_DATA->mount_flags & MOUNT_MMAP) {
+        void * map = mmap(NULL, FS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(BB_DATA->fs), 0);
+        if (map == MAP_FAILED) {
+            int err = errno;
+            free(BB_DATA->super_blk);
+            BB_DATA->super_blk = NULL;
+            fclose(BB_DATA->fs);
+            return -err;
+        }
+        BB_DATA->map = (char *) map;
+    }
+    else if (cache_init(fileno(BB_DATA->fs), CACHE_SIZE / BLK_SIZE) != 0) {
+        free(BB_DATA->super_blk);
+        BB_DATA->super_blk = NULL;
+        fclose(BB_DATA->fs);
+        return -ENOMEM;
+    }
+
+    /* Journal the metadata changes; the changes to a mapped image reach the
+       disk whenever the kernel writes them back, so they cannot be */
+    else if (journal_init(fileno(BB_DATA->fs)) != 0) {
+        cache_destroy();
+        free(BB_DATA->super_blk);
+        BB_DATA->super_blk = NULL;
+        fclose(BB_DATA->fs);
+        return -ENOMEM;
+    }
+
+    if (fs_locks_init() != 0)
+        goto fail;
+
+    /* Load the free block bitmap in memory */
+    slab_init(&BB_DATA->delalloc_blocks, BLK_SIZE, DELALLOC_SLAB);
+    BB_DATA->block_bitmap = (bitmap_word_t *)malloc(BITMAP_WORDS(BLK_DATA_COUNT) * sizeof(bitmap_word_t));
+    if (BB_DATA->block_bitmap == NULL)
+        goto fail_tables;
+    DISK_READ(BB_DATA->super_blk->block_bitmap, BB_DATA->block_bitmap,
+              BITMAP_WORDS(BLK_DATA_COUNT) * sizeof(bitmap_word_t));
+    BB_DATA->block_rotor = 0;
+    BB_DATA->blocks_reserved = 0;
+
+    /* Load the share table in memory */
+    if (block_shares_load() != 0)
+        goto fail_tables;
+
+    /* Find the free blocks which need not be zeroed when allocated */
+    BB_DATA->block_zero = (bitmap_word_t *)calloc(BITMAP_WORDS(BLK_DATA_COUNT), sizeof(bitmap_word_t));
+    BB_DATA->block_freed = (bitmap_word_t *)calloc(BITMAP_WORDS(BLK_DATA_COUNT), sizeof(bitmap_word_t));
+    if (BB_DATA->block_zero == NULL || BB_DATA->block_freed == NULL)
+        goto fail_tables;
+    block_zero_scan();
+
+    /* Load the inode table in memory */
+    if (inode_table_load() != 0)
+        goto fail_tables;
+
+    /* Keep the last clusters of compressed files read decompressed; without
+       the memory for them they are decompressed on every read */
+    cluster_cache_init(CLUSTER_CACHE_SIZE / ((size_t) COMPRESS_CLUSTER_BLKS * BLK_SIZE),
+                       (size_t) COMPRESS_CLUSTER_BLKS * BLK_SIZE);
+
+    /* Start with an empty directory entry cache */
+    BB_DATA->dcache = (dcache_entry_t *) calloc(DCACHE_ENTRIES, sizeof(dcache_entry_t));
+    if (BB_DATA->dcache == NULL)
+        goto fail_tables;
+
+    /* Start keeping statistics; without the memory for them the fs works all
+       the same */
+    stats_init();
 
     /* Initialise the Open File Table */
-    BB_DATA->openFileTable = (table_entry_t **)malloc(MAX_OPEN_FILES * sizeof(table_entry_t *));
-    int i ;
-    for(i = 0;i<MAX_OPEN_FILES;i++)
-        BB_DATA->openFileTable[i] = NULL;
-
-    /* Initialise the first entry of file table with root inode */
-    BB_DATA->openFileTable[0] = (table_entry_t *)malloc(sizeof(table_entry_t));
-    inode_t root_inode;
-    INODE_READ(ROOT_INODE_NUMBER,&root_inode);
-    BB_DATA->openFileTable[0]->inode = root_inode;
-    BB_DATA->openFileTable[0]->refCount = 1;
+    file_table_init();
 
     return 0;
+
+    /* the tables not allocated yet are NULL, as myunmount() leaves them */
+ fail_tables:
+    free(BB_DATA->block_bitmap);
+    BB_DATA->block_bitmap = NULL;
+    free(BB_DATA->block_shares);
+    BB_DATA->block_shares = NULL;
+    free(BB_DATA->block_zero);
+    BB_DATA->block_zero = NULL;
+    free(BB_DATA->block_freed);
+    BB_DATA->block_freed = NULL;
+    free(BB_DATA->inode_table);
+    BB_DATA->inode_table = NULL;
+    free(BB_DATA->inode_bitmap);
+    BB_DATA->inode_bitmap = NULL;
+    free(BB_DATA->inode_dirty);
+    BB_DATA->inode_dirty = NULL;
+    cluster_cache_destroy();
+    slab_destroy(&BB_DATA->delalloc_blocks);
+    fs_locks_destroy();
+
+ fail:
+    if (BB_DATA->map != NULL) {
+        munmap(BB_DATA->map, FS_SIZE);
+        BB_DATA->map = NULL;
+    }
+    else {
+        journal_destroy();
+        cache_destroy();
+    }
+    free(BB_DATA->super_blk);
+    BB_DATA->super_blk = NULL;
+    fclose(BB_DATA->fs);
+    return -ENOMEM;
 }
 
 void myunmount(char * fs_name)
 {
     (void) fs_name;
 
-    /* Write the superblock back to disk*/
-    fseek(BB_DATA->fs,BLK_SUPER_ADDR,SEEK_SET);
-    fwrite(BB_DATA->super_blk,sizeof(super_block_t),1,BB_DATA->fs);
+    /* Write the superblock, the modified inodes and all dirty blocks back to
+       disk */
+    fs_commit();
+
+    /* Drop the cache or the mapping */
+    if (BB_DATA->map != NULL) {
+        munmap(BB_DATA->map, FS_SIZE);
+        BB_DATA->map = NULL;
+    }
+    else {
+        journal_destroy();
+        cache_destroy();
+    }
 
     /* Close the file */
     fclose(BB_DATA->fs);
 
     /* Make the superblock and fileTable null*/
+    free(BB_DATA->block_bitmap);
+    BB_DATA->block_bitmap = NULL;
+    free(BB_DATA->block_zero);
+    BB_DATA->block_zero = NULL;
+    free(BB_DATA->block_freed);
+    BB_DATA->block_freed = NULL;
+    free(BB_DATA->block_shares);
+    BB_DATA->block_shares = NULL;
+    free(BB_DATA->inode_table);
+    free(BB_DATA->inode_bitmap);
+    free(BB_DATA->inode_dirty);
+    BB_DATA->inode_table = NULL;
+    BB_DATA->inode_bitmap = NULL;
+    BB_DATA->inode_dirty = NULL;
+    free(BB_DATA->dcache);
+    BB_DATA->dcache = NULL;
+    cluster_cache_destroy();
+    stats_destroy();
+    file_table_destroy();
+    slab_destroy(&BB_DATA->delalloc_blocks);
+    fs_locks_destroy();
     free(BB_DATA->super_blk);
-    free(BB_DATA->openFileTable);
-    BB_DATA->openFileTable = NULL;
     BB_DATA->super_blk = NULL;
 }
 
@@ -99,16 +328,34 @@ int myopen(const char * filepath, char * mode_str) {
 
     /* Get the inode number of the file */
     inode_t file_inode;
-    inumber_t inode_no = get_inode_from_path(filepath, &file_inode);
+    int ret;
+    fs_op_begin();
+    pthread_rwlock_rdlock(&BB_DATA->ns_lock);
+    inumber_t inode_no = path_lookup(filepath, &file_inode);
+
+    /* creating the file changes the directory tree, so look again under the
+       write lock, in case another thread created it in the meantime */
+    if (inode_no == 0) {
+        pthread_rwlock_unlock(&BB_DATA->ns_lock);
+        pthread_rwlock_wrlock(&BB_DATA->ns_lock);
+        inode_no = path_lookup(filepath, &file_inode);
+    }
 
     if (inode_no > 0 && inode_no < INODE_COUNT + 1 && file_inode.attr.type == DIR_T) {
-        return -EISDIR;
+        ret = -EISDIR;
+        goto out;
+    }
+    else if (inode_no == 0 && (file_inode.flags & INODE_F_SNAPSHOT)) {
+        /* nothing is created in a snapshot */
+        ret = -EROFS;
+        goto out;
     }
-    else if(inode_no >= INODE_COUNT || strcmp(filepath, "") == 0)
+    else if(inode_no > INODE_COUNT || strcmp(filepath, "") == 0)
 	{
             /* Path is incorrect */
             /* fprintf(stderr,"Error in myopen : Incorrect file path\n"); */
-            return -ENOENT;
+            ret = -ENOENT;
+            goto out;
 	}
     else if(inode_no == 0)
 	{
@@ -124,20 +371,93 @@ int myopen(const char * filepath, char * mode_str) {
             if(inode.attr.mode != mode)
 		{
                     /* fprintf(stderr,"Error in myopen : Mode Mismatch\n"); */
-                    return -EACCES;
+                    ret = -EACCES;
+                    goto out;
 		}
 	}
 
-    /* make an entry in open file table and return fd */
+    /* make an entry in open file table and return fd; this is done before
+       dropping the lock, so that the file cannot be removed in between */
     if(inode_no == 0)
 	{
             /* fprintf(stderr,"Error in  myopen : error creating new file\n"); */
             log_msg("myopen ENOENT here\n");
-            return -ENOENT;
+            ret = -ENOENT;
+            goto out;
 	}
-    return (file_table_insert(inode_no));
+    ret = file_table_insert(inode_no);
+
+ out:
+    pthread_rwlock_unlock(&BB_DATA->ns_lock);
+    fs_op_end();
+    return ret;
+}
+
+
+int mysnapshot(const char * name) {
+    inode_t dir;
+    inumber_t root;
+    int ret;
+
+    fs_check_mounted();
+
+    if (strlen(name) > FILE_NAME_MAX)
+        return -ENAMETOOLONG;
+    if (name[0] == '\0' || strchr(name, '/') != NULL)
+        return -EINVAL;
+
+    /* no operation runs while the tree is copied, so that the snapshot holds
+       all of each, and the data held back is allocated first, so that it is
+       in the snapshot too. A mapped image has neither, and its files are
+       written to all along, so each inode is locked while it is copied. */
+    journal_freeze();
+    if (BB_DATA->map == NULL)
+        delalloc_flush_all();
+    pthread_rwlock_wrlock(&BB_DATA->ns_lock);
+
+    INODE_READ(BB_DATA->super_blk->snapshots, &dir);
+    if (get_inode_from_name(dir.inumber, (char *) name, FILE_T) != 0)
+        ret = -EEXIST;
+    else if (dir.attr.size >= SNAPSHOTS_MAX)
+        ret = -EMLINK;
+    else if ((ret = snapshot_tree(&root)) == 0 && (ret = dir_entry_add(&dir, name, root)) < 0)
+        snapshot_free(root);
+
+    if (ret == 0) {
+        dcache_insert(dir.inumber, name, root);
+        stats_count(STATS_SNAPSHOTS, 1);
+    }
+
+    pthread_rwlock_unlock(&BB_DATA->ns_lock);
+
+    /* the snapshot is committed as a whole, and operations start again */
+    fs_commit_frozen();
+    return ret;
 }
 
+int mysnapshot_delete(const char * name) {
+    inode_t dir;
+    inumber_t root;
+    int ret;
+
+    fs_check_mounted();
+
+    fs_op_begin();
+    pthread_rwlock_wrlock(&BB_DATA->ns_lock);
+
+    INODE_READ(BB_DATA->super_blk->snapshots, &dir);
+    root = strlen(name) > FILE_NAME_MAX ? 0 : get_inode_from_name(dir.inumber, (char *) name, FILE_T);
+    if (root == 0)
+        ret = -ENOENT;
+    else if ((ret = snapshot_free(root)) == 0) {
+        dcache_insert(dir.inumber, name, 0);
+        dir_entry_remove(&dir, name);
+    }
+
+    pthread_rwlock_unlock(&BB_DATA->ns_lock);
+    fs_op_end();
+    return ret;
+}
 
 int mymkdir(const char * name) {
 
@@ -150,72 +470,96 @@ int mymkdir(const char * name) {
         return -1;
     }
 
-    inumber = get_inode_from_path(name,&inode);
-    if(inumber > 0 && inumber<INODE_COUNT)
+    fs_op_begin();
+    pthread_rwlock_wrlock(&BB_DATA->ns_lock);
+
+    inumber = path_lookup(name,&inode);
+    if(inumber > 0 && inumber <= INODE_COUNT)
 	{
             fprintf(stderr,"mkdir : Directory with this name already exists\n");
+            pthread_rwlock_unlock(&BB_DATA->ns_lock);
+            fs_op_end();
             return -EEXIST;
 	}
-    else if(inumber >= INODE_COUNT)
+    else if(inumber > INODE_COUNT)
 	{
             fprintf(stderr,"mkdir : Incorrect filepath\n");
+            pthread_rwlock_unlock(&BB_DATA->ns_lock);
+            fs_op_end();
             return -ENOTDIR;
 	}
 
+    /* a directory made in the directory of snapshots is a new snapshot, which
+       is taken with the journal frozen, rather than as an operation */
+    if (inode.flags & INODE_F_SNAPSHOT) {
+        pthread_rwlock_unlock(&BB_DATA->ns_lock);
+        fs_op_end();
+        if (inode.inumber != BB_DATA->super_blk->snapshots)
+            return -EROFS;
+        return mysnapshot(basename(strdup(name)));
+    }
+
     if(create_file(inode,basename(strdup(name)),DIR_T,RW) == 0)
 	{
             fprintf(stderr,"mkdir : Error Creating directory\n");
+            pthread_rwlock_unlock(&BB_DATA->ns_lock);
+            fs_op_end();
             return -EIO;
 	}
+
+    pthread_rwlock_unlock(&BB_DATA->ns_lock);
+    fs_op_end();
     return 0;
 }
 
 void myls(const char * name)
 {
     fs_check_mounted();
-    inumber_t inumber;
-    inode_t inode;
 
-    if(name==NULL || strcmp(name,"")==0 || strcmp(name,"/")==0) {
+    pthread_rwlock_rdlock(&BB_DATA->ns_lock);
+    dir_print(name);
+    pthread_rwlock_unlock(&BB_DATA->ns_lock);
+}
 
-        inumber = ROOT_INODE_NUMBER;
-    }
-    else
-        inumber = get_inode_from_path(name,&inode);
-    if(inumber == 0 || inumber>=INODE_COUNT)
-	{
-            fprintf(stderr,"Incorrect path\n");
-            return;
-	}
-    /* Listing the Directory contents */
-    INODE_READ(inumber, &inode);
+/* print the names in the directory @name, one per line; this does the actual
+ * work for myls() */
 
-    int file_count = inode.attr.size;
-    int blk_count = CEIL(file_count,MAX_FILES_PER_BLOCK);
+void dir_print(const char * name)
+{
+    if (dir_list(name, 0, dir_print_entry, NULL) < 0)
+        fprintf(stderr,"Incorrect path\n");
+}
 
-    unsigned int i,j;
-    /*Print the filenames in the direct blocks */
-    for( i=0; (i<BLKS_DIRECT && blk_count>0);i++,blk_count--)
-        print_filenames_in_block(inode.blocks_direct[i],&file_count);
+/* dir_filler_t for dir_print() */
 
-    /* Print the fielnames in the indirect blocks */
-    for(i = 0;i<BLKS_INDIRECT;i++)
-	{
-            if(inode.blocks_indirect[i] == 0)
-                return;
+int dir_print_entry(void * buf, const char * name, const inode_t * inode, offset_t next)
+{
+    (void) buf;
+    (void) inode;
+    (void) next;
 
-            blk_addr_t blk_addresses[MAX_ADDR_PER_BLOCK];
-            BLK_READ_INDIRECT(inode.blocks_indirect[i],blk_addresses);
-            for(j = 0;(j<MAX_ADDR_PER_BLOCK && blk_count>0);j++,blk_count--)
-		{
-                    print_filenames_in_block(blk_addresses[j],&file_count);
-		}
- 	}
+    printf("%s\n", name);
+    return 0;
 }
 
-int myreaddir(const char * name, char *files[])
+int myreaddir(const char * name, offset_t offset, dir_filler_t filler, void * buf)
 {
+    int ret;
+
     fs_check_mounted();
+
+    pthread_rwlock_rdlock(&BB_DATA->ns_lock);
+    ret = dir_list(name, offset, filler, buf);
+    pthread_rwlock_unlock(&BB_DATA->ns_lock);
+
+    return ret;
+}
+
+/* list the directory @name, from @offset on; this does the actual work for
+ * myreaddir() */
+
+int dir_list(const char * name, offset_t offset, dir_filler_t filler, void * buf)
+{
     inumber_t inumber;
     inode_t inode;
 
@@ -224,59 +568,216 @@ int myreaddir(const char * name, char *files[])
         inumber = ROOT_INODE_NUMBER;
     }
     else
-        inumber = get_inode_from_path(name,&inode);
-    if(inumber == 0)
-	{
-            fprintf(stderr,"Incorrect path\n");
-            return -1;
-	}
-    /* Listing the Directory contents */
+        inumber = path_lookup(name,&inode);
+    if(inumber == 0 || inumber > INODE_COUNT)
+        return -ENOENT;
+
     INODE_READ(inumber, &inode);
+    if (inode.attr.type != DIR_T)
+        return -ENOTDIR;
+
+    dir_inode_list(&inode, offset, filler, buf);
+    return 0;
+}
+
+/* list the directory @inode, from @offset on
+ *
+ * @return          nonzero if the listing was stopped by @filler */
+
+int dir_inode_list(const inode_t * inode, offset_t offset, dir_filler_t filler, void * buf)
+{
+    dir_index_t root[DIR_INDEX_MAX + 1];
 
-    int file_count = inode.attr.size;
-    int blk_count = CEIL(file_count,MAX_FILES_PER_BLOCK);
-    unsigned int i,j;
-    int count = 0;
-    /*Print the filenames in the direct blocks */
-    for( i=0; (i<BLKS_DIRECT && blk_count>0);i++,blk_count--) {
-        get_filenames_in_block(inode.blocks_direct[i], &file_count, files, &count);
-        if (count == inode.attr.size)
-            return inode.attr.size;
+    /* an empty directory has no blocks */
+    if (inode->blocks_direct[0] == 0)
+        return 0;
+
+    if (inode->flags & INODE_F_INDEX) {
+        DIR_INDEX_READ(root, inode->blocks_direct[0]);
+        return dir_index_list(inode->blocks_direct[0], root[0].header.levels, offset, filler, buf);
     }
 
-    /* Print the fielnames in the indirect blocks */
-    for(i = 0;i<BLKS_INDIRECT;i++)
-	{
-            if(inode.blocks_indirect[i] == 0)
-                return count;
+    return dir_leaf_list(inode->blocks_direct[0], offset, filler, buf);
+}
 
-            blk_addr_t blk_addresses[MAX_ADDR_PER_BLOCK];
-            BLK_READ_INDIRECT(inode.blocks_indirect[i],blk_addresses);
-            for(j = 0;(j<MAX_ADDR_PER_BLOCK && blk_count>0);j++,blk_count--)
-		{
-                    get_filenames_in_block(blk_addresses[j], &file_count, files, &count);
-                    if (count == inode.attr.size)
-                        return inode.attr.size;
-                }
- 	}
+/* list the leaves under the index block at @addr, which has @levels index
+ * levels below it, from the leaf holding the position @offset on
+ *
+ * @return          nonzero if the listing was stopped by @filler */
 
-    return inode.attr.size;
+int dir_index_list(blk_addr_t addr, unsigned int levels, offset_t offset, dir_filler_t filler, void * buf)
+{
+    dir_index_t index[DIR_INDEX_MAX + 1], * entries = index + 1;
+    unsigned int i, count;
+    uint32_t hash = offset >> 32;
+
+    DIR_INDEX_READ(index, addr);
+    count = index[0].header.count;
+
+    /* the first block which may hold positions at or after @offset */
+    for (i = 1; i < count && entries[i].entry.hash <= hash; i++)
+        ;
+
+    for (i--; i < count; i++) {
+        if (levels > 0 ? dir_index_list(entries[i].entry.addr, levels - 1, offset, filler, buf) :
+            dir_leaf_list(entries[i].entry.addr, offset, filler, buf))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* list the entries in the leaf at @addr from the position @offset on. The
+ * position of an entry is the hash of its name in the upper 32 bits, and in
+ * the lower ones, its rank among the names in the leaf with the same hash
+ * (which is nearly always 0); entries are listed in order of position.
+ *
+ * @return          nonzero if the listing was stopped by @filler */
+
+int dir_leaf_list(blk_addr_t addr, offset_t offset, dir_filler_t filler, void * buf)
+{
+    file_entry_t entries[MAX_FILES_PER_BLOCK];
+    unsigned int i, count, rank = 0;
+    uint32_t hash, prev = 0;
+    offset_t pos;
+    inode_t inode;
+
+    DIR_BLOCK_READ(entries, addr);
+
+    /* sort the entries in use by position */
+    for (i = 0, count = 0; i < MAX_FILES_PER_BLOCK; i++)
+        if (entries[i].inumber != 0)
+            entries[count++] = entries[i];
+    qsort(entries, count, sizeof(file_entry_t), dir_entry_cmp);
+
+    for (i = 0; i < count; i++) {
+        hash = dir_hash(entries[i].name);
+        rank = i > 0 && hash == prev ? rank + 1 : 0;
+        prev = hash;
+
+        pos = (offset_t) hash << 32 | rank;
+        if (pos < offset)
+            continue;
+
+        /* the inode comes from the in-memory inode table, so listing the
+           attributes along with the names costs no extra disk reads */
+        INODE_READ(entries[i].inumber, &inode);
+        if (filler(buf, entries[i].name, &inode, pos + 1) != 0)
+            return 1;
+    }
+
+    return 0;
 }
 
-void myclose(int fd)
+int myclose(int fd)
 {
+    table_entry_t * table_entry;
+    inumber_t inumber;
+    unsigned int refcount;
+    int ret = 0;
+
     fs_check_mounted();
+
+    /* closing is an fs operation, so that a commit never sees the file table
+       change under it (see fs_commit()) */
+    fs_op_begin();
+
+    if ((table_entry = file_table_get(fd)) == NULL) {
+        file_table_delete(fd);
+        fs_op_end();
+        return -EBADF;
+    }
+
+    /* the size of the file is final once the last fd on it is closed, so
+       allocate whatever it held back now */
+    inumber = table_entry->file->inode.inumber;
+    INODE_WRLOCK(inumber);
+    pthread_mutex_lock(&BB_DATA->file_table_lock);
+    refcount = table_entry->file->refcount;
+    pthread_mutex_unlock(&BB_DATA->file_table_lock);
+    if (refcount == 1)
+        ret = delalloc_flush(table_entry->file);
+
     file_table_delete(fd);
+    INODE_UNLOCK(inumber);
+    fs_op_end();
+
+    return ret;
+}
+
+int myflush(int fd)
+{
+    table_entry_t * table_entry;
+    inumber_t inumber;
+    int ret;
+
+    fs_check_mounted();
+
+    fs_op_begin();
+
+    if ((table_entry = file_table_get(fd)) == NULL) {
+        fs_op_end();
+        return -EBADF;
+    }
+
+    inumber = table_entry->file->inode.inumber;
+    INODE_WRLOCK(inumber);
+    ret = delalloc_flush(table_entry->file);
+    INODE_UNLOCK(inumber);
+    fs_op_end();
+
+    return ret;
+}
+
+int myfsync(int fd)
+{
+    (void) fd;
+
+    fs_check_mounted();
+
+    /* neither the cache nor the mapping track which file a block belongs to,
+       so commit the running transaction, and write back all dirty blocks */
+    return fs_commit();
 }
 
 int myread(int fd, void * buf, size_t nbytes) {
     fs_check_mounted();
 
+    table_entry_t * table_entry;
+    inumber_t inumber;
+    int ret;
+
+    /* error handling similar to read(2) */
+    if ((table_entry = file_table_get(fd)) == NULL) {
+        return -EBADF;
+    }
+
+    inumber = table_entry->file->inode.inumber;
+    INODE_RDLOCK(inumber);
+    pthread_mutex_lock(&table_entry->lock);
+
+    /* the file may have been written through another fd since */
+    block_load_current(table_entry);
+
+    file_readahead(table_entry, table_entry->file_offset, nbytes);
+
+    ret = file_read(fd, buf, nbytes);
+
+    pthread_mutex_unlock(&table_entry->lock);
+    INODE_UNLOCK(inumber);
+
+    return ret;
+}
+
+/* read @nbytes bytes into @buf from the file @fd, one block at a time; this
+ * does the actual work for myread() */
+
+int file_read(int fd, void * buf, size_t nbytes) {
     size_t bytes_read;
-    table_entry_t * table_entry = BB_DATA->openFileTable[fd];
+    table_entry_t * table_entry = file_table_get(fd);
     offset_t block_offset = table_entry->file_offset % BLK_SIZE; /* offset in current block */
     unsigned int block_leftover_bytes = (BLK_SIZE - (table_entry->file_offset % BLK_SIZE));
-    file_size_t file_size = table_entry->inode.attr.size;
+    file_size_t file_size = table_entry->file->inode.attr.size;
 
     /* error handling similar to read(2) */
     if (! table_entry) {
@@ -284,7 +785,7 @@ int myread(int fd, void * buf, size_t nbytes) {
     }
 
     /* check if current position is already EOF */
-    if (table_entry->file_offset > (unsigned) table_entry->inode.attr.size - 1)
+    if (table_entry->file_offset >= table_entry->file->inode.attr.size)
         return 0;
 
     /* adjust the number of bytes to read, if it will go past EOF */
@@ -323,645 +824,2677 @@ int myread(int fd, void * buf, size_t nbytes) {
            next block(s) */
         void * buf_new = buf + bytes_read;
         size_t nbytes_new = nbytes - bytes_read;
-        return bytes_read + myread(fd,buf_new, nbytes_new);
+        return bytes_read + file_read(fd,buf_new, nbytes_new);
     }
 }
 
 int mywrite(int fd, void * buf, size_t nbytes) {
     fs_check_mounted();
 
-    table_entry_t * table_entry = BB_DATA->openFileTable[fd];
-    inode_t * inode = &table_entry->inode;
-    offset_t block_offset = table_entry->file_offset % BLK_SIZE; /* offset in current block */
-    unsigned int block_leftover_bytes = (BLK_SIZE - (table_entry->file_offset % BLK_SIZE));
+    table_entry_t * table_entry;
+    inumber_t inumber;
+    int ret;
 
     /* error handling similar to write(2) */
-    if (inode->attr.mode != RW || ! table_entry) {
+    if ((table_entry = file_table_get(fd)) == NULL || table_entry->file->inode.attr.mode != RW) {
         return -EBADF;
     }
+    if (table_entry->file->inode.flags & INODE_F_SNAPSHOT)
+        return -EROFS;
 
-    /* check if we are past the last block; if yes, allocate new block(s) */
-    if (table_entry->addr == 0 && table_entry->data == NULL) {
-        blk_addr_t addr;
-        table_entry->data = malloc(BLK_SIZE);
+    inumber = table_entry->file->inode.inumber;
+    fs_op_begin();
+    INODE_WRLOCK(inumber);
+    pthread_mutex_lock(&table_entry->lock);
 
-        addr = block_allocate(fd);
+    /* the same as a pwrite() at the file offset; the block loaded for myread()
+       is reloaded by the next read, so it is left alone */
+    ret = delalloc_write(table_entry->file, buf, nbytes, table_entry->file_offset);
+    if (ret > 0)
+        table_entry->file_offset += ret;
 
-        /* load the newly-allocated block into memory */
-        table_entry->addr = addr;
-        BLK_READ_DATA(table_entry->addr, table_entry->data);
-    }
+    pthread_mutex_unlock(&table_entry->lock);
+    INODE_UNLOCK(inumber);
+    fs_op_end();
 
-    /* if the request for @nbytes bytes can be satisfied using the left-over
-       bytes in the currently loaded block, write into those from @buf, update
-       the file_offset and data fields, and return immediately */
-    if (nbytes <= block_leftover_bytes) {
-        memcpy(table_entry->data + block_offset, buf, nbytes);
-        table_entry->file_offset += nbytes;
+    return ret;
+}
 
-        /* write the modified block to disk */
-        BLK_WRITE_DATA(table_entry->addr, table_entry->data);
+int mypread(int fd, void * buf, size_t nbytes, offset_t offset) {
+    fs_check_mounted();
 
-        /* if the current data block has been traversed completely, load the
-           next block */
-        if (nbytes == block_leftover_bytes)
-            block_load_next(fd);
+    table_entry_t * table_entry;
+    inode_t inode;
+    extent_t extent;
+    blk_addr_t * addrs;
+    unsigned int first, count, i, run;
+    offset_t pos, end, run_end, delayed;
+    int ret;
+
+    /* error handling similar to pread(2) */
+    if ((table_entry = file_table_get(fd)) == NULL) {
+        return -EBADF;
+    }
 
-        /* update file size, if required */
-        if (table_entry->file_offset >= inode->attr.size) {
-            inode->attr.size = table_entry->file_offset;
+    /* the file table entry is only used to find the inode (and for readahead
+       hints), so that any number of readers can share an fd, and the inode is
+       only locked shared, so that they can read it in parallel */
+    INODE_RDLOCK(table_entry->file->inode.inumber);
+    inode = table_entry->file->inode;
 
-            /* write the modified inode to disk */
-            INODE_WRITE(inode->inumber, inode);
-        }
+    pthread_mutex_lock(&table_entry->lock);
+    file_readahead(table_entry, offset, nbytes);
+    pthread_mutex_unlock(&table_entry->lock);
 
+    /* adjust the number of bytes to read, if it will go past EOF */
+    if (offset >= inode.attr.size || nbytes == 0) {
+        INODE_UNLOCK(inode.inumber);
+        return 0;
+    }
+    if (nbytes > inode.attr.size - offset)
+        nbytes = inode.attr.size - offset;
+    end = offset + nbytes;
+
+    /* a file kept inline is read from its inode's block */
+    if (inode.flags & INODE_F_INLINE) {
+        DISK_READ(INODE_INLINE_POS(inode.inumber) + offset, buf, nbytes);
+        INODE_UNLOCK(inode.inumber);
         return nbytes;
     }
 
-    else {
-        memcpy(table_entry->data + block_offset, buf, block_leftover_bytes);
-        table_entry->file_offset += block_leftover_bytes;
-
-        /* write the modified block to disk */
-        BLK_WRITE_DATA(table_entry->addr, table_entry->data);
+    /* the data not allocated yet is copied from memory, which the inode lock
+       keeps still */
+    delayed = table_entry->file->delayed_count > 0 ? (offset_t) table_entry->file->delayed_from * BLK_SIZE : end;
+    for (pos = offset > delayed ? offset : delayed; pos < end; pos = run_end) {
+        run_end = (pos / BLK_SIZE + 1) * BLK_SIZE;
+        if (run_end > end)
+            run_end = end;
+        memcpy((char *) buf + (pos - offset), table_entry->file->delayed[(pos - delayed) / BLK_SIZE] + pos % BLK_SIZE, run_end - pos);
+    }
+    if (delayed < end)
+        end = delayed > offset ? delayed : offset;
+    if (end <= offset) {
+        INODE_UNLOCK(inode.inumber);
+        return nbytes;
+    }
 
-        /* load the next block, since the current one is definitely over */
-        block_load_next(fd);
+    /* map the whole byte range to block addresses in one pass */
+    first = offset / BLK_SIZE;
+    count = (end - 1) / BLK_SIZE - first + 1;
+    addrs = (blk_addr_t *) malloc(count * sizeof(blk_addr_t));
+    if (addrs == NULL) {
+        INODE_UNLOCK(inode.inumber);
+        return -ENOMEM;
+    }
+    block_map_range(&inode, first, count, addrs);
+
+    /* copy each run of physically contiguous blocks with a single read, and
+       the blocks of a compressed cluster from the cluster decompressed */
+    for (pos = offset, i = 0; i < count; i += run) {
+        if (addrs[i] == BLK_ADDR_COMPRESSED) {
+            extent_lookup(&inode, first + i, &extent);
+            run = extent.logical + extent.len - (first + i);
+            if (run > count - i)
+                run = count - i;
+        }
+        else {
+            for (run = 1; i + run < count && addrs[i + run] == addrs[i] + run; run++)
+                ;
+        }
 
-        /* update file size, if required */
-        if (table_entry->file_offset >= inode->attr.size) {
-            inode->attr.size = table_entry->file_offset - 1;
+        run_end = (offset_t) (first + i + run) * BLK_SIZE;
+        if (run_end > end)
+            run_end = end;
 
-            /* write the modified inode to disk */
-            INODE_WRITE(inode->inumber, inode);
+        if (addrs[i] == BLK_ADDR_COMPRESSED) {
+            ret = cluster_read(&extent, pos - (offset_t) extent.logical * BLK_SIZE, (char *) buf + (pos - offset), run_end - pos);
+            if (ret < 0) {
+                free(addrs);
+                INODE_UNLOCK(inode.inumber);
+                return ret;
+            }
         }
+        else if (addrs[i] == 0)
+            memset((char *) buf + (pos - offset), 0, run_end - pos);
+        else
+            DISK_READ(BLK_POS(addrs[i]) + pos % BLK_SIZE, (char *) buf + (pos - offset), run_end - pos);
 
-        /* recursively call mywrite() to continue writing from @buf to the
-           next block(s) */
-        void * buf_new = buf + block_leftover_bytes;
-        size_t nbytes_new = nbytes - block_leftover_bytes;
-        return block_leftover_bytes + mywrite(fd, buf_new, nbytes_new);
+        pos = run_end;
     }
+
+    free(addrs);
+    INODE_UNLOCK(inode.inumber);
+    return nbytes;
 }
 
-int myrmdir(const char * path) {
-    inode_t * inode = (inode_t *) malloc(sizeof(inode_t));
-    inumber_t inumber;
+int mypwrite(int fd, const void * buf, size_t nbytes, offset_t offset) {
+    fs_check_mounted();
 
-    inumber = get_inode_from_path(path, inode);
+    table_entry_t * table_entry;
+    inumber_t inumber;
+    int ret;
 
-    /* check if directory exists */
-    if (inumber == 0 || inumber >= INODE_COUNT) {
-        /* fprintf(stderr, "myrmdir: %s: no such directory\n", path); */
-        free(inode);
-        return -ENOENT;
+    /* error handling similar to pwrite(2) */
+    if ((table_entry = file_table_get(fd)) == NULL || table_entry->file->inode.attr.mode != RW) {
+        return -EBADF;
     }
+    if (table_entry->file->inode.flags & INODE_F_SNAPSHOT)
+        return -EROFS;
 
-    /* free @inode only if there are no files in the directory */
-    if (inode->attr.size == 0) {
-        inode_free(inode);
+    /* the inode is shared by all the fds on the file, and changed in place */
+    inumber = table_entry->file->inode.inumber;
+    fs_op_begin();
+    INODE_WRLOCK(inumber);
 
-        /* update the parent */
-        dir_entry_delete(path);
+    ret = delalloc_write(table_entry->file, buf, nbytes, offset);
 
-        free(inode);
-        return 0;
-    }
-    else {
-        /* fprintf(stderr, "myrmdir: %s: directory not empty\n", path); */
-        free(inode);
-        return -ENOTEMPTY;
-    }
+    INODE_UNLOCK(inumber);
+    fs_op_end();
+    return ret;
 }
 
-int myrm(const char * path) {
-    inode_t * inode = (inode_t *) malloc(sizeof(inode_t));
-    inumber_t inumber;
-
-    inumber = get_inode_from_path(path, inode);
-    log_msg("myrm inumber %d\n", inumber);
+/* write @nbytes bytes from @buf into the file represented by @inode, starting
+ * at byte @offset; this does the actual work for mywrite() and mypwrite(). All
+ * the blocks the write needs are allocated in one go, each run of physically
+ * contiguous blocks is copied with a single write, blocks which are
+ * overwritten completely are not read first (see cache_write()), and the
+ * inode is written once. The caller holds the inode's write lock.
+ *
+ * @return          the no. of bytes written, which is less than @nbytes if the
+ *                  fs ran out of space, else -errno */
+
+int inode_write(inode_t * inode, const void * buf, size_t nbytes, offset_t offset) {
+    blk_addr_t * addrs;
+    unsigned int first, count, have, i, run;
+    offset_t pos, end, run_end;
+    int ret;
+
+    if (offset >= INODE_SIZE_MAX(inode) || nbytes == 0)
+        return offset >= INODE_SIZE_MAX(inode) ? -EFBIG : 0;
+    if (nbytes > INODE_SIZE_MAX(inode) - offset)
+        nbytes = INODE_SIZE_MAX(inode) - offset;
+
+    /* a file kept inline stays so for as long as it fits, and moves out to
+       a data block the first time it is written past that */
+    if (inode->flags & INODE_F_INLINE) {
+        if (offset + nbytes <= INODE_INLINE_MAX)
+            return inode_inline_write(inode, buf, nbytes, offset);
+        if ((ret = inode_inline_promote(inode)) < 0)
+            return ret;
+    }
 
-    /* check if file exists */
-    if (inumber == INODE_COUNT + 1) {
-        /* fprintf(stderr, "myrm: %s: no such file\n", path); */
-        free(inode);
-        return -ENOTDIR;
+    /* allocate all the blocks the write needs in one go; if the fs is full,
+       write only as much as fits */
+    end = offset + nbytes;
+    have = inode_blocks_extend(inode, CEIL(end, BLK_SIZE), true);
+    if ((offset_t) have * BLK_SIZE < end)
+        end = (offset_t) have * BLK_SIZE;
+    if (end <= offset) {
+        INODE_WRITE(inode->inumber, inode);
+        return -ENOSPC;
     }
-    else if (inumber == 0) {
-        free(inode);
-        return -ENOENT;
+    nbytes = end - offset;
+
+    /* map the whole byte range to block addresses in one pass, once the
+       compressed clusters in it, and the blocks shared with snapshots, have
+       blocks of their own */
+    first = offset / BLK_SIZE;
+    count = (end - 1) / BLK_SIZE - first + 1;
+    if ((ret = inode_uncompress(inode, first, count)) < 0 ||
+        (ret = inode_unshare(inode, offset, end)) < 0) {
+        INODE_WRITE(inode->inumber, inode);
+        return ret;
     }
-
-    int i;
-    for (i = 0; i < MAX_OPEN_FILES; i++) {
-        log_msg("myrm entry %d\n", i);
-        if (BB_DATA->openFileTable[i] && BB_DATA->openFileTable[i]->inode.inumber == inumber)
-            return -EBUSY;
+    addrs = (blk_addr_t *) malloc(count * sizeof(blk_addr_t));
+    if (addrs == NULL) {
+        INODE_WRITE(inode->inumber, inode);
+        return -ENOMEM;
     }
+    block_map_range(inode, first, count, addrs);
 
-    /* free the file inode */
-    log_msg("sadfsdf\n");
-    inode_free(inode);
-    log_msg("sadfsdfasdsad\n");
+    /* copy each run of physically contiguous blocks with a single write */
+    for (pos = offset, i = 0; i < count; i += run) {
+        for (run = 1; i + run < count && addrs[i + run] == addrs[i] + run; run++)
+            ;
 
-    /* update the parent */
-    dir_entry_delete(path);
-    log_msg("sadfsdffsdifjsdkjfsakjdfh\n");
+        run_end = (offset_t) (first + i + run) * BLK_SIZE;
+        if (run_end > end)
+            run_end = end;
 
-    free(inode);
+        DISK_WRITE(BLK_POS(addrs[i]) + pos % BLK_SIZE, (const char *) buf + (pos - offset), run_end - pos);
 
-    return 0;
-}
+        pos = run_end;
+    }
 
-/* internal functions, not part of the public-facing API */
+    free(addrs);
 
+    /* update file size, if required, and write the inode once */
+    if (end > inode->attr.size)
+        inode->attr.size = end;
+    INODE_WRITE(inode->inumber, inode);
 
-/* delete the directory entry of @path from its parent inode */
+    return nbytes;
+}
 
-void dir_entry_delete(const char * path) {
-    char * parent_path = dirname(strdup(path));
-    char * name = basename(strdup(path));
-    inode_t * parent_inode = (inode_t *) malloc(sizeof(inode_t));
-    inumber_t inumber;
-    blk_addr_t addr;
-    unsigned int i, j, entry_count,blk_count;
+/* write @nbytes bytes from @buf into the file represented by @inode, which is
+ * kept inline, starting at byte @offset; the write has to fit inline. The data
+ * is journalled along with the inode, whose block it shares. */
 
-    inumber = get_inode_from_path(parent_path, parent_inode);
+int inode_inline_write(inode_t * inode, const void * buf, size_t nbytes, offset_t offset) {
+    char * zeroes;
 
-    /* check if parent directory exists */
-    if (inumber == 0 || inumber >= INODE_COUNT)
-        return;
+    /* the bytes skipped over read as zeroes; the inline area may still hold
+       the data of a file which had the inode before */
+    if (offset > inode->attr.size) {
+        if ((zeroes = (char *) calloc(1, offset - inode->attr.size)) == NULL)
+            return -ENOMEM;
+        META_WRITE(INODE_INLINE_POS(inode->inumber) + inode->attr.size, zeroes, offset - inode->attr.size);
+        free(zeroes);
+    }
+
+    META_WRITE(INODE_INLINE_POS(inode->inumber) + offset, buf, nbytes);
+
+    if (offset + nbytes > inode->attr.size)
+        inode->attr.size = offset + nbytes;
+    INODE_WRITE(inode->inumber, inode);
+
+    return nbytes;
+}
+
+/* move the data of the file represented by @inode, which is kept inline, out
+ * to its first data block; the inode is not written to disk */
+
+int inode_inline_promote(inode_t * inode) {
+    file_size_t size = inode->attr.size;
+    char * data;
+
+    inode->flags &= ~INODE_F_INLINE;
+    if (size == 0)
+        return 0;
+
+    if ((data = (char *) malloc(size)) == NULL) {
+        inode->flags |= INODE_F_INLINE;
+        return -ENOMEM;
+    }
+    DISK_READ(INODE_INLINE_POS(inode->inumber), data, size);
+
+    /* the new block is zeroed past @size by get_free_extent() */
+    inode->attr.size = 0;
+    if (inode_blocks_extend(inode, 1, true) < 1) {
+        inode->flags |= INODE_F_INLINE;
+        inode->attr.size = size;
+        free(data);
+        return -ENOSPC;
+    }
+    DISK_WRITE(BLK_POS(block_map(inode, 0)), data, size);
+    inode->attr.size = size;
+
+    free(data);
+    stats_count(STATS_INLINE_PROMOTED, 1);
+    return 0;
+}
+
+/* write @nbytes bytes from @buf into the open file @file, starting at byte
+ * @offset, like inode_write(), but hold back the allocation of the blocks
+ * past the end of the file: their data is kept in memory (at @file->delayed)
+ * until the file is closed or the running transaction commits, and they are
+ * allocated then in one go, so that files written side by side each get
+ * contiguous runs. Free blocks are reserved for the data held back, so that
+ * it always finds room. The caller holds the inode's write lock.
+ *
+ * @return          the no. of bytes written, else -errno */
+
+int delalloc_write(open_inode_t * file, const void * buf, size_t nbytes, offset_t offset) {
+    inode_t * inode = &file->inode;
+    offset_t start, end, old_end, new_end, pos;
+    unsigned int from, have, count;
+    size_t n;
+    int ret, done = 0;
+
+    /* a mapped image has no cache to write through later, and a file which
+       still fits inline has no blocks at all */
+    if (BB_DATA->map != NULL || nbytes == 0 || offset >= INODE_SIZE_MAX(inode) ||
+        ((inode->flags & INODE_F_INLINE) && offset + nbytes <= INODE_INLINE_MAX))
+        return inode_write(inode, buf, nbytes, offset);
+    if (nbytes > INODE_SIZE_MAX(inode) - offset)
+        nbytes = INODE_SIZE_MAX(inode) - offset;
+    if ((inode->flags & INODE_F_INLINE) && (ret = inode_inline_promote(inode)) < 0)
+        return ret;
+
+    /* the blocks the file has already are written in place */
+    from = file->delayed_count > 0 ? file->delayed_from : CEIL(inode->attr.size, BLK_SIZE);
+    start = (offset_t) from * BLK_SIZE;
+    end = offset + nbytes;
+    if (offset < start) {
+        done = inode_write(inode, buf, (end < start ? end : start) - offset, offset);
+        if (done < 0 || end <= start || offset + done < start)
+            return done;
+    }
+
+    old_end = inode->attr.size > start ? inode->attr.size : start;
+    new_end = end > old_end ? end : old_end;
+    have = CEIL(old_end, BLK_SIZE) - from;
+    count = CEIL(new_end, BLK_SIZE) - from;
+
+    /* past the limits on the data held back, allocate what the file held back
+       so far, and write the rest in place */
+    if ((offset_t) count * BLK_SIZE > DELALLOC_FILE_MAX || ! delalloc_reserve(count - have)) {
+        if ((ret = delalloc_flush(file)) < 0)
+            return done > 0 ? done : ret;
+        ret = inode_write(inode, (const char *) buf + done, nbytes - done, offset + done);
+        return ret < 0 ? (done > 0 ? done : ret) : done + ret;
+    }
+
+    file->delayed_from = from;
+    if (delalloc_grow(file, count) < 0) {
+        delalloc_release(count - have);
+        return done > 0 ? done : -ENOMEM;
+    }
+
+    for (pos = offset + done; pos < end; pos += n) {
+        n = BLK_SIZE - pos % BLK_SIZE;
+        if (n > end - pos)
+            n = end - pos;
+        memcpy(file->delayed[pos / BLK_SIZE - from] + pos % BLK_SIZE, (const char *) buf + (pos - offset), n);
+    }
+
+    /* the inode table has the new size, but the inode only reaches the disk
+       after the blocks are allocated (see fs_commit()) */
+    inode->attr.size = new_end;
+    INODE_WRITE(inode->inumber, inode);
+
+    return nbytes;
+}
+
+/* make room for @count blocks of data held back by the open file @file; the
+ * blocks added read as zeroes until they are written. They come from a slab,
+ * so that memory which was used for data held back once is used again, rather
+ * than given back and faulted in anew.
+ *
+ * @return          0 on success, else -ENOMEM */
+
+int delalloc_grow(open_inode_t * file, unsigned int count) {
+    char ** delayed;
+    unsigned int max, i = file->delayed_count;
+    int ret = 0;
+
+    if (count <= file->delayed_count)
+        return 0;
+
+    if (count > file->delayed_max) {
+        max = file->delayed_max * 2 > count ? file->delayed_max * 2 : count;
+        if ((delayed = (char **) realloc(file->delayed, max * sizeof(char *))) == NULL)
+            return -ENOMEM;
+        file->delayed = delayed;
+        file->delayed_max = max;
+    }
+
+    pthread_mutex_lock(&BB_DATA->alloc_lock);
+    for (; file->delayed_count < count; file->delayed_count++) {
+        if ((file->delayed[file->delayed_count] = (char *) slab_alloc(&BB_DATA->delalloc_blocks)) == NULL) {
+            ret = -ENOMEM;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&BB_DATA->alloc_lock);
+
+    for (; i < file->delayed_count; i++)
+        memset(file->delayed[i], 0, BLK_SIZE);
+
+    return ret;
+}
+
+/* allocate the blocks of the data the open file @file held back, and write
+ * it out; the whole clusters of a compressed file are compressed on the way.
+ * The caller holds the inode's write lock, or is committing.
+ *
+ * @return          0 on success, else -errno, in which case the file is cut
+ *                  short at the data which could be written */
+
+int delalloc_flush(open_inode_t * file) {
+    inode_t * inode = &file->inode;
+    file_size_t size = inode->attr.size;
+    unsigned int cluster = COMPRESS_CLUSTER_BLKS;
+    unsigned int count, done, n, have, block_no, i, run;
+    blk_addr_t * addrs;
+    char * buf = NULL;
+    int ret = 0, compressed;
+
+    if (file->delayed_count == 0)
+        return 0;
+
+    /* the blocks come out of the ones reserved for the file, and are
+       allocated in as few runs as possible; they are overwritten whole, so
+       need no zeroing */
+    count = size > (offset_t) file->delayed_from * BLK_SIZE ? CEIL(size, BLK_SIZE) - file->delayed_from : 0;
+    delalloc_release(count);
+
+    /* a cluster is compressed by way of a buffer with room for it twice; if
+       there is no memory for one, the data is written as it is */
+    if (inode->flags & INODE_F_COMPRESS)
+        buf = (char *) malloc((size_t) cluster * BLK_SIZE * 2);
+
+    addrs = (blk_addr_t *) malloc((count > 0 ? count : 1) * sizeof(blk_addr_t));
+    if (addrs == NULL)
+        ret = -ENOMEM;
+
+    inode->attr.size = (offset_t) file->delayed_from * BLK_SIZE;
+    for (done = 0; addrs != NULL && done < count; done += n) {
+        block_no = file->delayed_from + done;
+
+        /* the data up to the next cluster boundary goes out in one piece */
+        n = count - done;
+        if (buf != NULL && n > cluster - block_no % cluster)
+            n = cluster - block_no % cluster;
+
+        if (buf != NULL && n == cluster && (compressed = delalloc_compress(file, done, buf)) != 0) {
+            if (compressed < 0 && ret == 0)
+                ret = compressed;
+            inode->attr.size = (offset_t) (block_no + n) * BLK_SIZE;
+            continue;
+        }
+
+        /* write each run of physically contiguous blocks with a single
+           write, past the cache; data is only held back when there is a
+           cache */
+        have = inode_blocks_extend(inode, block_no + n, false) - block_no;
+        block_map_range(inode, block_no, have, addrs);
+        for (i = 0; i < have; i += run) {
+            for (run = 1; i + run < have && addrs[i + run] == addrs[i] + run; run++)
+                ;
+            if (cache_write_blocks(addrs[i], file->delayed + done + i, run) != 0 && ret == 0)
+                ret = -EIO;
+        }
+
+        inode->attr.size = (offset_t) (block_no + have) * BLK_SIZE;
+        if (have < n) {
+            done += have;
+            break;
+        }
+    }
+
+    free(addrs);
+    free(buf);
+
+    if (done < count) {
+        size = (offset_t) (file->delayed_from + done) * BLK_SIZE;
+        log_error("delalloc_flush: inode %u cut short to %llu bytes\n", inode->inumber, (unsigned long long) size);
+        if (ret == 0)
+            ret = -ENOSPC;
+    }
+    inode->attr.size = size;
+    INODE_WRITE(inode->inumber, inode);
+
+    pthread_mutex_lock(&BB_DATA->alloc_lock);
+    for (i = 0; i < file->delayed_count; i++)
+        slab_free(&BB_DATA->delalloc_blocks, file->delayed[i]);
+    pthread_mutex_unlock(&BB_DATA->alloc_lock);
+
+    free(file->delayed);
+    file->delayed = NULL;
+    file->delayed_count = 0;
+    file->delayed_max = 0;
+
+    stats_count(STATS_DELALLOC_FLUSHES, 1);
+
+    return ret;
+}
+
+/* store the cluster of the data held back by the open file @file which starts
+ * at @file->delayed[@i] compressed, if that saves a block: it is compressed by
+ * way of @buf, which has room for two clusters, into blocks allocated in one
+ * run, which are written with a single write
+ *
+ * @return          1 if the cluster was stored compressed, 0 if it is to be
+ *                  stored as it is, else -EIO if it was stored compressed, but
+ *                  could not be written */
+
+int delalloc_compress(open_inode_t * file, unsigned int i, char * buf) {
+    inode_t * inode = &file->inode;
+    unsigned int n = COMPRESS_CLUSTER_BLKS, stored, got, j;
+    size_t size = (size_t) n * BLK_SIZE;
+    char * out = buf + size, * blocks[COMPRESS_CLUSTER_SIZE / BLK_SIZE_MIN];
+    blk_addr_t addr;
+    uint32_t len;
+
+    if (inode->extent_count >= COMPRESS_EXTENTS_MAX)
+        return 0;
+
+    for (j = 0; j < n; j++)
+        memcpy(buf + (size_t) j * BLK_SIZE, file->delayed[i + j], BLK_SIZE);
+
+    len = compress_buffer(buf, size, out + sizeof(len), size - BLK_SIZE - sizeof(len));
+    if (len == 0)
+        return 0;
+    memcpy(out, &len, sizeof(len));
+    stored = CEIL(sizeof(len) + len, BLK_SIZE);
+    memset(out + sizeof(len) + len, 0, (size_t) stored * BLK_SIZE - sizeof(len) - len);
+
+    addr = get_free_extent(extent_next(inode), stored, &got, false);
+    if (got < stored || ! extent_append(inode, addr, n, stored)) {
+        extent_free(addr, got);
+        return 0;
+    }
+
+    for (j = 0; j < stored; j++)
+        blocks[j] = out + (size_t) j * BLK_SIZE;
+
+    stats_count(STATS_CLUSTERS_COMPRESSED, 1);
+    stats_count(STATS_BLOCKS_SAVED, n - stored);
+
+    return cache_write_blocks(addr, blocks, stored) != 0 ? -EIO : 1;
+}
+
+/* allocate the blocks of the data held back by all the open files; this is
+ * done while committing, when no operation is in progress, so the file table
+ * cannot change, and only readers can hold the inode locks */
+
+void delalloc_flush_all(void) {
+    open_inode_t * file;
+    unsigned int i;
+
+    for (i = 0; i < OPEN_INODE_BUCKETS; i++) {
+        for (file = BB_DATA->file_table->buckets[i]; file != NULL; file = file->hash_next) {
+            if (file->delayed_count == 0)
+                continue;
+
+            INODE_WRLOCK(file->inode.inumber);
+            delalloc_flush(file);
+            INODE_UNLOCK(file->inode.inumber);
+        }
+    }
+}
+
+/* reserve @count free blocks for data held back from allocation, which the
+ * allocator leaves alone from then on
+ *
+ * @return          false if there are not as many free blocks, or the data
+ *                  held back by all files would go past DELALLOC_TOTAL_MAX */
+
+bool delalloc_reserve(unsigned int count) {
+    bool ok;
+
+    pthread_mutex_lock(&BB_DATA->alloc_lock);
+    ok = BB_DATA->blocks_reserved + count <= BB_DATA->super_blk->block_free_count &&
+         (BB_DATA->blocks_reserved + count) * BLK_SIZE <= DELALLOC_TOTAL_MAX;
+    if (ok)
+        BB_DATA->blocks_reserved += count;
+    pthread_mutex_unlock(&BB_DATA->alloc_lock);
+
+    return ok;
+}
+
+/* give back @count blocks reserved by delalloc_reserve() */
+
+void delalloc_release(unsigned int count) {
+    pthread_mutex_lock(&BB_DATA->alloc_lock);
+    BB_DATA->blocks_reserved -= count;
+    pthread_mutex_unlock(&BB_DATA->alloc_lock);
+}
+
+int myrmdir(const char * path) {
+    inode_t * inode = (inode_t *) malloc(sizeof(inode_t)), parent;
+    char dir_path[PATH_LEN_MAX + 1];
+    inumber_t inumber;
+    bool snapshot;
+
+    fs_op_begin();
+    pthread_rwlock_wrlock(&BB_DATA->ns_lock);
+
+    inumber = path_lookup(path, inode);
+
+    /* check if directory exists */
+    if (inumber == 0 || inumber > INODE_COUNT) {
+        /* fprintf(stderr, "myrmdir: %s: no such directory\n", path); */
+        pthread_rwlock_unlock(&BB_DATA->ns_lock);
+        fs_op_end();
+        free(inode);
+        return -ENOENT;
+    }
+
+    /* a snapshot is freed whole, by mysnapshot_delete(), and nothing else
+       in the directory of snapshots, or in a snapshot, is removed */
+    if (inode->flags & INODE_F_SNAPSHOT) {
+        strcpy(dir_path, path);
+        snapshot = path_lookup(dirname(dir_path), &parent) == BB_DATA->super_blk->snapshots;
+        pthread_rwlock_unlock(&BB_DATA->ns_lock);
+        fs_op_end();
+        free(inode);
+        if (! snapshot)
+            return -EROFS;
+        strcpy(dir_path, path);
+        return mysnapshot_delete(basename(dir_path));
+    }
+
+    /* free @inode only if there are no files in the directory */
+    if (inode->attr.size == 0) {
+        inode_free(inode);
+
+        /* update the parent */
+        dir_entry_delete(path);
+
+        pthread_rwlock_unlock(&BB_DATA->ns_lock);
+        fs_op_end();
+        free(inode);
+        return 0;
+    }
+    else {
+        /* fprintf(stderr, "myrmdir: %s: directory not empty\n", path); */
+        pthread_rwlock_unlock(&BB_DATA->ns_lock);
+        fs_op_end();
+        free(inode);
+        return -ENOTEMPTY;
+    }
+}
+
+int myrm(const char * path) {
+    inode_t * inode = (inode_t *) malloc(sizeof(inode_t));
+    inumber_t inumber;
+
+    fs_op_begin();
+    pthread_rwlock_wrlock(&BB_DATA->ns_lock);
+
+    inumber = path_lookup(path, inode);
+    log_msg("myrm inumber %d\n", inumber);
+
+    /* check if file exists */
+    if (inumber == INODE_COUNT + 1) {
+        /* fprintf(stderr, "myrm: %s: no such file\n", path); */
+        pthread_rwlock_unlock(&BB_DATA->ns_lock);
+        fs_op_end();
+        free(inode);
+        return -ENOTDIR;
+    }
+    else if (inumber == 0) {
+        pthread_rwlock_unlock(&BB_DATA->ns_lock);
+        fs_op_end();
+        free(inode);
+        return -ENOENT;
+    }
+
+    if (inode->flags & INODE_F_SNAPSHOT) {
+        pthread_rwlock_unlock(&BB_DATA->ns_lock);
+        fs_op_end();
+        free(inode);
+        return -EROFS;
+    }
+
+    /* no new fd can be opened on the file while the tree is locked */
+    if (file_table_busy(inumber)) {
+        pthread_rwlock_unlock(&BB_DATA->ns_lock);
+        fs_op_end();
+        free(inode);
+        return -EBUSY;
+    }
+
+    /* free the file inode */
+    log_msg("sadfsdf\n");
+    inode_free(inode);
+    log_msg("sadfsdfasdsad\n");
+
+    /* update the parent */
+    dir_entry_delete(path);
+    log_msg("sadfsdffsdifjsdkjfsakjdfh\n");
+
+    pthread_rwlock_unlock(&BB_DATA->ns_lock);
+    fs_op_end();
+    free(inode);
+
+    return 0;
+}
+
+/* internal functions, not part of the public-facing API */
+
+
+/* delete the directory entry of @path from its parent inode */
+
+void dir_entry_delete(const char * path) {
+    char * parent_path = dirname(strdup(path));
+    char * name = basename(strdup(path));
+    inode_t parent_inode;
+    inumber_t inumber;
+
+    inumber = path_lookup(parent_path, &parent_inode);
+
+    /* check if parent directory exists */
+    if (inumber == 0 || inumber > INODE_COUNT)
+        return;
+
+    /* the name is about to go away */
+    dcache_insert(inumber, name, 0);
+
+    dir_entry_remove(&parent_inode, name);
+}
+
+/* hash of @name, which decides where it goes in a directory; it is only 31
+ * bits, so that positions in a directory (see dir_leaf_list()) fit in an
+ * off_t */
+
+uint32_t dir_hash(const char * name) {
+    uint32_t hash = 2166136261u;
+
+    while (*name != '\0')
+        hash = (hash ^ (unsigned char) *name++) * 16777619u;
+
+    return hash & 0x7fffffff;
+}
+
+/* qsort() comparison of two file_entry_t, by the hash of their names, then by
+ * name */
+
+int dir_entry_cmp(const void * a, const void * b) {
+    const file_entry_t * x = a, * y = b;
+    uint32_t hx = dir_hash(x->name), hy = dir_hash(y->name);
+
+    if (hx != hy)
+        return hx < hy ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+/* find the leaf of the directory @dir which holds the names with hash @hash.
+ * The index blocks on the way from the root are put in @addrs, and the
+ * positions of the entries followed in them in @pos; both have room for
+ * DIR_LEVELS_MAX + 1 elements.
+ *
+ * @param depth     set to the no. of index blocks on the way
+ * @return          block address of the leaf, or 0 if @dir has no blocks */
+
+blk_addr_t dir_leaf_find(inode_t * dir, uint32_t hash, blk_addr_t * addrs, unsigned int * pos, unsigned int * depth) {
+    dir_index_t index[DIR_INDEX_MAX + 1], * entries = index + 1;
+    blk_addr_t addr = dir->blocks_direct[0];
+    unsigned int d, levels = 0, lo, hi, mid;
+
+    *depth = 0;
+    if (! (dir->flags & INODE_F_INDEX))
+        return addr;
+
+    for (d = 0; d <= levels; d++) {
+        DIR_INDEX_READ(index, addr);
+        if (d == 0)
+            levels = index[0].header.levels;
+
+        /* the last entry whose hash is at most @hash; the first one's is 0 */
+        lo = 0;
+        hi = index[0].header.count;
+        while (hi - lo > 1) {
+            mid = (lo + hi) / 2;
+            if (entries[mid].entry.hash <= hash)
+                lo = mid;
+            else
+                hi = mid;
+        }
+
+        addrs[d] = addr;
+        pos[d] = lo;
+        addr = entries[lo].entry.addr;
+    }
+
+    *depth = d;
+    return addr;
+}
+
+/* add the entry (@name, @inumber) to the directory @dir, and write @dir to
+ * disk; a full leaf is split in two, after making room in the index for the
+ * new leaf if need be, until there is room in the leaf for @name
+ *
+ * @return          0 on success, else -ENOSPC or -ENOMEM */
+
+int dir_entry_add(inode_t * dir, const char * name, inumber_t inumber) {
+    file_entry_t entries[MAX_FILES_PER_BLOCK];
+    blk_addr_t addrs[DIR_LEVELS_MAX + 1], leaf;
+    unsigned int pos[DIR_LEVELS_MAX + 1], depth, i;
+    uint32_t hash = dir_hash(name);
+    int ret;
+
+    for (;;) {
+        leaf = dir_leaf_find(dir, hash, addrs, pos, &depth);
+
+        /* the first entry of the directory gets it its first block */
+        if (leaf == 0) {
+            leaf = get_free_block();
+            if (leaf == 0)
+                return -ENOSPC;
+            dir->blocks_direct[0] = leaf;
+        }
+
+        DIR_BLOCK_READ(entries, leaf);
+        for (i = 0; i < MAX_FILES_PER_BLOCK && entries[i].inumber != 0; i++)
+            ;
+
+        if (i < MAX_FILES_PER_BLOCK) {
+            strcpy(entries[i].name, name);
+            entries[i].inumber = inumber;
+            META_WRITE(BLK_POS(leaf) + i * sizeof(file_entry_t), &entries[i], sizeof(file_entry_t));
+
+            dir->attr.size++;
+            INODE_WRITE(dir->inumber, dir);
+            return 0;
+        }
+
+        /* a directory outgrowing its single leaf gets an index */
+        ret = depth == 0 ? dir_index_create(dir) : dir_leaf_split(dir, leaf, addrs, pos, depth);
+        if (ret < 0)
+            return ret;
+    }
+}
+
+/* remove the entry @name from the directory @dir, and write @dir to disk; the
+ * blocks of a directory are freed when it becomes empty, but until then, its
+ * leaves are not merged
+ *
+ * @return          0 on success, else -ENOENT */
+
+int dir_entry_remove(inode_t * dir, const char * name) {
+    file_entry_t entries[MAX_FILES_PER_BLOCK];
+    blk_addr_t addrs[DIR_LEVELS_MAX + 1], leaf;
+    unsigned int pos[DIR_LEVELS_MAX + 1], depth, i;
+
+    leaf = dir_leaf_find(dir, dir_hash(name), addrs, pos, &depth);
+    if (leaf == 0)
+        return -ENOENT;
+
+    DIR_BLOCK_READ(entries, leaf);
+    for (i = 0; i < MAX_FILES_PER_BLOCK; i++)
+        if (entries[i].inumber != 0 && strcmp(entries[i].name, name) == 0)
+            break;
+    if (i == MAX_FILES_PER_BLOCK)
+        return -ENOENT;
+
+    memset(&entries[i], 0, sizeof(file_entry_t));
+    META_WRITE(BLK_POS(leaf) + i * sizeof(file_entry_t), &entries[i], sizeof(file_entry_t));
+
+    dir->attr.size--;
+    if (dir->attr.size == 0)
+        dir_blocks_free(dir);
+    INODE_WRITE(dir->inumber, dir);
+
+    return 0;
+}
+
+/* turn the single leaf of the directory @dir into the only leaf of a new hash
+ * tree; the leaf stays where it is
+ *
+ * @return          0 on success, else -ENOSPC */
+
+int dir_index_create(inode_t * dir) {
+    dir_index_t root[DIR_INDEX_MAX + 1];
+    blk_addr_t addr;
+
+    addr = get_free_block();
+    if (addr == 0)
+        return -ENOSPC;
+
+    memset(root, 0, sizeof(root));
+    root[0].header.count = 1;
+    root[0].header.levels = 0;
+    root[1].entry.hash = 0;
+    root[1].entry.addr = dir->blocks_direct[0];
+    DIR_INDEX_WRITE(root, addr);
+
+    dir->blocks_direct[0] = addr;
+    dir->flags |= INODE_F_INDEX;
+    INODE_WRITE(dir->inumber, dir);
+
+    return 0;
+}
+
+/* make room in the full index block @addrs[@d] of the directory @dir (see
+ * dir_leaf_find()): the root grows the tree a level, by moving its entries
+ * into a new block below it; any other index block is split in two, once its
+ * parent has room for the new one
+ *
+ * @return          0 on success, else -ENOSPC */
+
+int dir_index_split(inode_t * dir, blk_addr_t * addrs, unsigned int * pos, unsigned int d) {
+    dir_index_t index[DIR_INDEX_MAX + 1], parent[DIR_INDEX_MAX + 1];
+    blk_addr_t addr;
+    unsigned int half, levels;
+
+    if (d == 0) {
+        DIR_INDEX_READ(index, addrs[0]);
+        levels = index[0].header.levels;
+        if (levels == DIR_LEVELS_MAX)
+            return -ENOSPC;
+
+        addr = get_free_block();
+        if (addr == 0)
+            return -ENOSPC;
+
+        index[0].header.levels = 0;
+        DIR_INDEX_WRITE(index, addr);
+
+        memset(index, 0, sizeof(index));
+        index[0].header.count = 1;
+        index[0].header.levels = levels + 1;
+        index[1].entry.hash = 0;
+        index[1].entry.addr = addr;
+        DIR_INDEX_WRITE(index, addrs[0]);
+        return 0;
+    }
+
+    DIR_INDEX_READ(parent, addrs[d - 1]);
+    if (parent[0].header.count == DIR_INDEX_MAX)
+        return dir_index_split(dir, addrs, pos, d - 1);
+
+    addr = get_free_block();
+    if (addr == 0)
+        return -ENOSPC;
+
+    /* move the upper half of the entries into the new block */
+    DIR_INDEX_READ(index, addrs[d]);
+    half = index[0].header.count / 2;
+    index[0].header.count -= half;
+    DIR_INDEX_WRITE(index, addrs[d]);
+
+    memmove(index + 1, index + 1 + index[0].header.count, half * sizeof(dir_index_t));
+    index[0].header.count = half;
+    DIR_INDEX_WRITE(index, addr);
+
+    /* and add it to the parent, after the block split */
+    memmove(parent + pos[d - 1] + 3, parent + pos[d - 1] + 2,
+            (parent[0].header.count - pos[d - 1] - 1) * sizeof(dir_index_t));
+    parent[pos[d - 1] + 2].entry.hash = index[1].entry.hash;
+    parent[pos[d - 1] + 2].entry.addr = addr;
+    parent[0].header.count++;
+    DIR_INDEX_WRITE(parent, addrs[d - 1]);
+
+    return 0;
+}
+
+/* split the full leaf @leaf of the directory @dir in two, by hash, so that
+ * the names with the same hash stay together; @addrs, @pos and @depth are as
+ * set by dir_leaf_find(). If the leaf's index block is full, room is made in
+ * it instead.
+ *
+ * @return          0 on success, else -ENOSPC or -ENOMEM */
+
+int dir_leaf_split(inode_t * dir, blk_addr_t leaf, blk_addr_t * addrs, unsigned int * pos, unsigned int depth) {
+    dir_index_t index[DIR_INDEX_MAX + 1];
+    file_entry_t * entries;
+    unsigned int n = MAX_FILES_PER_BLOCK, split, p = pos[depth - 1];
+    uint32_t hash;
+    blk_addr_t addr;
+
+    DIR_INDEX_READ(index, addrs[depth - 1]);
+    if (index[0].header.count == DIR_INDEX_MAX)
+        return dir_index_split(dir, addrs, pos, depth - 1);
+
+    entries = (file_entry_t *) malloc(2 * n * sizeof(file_entry_t));
+    if (entries == NULL)
+        return -ENOMEM;
+    DIR_BLOCK_READ(entries, leaf);
+    qsort(entries, n, sizeof(file_entry_t), dir_entry_cmp);
+
+    /* split at the middle, or at the nearest change of hash to it */
+    for (split = n / 2; split < n && dir_hash(entries[split].name) == dir_hash(entries[split - 1].name); split++)
+        ;
+    if (split == n)
+        for (split = n / 2; split > 0 && dir_hash(entries[split].name) == dir_hash(entries[split - 1].name); split--)
+            ;
+
+    if (split == 0 || (addr = get_free_block()) == 0) {
+        free(entries);
+        return -ENOSPC;
+    }
+
+    /* the upper half goes to the new leaf */
+    memset(entries + n, 0, n * sizeof(file_entry_t));
+    memcpy(entries + n, entries + split, (n - split) * sizeof(file_entry_t));
+    memset(entries + split, 0, (n - split) * sizeof(file_entry_t));
+    DIR_BLOCK_WRITE(entries, leaf);
+    DIR_BLOCK_WRITE(entries + n, addr);
+    hash = dir_hash(entries[n].name);
+    free(entries);
+
+    /* and is added to the index, after the old one */
+    memmove(index + p + 3, index + p + 2, (index[0].header.count - p - 1) * sizeof(dir_index_t));
+    index[p + 2].entry.hash = hash;
+    index[p + 2].entry.addr = addr;
+    index[0].header.count++;
+    DIR_INDEX_WRITE(index, addrs[depth - 1]);
+
+    return 0;
+}
+
+/* free all blocks of the directory @dir, leaving it without any (the caller
+ * writes @dir to disk) */
+
+void dir_blocks_free(inode_t * dir) {
+    dir_index_t root[DIR_INDEX_MAX + 1];
+
+    if (dir->blocks_direct[0] == 0)
+        return;
+
+    if (dir->flags & INODE_F_INDEX) {
+        DIR_INDEX_READ(root, dir->blocks_direct[0]);
+        dir_index_free(dir->blocks_direct[0], root[0].header.levels);
+    }
+    else
+        block_free(dir->blocks_direct[0]);
+
+    dir->blocks_direct[0] = 0;
+    dir->flags &= ~INODE_F_INDEX;
+}
+
+/* free the directory index block at @addr, with @levels index levels below
+ * it, and all blocks below it */
+
+void dir_index_free(blk_addr_t addr, unsigned int levels) {
+    dir_index_t index[DIR_INDEX_MAX + 1];
+    unsigned int i;
+
+    DIR_INDEX_READ(index, addr);
+    for (i = 1; i <= index[0].header.count; i++) {
+        if (levels > 0)
+            dir_index_free(index[i].entry.addr, levels - 1);
+        else
+            block_free(index[i].entry.addr);
+    }
+
+    block_free(addr);
+}
+
+/* free the inode @inode, and all blocks associated with it */
+
+void inode_free(inode_t * inode) {
+    /* check if @inode points to a valid inode */
+    if (inode == NULL)
+        return;
+
+    unsigned int i, j;
+    bool done = false;
+    blk_addr_t addr;
+    extent_t extent;
+
+    if (inode->attr.type == DIR_T) {
+        dir_blocks_free(inode);
+        done = true;
+    }
+
+    /* a file kept inline has no blocks */
+    else if (inode->flags & INODE_F_INLINE) {
+        done = true;
+    }
+
+    /* free each extent with one go at the bitmap, and then the extent blocks
+       which held them */
+    else if (inode->flags & INODE_F_EXTENTS) {
+        for (i = 0; i < inode->extent_count; i++) {
+            extent_get(inode, i, &extent);
+            if (extent.stored != 0)
+                cluster_cache_forget(extent.physical);
+            extent_free(extent.physical, EXTENT_BLKS(&extent));
+        }
+        for (i = 0; i < INODE_EXTENT_BLOCKS; i++)
+            if (inode->extent_blocks[i] != 0)
+                block_free(inode->extent_blocks[i]);
+
+        done = true;
+    }
+
+    for (i = 0; ! done && i < BLKS_DIRECT; i++) {
+        addr = inode->blocks_direct[i];
+
+        /* break if we're past the last valid block in the inode */
+        if (addr < BLK_DATA_START || addr > BLK_COUNT - 1) {
+            done = true;
+            break;
+        }
+
+        block_free(addr);
+    }
+
+    if (! done) {
+        for (i = 0; i < BLKS_INDIRECT; i++) {
+            blk_addr_t indirect_block_addr = inode->blocks_indirect[i];
+            blk_addr_t indirect_block[MAX_ADDR_PER_BLOCK];
+
+            /* break if we're past the last valid block in the inode */
+            if (indirect_block_addr < BLK_DATA_START || indirect_block_addr > BLK_COUNT - 1) {
+                done = true;
+                break;
+            }
+
+            /* read the indirect block into memory */
+            BLK_READ_INDIRECT(indirect_block_addr, indirect_block);
+
+            /* free all blocks pointed to by the indirect block */
+            for (j = 0; j < MAX_ADDR_PER_BLOCK; j++) {
+                addr = indirect_block[j];
+
+                /* break if we're past the last valid block in the inode */
+                if (addr < BLK_DATA_START || addr > BLK_COUNT - 1) {
+                    done = true;
+                    break;
+                }
+
+                block_free(addr);
+            }
+
+            /* free the indirect block itself, even if it is only partly
+               used */
+            block_free(indirect_block_addr);
+
+            /* break if we're past the last valid block in the inode */
+            if (done)
+                break;
+        }
+    }
+
+    /* mark the inode as free */
+    inode->used = false;
+
+    /* write the modified inode to disk */
+    INODE_WRITE(inode->inumber, inode);
+
+    /* update super block stats */
+    pthread_mutex_lock(&BB_DATA->alloc_lock);
+    BB_DATA->super_blk->inode_free_count++;
+    SUPER_BLOCK_WRITE(BB_DATA->super_blk);
+    pthread_mutex_unlock(&BB_DATA->alloc_lock);
+
+    stats_count(STATS_INODES_FREED, 1);
+}
+
+/* free the block at @addr */
+
+void block_free(blk_addr_t addr) {
+    extent_free(addr, 1);
+}
+
+/* free the @count blocks starting at @addr, by clearing their bits in the free
+ * block bitmap; the blocks shared with snapshots are not freed, but have their
+ * share counts taken down instead, a run of them at a time */
+
+void extent_free(blk_addr_t addr, unsigned int count) {
+    share_count_t * shares = BB_DATA->block_shares;
+    unsigned long start = addr - BLK_DATA_START, i, j, run, freed = 0;
+    bool shared;
+
+    /* check if @addr is the address of a valid data block */
+    if (count == 0 || addr < BLK_DATA_START || addr + count > BLK_COUNT)
+        return;
+
+    pthread_mutex_lock(&BB_DATA->alloc_lock);
+
+    for (i = 0; i < count; i += run) {
+        shared = shares[start + i] > 0;
+        for (run = 1; i + run < count && (shares[start + i + run] > 0) == shared; run++)
+            ;
+
+        if (shared) {
+            for (j = i; j < i + run; j++)
+                shares[start + j]--;
+            block_shares_sync(start + i, run);
+            __atomic_fetch_sub(&BB_DATA->blocks_shared, run, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        bitmap_clear(BB_DATA->block_bitmap, start + i, run);
+        block_bitmap_sync(start + i, run);
+
+        /* the blocks are discarded once the transaction freeing them commits */
+        bitmap_set(BB_DATA->block_freed, start + i, run);
+        freed += run;
+    }
+
+    /* update block statistics in the super block */
+    if (freed > 0) {
+        BB_DATA->super_blk->block_free_count += freed;
+        BB_DATA->super_blk->block_used_count -= freed;
+
+        SUPER_BLOCK_WRITE(BB_DATA->super_blk);
+    }
+
+    pthread_mutex_unlock(&BB_DATA->alloc_lock);
+
+    stats_count(STATS_EXTENT_FREES, 1);
+    stats_count(STATS_BLOCKS_FREED, freed);
+}
+
+/* load the next block in the open file @fd */
+
+void block_load_next(int fd) {
+    table_entry_t * table_entry = file_table_get(fd);
+    int block_next = CEIL(table_entry->file_offset, BLK_SIZE);
+    int block_last;
+
+    /* last valid block no. (0-based) in the file */
+    block_last = (int) CEIL(table_entry->file->inode.attr.size, BLK_SIZE) - 1;
+
+    /* check if @block_next lies after @block_last */
+    if (block_next > block_last) {
+        table_entry->addr = 0;
+        return;
+    }
+
+    /* find @block_next (through the indirect block decoded in the file table
+       entry, if need be) and load it */
+    block_load(table_entry, block_next);
+}
+
+/* (re)load the block of the open file @table_entry that its file offset lies
+ * in, so that it reflects writes made through other fds */
+
+void block_load_current(table_entry_t * table_entry) {
+    unsigned int block_no = table_entry->file_offset / BLK_SIZE;
+
+    /* past the last block, as block_load_next() leaves it */
+    if (block_no >= CEIL(table_entry->file->inode.attr.size, BLK_SIZE)) {
+        table_entry->addr = 0;
+        return;
+    }
+
+    block_load(table_entry, block_no);
+}
+
+/* load block no. @block_no of the open file @table_entry into its data
+ * buffer; a file kept inline has a single block, read from its inode's block,
+ * the blocks held back from allocation are copied from memory, and those of
+ * a compressed cluster are decompressed */
+
+void block_load(table_entry_t * table_entry, unsigned int block_no) {
+    inode_t * inode = &table_entry->file->inode;
+
+    if (inode->flags & INODE_F_INLINE) {
+        table_entry->addr = 0;
+        DISK_READ(INODE_INLINE_POS(inode->inumber), table_entry->data, inode->attr.size);
+        return;
+    }
+
+    /* a block whose allocation is held back is still in memory */
+    if (table_entry->file->delayed_count > 0 && block_no >= table_entry->file->delayed_from) {
+        table_entry->addr = 0;
+        memcpy(table_entry->data, table_entry->file->delayed[block_no - table_entry->file->delayed_from], BLK_SIZE);
+        return;
+    }
+
+    table_entry->addr = file_block_map(table_entry, block_no);
+    if (table_entry->addr == BLK_ADDR_COMPRESSED) {
+        table_entry->addr = 0;
+        if (cluster_read(&table_entry->extent, (offset_t) (block_no - table_entry->extent.logical) * BLK_SIZE,
+                         table_entry->data, BLK_SIZE) < 0)
+            memset(table_entry->data, 0, BLK_SIZE);
+        return;
+    }
+    BLK_READ_DATA(table_entry->addr, table_entry->data);
+}
+
+/* get the block address of block no. @block_no of the open file
+ * @table_entry, or BLK_ADDR_COMPRESSED if it is in a compressed cluster. The
+ * indirect block (or extent) it is found in stays decoded in the file table
+ * entry, so a sequential scan reads each indirect block (or looks up each
+ * extent) only once. */
+
+blk_addr_t file_block_map(table_entry_t * table_entry, unsigned int block_no) {
+    inode_t * inode = &table_entry->file->inode;
+    extent_t * extent = &table_entry->extent;
+    unsigned int indirect_block_no, indirect_block_offset;
+    blk_addr_t indirect_block_addr;
+    unsigned long moves;
+
+    /* extents only ever grow, so the extent looked up last stays valid, and
+       covers the next block of a sequential scan most of the time; but a
+       compressed one may have been replaced since, and so may any other if
+       blocks shared with a snapshot have been moved since (the count of which
+       does not change while the inode is locked), so those are looked up
+       anew */
+    if (inode->flags & INODE_F_EXTENTS) {
+        moves = __atomic_load_n(&BB_DATA->extents_moved, __ATOMIC_RELAXED);
+        if (extent->len == 0 || extent->stored != 0 || table_entry->extent_moves != moves ||
+            block_no < extent->logical || block_no >= extent->logical + extent->len) {
+            table_entry->extent_moves = moves;
+            if (extent_lookup(inode, block_no, extent) < 0) {
+                extent->len = 0;
+                return 0;
+            }
+        }
+
+        if (extent->stored != 0)
+            return BLK_ADDR_COMPRESSED;
+        return extent->physical + (block_no - extent->logical);
+    }
+
+    if (block_no < BLKS_DIRECT)
+        return inode->blocks_direct[block_no];
+
+    indirect_block_no = (block_no - BLKS_DIRECT) / MAX_ADDR_PER_BLOCK;
+    indirect_block_offset = (block_no - BLKS_DIRECT) % MAX_ADDR_PER_BLOCK;
+    if (indirect_block_no >= BLKS_INDIRECT || (indirect_block_addr = inode->blocks_indirect[indirect_block_no]) == 0)
+        return 0;
+
+    /* blocks are only ever added to an indirect block, so a cached entry
+       other than 0 is still valid */
+    if (table_entry->indirect_addr != indirect_block_addr || table_entry->indirect[indirect_block_offset] == 0) {
+        BLK_READ_INDIRECT(indirect_block_addr, table_entry->indirect);
+        table_entry->indirect_addr = indirect_block_addr;
+    }
+
+    return table_entry->indirect[indirect_block_offset];
+}
+
+/* detect sequential reads of the open file @table_entry, and prefetch the
+ * blocks ahead of such a read stream into the cache. A read of @nbytes bytes
+ * at @offset which starts in the block where the last one ended continues the
+ * stream and doubles the readahead window; any other read ends it.
+ * Prefetching is only done once less than half a window is left prefetched,
+ * so that blocks are read ahead in large batches. */
+
+void file_readahead(table_entry_t * table_entry, offset_t offset, size_t nbytes) {
+    unsigned int file_blocks = CEIL(table_entry->file->inode.attr.size, BLK_SIZE);
+    unsigned int block_no = offset / BLK_SIZE;
+    unsigned int end = CEIL(offset + nbytes, BLK_SIZE);
+    unsigned int from, to, i, run;
+    blk_addr_t addr;
+
+    /* a file kept inline has no blocks to read ahead */
+    if (table_entry->file->inode.flags & INODE_F_INLINE)
+        return;
+
+    if (block_no == table_entry->ra_next) {
+        if (table_entry->ra_window == 0)
+            table_entry->ra_window = RA_BLKS_MIN;
+        else if (table_entry->ra_window * 2 <= RA_BLKS_MAX)
+            table_entry->ra_window *= 2;
+    }
+    else {
+        table_entry->ra_window = 0;
+        table_entry->ra_until = 0;
+    }
+
+    table_entry->ra_next = (offset + nbytes) / BLK_SIZE;
+
+    if (table_entry->ra_window == 0 || table_entry->ra_until >= end + table_entry->ra_window / 2)
+        return;
+
+    from = block_no > table_entry->ra_until ? block_no : table_entry->ra_until;
+    to = end + table_entry->ra_window;
+    if (to > file_blocks)
+        to = file_blocks;
+
+    /* prefetch each run of physically contiguous blocks at once, and the
+       compressed data of a cluster whole */
+    for (i = from; i < to; i += run) {
+        addr = file_block_map(table_entry, i);
+        if (addr == BLK_ADDR_COMPRESSED) {
+            DISK_PREFETCH(table_entry->extent.physical, table_entry->extent.stored);
+            run = table_entry->extent.logical + table_entry->extent.len - i;
+            continue;
+        }
+        for (run = 1; i + run < to && file_block_map(table_entry, i + run) == addr + run; run++)
+            ;
+
+        if (addr != 0)
+            DISK_PREFETCH(addr, run);
+    }
+
+    table_entry->ra_until = to;
+}
+
+/* get the block address of block no. @block_no (0-based) of the file
+ * represented by @inode, or 0 if it lies past the blocks of the file */
+
+blk_addr_t block_map(inode_t * inode, unsigned int block_no) {
+    blk_addr_t addr;
+
+    block_map_range(inode, block_no, 1, &addr);
+    return addr;
+}
+
+/* get the block addresses of the @count blocks starting at block no. @first
+ * of the file represented by @inode into @addrs, reading each indirect block
+ * (or looking up each extent) involved only once; blocks past the end of the
+ * file map to 0, and those of a compressed cluster to BLK_ADDR_COMPRESSED */
+
+void block_map_range(inode_t * inode, unsigned int first, unsigned int count, blk_addr_t * addrs) {
+    blk_addr_t indirect_block[MAX_ADDR_PER_BLOCK];
+    int indirect_loaded = -1;   /* index of the indirect block in memory */
+    unsigned int i, block_no, indirect_block_no;
+    extent_t extent;
+
+    /* look up one extent per run of blocks, rather than one per block */
+    if (inode->flags & INODE_F_EXTENTS) {
+        for (i = 0; i < count; ) {
+            if (extent_lookup(inode, first + i, &extent) < 0) {
+                addrs[i++] = 0;
+                continue;
+            }
+
+            for (; i < count && first + i < extent.logical + extent.len; i++)
+                addrs[i] = extent.stored != 0 ? BLK_ADDR_COMPRESSED : extent.physical + (first + i - extent.logical);
+        }
+
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        block_no = first + i;
+
+        if (block_no < BLKS_DIRECT) {
+            addrs[i] = inode->blocks_direct[block_no];
+            continue;
+        }
+
+        indirect_block_no = (block_no - BLKS_DIRECT) / MAX_ADDR_PER_BLOCK;
+        if (indirect_block_no >= BLKS_INDIRECT || inode->blocks_indirect[indirect_block_no] == 0) {
+            addrs[i] = 0;
+            continue;
+        }
+
+        if (indirect_loaded != (int) indirect_block_no) {
+            BLK_READ_INDIRECT(inode->blocks_indirect[indirect_block_no], indirect_block);
+            indirect_loaded = indirect_block_no;
+        }
+
+        addrs[i] = indirect_block[(block_no - BLKS_DIRECT) % MAX_ADDR_PER_BLOCK];
+    }
+}
+
+/* allocate blocks to the file represented by @inode (which is not written to
+ * disk) until it has @end blocks. All the blocks needed, including indirect
+ * ones, are taken from the bitmap in as few contiguous runs as possible, and
+ * each indirect block involved is written only once. The data blocks are
+ * zeroed only if @zero is set; else the caller overwrites them whole.
+ *
+ * @return          the no. of blocks the file has now, which is less than @end
+ *                  if the fs ran out of space */
+
+unsigned int inode_blocks_extend(inode_t * inode, unsigned int end, bool zero) {
+    blk_addr_t indirect_block[MAX_ADDR_PER_BLOCK];
+    int indirect_loaded = -1;   /* index of the indirect block in memory */
+    unsigned int have = CEIL(inode->attr.size, BLK_SIZE);
+    unsigned int block_no, indirect_block_no, need, got = 0;
+    blk_addr_t next = 0, * slot;
+
+    if (end > INODE_BLKS_MAX(inode))
+        end = INODE_BLKS_MAX(inode);
+
+    need = blocks_needed(inode, have, end);
+
+    /* with extents, each run taken from the bitmap is (at most) one more
+       extent; the runs are placed right after the last block of the file if
+       possible, so that the last extent just grows */
+    if (inode->flags & INODE_F_EXTENTS) {
+        next = extent_next(inode);
+
+        while (have < end && (next = get_free_extent(next, end - have, &got, zero)) != 0) {
+            if (! extent_append(inode, next, got, 0)) {
+                extent_free(next, got);
+                break;
+            }
+
+            have += got;
+            next += got;
+        }
+
+        return have;
+    }
+
+    for (block_no = have; block_no < end; block_no++) {
+        if (block_no < BLKS_DIRECT) {
+            slot = &inode->blocks_direct[block_no];
+        }
+        else {
+            indirect_block_no = (block_no - BLKS_DIRECT) / MAX_ADDR_PER_BLOCK;
+
+            if (indirect_loaded != (int) indirect_block_no) {
+                if (indirect_loaded >= 0)
+                    BLK_WRITE_INDIRECT(inode->blocks_indirect[indirect_loaded], indirect_block);
+
+                if (inode->blocks_indirect[indirect_block_no] == 0) {
+                    /* take the new indirect block from the current run */
+                    if (got == 0 && (next = get_free_extent(next, need, &got, zero)) == 0)
+                        break;
+                    inode->blocks_indirect[indirect_block_no] = next++;
+                    got--;
+                    need--;
+                    memset(indirect_block, 0, sizeof(indirect_block));
+                }
+                else {
+                    BLK_READ_INDIRECT(inode->blocks_indirect[indirect_block_no], indirect_block);
+                }
+
+                indirect_loaded = indirect_block_no;
+            }
+
+            slot = &indirect_block[(block_no - BLKS_DIRECT) % MAX_ADDR_PER_BLOCK];
+        }
+
+        /* start a new run (as close to the last one as possible) if the
+           current one is used up */
+        if (got == 0 && (next = get_free_extent(next, need, &got, zero)) == 0)
+            break;
+
+        *slot = next++;
+        got--;
+        need--;
+    }
+
+    if (indirect_loaded >= 0)
+        BLK_WRITE_INDIRECT(inode->blocks_indirect[indirect_loaded], indirect_block);
+
+    /* give back whatever was left over, if allocation stopped midway */
+    if (got > 0)
+        extent_free(next, got);
+
+    return block_no;
+}
+
+/* count the blocks (data and indirect) that have to be allocated to the file
+ * represented by @inode, to take it from @have blocks to @end blocks */
+
+unsigned int blocks_needed(inode_t * inode, unsigned int have, unsigned int end) {
+    unsigned int need, i, first, last;
+
+    if (end > INODE_BLKS_MAX(inode))
+        end = INODE_BLKS_MAX(inode);
+    if (end <= have)
+        return 0;
+
+    need = end - have;
+
+    /* indirect blocks which will have to be allocated on the way; extent
+       blocks are allocated on their own, as they are rarely needed */
+    for (i = 0; ! (inode->flags & INODE_F_EXTENTS) && i < BLKS_INDIRECT; i++) {
+        first = BLKS_DIRECT + i * MAX_ADDR_PER_BLOCK;
+        last = first + MAX_ADDR_PER_BLOCK;
+        if (inode->blocks_indirect[i] == 0 && have < last && end > first)
+            need++;
+    }
+
+    return need;
+}
+
+/* read extent no. @i of the file represented by @inode into @extent */
+
+void extent_get(inode_t * inode, unsigned int i, extent_t * extent) {
+    if (i < INODE_EXTENTS)
+        *extent = inode->extents[i];
+    else
+        DISK_READ(EXTENT_POS(inode, i), extent, sizeof(extent_t));
+}
+
+/* write @extent as extent no. @i of the file represented by @inode; the
+ * inode itself is not written to disk */
+
+void extent_put(inode_t * inode, unsigned int i, const extent_t * extent) {
+    if (i < INODE_EXTENTS)
+        inode->extents[i] = *extent;
+    else
+        META_WRITE(EXTENT_POS(inode, i), extent, sizeof(extent_t));
+}
+
+/* find the extent of the file represented by @inode which contains block no.
+ * @block_no, by binary search on the extents, which are sorted by logical
+ * block no.
+ *
+ * @param extent    set to the extent found
+ * @return          the index of the extent, else -1 if @block_no lies past
+ *                  the blocks of the file */
+
+int extent_lookup(inode_t * inode, blk_addr_t block_no, extent_t * extent) {
+    int lo = 0, hi = (int) inode->extent_count - 1, mid;
+
+    if (hi < 0)
+        return -1;
+
+    /* appends and sequential access mostly hit the last extent */
+    extent_get(inode, hi, extent);
+    if (block_no >= extent->logical)
+        return block_no < extent->logical + extent->len ? hi : -1;
+
+    /* the extent sought is the last one which starts at or before @block_no */
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        extent_get(inode, mid, extent);
+
+        if (extent->logical <= block_no)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    extent_get(inode, lo, extent);
+    return block_no < extent->logical + extent->len ? lo : -1;
+}
+
+/* add the @count blocks starting at block address @addr to the end of the
+ * file represented by @inode (which is not written to disk); or, if @stored is
+ * not 0, a cluster of @count blocks compressed into the @stored blocks at
+ * @addr. Blocks which follow right after the last extent extend it, unless
+ * either is compressed; else they become a new extent, for which an extent
+ * block may have to be allocated.
+ *
+ * @return          true on success, else false if the file has as many
+ *                  extents as it can have, or the fs is full */
+
+bool extent_append(inode_t * inode, blk_addr_t addr, unsigned int count, unsigned int stored) {
+    extent_t extent = { 0, 0, 0, 0 };
+    unsigned int i = inode->extent_count, got;
+    blk_addr_t * block;
+
+    if (i > 0) {
+        extent_get(inode, i - 1, &extent);
+
+        if (stored == 0 && extent.stored == 0 && extent.physical + extent.len == addr) {
+            extent.len += count;
+            extent_put(inode, i - 1, &extent);
+            return true;
+        }
+    }
+
+    if (i >= EXTENTS_MAX)
+        return false;
+
+    /* the first extent in an extent block needs that block, unless it was
+       allocated already (see extent_replace()) */
+    if (i >= INODE_EXTENTS && (i - INODE_EXTENTS) % EXTENTS_PER_BLOCK == 0) {
+        block = &inode->extent_blocks[(i - INODE_EXTENTS) / EXTENTS_PER_BLOCK];
+        if (*block == 0 && (*block = get_free_extent(addr + (stored != 0 ? stored : count), 1, &got, true)) == 0)
+            return false;
+    }
+
+    extent.logical += extent.len;
+    extent.physical = addr;
+    extent.len = count;
+    extent.stored = stored;
+    extent_put(inode, i, &extent);
+    inode->extent_count++;
+
+    return true;
+}
+
+/* get the block address right after the last extent of the file represented
+ * by @inode, where the blocks added to it are best placed; 0 if it has no
+ * extents */
+
+blk_addr_t extent_next(inode_t * inode) {
+    extent_t extent;
+
+    if (inode->extent_count == 0)
+        return 0;
+
+    extent_get(inode, inode->extent_count - 1, &extent);
+    return extent.physical + EXTENT_BLKS(&extent);
+}
+
+/* replace extent no. @i of the file represented by @inode (which is not
+ * written to disk) with the @n extents at @with, which map the same blocks,
+ * moving the extents after it up (or down, if @n is 0, when the extent before
+ * has taken its blocks); extent blocks are allocated as needed
+ *
+ * @return          true on success, else false if the file would have more
+ *                  extents than it can have, or the fs is full */
+
+bool extent_replace(inode_t * inode, unsigned int i, const extent_t * with, unsigned int n) {
+    unsigned int count = inode->extent_count + n - 1, j, got;
+    blk_addr_t * block;
+    extent_t extent;
+
+    if (count > EXTENTS_MAX)
+        return false;
+
+    for (j = inode->extent_count; j < count; j++) {
+        if (j >= INODE_EXTENTS && (j - INODE_EXTENTS) % EXTENTS_PER_BLOCK == 0) {
+            block = &inode->extent_blocks[(j - INODE_EXTENTS) / EXTENTS_PER_BLOCK];
+            if (*block == 0 && (*block = get_free_extent(with[0].physical, 1, &got, true)) == 0)
+                return false;
+        }
+    }
+
+    for (j = i + 1; n == 0 && j < inode->extent_count; j++) {
+        extent_get(inode, j, &extent);
+        extent_put(inode, j - 1, &extent);
+    }
+    for (j = inode->extent_count; n > 0 && j-- > i + 1; ) {
+        extent_get(inode, j, &extent);
+        extent_put(inode, j + n - 1, &extent);
+    }
+    for (j = 0; j < n; j++)
+        extent_put(inode, i + j, &with[j]);
+    inode->extent_count = count;
+
+    return true;
+}
+
+/* store the compressed clusters holding any of the @count blocks from block
+ * no. @first on of the file represented by @inode (which is not written to
+ * disk) uncompressed, so that the blocks can be written in place
+ *
+ * @return          0 on success, else -errno */
+
+int inode_uncompress(inode_t * inode, unsigned int first, unsigned int count) {
+    unsigned int block_no;
+    extent_t extent;
+    int i, ret;
+
+    if (! (inode->flags & INODE_F_COMPRESS))
+        return 0;
+
+    for (block_no = first; block_no < first + count; block_no = extent.logical + extent.len) {
+        if ((i = extent_lookup(inode, block_no, &extent)) < 0)
+            break;
+        if (extent.stored != 0 && (ret = extent_uncompress(inode, i, &extent)) < 0)
+            return ret;
+    }
 
-    entry_count = parent_inode->attr.size;
-    blk_count = CEIL(entry_count,MAX_FILES_PER_BLOCK);
+    return 0;
+}
 
-    /* Search in the direct blocks */
-    for (i = 0; i < BLKS_DIRECT && blk_count>0; i++,blk_count--)
-	{
-            addr = parent_inode->blocks_direct[i];
+/* store the compressed cluster @extent, which is extent no. @i of the file
+ * represented by @inode (which is not written to disk), uncompressed: its data
+ * is written to as few runs of free blocks as can be found, which replace it,
+ * and its compressed data is freed. A cluster is not compressed again, as
+ * blocks written in place one at a time would have it compressed over and
+ * over.
+ *
+ * @return          0 on success, else -errno */
+
+int extent_uncompress(inode_t * inode, unsigned int i, const extent_t * extent) {
+    size_t size = (size_t) extent->len * BLK_SIZE;
+    unsigned int n = 0, have = 0, got, j;
+    blk_addr_t goal = extent->physical + extent->stored;
+    extent_t * runs;
+    char * data;
+    int ret;
+
+    data = (char *) malloc(size);
+    runs = (extent_t *) malloc(extent->len * sizeof(extent_t));
+    if (data == NULL || runs == NULL) {
+        free(data);
+        free(runs);
+        return -ENOMEM;
+    }
+    if ((ret = cluster_read(extent, 0, data, size)) < 0) {
+        free(data);
+        free(runs);
+        return ret;
+    }
 
-            /* return if we're past the last valid block in the inode */
-            if (addr < BLK_DATA_ADDR / BLK_SIZE || addr > BLK_COUNT - 1) {
-                return;
-            }
+    /* the blocks are overwritten whole, so need no zeroing */
+    while (have < extent->len && (goal = get_free_extent(goal, extent->len - have, &got, false)) != 0) {
+        runs[n].logical = extent->logical + have;
+        runs[n].physical = goal;
+        runs[n].len = got;
+        runs[n].stored = 0;
+        n++;
+        have += got;
+        goal += got;
+    }
+
+    if (have < extent->len || ! extent_replace(inode, i, runs, n)) {
+        for (j = 0; j < n; j++)
+            extent_free(runs[j].physical, runs[j].len);
+        free(data);
+        free(runs);
+        return -ENOSPC;
+    }
+
+    for (j = 0; j < n; j++)
+        DISK_WRITE(BLK_POS(runs[j].physical), data + (size_t) (runs[j].logical - extent->logical) * BLK_SIZE,
+                   (size_t) runs[j].len * BLK_SIZE);
+
+    cluster_cache_forget(extent->physical);
+    extent_free(extent->physical, extent->stored);
+
+    free(data);
+    free(runs);
+    stats_count(STATS_CLUSTERS_UNCOMPRESSED, 1);
+    return 0;
+}
+
+/* give the blocks of the file represented by @inode (which is not written to
+ * disk) which hold any of the bytes from @offset to @end, and which it shares
+ * with a snapshot, blocks of their own, so that they can be written in place;
+ * the snapshot keeps the old ones. The compressed clusters among them have
+ * been stored uncompressed already (see inode_uncompress()).
+ *
+ * @return          0 on success, else -errno */
+
+int inode_unshare(inode_t * inode, offset_t offset, offset_t end) {
+    unsigned int block_no, last = CEIL(end, BLK_SIZE);
+    extent_t extent;
+    int i, ret;
+
+    /* the blocks of a file are only shared once a snapshot has been taken of
+       it, which cannot happen while the caller holds the inode's write
+       lock */
+    if (! (inode->flags & INODE_F_EXTENTS) || __atomic_load_n(&BB_DATA->blocks_shared, __ATOMIC_RELAXED) == 0)
+        return 0;
+
+    for (block_no = offset / BLK_SIZE; block_no < last; block_no = extent.logical + extent.len) {
+        if ((i = extent_lookup(inode, block_no, &extent)) < 0)
+            break;
+        if (extent.stored == 0 && (ret = extent_unshare(inode, i, &extent, offset, end)) < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+/* give the blocks of @extent, which is extent no. @i of the file represented
+ * by @inode (which is not written to disk), which hold any of the bytes from
+ * @offset to @end, and which are shared, blocks of their own: the blocks from
+ * the first shared one to the last are moved to as few runs of free blocks as
+ * can be found, which replace them in the extent, and are let go of. If that
+ * would split the extent into more extents than the file can have, the whole
+ * extent is moved instead. Only the blocks which are not about to be
+ * overwritten whole have their data copied. The first run extends the extent
+ * before, if it can, so that a file written over from start to end keeps few
+ * extents.
+ *
+ * @return          0 on success, else -ENOSPC or -ENOMEM */
+
+int extent_unshare(inode_t * inode, unsigned int i, const extent_t * extent, offset_t offset, offset_t end) {
+    share_count_t * shares = BB_DATA->block_shares;
+    blk_addr_t start = extent->physical - BLK_DATA_START, goal, addr;
+    unsigned int from, to, n, k, have, got, j, merged, first, last;
+    bool follows = false, whole = false;
+    extent_t prev, * runs;
+    char * block;
+
+    from = offset / BLK_SIZE > extent->logical ? offset / BLK_SIZE : extent->logical;
+    to = CEIL(end, BLK_SIZE) < extent->logical + extent->len ? CEIL(end, BLK_SIZE) : extent->logical + extent->len;
+
+    pthread_mutex_lock(&BB_DATA->alloc_lock);
+    while (from < to && shares[start + from - extent->logical] == 0)
+        from++;
+    while (to > from && shares[start + to - 1 - extent->logical] == 0)
+        to--;
+    pthread_mutex_unlock(&BB_DATA->alloc_lock);
+    if (from == to)
+        return 0;
+
+    if (i > 0) {
+        extent_get(inode, i - 1, &prev);
+        follows = prev.stored == 0 && prev.logical + prev.len == extent->logical;
+    }
+
+    runs = (extent_t *) malloc((extent->len + 2) * sizeof(extent_t));
+    block = (char *) malloc(BLK_SIZE);
+    if (runs == NULL || block == NULL) {
+        free(runs);
+        free(block);
+        return -ENOMEM;
+    }
+
+    for (;;) {
+        n = 0;
+        have = 0;
+        merged = 0;
 
-            if(delete_filename_in_block(addr,&entry_count,parent_inode,name))
-                return;
+        /* the blocks which follow the extent before are best placed */
+        goal = follows && from == extent->logical ? prev.physical + prev.len : 0;
+
+        if (from > extent->logical) {
+            runs[n].logical = extent->logical;
+            runs[n].physical = extent->physical;
+            runs[n].len = from - extent->logical;
+            runs[n].stored = 0;
+            n++;
         }
 
-    /* Search in the indirect blocks */
-    for(i = 0;i<BLKS_INDIRECT;i++)
-	{
-            if(parent_inode->blocks_indirect[i] == 0)
-                return ;
-            BLK_SEEK(parent_inode->blocks_indirect[i]);
-            for(j = 0;(j<MAX_ADDR_PER_BLOCK && blk_count>0);j++,blk_count--)
-		{
-                    fread(&addr,sizeof(blk_addr_t),1,BB_DATA->fs);
-                    if(delete_filename_in_block(addr,&entry_count,parent_inode,name))
-                        return;
-		}
- 	}
+        /* the blocks are either copied or overwritten whole, so need no
+           zeroing */
+        for (k = n; have < to - from && (addr = get_free_extent(goal, to - from - have, &got, false)) != 0; n++) {
+            runs[n].logical = from + have;
+            runs[n].physical = addr;
+            runs[n].len = got;
+            runs[n].stored = 0;
+            have += got;
+            goal = addr + got;
+        }
+
+        if (to < extent->logical + extent->len) {
+            runs[n].logical = to;
+            runs[n].physical = extent->physical + (to - extent->logical);
+            runs[n].len = extent->logical + extent->len - to;
+            runs[n].stored = 0;
+            n++;
+        }
+
+        if (k == 0 && have > 0 && follows && runs[0].physical == prev.physical + prev.len)
+            merged = 1;
+
+        if (have == to - from && (whole || inode->extent_count + n - merged - 1 <= EXTENTS_MAX))
+            break;
+
+        for (j = k; j < n && runs[j].logical < to; j++)
+            extent_free(runs[j].physical, runs[j].len);
+        if (have < to - from || whole) {
+            free(runs);
+            free(block);
+            return -ENOSPC;
+        }
+
+        /* a file with as many extents as it can have does not have any of
+           them split: the whole extent is moved */
+        whole = true;
+        from = extent->logical;
+        to = extent->logical + extent->len;
+    }
+
+    if (! extent_replace(inode, i, runs + merged, n - merged)) {
+        for (j = k; j < n && runs[j].logical < to; j++)
+            extent_free(runs[j].physical, runs[j].len);
+        free(runs);
+        free(block);
+        return -ENOSPC;
+    }
+    if (merged) {
+        prev.len += runs[0].len;
+        extent_put(inode, i - 1, &prev);
+    }
+
+    /* the blocks from @first to @last are overwritten whole; the others are
+       the first and the last block, or with the whole extent moved, any */
+    first = CEIL(offset, BLK_SIZE);
+    last = end / BLK_SIZE;
+    for (j = k; j < n && runs[j].logical < to; j++) {
+        for (addr = runs[j].logical; addr < runs[j].logical + runs[j].len; addr++) {
+            if (addr >= first && addr < last)
+                continue;
+            DISK_READ(BLK_POS(extent->physical + (addr - extent->logical)), block, BLK_SIZE);
+            DISK_WRITE(BLK_POS(runs[j].physical + (addr - runs[j].logical)), block, BLK_SIZE);
+        }
+    }
+
+    /* the file lets go of the old blocks, and the extents cached by its fds
+       are looked up again (see file_block_map()) */
+    extent_free(extent->physical + (from - extent->logical), to - from);
+    __atomic_fetch_add(&BB_DATA->extents_moved, 1, __ATOMIC_RELAXED);
 
-    free(parent_inode);
+    free(runs);
+    free(block);
+    stats_count(STATS_BLOCKS_UNSHARED, to - from);
+    return 0;
 }
 
-/* Search for a filename in a block and if present return 1, else 0 */
-int delete_filename_in_block(blk_addr_t addr,unsigned int * entry_count,inode_t * parent_inode,char * name)
-{
-    unsigned int j;
-    blk_addr_t last_addr;
-    file_entry_t file_entries[MAX_FILES_PER_BLOCK];
-    DIR_BLOCK_READ(file_entries, addr);
+/* copy @len bytes at byte @pos of the compressed cluster @extent into @buf,
+ * from the cache of decompressed clusters, or else from the cluster read and
+ * decompressed, which is added to the cache
+ *
+ * @return          0 on success, else -errno */
 
-    for (j = 0; j < MAX_FILES_PER_BLOCK && *entry_count>0; j++,(*entry_count)--)
-	{
-            if (strcmp(file_entries[j].name, name) == 0)
-		{
-                    /* Move the last entry to this position */
-                    last_addr = dir_entry_move_last(parent_inode, &file_entries[j]);
+int cluster_read(const extent_t * extent, offset_t pos, void * buf, size_t len) {
+    size_t size = (size_t) extent->len * BLK_SIZE;
+    char * data;
+    int ret;
 
-                    /* Update the parent inode back to disk */
-                    INODE_WRITE(parent_inode->inumber,parent_inode);
+    if (cluster_cache_read(extent->physical, pos, buf, len))
+        return 0;
 
-                    /* Update th entries in the block */
-                    if (last_addr != addr)
-                        DIR_BLOCK_WRITE(file_entries,addr);
+    if ((data = (char *) malloc(size)) == NULL)
+        return -ENOMEM;
+    if ((ret = cluster_load(extent, data)) < 0) {
+        free(data);
+        return ret;
+    }
 
-                    return 1;
-		}
-	}
+    cluster_cache_insert(extent->physical, data, size);
+    memcpy(buf, data + pos, len);
+
+    free(data);
+    return 0;
+}
+
+/* read the compressed cluster @extent, and decompress it into @data, which
+ * has room for its @len blocks
+ *
+ * @return          0 on success, else -EIO if the cluster is corrupt, or
+ *                  -ENOMEM */
+
+int cluster_load(const extent_t * extent, char * data) {
+    size_t stored = (size_t) extent->stored * BLK_SIZE, size = (size_t) extent->len * BLK_SIZE;
+    uint32_t len;
+    char * buf;
+
+    if ((buf = (char *) malloc(stored)) == NULL)
+        return -ENOMEM;
+    DISK_READ(BLK_POS(extent->physical), buf, stored);
+
+    memcpy(&len, buf, sizeof(len));
+    if (len > stored - sizeof(len) || decompress_buffer(buf + sizeof(len), len, data, size) != (int) size) {
+        log_error("cluster_load: corrupt cluster at block %u\n", extent->physical);
+        free(buf);
+        return -EIO;
+    }
+
+    free(buf);
     return 0;
 }
 
-/* move the last directory entry in @inode to @entry (also updated the directory
- * entry count) */
-blk_addr_t dir_entry_move_last(inode_t * inode, file_entry_t * entry)
+/* Create a file with given type
+ * @param parent_inode : inode of parent_dir
+ * @param file_type : file or directory
+ * @param name : name of the file
+ * @return : inode number of the file created, 0 on failure*/
+
+inumber_t create_file(inode_t parent_inode,char * name,file_type_t file_type,file_mode_t mode)
 {
-    unsigned int entry_count_total = inode->attr.size;
-    blk_addr_t addr;
-    unsigned int file_entry_offset;
-    file_entry_t file_entries[MAX_FILES_PER_BLOCK], * last;
+    int i;
+    inode_t inode;
+    inumber_t inumber;
 
-    if (inode == NULL || entry == NULL)
+    inumber = get_free_inode(&inode);
+    if (inumber == 0)
         return 0;
-    int blk_index = CEIL(entry_count_total,MAX_FILES_PER_BLOCK)-1;
 
-    file_entry_offset = (entry_count_total-1) % MAX_FILES_PER_BLOCK;
+    /* create the new directory in a free inode */
+    inode.attr.type = file_type;
+    inode.attr.creation_time = time(NULL);
+    inode.attr.mode = mode;
+    inode.attr.size = 0;
+    inode.used = true;
+    for(i = 0; i < BLKS_DIRECT; i++)
+        inode.blocks_direct[i] = 0;
+    for(i = 0; i < BLKS_INDIRECT; i++)
+        inode.blocks_indirect[i] = 0;
 
-    if(blk_index < BLKS_DIRECT)
-	{
-            /* Get the addr of the block from the direct blocks */
-            addr = inode->blocks_direct[blk_index];
-            if(file_entry_offset == 0)
-                inode->blocks_direct[blk_index] = 0;
-	}
-    else
-	{
-            /* Get the addr of the block from the indirect blocks */
+    /* regular files are mapped by extents, and start out inline; on a mount
+       with compression, they are compressed once they grow out of it */
+    inode.flags = file_type == FILE_T ? INODE_F_EXTENTS | INODE_F_INLINE : 0;
+    if (file_type == FILE_T && (BB_DATA->mount_flags & MOUNT_COMPRESS))
+        inode.flags |= INODE_F_COMPRESS;
+    inode.extent_count = 0;
+    for(i = 0; i < INODE_EXTENT_BLOCKS; i++)
+        inode.extent_blocks[i] = 0;
 
-            blk_index-=BLKS_DIRECT;
-            int blk_indirect_index = blk_index/MAX_ADDR_PER_BLOCK;
-            blk_index-=blk_indirect_index*MAX_ADDR_PER_BLOCK;
-            blk_addr_t  blk_addresses[MAX_ADDR_PER_BLOCK];
-            DIR_BLOCK_READ(blk_addresses,inode->blocks_indirect[blk_indirect_index]);
-            addr = blk_addresses[blk_index];
+    INODE_WRITE(inumber, &inode);
 
-            /*free the block and also the indirect block if it is the last entry  */
-            if(file_entry_offset == 0)
-		{
-                    blk_addresses[blk_index] = 0;
-                    DIR_BLOCK_WRITE(blk_addresses,inode->blocks_indirect[blk_indirect_index]);
-		}
-            if(blk_index == 0 && file_entry_offset == 0) {
-                block_free(inode->blocks_indirect[blk_index]);
-                inode->blocks_indirect[blk_index] = 0;
-            }
-	}
-    if (addr < BLK_DATA_ADDR / BLK_SIZE || addr > BLK_COUNT - 1)
+    /* add an entry for the new directory in its parent directory inode */
+    if (dir_entry_add(&parent_inode, name, inumber) < 0) {
+        inode_free(&inode);
         return 0;
+    }
 
-    DIR_BLOCK_READ(file_entries, addr);
-    last = &file_entries[file_entry_offset];
-
-    /* copy @last to @entry */
-    strcpy(entry->name, last->name);
-    entry->inumber = last->inumber;
+    /* forget whatever was cached under a directory which had the same
+       inumber, and replace the (probably negative) entry for @name */
+    if (file_type == DIR_T)
+        dcache_purge_dir(inumber);
+    dcache_insert(parent_inode.inumber, name, inumber);
 
-    /* zero @last */
-    memset(last->name, 0, FILE_NAME_MAX + 1);
-    last->inumber = 0;
+    return inumber;
+}
 
-    /* Free the block if the block has no more valid entries */
-    if(file_entry_offset == 0)
-        block_free(addr);
+/* copy the tree under the root directory into free inodes: see mysnapshot().
+ * The directories are copied a level at a time, each into an empty directory
+ * to which the copies of its entries are added.
+ *
+ * @param copy      set to the inumber of the copy of the root directory
+ * @return          0 on success, else -errno; nothing is left of the copy */
+
+int snapshot_tree(inumber_t * copy) {
+    snapshot_walk_t walk;
+    unsigned long i;
+    inode_t dir;
+    int ret;
+
+    memset(&walk, 0, sizeof(walk));
+
+    if ((ret = snapshot_inode(ROOT_INODE_NUMBER, copy)) < 0)
+        return ret;
+    if ((ret = snapshot_walk_push(&walk, ROOT_INODE_NUMBER, *copy)) < 0) {
+        snapshot_free(*copy);
+        return ret;
+    }
 
-    /* write @last's block to disk */
-    else
-        DIR_BLOCK_WRITE(file_entries, addr);
+    for (i = 0; i < walk.count && walk.ret == 0; i++) {
+        INODE_READ(walk.from[i], &dir);
+        INODE_READ(walk.to[i], &walk.dir);
+        dir_inode_list(&dir, 0, snapshot_entry, &walk);
+    }
 
-    /* decrement the entry count of the directory */
-    inode->attr.size--;
+    free(walk.from);
+    free(walk.to);
 
-    return addr;
+    if (walk.ret < 0)
+        snapshot_free(*copy);
+    return walk.ret;
 }
 
-/* free the inode @inode, and all blocks associated with it */
+/* copy the file @inode, listed as @name in the directory being copied, and
+ * add the copy to the copy of the directory (the snapshot_walk_t at @buf);
+ * directories are left to be copied later. A dir_filler_t for
+ * dir_inode_list().
+ *
+ * @return          0, else 1 to stop the listing, with the error in the walk */
 
-void inode_free(inode_t * inode) {
-    /* check if @inode points to a valid inode */
-    if (inode == NULL)
-        return;
+int snapshot_entry(void * buf, const char * name, const inode_t * inode, offset_t next) {
+    snapshot_walk_t * walk = (snapshot_walk_t *) buf;
+    inumber_t copy;
+    inode_t snap;
+    int ret;
 
-    unsigned int i, j;
-    bool done = false;
-    blk_addr_t addr;
+    (void) next;
 
-    for (i = 0; i < BLKS_DIRECT; i++) {
-        addr = inode->blocks_direct[i];
+    if ((ret = snapshot_inode(inode->inumber, &copy)) == 0 &&
+        (ret = dir_entry_add(&walk->dir, name, copy)) < 0) {
+        INODE_READ(copy, &snap);
+        inode_free(&snap);
+    }
 
-        /* break if we're past the last valid block in the inode */
-        if (addr < BLK_DATA_ADDR / BLK_SIZE || addr > BLK_COUNT - 1) {
-            done = true;
-            break;
-        }
+    if (ret == 0 && inode->attr.type == DIR_T)
+        ret = snapshot_walk_push(walk, inode->inumber, copy);
 
-        block_free(addr);
-    }
+    walk->ret = ret;
+    return ret < 0;
+}
 
-    if (! done) {
-        for (i = 0; i < BLKS_INDIRECT; i++) {
-            blk_addr_t indirect_block_addr = inode->blocks_indirect[i];
-            blk_addr_t indirect_block[MAX_ADDR_PER_BLOCK];
+/* copy the inode @inumber into a free inode, flagged INODE_F_SNAPSHOT. A
+ * directory is copied empty. The data of a file is not copied, but shared
+ * with it: only the inline data and the extent blocks are, and each block
+ * the extents point at has its share count raised.
+ *
+ * @param copy      set to the inumber of the copy
+ * @return          0 on success, else -ENOSPC or -ENOMEM */
+
+int snapshot_inode(inumber_t inumber, inumber_t * copy) {
+    unsigned int i, got, copied = 0;
+    inode_t inode, snap;
+    extent_t extent;
+    char * block;
+    int ret = 0;
+
+    if ((*copy = get_free_inode(&snap)) == 0)
+        return -ENOSPC;
+    if ((block = (char *) malloc(BLK_SIZE)) == NULL)
+        ret = -ENOMEM;
+
+    INODE_RDLOCK(inumber);
+    INODE_READ(inumber, &inode);
 
-            /* break if we're past the last valid block in the inode */
-            if (indirect_block_addr < BLK_DATA_ADDR / BLK_SIZE || indirect_block_addr > BLK_COUNT - 1) {
-                done = true;
+    snap = inode;
+    snap.inumber = *copy;
+    snap.flags |= INODE_F_SNAPSHOT;
+
+    if (ret < 0)
+        ;
+    else if (inode.attr.type == DIR_T) {
+        snap.attr.size = 0;
+        snap.blocks_direct[0] = 0;
+        snap.flags &= ~INODE_F_INDEX;
+    }
+    else if (inode.flags & INODE_F_INLINE) {
+        DISK_READ(INODE_INLINE_POS(inumber), block, inode.attr.size);
+        META_WRITE(INODE_INLINE_POS(*copy), block, inode.attr.size);
+    }
+    else if (! (inode.flags & INODE_F_EXTENTS))
+        ret = -EINVAL;
+    else {
+        /* the extent blocks are written to by the file, so are not shared */
+        for (copied = 0; copied < INODE_EXTENT_BLOCKS && inode.extent_blocks[copied] != 0; copied++) {
+            snap.extent_blocks[copied] = get_free_extent(inode.extent_blocks[copied], 1, &got, false);
+            if (snap.extent_blocks[copied] == 0) {
+                ret = -ENOSPC;
                 break;
             }
+            DISK_READ(BLK_POS(inode.extent_blocks[copied]), block, BLK_SIZE);
+            META_WRITE(BLK_POS(snap.extent_blocks[copied]), block, BLK_SIZE);
+        }
 
-            /* read the indirect block into memory */
-            BLK_READ_INDIRECT(indirect_block_addr, indirect_block);
+        for (i = 0; ret == 0 && i < inode.extent_count; i++) {
+            extent_get(&inode, i, &extent);
+            extent_share(extent.physical, EXTENT_BLKS(&extent));
+        }
+    }
 
-            /* free all blocks pointed to by the indirect block */
-            for (j = 0; j < MAX_ADDR_PER_BLOCK; j++) {
-                addr = indirect_block[j];
+    INODE_UNLOCK(inumber);
+    free(block);
 
-                /* break if we're past the last valid block in the inode */
-                if (addr < BLK_DATA_ADDR / BLK_SIZE || addr > BLK_COUNT - 1) {
-                    done = true;
-                    break;
-                }
+    if (ret < 0) {
+        for (i = 0; i < copied; i++)
+            block_free(snap.extent_blocks[i]);
 
-                block_free(addr);
-            }
+        /* the inode is let go of with nothing in it */
+        memset(&snap, 0, sizeof(snap));
+        snap.inumber = *copy;
+        snap.flags = INODE_F_INLINE;
+        snap.used = true;
+        inode_free(&snap);
+        return ret;
+    }
 
-            /* break if we're past the last valid block in the inode */
-            if (done)
-                break;
+    snap.used = true;
+    INODE_WRITE(*copy, &snap);
 
-            /* free the indirect block itself */
-            block_free(indirect_block_addr);
-        }
+    /* forget whatever was cached under a directory which had the same
+       inumber */
+    if (snap.attr.type == DIR_T)
+        dcache_purge_dir(*copy);
+
+    return 0;
+}
+
+/* free the snapshot whose root directory is the inode @root, with all the
+ * inodes under it; the blocks it shares are only let go of
+ *
+ * @return          0 on success, else -EBUSY if any of its files is open, or
+ *                  -ENOMEM; the snapshot is then left whole */
+
+int snapshot_free(inumber_t root) {
+    snapshot_walk_t walk;
+    unsigned long i;
+    inode_t inode;
+    int ret;
+
+    memset(&walk, 0, sizeof(walk));
+
+    if ((ret = snapshot_walk_push(&walk, root, 0)) < 0)
+        return ret;
+
+    /* the walk grows as the directories in it are listed */
+    for (i = 0; i < walk.count && walk.ret == 0; i++) {
+        INODE_READ(walk.from[i], &inode);
+        if (inode.attr.type == DIR_T)
+            dir_inode_list(&inode, 0, snapshot_collect, &walk);
     }
 
-    /* mark the inode as free */
-    inode->used = false;
+    for (i = 0; i < walk.count && walk.ret == 0; i++)
+        if (file_table_busy(walk.from[i]))
+            walk.ret = -EBUSY;
 
-    /* write the modified inode to disk */
-    INODE_WRITE(inode->inumber, inode);
+    for (i = 0; i < walk.count && walk.ret == 0; i++) {
+        INODE_READ(walk.from[i], &inode);
+        if (inode.attr.type == DIR_T)
+            dcache_purge_dir(inode.inumber);
+        inode_free(&inode);
+    }
 
-    /* update super block stats */
-    BB_DATA->super_blk->inode_free_count++;
-    SUPER_BLOCK_WRITE(BB_DATA->super_blk);
+    ret = walk.ret;
+    free(walk.from);
+    free(walk.to);
+    return ret;
 }
 
-/* free the block at @addr */
+/* add the inode of an entry of a snapshot to the walk at @buf; a dir_filler_t
+ * for dir_inode_list()
+ *
+ * @return          0, else 1 to stop the listing, with the error in the walk */
 
-void block_free(blk_addr_t addr) {
-    /* check if @addr is the address of a valid data block */
-    if (addr < BLK_DATA_ADDR / BLK_SIZE || addr > BLK_COUNT - 1)
-        return;
+int snapshot_collect(void * buf, const char * name, const inode_t * inode, offset_t next) {
+    snapshot_walk_t * walk = (snapshot_walk_t *) buf;
+
+    (void) name;
+    (void) next;
 
-    /* zero the block to be freed */
-    BLK_SEEK(addr);
-    write_zeroes(BB_DATA->fs, BLK_SIZE);
+    walk->ret = snapshot_walk_push(walk, inode->inumber, 0);
+    return walk->ret < 0;
+}
 
-    /* make the freed block point to the current head of the free block list */
-    BLK_SEEK(addr);
-    fwrite(&BB_DATA->super_blk->first_free_block, sizeof(blk_addr_t), 1, BB_DATA->fs);
+/* add the directory @from, and its copy @to, to the end of @walk, which grows
+ * by doubling
+ *
+ * @return          0 on success, else -ENOMEM */
+
+int snapshot_walk_push(snapshot_walk_t * walk, inumber_t from, inumber_t to) {
+    unsigned long max = walk->max == 0 ? 64 : walk->max * 2;
+    inumber_t * grown;
+
+    if (walk->count == walk->max) {
+        if ((grown = (inumber_t *) realloc(walk->from, max * sizeof(inumber_t))) == NULL)
+            return -ENOMEM;
+        walk->from = grown;
+        if ((grown = (inumber_t *) realloc(walk->to, max * sizeof(inumber_t))) == NULL)
+            return -ENOMEM;
+        walk->to = grown;
+        walk->max = max;
+    }
 
-    /* install the freed block as the new head of the free block list */
-    BB_DATA->super_blk->first_free_block = addr;
+    walk->from[walk->count] = from;
+    walk->to[walk->count] = to;
+    walk->count++;
+    return 0;
+}
 
-    /* update block statistics in the super block */
-    BB_DATA->super_blk->block_free_count++;
-    BB_DATA->super_blk->block_used_count--;
+/* get a free data block
+ *
+ * @return          block address of the newly acquired block */
 
-    SUPER_BLOCK_WRITE(BB_DATA->super_blk);
+blk_addr_t get_free_block(void) {
+    unsigned int got;
+
+    return get_free_extent(0, 1, &got, true);
 }
 
-/* load the next block in the open file @fd */
+/* get a run of up to @count contiguous free data blocks. The run starts at
+ * @goal if that block is free; else the bitmap is scanned (a word at a time)
+ * for the first run of @count free blocks, and if there is none, the longest
+ * run found is returned. The blocks are zeroed if @zero is set.
+ *
+ * @param got       set to the no. of blocks actually acquired
+ * @return          block address of the first block of the run, else 0 */
 
-void block_load_next(int fd) {
-    table_entry_t * table_entry = BB_DATA->openFileTable[fd];
-    int block_next = (table_entry->file_offset - 1) / BLK_SIZE + 1;
-    int block_last;
+blk_addr_t get_free_extent(blk_addr_t goal, unsigned int count, unsigned int * got, bool zero) {
+    bitmap_word_t * map = BB_DATA->block_bitmap;
+    unsigned long nbits = BLK_DATA_COUNT, pos, scanned = 0, run;
+    unsigned long best_start = 0, best_run = 0;
+    unsigned int i;
+    long bit;
 
-    /* last valid block no. (0-based) in the file */
-    block_last = (table_entry->inode.attr.size - 1) / BLK_SIZE;
+    *got = 0;
 
-    /* check if @block_next lies after @block_last */
-    if (block_next > block_last) {
-        table_entry->addr = 0;
-        table_entry->data = NULL;
-        return;
+    pthread_mutex_lock(&BB_DATA->alloc_lock);
+
+    /* the blocks reserved for data held back from allocation are not free */
+    if (count > BB_DATA->super_blk->block_free_count - BB_DATA->blocks_reserved)
+        count = BB_DATA->super_blk->block_free_count - BB_DATA->blocks_reserved;
+    if (count == 0) {
+        pthread_mutex_unlock(&BB_DATA->alloc_lock);
+        return 0;
     }
 
-    /* if @block_next is a direct block, load it directly */
-    if (block_next < BLKS_DIRECT) {
-        table_entry->addr = table_entry->inode.blocks_direct[block_next];
-        BLK_READ_DATA(table_entry->addr, table_entry->data);
+    /* try to extend the caller's existing run first */
+    if (goal >= BLK_DATA_START && goal < BLK_COUNT) {
+        best_start = goal - BLK_DATA_START;
+        best_run = bitmap_clear_run(map, nbits, best_start, count);
     }
-    /* else find the indirect block which contains @block_next, load that, and then load @block_next */
-    else {
-        int indirect_block_no = (block_next - BLKS_DIRECT) / MAX_ADDR_PER_BLOCK;
-        int indirect_block_offset = (block_next - BLKS_DIRECT) % MAX_ADDR_PER_BLOCK;
-        blk_addr_t indirect_block_addr = table_entry->inode.blocks_indirect[indirect_block_no];
-        blk_addr_t indirect_block[MAX_ADDR_PER_BLOCK];
 
-        BLK_READ_INDIRECT(indirect_block_addr, indirect_block);
+    /* else scan from where the last allocation left off */
+    pos = BB_DATA->block_rotor;
+    while (best_run < count && scanned < nbits) {
+        bit = bitmap_find_clear(map, nbits, pos);
+        if (bit < 0)
+            break;
+
+        /* no. of bits skipped, allowing for the search wrapping around */
+        scanned += ((unsigned long) bit >= pos) ? bit - pos : nbits - pos + bit;
+
+        run = bitmap_clear_run(map, nbits, bit, count);
+        if (run > best_run) {
+            best_start = bit;
+            best_run = run;
+        }
+
+        scanned += run;
+        pos = bit + run;
+    }
+
+    if (best_run == 0) {
+        pthread_mutex_unlock(&BB_DATA->alloc_lock);
+        return 0;
+    }
 
-        table_entry->addr = indirect_block[indirect_block_offset];
-        BLK_READ_DATA(table_entry->addr, table_entry->data);
+    bitmap_set(map, best_start, best_run);
+    block_bitmap_sync(best_start, best_run);
+    BB_DATA->block_rotor = best_start + best_run;
+
+    /* zero the free blocks to be returned, unless they read as zeroes
+       already */
+    for (i = 0; i < best_run; i++) {
+        if (bitmap_test(BB_DATA->block_zero, best_start + i))
+            bitmap_clear(BB_DATA->block_zero, best_start + i, 1);
+        else if (zero)
+            DISK_ZERO(BLK_DATA_START + best_start + i);
     }
+
+    /* update super block statistics */
+    BB_DATA->super_blk->block_used_count += best_run;
+    BB_DATA->super_blk->block_free_count -= best_run;
+
+    /* write the super block back to disk */
+    SUPER_BLOCK_WRITE(BB_DATA->super_blk);
+
+    pthread_mutex_unlock(&BB_DATA->alloc_lock);
+
+    stats_count(STATS_EXTENT_ALLOCS, 1);
+    stats_count(STATS_BLOCKS_ALLOCATED, best_run);
+
+    *got = best_run;
+    return BLK_DATA_START + best_start;
+}
+
+/* write the words of the in-memory free block bitmap which cover the @count
+ * bits starting at @start back to disk */
+
+void block_bitmap_sync(unsigned long start, unsigned long count) {
+    unsigned long first = start / BITMAP_WORD_BITS;
+    unsigned long last = (start + count - 1) / BITMAP_WORD_BITS;
+
+    META_WRITE(BB_DATA->super_blk->block_bitmap + first * sizeof(bitmap_word_t),
+               &BB_DATA->block_bitmap[first], (last - first + 1) * sizeof(bitmap_word_t));
+}
+
+/* take up the @count blocks starting at @addr in one more snapshot, by
+ * raising their share counts; a block with a share count of n is pointed at
+ * by n + 1 files, and is only freed by the last of them */
+
+void extent_share(blk_addr_t addr, unsigned int count) {
+    share_count_t * shares = BB_DATA->block_shares;
+    unsigned long start = addr - BLK_DATA_START, i;
+
+    if (count == 0 || addr < BLK_DATA_START || addr + count > BLK_COUNT)
+        return;
+
+    pthread_mutex_lock(&BB_DATA->alloc_lock);
+    for (i = start; i < start + count; i++)
+        shares[i]++;
+    block_shares_sync(start, count);
+    pthread_mutex_unlock(&BB_DATA->alloc_lock);
+
+    __atomic_fetch_add(&BB_DATA->blocks_shared, count, __ATOMIC_RELAXED);
+}
+
+/* write the share counts of the @count data blocks starting at @start back to
+ * disk; the caller holds alloc_lock */
+
+void block_shares_sync(unsigned long start, unsigned long count) {
+    META_WRITE(BLK_SHARES_ADDR + start * sizeof(share_count_t),
+               &BB_DATA->block_shares[start], count * sizeof(share_count_t));
+}
+
+/* read the share table into memory, and count the shares in it, so that
+ * files are not looked at for shared blocks before there are any
+ *
+ * @return          0 on success, else -ENOMEM */
+
+int block_shares_load(void) {
+    unsigned long i;
+
+    BB_DATA->block_shares = (share_count_t *) malloc(BLK_DATA_COUNT * sizeof(share_count_t));
+    if (BB_DATA->block_shares == NULL)
+        return -ENOMEM;
+    DISK_READ_BULK(BLK_SHARES_ADDR, BB_DATA->block_shares, BLK_DATA_COUNT * sizeof(share_count_t));
+
+    BB_DATA->blocks_shared = 0;
+    for (i = 0; i < BLK_DATA_COUNT; i++)
+        BB_DATA->blocks_shared += BB_DATA->block_shares[i];
+    BB_DATA->extents_moved = 0;
+
+    return 0;
 }
 
-/* allocate a new block to the open file @fd */
+/* find the free data blocks which read as zeroes because they lie in holes of
+ * the storage file, as the whole data area does after format */
 
-blk_addr_t block_allocate(int fd) {
-    table_entry_t * table_entry = BB_DATA->openFileTable[fd];
-    inode_t * inode = &table_entry->inode;
-    int block_last = floor((table_entry->inode.attr.size - 1) * 1.0 / BLK_SIZE);
-    int block_new = block_last + 1;
+void block_zero_scan(void) {
+    int fd = fileno(BB_DATA->fs);
+    off_t hole, data, end = FS_SIZE;
+    blk_addr_t addr;
 
-    /* if @block_new will be a direct block, allocate it directly */
-    if (block_new < BLKS_DIRECT) {
-        inode->blocks_direct[block_new] = get_free_block();
+    for (hole = lseek(fd, BLK_DATA_ADDR, SEEK_HOLE); hole >= 0 && hole < end;
+         hole = lseek(fd, data, SEEK_HOLE)) {
+        data = lseek(fd, hole, SEEK_DATA);
+        if (data < 0 || data > end)
+            data = end;
 
-        /* write the modified inode to disk */
-        INODE_WRITE(inode->inumber, inode);
+        /* only the blocks which lie wholly in the hole */
+        for (addr = CEIL(hole, BLK_SIZE); addr < data / BLK_SIZE; addr++)
+            if (! bitmap_test(BB_DATA->block_bitmap, addr - BLK_DATA_START))
+                bitmap_set(BB_DATA->block_zero, addr - BLK_DATA_START, 1);
 
-        return inode->blocks_direct[block_new];
+        if (data == end)
+            break;
     }
+}
 
-    else {
-        int indirect_block_no = (block_new - BLKS_DIRECT) / MAX_ADDR_PER_BLOCK;
-        int indirect_block_offset = (block_new - BLKS_DIRECT) % MAX_ADDR_PER_BLOCK;
-        blk_addr_t indirect_block_addr = table_entry->inode.blocks_indirect[indirect_block_no];
-        blk_addr_t indirect_block[MAX_ADDR_PER_BLOCK];
-
-        if (indirect_block_addr == 0) {
-            indirect_block_addr = get_free_block();
-            inode->blocks_indirect[indirect_block_no] = indirect_block_addr;
-
-            /* write the modified inode to disk */
-            INODE_WRITE(inode->inumber, inode);
+/* punch holes in the storage file where the blocks freed since the last
+ * commit are, so that they read as zeroes and need not be zeroed when they are
+ * allocated again. This is done after the commit and before the journal
+ * thaws, so that every block in block_freed was freed by the transaction just
+ * committed, and a crash cannot leave a file on disk which points at blocks
+ * that have been cleared. */
+
+void block_discard_freed(void) {
+    bitmap_word_t * freed = BB_DATA->block_freed;
+    unsigned long nbits = BLK_DATA_COUNT, run;
+    long bit = 0;
+
+    pthread_mutex_lock(&BB_DATA->alloc_lock);
+
+    while ((bit = bitmap_find_set(freed, nbits, bit)) >= 0) {
+        /* skip the blocks which have been allocated again since */
+        for (run = 0; bit + run < nbits && bitmap_test(freed, bit + run) &&
+                 ! bitmap_test(BB_DATA->block_bitmap, bit + run); run++)
+            ;
+        if (run == 0) {
+            bitmap_clear(freed, bit, 1);
+            bit++;
+            continue;
         }
 
-        BLK_READ_INDIRECT(indirect_block_addr, indirect_block);
+        bitmap_clear(freed, bit, run);
+        if (BB_DATA->map == NULL)
+            cache_discard(BLK_DATA_START + bit, run);
 
-        /* allocate a new block in the indirect block */
-        indirect_block[indirect_block_offset] = get_free_block();
+        if (fallocate(fileno(BB_DATA->fs), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      BLK_POS(BLK_DATA_START + bit), (offset_t) run * BLK_SIZE) == 0)
+            bitmap_set(BB_DATA->block_zero, bit, run);
 
-        /* write the modified indirect block to disk */
-        BLK_WRITE_INDIRECT(indirect_block_addr, indirect_block);
-
-        return indirect_block[indirect_block_offset];
+        bit += run;
     }
+
+    pthread_mutex_unlock(&BB_DATA->alloc_lock);
 }
 
-/* get the block address of the first block in the directory (represented by
- * @inode) which has free space for a new file entry. A new block may be
- * allocated to the directory in this process.
+/* get a free inode, or NULL
  *
- * @param inode     inode of the directory under consideration
- * @return          block address of the first block with free space for a new
- *                  entry in the directory */
-
-blk_addr_t get_first_free_dir_block(inode_t * inode) {
-
-    int i, block_offset;
-    unsigned int first_free_dir_block_no = (inode->attr.size) / MAX_FILES_PER_BLOCK;
+ * @param free_inode  the free inode found, if one exists, else NULL
+ * @return            the inumber of the free inode, if found, else 0 */
 
-    if (first_free_dir_block_no < BLKS_DIRECT) {
-        /* allocate a new block to the directory, if required */
-        if (inode->attr.size % MAX_FILES_PER_BLOCK == 0) {
-            inode->blocks_direct[first_free_dir_block_no] = get_free_block();
+inumber_t get_free_inode(inode_t * free_inode) {
+    long bit;
 
-            /* write the modified inode back to disk */
-            INODE_WRITE(inode->inumber, inode);
-        }
+    pthread_mutex_lock(&BB_DATA->alloc_lock);
+    pthread_mutex_lock(&BB_DATA->inode_table_lock);
 
-        /* return the block address of the (possibly new) block */
-        return inode->blocks_direct[first_free_dir_block_no];
+    bit = bitmap_find_clear(BB_DATA->inode_bitmap, INODE_COUNT, BB_DATA->inode_rotor);
+    if (bit >= 0) {
+        /* claim the inode right away; create_file() marks it as used */
+        bitmap_set(BB_DATA->inode_bitmap, bit, 1);
+        BB_DATA->inode_rotor = bit + 1;
+        *free_inode = BB_DATA->inode_table[bit];
     }
 
-    else {
-
-        for (i = 0; i < BLKS_INDIRECT; i++) {
-
-            if (first_free_dir_block_no >= BLKS_DIRECT + i * MAX_ADDR_PER_BLOCK &&
-                first_free_dir_block_no < BLKS_DIRECT + (i + 1) * MAX_ADDR_PER_BLOCK) {
+    pthread_mutex_unlock(&BB_DATA->inode_table_lock);
 
-                /* Allocate space for the indirect block, if required*/
-                if(inode->blocks_indirect[i] == 0)
-                    inode->blocks_indirect[i] = get_free_block();
+    if (bit >= 0) {
+        /* update super block stats */
+        BB_DATA->super_blk->inode_free_count--;
+        SUPER_BLOCK_WRITE(BB_DATA->super_blk);
+    }
 
-                blk_addr_t indirect_block[MAX_ADDR_PER_BLOCK];
-                blk_addr_t indirect_block_addr = inode->blocks_indirect[i];
+    pthread_mutex_unlock(&BB_DATA->alloc_lock);
 
-                /* read the block addresses from the indirect block */
-                BLK_READ_INDIRECT(indirect_block_addr, indirect_block);
+    if (bit >= 0)
+        stats_count(STATS_INODES_ALLOCATED, 1);
 
-                /* offset of the target block in the indirect block */
-                block_offset = first_free_dir_block_no - (BLKS_DIRECT + i * MAX_ADDR_PER_BLOCK);
+    return bit + 1;
+}
 
-                /* allocate a new block to the directory, if required */
-                if (inode->attr.size % MAX_FILES_PER_BLOCK == 0) {
-                    indirect_block[block_offset] = get_free_block();
+/* read the whole inode list into the in-memory inode table, and build the
+ * free inode bitmap from it
+ *
+ * @return          0 on success, else -ENOMEM */
+
+int inode_table_load(void) {
+    unsigned long i, j, n, chunk = INODE_LOAD_SIZE / BLK_SIZE;
+    char * inode_list;
+
+    BB_DATA->inode_table = (inode_t *) malloc(INODE_COUNT * sizeof(inode_t));
+    BB_DATA->inode_bitmap = (bitmap_word_t *) calloc(BITMAP_WORDS(INODE_COUNT), sizeof(bitmap_word_t));
+    BB_DATA->inode_dirty = (bitmap_word_t *) calloc(BITMAP_WORDS(INODE_COUNT), sizeof(bitmap_word_t));
+    BB_DATA->inode_rotor = 0;
+
+    /* one inode per block, so read the blocks a chunk at a time, each in one
+       go */
+    inode_list = malloc(chunk * BLK_SIZE);
+    if (BB_DATA->inode_table == NULL || BB_DATA->inode_bitmap == NULL ||
+        BB_DATA->inode_dirty == NULL || inode_list == NULL) {
+        free(inode_list);
+        return -ENOMEM;
+    }
 
-                    /* write the modified indirect block back to disk */
-                    BLK_WRITE_INDIRECT(indirect_block_addr, indirect_block);
-                }
+    for (i = 0; i < INODE_COUNT; i += n) {
+        n = INODE_COUNT - i < chunk ? INODE_COUNT - i : chunk;
+        DISK_READ_BULK(INODE_LIST_ADDR + (offset_t) i * BLK_SIZE, inode_list, n * BLK_SIZE);
 
-                /* return the block address of the (possibly new) block */
-                return indirect_block[block_offset];
-            }
+        for (j = 0; j < n; j++) {
+            memcpy(&BB_DATA->inode_table[i + j], inode_list + j * BLK_SIZE, sizeof(inode_t));
 
+            /* format leaves the unused inodes all zeroes */
+            BB_DATA->inode_table[i + j].inumber = i + j + 1;
+            if (BB_DATA->inode_table[i + j].used)
+                bitmap_set(BB_DATA->inode_bitmap, i + j, 1);
         }
-
     }
 
+    free(inode_list);
     return 0;
 }
 
-/* Create a file with given type
- * @param parent_inode : inode of parent_dir
- * @param file_type : file or directory
- * @param name : name of the file
- * @return : inode number of the file created, 0 on failure*/
-
-inumber_t create_file(inode_t parent_inode,char * name,file_type_t file_type,file_mode_t mode)
-{
-    int i, entry_offset;
-    inode_t inode;
-    inumber_t inumber;
-    blk_addr_t first_free_dir_block;
-    file_entry_t parent_dir[MAX_FILES_PER_BLOCK];
-
-    inumber = get_free_inode(&inode);
-
-    /* create the new directory in a free inode */
-    inode.attr.type = file_type;
-    inode.attr.creation_time = time(NULL);
-    inode.attr.mode = mode;
-    inode.attr.size = 0;
-    inode.used = true;
-    for(i = 0; i < BLKS_DIRECT; i++)
-        inode.blocks_direct[i] = 0;
-    for(i = 0; i < BLKS_INDIRECT; i++)
-        inode.blocks_indirect[i] = 0;
-
-    INODE_WRITE(inumber, &inode);
-
-    /* add an entry for the new directory in its parent directory inode */
-    first_free_dir_block = get_first_free_dir_block(&parent_inode);
-    DIR_BLOCK_READ(parent_dir, first_free_dir_block);
-    entry_offset = parent_inode.attr.size % MAX_FILES_PER_BLOCK;
-
-    parent_inode.attr.size++;
-    INODE_WRITE(parent_inode.inumber, &parent_inode);
+/* copy inode @inumber from the inode table into @inode; an invalid inumber
+ * gives an unused inode */
 
-    strcpy(parent_dir[entry_offset].name, name);
-    parent_dir[entry_offset].inumber = inumber;
+void inode_table_read(inumber_t inumber, inode_t * inode) {
+    if (inumber < 1 || inumber > INODE_COUNT) {
+        memset(inode, 0, sizeof(inode_t));
+        return;
+    }
 
-    DIR_BLOCK_WRITE(parent_dir,first_free_dir_block);
-    return inumber;
+    pthread_mutex_lock(&BB_DATA->inode_table_lock);
+    *inode = BB_DATA->inode_table[inumber - 1];
+    pthread_mutex_unlock(&BB_DATA->inode_table_lock);
 }
 
-/* get a free data block
- *
- * @return          block address of the newly acquired block */
-
-blk_addr_t get_free_block(void) {
-    blk_addr_t ret = BB_DATA->super_blk->first_free_block;
-    blk_addr_t next;
+/* copy @inode into inode @inumber of the inode table, and mark it dirty */
 
-    /* if super_blk->first_free_block == BLK_COUNT, it means there are no more
-       free blocks */
-    if (ret == BLK_COUNT)
-        return 0;
+void inode_table_write(inumber_t inumber, inode_t * inode) {
+    if (inumber < 1 || inumber > INODE_COUNT)
+        return;
 
-    /* update the first free block entry in the super block */
-    BLK_SEEK(ret);
-    fread(&next, sizeof(blk_addr_t), 1, BB_DATA->fs);
-    BB_DATA->super_blk->first_free_block = next;
+    /* the inode reaches the disk with the running transaction; reserve its
+       block in it now, so that the transaction knows how large it is */
+    journal_dirty(INODE_POS(inumber), sizeof(inode_t));
 
-    /* zero the free block to be returned */
-    BLK_SEEK(ret);
-    write_zeroes(BB_DATA->fs, BLK_SIZE);
+    pthread_mutex_lock(&BB_DATA->inode_table_lock);
 
-    /* update super block statistics */
-    BB_DATA->super_blk->block_used_count++;
-    BB_DATA->super_blk->block_free_count--;
+    BB_DATA->inode_table[inumber - 1] = *inode;
+    bitmap_set(BB_DATA->inode_dirty, inumber - 1, 1);
 
-    /* write the super block back to disk */
-    SUPER_BLOCK_WRITE(BB_DATA->super_blk);
+    /* keep the free inode bitmap in step with the used flag */
+    if (inode->used)
+        bitmap_set(BB_DATA->inode_bitmap, inumber - 1, 1);
+    else
+        bitmap_clear(BB_DATA->inode_bitmap, inumber - 1, 1);
 
-    return ret;
+    pthread_mutex_unlock(&BB_DATA->inode_table_lock);
 }
 
-/* get a free inode, or NULL
- *
- * @param free_inode  the free inode found, if one exists, else NULL
- * @return            the inumber of the free inode, if found, else 0 */
+/* write all dirty inodes in the inode table back to disk */
 
-inumber_t get_free_inode(inode_t * free_inode) {
-    int i;
+void inode_table_flush(void) {
+    long bit = 0;
 
-    for (i = 1; i <= INODE_COUNT; i++) {
-        INODE_READ(i, free_inode);
-        if(! free_inode->used) {
-            /* update super block stats */
-            BB_DATA->super_blk->inode_free_count--;
-            SUPER_BLOCK_WRITE(BB_DATA->super_blk);
+    pthread_mutex_lock(&BB_DATA->inode_table_lock);
 
-            return i;
-        }
+    while ((bit = bitmap_find_set(BB_DATA->inode_dirty, INODE_COUNT, bit)) >= 0) {
+        META_WRITE(INODE_POS(bit + 1), &BB_DATA->inode_table[bit], sizeof(inode_t));
+        bitmap_clear(BB_DATA->inode_dirty, bit, 1);
+        bit++;
     }
 
-    return 0;
+    pthread_mutex_unlock(&BB_DATA->inode_table_lock);
 }
 
 /*This function returns the inode of the file from a path.
@@ -973,33 +3506,49 @@ inumber_t get_free_inode(inode_t * free_inode) {
 
 inumber_t get_inode_from_path(const char * filepath, inode_t * inode)
 {
-    if (strcmp(filepath, "/") == 0 || strcmp(filepath,".")==0) {
-        INODE_READ(ROOT_INODE_NUMBER, inode);
-        return ROOT_INODE_NUMBER;
-    }
+    inumber_t inumber;
 
-    /* Format the input filename string to exclude '/' */
-    char * str = strdup(filepath);
-    if(filepath[0] == '/')
-        str++;
+    pthread_rwlock_rdlock(&BB_DATA->ns_lock);
+    inumber = path_lookup(filepath, inode);
+    pthread_rwlock_unlock(&BB_DATA->ns_lock);
 
-    /* Split the filename with '/' to get the inode of the final file*/
-    int i;
+    return inumber;
+}
+
+/* does the actual work for get_inode_from_path(), for callers which already
+ * hold the directory tree lock */
+
+inumber_t path_lookup(const char * filepath, inode_t * inode)
+{
+    char path[PATH_LEN_MAX + 1], * name, * next, * saveptr;
     inumber_t inode_no = ROOT_INODE_NUMBER;     // Start with root dir
-    char ** splitarr = (char **)malloc(sizeof(char *)*PATH_DEPTH_MAX);
+    inumber_t parent_inumber;
+
+    if (strlen(filepath) > PATH_LEN_MAX)
+        return (INODE_COUNT+1);
 
-    /*Check if the path is valid  */
-    int pathdepth = strsplit(str,"/",splitarr);
-    for(i = 0;i < pathdepth-1 ;i++)
+    /* Split the path at '/', in place, to get the inode of the final file */
+    strcpy(path, filepath);
+    name = strtok_r(path, "/", &saveptr);
+
+    if (name == NULL || strcmp(filepath, ".") == 0) {
+        INODE_READ(ROOT_INODE_NUMBER, inode);
+        return ROOT_INODE_NUMBER;
+    }
+
+    /* Check if the path is valid: all components but the last one have to be
+       directories */
+    while ((next = strtok_r(NULL, "/", &saveptr)) != NULL)
 	{
-            inode_no = get_inode_from_name(inode_no,splitarr[i],DIR_T);
+            inode_no = get_inode_from_name(inode_no,name,DIR_T);
             if(inode_no == 0)
                 return (INODE_COUNT+1);
+            name = next;
 	}
 
     /* Check if the file exists */
-    inumber_t parent_inumber = inode_no;
-    inode_no = get_inode_from_name(inode_no,splitarr[i],FILE_T);
+    parent_inumber = inode_no;
+    inode_no = get_inode_from_name(inode_no,name,FILE_T);
 
     /* Put the appropriate structure in the input param */
     if(inode_no == 0)
@@ -1010,135 +3559,65 @@ inumber_t get_inode_from_path(const char * filepath, inode_t * inode)
 }
 
 
-/* write @count zeroes to @fs, starting from the current offset
- *
- * @param fs        the storage file for the fs
- * @param count     the number of times to write zeroes */
-void write_zeroes(FILE * fs, int count) {
-    int i;
-    for (i = 0; i < count; i++) {
-        fprintf(fs, "%c", '\x00');
-    }
-}
-
 /* Exit in case of error after printing the error Message */
 void error_exit(char * errorStr){
     fprintf(stderr,"%s\n",errorStr);
     exit(EXIT_FAILURE);
 }
 
-/* Get the inode number of a given filename in a directory
+/* Get the inode number of a given filename in a directory, going to the
+ * directory blocks only if the directory entry cache has no answer
  * @param inode_no : inode_number of parent directory
  * @param name : Name of the file
+ * @param file_type : DIR_T if the file has to be a directory, else FILE_T
  * @return inode_no of file or 0,if not exists.
  */
 
 inumber_t get_inode_from_name(inumber_t parent_inode_no,char * name,file_type_t file_type)
 {
-    /* Get the inode structure of the parent */
-    inode_t parent_inode;
-    if(parent_inode_no == 1)
-        INODE_READ(ROOT_INODE_NUMBER, &parent_inode);
-    else
-	{
-            INODE_READ(parent_inode_no,&parent_inode);
-	}
-
-    /* Traverse through the blocks of directory for the filename */
-    unsigned int i,j;
     inumber_t inode_no;
-    int file_count = parent_inode.attr.size;
-    int blk_count = CEIL(file_count,MAX_FILES_PER_BLOCK);
 
-    for( i=0; (i<BLKS_DIRECT && blk_count>0);i++,blk_count--)
-	{
-            inode_no = get_inode_in_block(parent_inode.blocks_direct[i],name,&file_count,file_type);
-            if(inode_no!=0)
-                return inode_no;
-	}
-    for(i = 0;i<BLKS_INDIRECT;i++)
-	{
-            if(parent_inode.blocks_indirect[i] == 0)
-                return 0;
-            blk_addr_t blk_addresses[MAX_ADDR_PER_BLOCK];
-            BLK_READ_INDIRECT(parent_inode.blocks_indirect[i],blk_addresses);
+    /* the directory of snapshots has no entry in the root directory, so that
+       it is not in the snapshots of it */
+    if (parent_inode_no == ROOT_INODE_NUMBER && strcmp(name, SNAPSHOTS_NAME) == 0)
+        return BB_DATA->super_blk->snapshots;
 
-            for(j = 0;(j<MAX_ADDR_PER_BLOCK && blk_count>0);j++,blk_count--)
-		{
-                    inode_no = get_inode_in_block(blk_addresses[j],name,&file_count,file_type);
-                    if(inode_no!=0)
-                        return inode_no;
-		}
- 	}
-    return 0;
-}
+    if (! dcache_lookup(parent_inode_no, name, &inode_no)) {
+        inode_no = dir_lookup(parent_inode_no, name);
+        dcache_insert(parent_inode_no, name, inode_no);
+    }
 
-/* Checks a given directory block for a file name
- * @param block_offset : offset of the block in the file system
- * @param name : name of the file
- * @return : inode number of the block if found, else 0
- */
-inumber_t get_inode_in_block(blk_addr_t addr,char * name,int * count,file_type_t file_type)
-{
-    unsigned int j;
-    if (addr < BLK_DATA_ADDR / BLK_SIZE || addr > BLK_COUNT - 1)
+    if (inode_no != 0 && file_type == DIR_T && ! is_filetype_same(inode_no, DIR_T))
         return 0;
 
-    file_entry_t file_entries[MAX_FILES_PER_BLOCK];
-    DIR_BLOCK_READ(file_entries,addr);
-
-    /* Compare the filename with all the names in this block */
-    for(j = 0;j<MAX_FILES_PER_BLOCK && (*count)>0;j++)
-	{
-            *count = *count -1;
-            if(strcmp(file_entries[j].name,name)==0)
-		{
-                    if(file_type == DIR_T && is_filetype_same(file_entries[j].inumber,file_type))
-                        return file_entries[j].inumber;
-                    else if(file_type == FILE_T)
-                        return file_entries[j].inumber;
-		}
-        }
-    return 0;
+    return inode_no;
 }
 
-void print_filenames_in_block(blk_addr_t addr,int * count)
-{
-    unsigned int j;
-    if (addr < BLK_DATA_ADDR / BLK_SIZE || addr > BLK_COUNT - 1)
-        return;
+/* Get the inode number of a given filename in a directory, by looking it up
+ * in the leaf of the directory which may hold it
+ * @return inode_no of file or 0,if not exists.
+ */
 
+inumber_t dir_lookup(inumber_t parent_inode_no, char * name)
+{
     file_entry_t file_entries[MAX_FILES_PER_BLOCK];
+    blk_addr_t addrs[DIR_LEVELS_MAX + 1], leaf;
+    unsigned int pos[DIR_LEVELS_MAX + 1], depth, i;
+    inode_t parent_inode;
 
-    DIR_BLOCK_READ(file_entries,addr);
-
-    /* Print the filenames in this block */
-    for(j = 0;j<MAX_FILES_PER_BLOCK && (*count)>0;j++)
-	{
-            *count = *count -1;
-            printf("%s\n",file_entries[j].name);
-        }
-}
-
-void get_filenames_in_block(blk_addr_t addr, int * file_count, char *files[], int * count)
-{
-    unsigned int j;
-    if (addr < BLK_DATA_ADDR / BLK_SIZE || addr > BLK_COUNT - 1)
-        return;
+    INODE_READ(parent_inode_no, &parent_inode);
 
-    file_entry_t file_entries[MAX_FILES_PER_BLOCK];
+    leaf = dir_leaf_find(&parent_inode, dir_hash(name), addrs, pos, &depth);
+    if (leaf == 0)
+        return 0;
 
-    DIR_BLOCK_READ(file_entries,addr);
+    /* Compare the filename with all the names in the leaf */
+    DIR_BLOCK_READ(file_entries, leaf);
+    for (i = 0; i < MAX_FILES_PER_BLOCK; i++)
+        if (file_entries[i].inumber != 0 && strcmp(file_entries[i].name, name) == 0)
+            return file_entries[i].inumber;
 
-    /* Print the filenames in this block */
-    for(j = 0;j<MAX_FILES_PER_BLOCK && (*file_count)>0;j++)
-	{
-            *file_count = *file_count -1;
-            files[*count] = malloc((strlen(file_entries[j].name) + 1) * sizeof(char));
-            strcpy(files[*count], file_entries[j].name);
-            log_msg("get_files name = %s\n", file_entries[j].name);
-            (*count)++;
-        }
+    return 0;
 }
 
 /* Check if a inode has the same required file type */
@@ -1152,58 +3631,266 @@ int is_filetype_same(inumber_t inode_no,file_type_t file_type)
         return 0;
 }
 
-/* Split a string into an array of strings with a delimiter */
-int strsplit(char * str, char * delim, char ** arr)
-{
-    char * origstr = (char * )malloc(sizeof(str));
-    strcpy(origstr,str);
-    int i = 0;
-    arr[i++]= strtok(origstr,delim);
-    while(arr[i-1]!=NULL)
-        arr[i++] = strtok(NULL,delim);
-    return i-1;
+/* look up (@parent, @name) in the directory entry cache
+ *
+ * @param inumber   set to the cached inumber, which is 0 if @name is known
+ *                  not to exist in @parent
+ * @return          true if the cache had an entry */
+
+bool dcache_lookup(inumber_t parent, const char * name, inumber_t * inumber) {
+    dcache_entry_t * entry = &BB_DATA->dcache[dcache_hash(parent, name)];
+    bool found;
+
+    pthread_mutex_lock(&BB_DATA->dcache_lock);
+
+    found = entry->valid && entry->parent == parent && strcmp(entry->name, name) == 0;
+    if (found)
+        *inumber = entry->inumber;
+
+    pthread_mutex_unlock(&BB_DATA->dcache_lock);
+    return found;
+}
+
+/* cache @inumber (which may be 0, for a negative entry) as the result of
+ * looking up @name in @parent, replacing whatever was in its slot */
+
+void dcache_insert(inumber_t parent, const char * name, inumber_t inumber) {
+    dcache_entry_t * entry;
+
+    /* names which cannot be stored in a directory are not cached */
+    if (strlen(name) > FILE_NAME_MAX)
+        return;
+
+    entry = &BB_DATA->dcache[dcache_hash(parent, name)];
+
+    pthread_mutex_lock(&BB_DATA->dcache_lock);
+    entry->valid = true;
+    entry->parent = parent;
+    entry->inumber = inumber;
+    strcpy(entry->name, name);
+    pthread_mutex_unlock(&BB_DATA->dcache_lock);
+}
+
+/* drop all cached entries under the directory @parent */
+
+void dcache_purge_dir(inumber_t parent) {
+    int i;
+
+    pthread_mutex_lock(&BB_DATA->dcache_lock);
+    for (i = 0; i < DCACHE_ENTRIES; i++)
+        if (BB_DATA->dcache[i].parent == parent)
+            BB_DATA->dcache[i].valid = false;
+    pthread_mutex_unlock(&BB_DATA->dcache_lock);
+}
+
+/* FNV-1a hash of (@parent, @name), as a slot in the directory entry cache */
+
+unsigned int dcache_hash(inumber_t parent, const char * name) {
+    unsigned int hash = 2166136261u ^ parent;
+
+    while (*name != '\0')
+        hash = (hash ^ (unsigned char) *name++) * 16777619u;
+
+    return hash % DCACHE_ENTRIES;
 }
 
+/* open the file @inode_no: its open inode is shared with the fds already on
+ * it, if any, else read from the inode table
+ *
+ * @return          the new fd, else -ENFILE or -ENOMEM */
+
 int file_table_insert(inumber_t inode_no)
 {
-    int i;
-    for(i = 0;i<MAX_OPEN_FILES;i++)
-	{
-            if(BB_DATA->openFileTable[i]==NULL)
-		{
-                    BB_DATA->openFileTable[i] = (table_entry_t *)malloc(sizeof(table_entry_t));
-                    INODE_READ(inode_no,&(BB_DATA->openFileTable[i]->inode));
-                    BB_DATA->openFileTable[i]->refCount = 1;
-                    BB_DATA->openFileTable[i]->file_offset = 0;
-                    BB_DATA->openFileTable[i]->addr = BB_DATA->openFileTable[i]->inode.blocks_direct[0];
-                    if (BB_DATA->openFileTable[i]->addr != 0) {
-                        BB_DATA->openFileTable[i]->data = malloc(BLK_SIZE);
-                        BLK_READ_DATA(BB_DATA->openFileTable[i]->addr, BB_DATA->openFileTable[i]->data);
-                    }
-                    else {
-                        BB_DATA->openFileTable[i]->data = NULL;
-                    }
-
-                    return i;
-		}
-	}
-    return -ENFILE;
+    file_table_t * table = BB_DATA->file_table;
+    open_inode_t ** bucket = &table->buckets[inode_no % OPEN_INODE_BUCKETS], * file;
+    table_entry_t * table_entry;
+    bool fresh;
+    int fd;
+
+    pthread_mutex_lock(&BB_DATA->file_table_lock);
+
+    /* reuse the fd freed last, else take the next one never used */
+    if (table->free_count > 0)
+        fd = table->free_fds[--table->free_count];
+    else if (table->next_fd < MAX_OPEN_FILES && file_table_grow(table) == 0)
+        fd = table->next_fd++;
+    else {
+        pthread_mutex_unlock(&BB_DATA->file_table_lock);
+        return -ENFILE;
+    }
+
+    for (file = *bucket; file != NULL && file->inode.inumber != inode_no; file = file->hash_next)
+        ;
+    fresh = file == NULL;
+
+    table_entry = (table_entry_t *) slab_alloc(&table->entries);
+    if (table_entry == NULL || (file == NULL && (file = (open_inode_t *) slab_alloc(&table->inodes)) == NULL)) {
+        if (table_entry != NULL)
+            slab_free(&table->entries, table_entry);
+        table->free_fds[table->free_count++] = fd;
+        pthread_mutex_unlock(&BB_DATA->file_table_lock);
+        return -ENOMEM;
+    }
+
+    /* no fd is open on the file, so nothing is changing its inode */
+    if (fresh) {
+        INODE_READ(inode_no, &file->inode);
+        file->refcount = 0;
+        file->delayed = NULL;
+        file->delayed_count = 0;
+        file->delayed_max = 0;
+        file->hash_next = *bucket;
+        *bucket = file;
+    }
+    file->refcount++;
+
+    /* the block buffers come along with the entry; block_load_current()
+       fills them on the first read or write */
+    pthread_mutex_init(&table_entry->lock, NULL);
+    table_entry->file = file;
+    table_entry->file_offset = 0;
+    table_entry->addr = 0;
+    table_entry->data = (char *) (table_entry + 1);
+    table_entry->indirect_addr = 0;
+    table_entry->indirect = (blk_addr_t *) ((char *) table_entry->data + BLK_SIZE);
+    table_entry->extent.len = 0;
+    table_entry->extent_moves = 0;
+    table_entry->ra_next = 0;
+    table_entry->ra_window = 0;
+    table_entry->ra_until = 0;
+
+    __atomic_store_n(&table->chunks[fd / FILE_TABLE_CHUNK][fd % FILE_TABLE_CHUNK], table_entry, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&BB_DATA->file_table_lock);
+    return fd;
+}
+
+/* make room in @table for the fd @table->next_fd, if it starts a new chunk
+ *
+ * @return          0 on success, else -ENOMEM */
+
+int file_table_grow(file_table_t * table)
+{
+    int chunk = table->next_fd / FILE_TABLE_CHUNK;
+    table_entry_t ** slots;
+    int * free_fds;
+
+    if (table->chunks[chunk] != NULL)
+        return 0;
+
+    /* the stack of free fds has to hold every fd there is a slot for */
+    free_fds = (int *) realloc(table->free_fds, (chunk + 1) * FILE_TABLE_CHUNK * sizeof(int));
+    if (free_fds == NULL)
+        return -ENOMEM;
+    table->free_fds = free_fds;
+
+    slots = (table_entry_t **) calloc(FILE_TABLE_CHUNK, sizeof(table_entry_t *));
+    if (slots == NULL)
+        return -ENOMEM;
+
+    __atomic_store_n(&table->chunks[chunk], slots, __ATOMIC_RELEASE);
+    return 0;
 }
 
 int file_table_delete(int fd)
 {
-    if(BB_DATA->openFileTable[fd] == NULL)
+    file_table_t * table = BB_DATA->file_table;
+    table_entry_t * table_entry;
+    open_inode_t ** link;
+
+    pthread_mutex_lock(&BB_DATA->file_table_lock);
+    if ((table_entry = file_table_get(fd)) == NULL)
 	{
+            pthread_mutex_unlock(&BB_DATA->file_table_lock);
             fprintf(stderr,"Incorrect File Descriptor\n");
             return 0;
 	}
 
-    /* free(BB_DATA->openFileTable[fd]); */
-    BB_DATA->openFileTable[fd] = NULL;
+    __atomic_store_n(&table->chunks[fd / FILE_TABLE_CHUNK][fd % FILE_TABLE_CHUNK], NULL, __ATOMIC_RELEASE);
+    table->free_fds[table->free_count++] = fd;
+
+    /* the last fd on the file takes its open inode along */
+    if (--table_entry->file->refcount == 0) {
+        link = &table->buckets[table_entry->file->inode.inumber % OPEN_INODE_BUCKETS];
+        while (*link != table_entry->file)
+            link = &(*link)->hash_next;
+        *link = table_entry->file->hash_next;
+        free(table_entry->file->delayed);
+        slab_free(&table->inodes, table_entry->file);
+    }
+
+    pthread_mutex_destroy(&table_entry->lock);
+    slab_free(&table->entries, table_entry);
+    pthread_mutex_unlock(&BB_DATA->file_table_lock);
 
     return 1;
 }
 
+/* get the entry of the open file @fd, else NULL if @fd is not open; the
+ * chunks of the table never move, so this takes no lock */
+
+table_entry_t * file_table_get(int fd)
+{
+    table_entry_t ** slots;
+
+    if (fd < 0 || fd >= MAX_OPEN_FILES)
+        return NULL;
+
+    slots = __atomic_load_n(&BB_DATA->file_table->chunks[fd / FILE_TABLE_CHUNK], __ATOMIC_ACQUIRE);
+    return slots == NULL ? NULL : __atomic_load_n(&slots[fd % FILE_TABLE_CHUNK], __ATOMIC_ACQUIRE);
+}
+
+/* check whether the file @inumber is open through any fd */
+
+bool file_table_busy(inumber_t inumber)
+{
+    open_inode_t * file;
+
+    pthread_mutex_lock(&BB_DATA->file_table_lock);
+    for (file = BB_DATA->file_table->buckets[inumber % OPEN_INODE_BUCKETS]; file != NULL; file = file->hash_next)
+        if (file->inode.inumber == inumber)
+            break;
+    pthread_mutex_unlock(&BB_DATA->file_table_lock);
+
+    return file != NULL;
+}
+
+/* set up an empty open file table; fd 0 is taken by the root directory, so
+ * that no file is ever open as fd 0 */
+
+void file_table_init(void)
+{
+    file_table_t * table = (file_table_t *) calloc(1, sizeof(file_table_t));
+
+    /* each entry is followed by its data block buffer and its indirect block
+       buffer, so that opening a file takes no malloc() */
+    slab_init(&table->entries, sizeof(table_entry_t) + 2 * BLK_SIZE, FILE_TABLE_SLAB);
+    slab_init(&table->inodes, sizeof(open_inode_t), FILE_TABLE_SLAB);
+    BB_DATA->file_table = table;
+
+    file_table_insert(ROOT_INODE_NUMBER);
+}
+
+/* close the fds left open, and free the open file table */
+
+void file_table_destroy(void)
+{
+    file_table_t * table = BB_DATA->file_table;
+    int fd;
+
+    for (fd = 0; fd < table->next_fd; fd++)
+        if (file_table_get(fd) != NULL)
+            file_table_delete(fd);
+
+    for (fd = 0; fd < FILE_TABLE_CHUNKS; fd++)
+        free(table->chunks[fd]);
+    free(table->free_fds);
+    slab_destroy(&table->entries);
+    slab_destroy(&table->inodes);
+    free(table);
+    BB_DATA->file_table = NULL;
+}
+
 /* check whether the fs is mounted; if not, print error and exit */
 void fs_check_mounted(void) {
     if(BB_DATA->super_blk == NULL) {
@@ -1212,12 +3899,132 @@ void fs_check_mounted(void) {
     }
 }
 
+/* an fs operation which changes metadata is bracketed by fs_op_begin() and
+ * fs_op_end(), so that its changes commit together (see journal.h) */
+void fs_op_begin(void) {
+    journal_start();
+}
+
+void fs_op_end(void) {
+    /* commit once the transaction has grown large */
+    if (journal_stop())
+        fs_commit();
+}
+
+/* commit the running journal transaction, along with the super block and the
+ * modified inodes, and write back all dirty blocks (or the whole mapping)
+ *
+ * @return          0 on success, else -EIO */
+int fs_commit(void) {
+    journal_freeze();
+    return fs_commit_frozen();
+}
+
+/* the work of fs_commit(), for callers which have frozen the journal
+ * already, as mysnapshot() does; the journal is thawed by the commit */
+
+int fs_commit_frozen(void) {
+    int ret;
+
+    /* the inodes must not reach the disk with sizes their blocks do not
+       cover yet */
+    if (BB_DATA->map == NULL)
+        delalloc_flush_all();
+
+    pthread_mutex_lock(&BB_DATA->alloc_lock);
+    SUPER_BLOCK_WRITE(BB_DATA->super_blk);
+    pthread_mutex_unlock(&BB_DATA->alloc_lock);
+    inode_table_flush();
+
+    if (BB_DATA->map != NULL)
+        ret = msync(BB_DATA->map, FS_SIZE, MS_SYNC) == 0 ? 0 : -EIO;
+    else
+        ret = journal_commit();
+
+    if (ret == 0)
+        block_discard_freed();
+    journal_thaw();
+
+    stats_count(STATS_COMMITS, 1);
+
+    return ret;
+}
+
+/* read the super block of the fs open as @fd into @super, and check it
+ *
+ * @return          0 on success, else -EINVAL */
+int super_block_read(int fd, super_block_t * super) {
+    if (pread(fd, super, sizeof(super_block_t), BLK_SUPER_ADDR) != sizeof(super_block_t) ||
+        ! super_block_valid(super))
+        return -EINVAL;
+
+    return 0;
+}
+
+/* set up the locks of the mounted fs; this needs the geometry of the fs, for
+ * the no. of inodes
+ *
+ * @return          0 on success, else -ENOMEM */
+int fs_locks_init(void) {
+    int i;
+
+    BB_DATA->inode_locks = (pthread_rwlock_t *) malloc(INODE_COUNT * sizeof(pthread_rwlock_t));
+    if (BB_DATA->inode_locks == NULL)
+        return -ENOMEM;
+    for (i = 0; i < (int) INODE_COUNT; i++)
+        pthread_rwlock_init(&BB_DATA->inode_locks[i], NULL);
+
+    pthread_rwlock_init(&BB_DATA->ns_lock, NULL);
+    pthread_mutex_init(&BB_DATA->alloc_lock, NULL);
+    pthread_mutex_init(&BB_DATA->inode_table_lock, NULL);
+    pthread_mutex_init(&BB_DATA->dcache_lock, NULL);
+    pthread_mutex_init(&BB_DATA->file_table_lock, NULL);
+
+    return 0;
+}
+
+void fs_locks_destroy(void) {
+    int i;
+
+    for (i = 0; i < (int) INODE_COUNT; i++)
+        pthread_rwlock_destroy(&BB_DATA->inode_locks[i]);
+    free(BB_DATA->inode_locks);
+    BB_DATA->inode_locks = NULL;
+
+    pthread_rwlock_destroy(&BB_DATA->ns_lock);
+    pthread_mutex_destroy(&BB_DATA->alloc_lock);
+    pthread_mutex_destroy(&BB_DATA->inode_table_lock);
+    pthread_mutex_destroy(&BB_DATA->dcache_lock);
+    pthread_mutex_destroy(&BB_DATA->file_table_lock);
+}
+
+/* check that @super is the super block of an image in the current on-disk
+ * format, with a sane geometry */
+bool super_block_valid(const super_block_t * super) {
+    if (super->magic != FS_MAGIC || super->version != FS_VERSION)
+        return false;
+
+    /* the block size has to be a power of 2 in range */
+    if (super->blk_size < BLK_SIZE_MIN || super->blk_size > BLK_SIZE_MAX ||
+        (super->blk_size & (super->blk_size - 1)) != 0)
+        return false;
+
+    return super->inode_count > 0 && super->inode_list > 0 &&
+           super->share_start > super->inode_list && super->journal_start > super->share_start &&
+           super->journal_count >= JOURNAL_BLKS_MIN &&
+           super->snapshots > 0 && super->snapshots <= super->inode_count &&
+           super->snapshots != ROOT_INODE_NUMBER &&
+           super->data_start == super->journal_start + super->journal_count &&
+           super->data_start + super->data_count == super->blk_count &&
+           super->fs_size == (offset_t) super->blk_count * super->blk_size;
+}
+
 void dump_used_inodes(void)
 {
     printf("\nDumping used inode numbers\n");
     int i = 0;
     inode_t inode;
-    for(i = 1;i<=INODE_COUNT;i++)
+    for(i = 1;i<=(int)INODE_COUNT;i++)
  	{
             INODE_READ(i,&inode);
             if(inode.used)
@@ -1,17 +1,33 @@
 /* this header file exposes and documents the public API of our filesystem */
 /* nothing else should go in here */
 
+/* once the fs is mounted, all the functions below may be called from several
+ * threads at once (FUSE runs multi-threaded); mymount() and myunmount() may
+ * not */
+
 #ifndef _FS_FUNCTIONS_H_
 #define _FS_FUNCTIONS_H_
 
 inumber_t get_inode_from_path(const char * filepath, inode_t * inode);
 
-int myreaddir(const char * path, char *files[]);
+/* list the directory @path, calling @filler for each entry in it; entries
+ * come in the order of the hash of their names, so that a listing can be
+ * resumed at the same place even if the directory has been changed since.
+ * The listing starts at @offset, which is 0 for the first entry, or the @next
+ * passed to @filler along with an entry to resume after that entry, and stops
+ * early if @filler returns nonzero.
+ *
+ * @return          0 on success, else -errno */
+
+int myreaddir(const char * path, offset_t offset, dir_filler_t filler, void * buf);
 
 /* create and format the filesystem, in the current directory itself, or
- * re-format it if it already exists */
+ * re-format it if it already exists; the block size (@blk_size), the size of
+ * the image (@fs_size) and the no. of inodes are recorded in the super block
+ *
+ * @return          0 on success, else -1 */
 
-void myformat(const char * fs_name);
+int myformat(const char * fs_name, unsigned int blk_size, offset_t fs_size, inumber_t inode_count);
 
 /* Mount the filesystem in memory with name @name
  * Return 0 on success
@@ -25,9 +41,30 @@ int myunmount(const char * fs_name);
 
 int myopen(const char * filename,char * mode);
 
-void myclose(int fd);
+/* close @fd; the data the file held back is allocated once its last fd is
+ * closed (see myflush())
+ *
+ * @return          0 on success, else -ENOSPC or -EIO if some of that data
+ *                  could not be written, and the file was cut short */
+
+int myclose(int fd);
 
-/* create a new directory with name @name */
+/* allocate and write out the data the file open as @fd holds back, so that
+ * errors in doing so are seen before it is closed
+ *
+ * @return          0 on success, else -EBADF, or -ENOSPC or -EIO if some of
+ *                  the data could not be written, and the file was cut short */
+
+int myflush(int fd);
+
+/* write all cached changes to the filesystem back to disk
+ *
+ * @return          0 on success, else -EIO */
+
+int myfsync(int fd);
+
+/* create a new directory with name @name; in the directory of snapshots
+ * (SNAPSHOTS_NAME in the root), this takes the snapshot @name */
 
 int mymkdir(const char * name);
 
@@ -45,7 +82,25 @@ int myread(int fd, void * buf, size_t nbytes);
 
 int mywrite(int fd, void * buf, size_t nbytes);
 
-/* remove the directory at @path, if it is empty */
+/* read up to @nbytes bytes into @buf from the file @fd, starting at byte
+ * @offset of the file; the offset of @fd is neither used nor changed, so any
+ * number of readers may share @fd
+ *
+ * @return          integer (>= 0) indicating the number of bytes actually read,
+ *                  else -errno */
+
+int mypread(int fd, void * buf, size_t nbytes, offset_t offset);
+
+/* write @nbytes bytes from @buf into the file @fd, starting at byte @offset
+ * of the file, and without using or changing the offset of @fd
+ *
+ * @return          integer (>= 0) indicating the number of bytes actually
+ *                  written, else -errno */
+
+int mypwrite(int fd, const void * buf, size_t nbytes, offset_t offset);
+
+/* remove the directory at @path, if it is empty; or the snapshot at @path, in
+ * the directory of snapshots */
 
 int myrmdir(const char * path);
 
@@ -53,5 +108,24 @@ int myrmdir(const char * path);
 
 int myrm(const char * path);
 
+/* take a snapshot of the whole tree under the root, which shows up as the
+ * directory @name in the directory of snapshots. It is read-only, and its
+ * files share their data blocks with those of the tree until those are
+ * written to, so taking it costs the metadata of the tree, rather than its
+ * data: the inodes and directories are copied, and a share count added for
+ * each data block. Files open for writing are flushed first.
+ *
+ * @return          0 on success, else -EEXIST, -ENAMETOOLONG, -EMLINK if there
+ *                  are SNAPSHOTS_MAX snapshots already, or -ENOSPC */
+
+int mysnapshot(const char * name);
+
+/* free the snapshot @name, and all it holds
+ *
+ * @return          0 on success, else -ENOENT, or -EBUSY if a file of it is
+ *                  open */
+
+int mysnapshot_delete(const char * name);
+
 
 #endif /* _FS_FUNCTIONS_H_ */
@@ -0,0 +1,869 @@
+/* checks the on-disk structures of an image which is not mounted: the super
+ * block and its counters, the journal, the block map of every inode in use,
+ * the directory trees, that each inode in use is reached from the root by
+ * exactly one directory entry (the snapshots from the directory of
+ * snapshots), and the free block bitmap and the share table against the
+ * blocks the inodes own
+ *
+ * the image is mapped into memory, and the inodes are checked by -j threads at
+ * once, which take FSCK_CHUNK inodes at a time; each claims the blocks of its
+ * inodes in a shared table, so that a block owned twice is found on the way.
+ * Only the data blocks of files may be owned by several files, which share
+ * them (see extent_free()). With -r, what can be is repaired: bad directory
+ * entries are cleared, and the inodes no longer reached from the root are
+ * freed, then the bitmap, the share table and the counters of the super block
+ * are rebuilt from what is left. Block maps which are broken are only
+ * reported.
+ *
+ * the exit status is as for e2fsck: 0 if the fs is consistent, 1 if all its
+ * problems were repaired, 4 if some are left, and 8 if it could not be
+ * checked */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "structs.h"
+#include "bitmap.h"
+
+/* the super block of the fs being checked, which holds its geometry (see
+   config.h) */
+static super_block_t fsck_super;
+#define FS_SUPER (&fsck_super)
+
+#include "macros.h"
+
+/* no. of inodes a thread takes at a time */
+#define FSCK_CHUNK 256
+
+/* hashes of names are below this (see dir_hash() in fs_functions.c) */
+#define FSCK_HASH_END 0x80000000u
+
+/* the inode @i in the image, and the extent no. @n of @inode, which is valid
+   once the extent blocks of @inode have been checked */
+#define FSCK_INODE(i) ((inode_t *) (map + INODE_POS(i)))
+#define FSCK_EXTENT(inode, n) ((n) < INODE_EXTENTS ? &(inode)->extents[n] : \
+                               (extent_t *) (map + EXTENT_POS(inode, n)))
+
+/* added to the claims of a block which only one inode may own */
+#define FSCK_EXCLUSIVE 0x80000000u
+
+/* the used flag of @inode as a byte, which the fs takes as set if it is not 0,
+   and which may be neither true nor false in a damaged image */
+#define FSCK_USED(inode) (*(unsigned char *) &(inode)->used)
+
+/* the options */
+static bool repair;
+static bool quiet;                  /* while checking again after a repair */
+static unsigned int thread_count;
+
+/* the image, and what the check found out; the fields the threads share are
+   updated atomically */
+static char * map;
+static uint32_t * claims;           /* no. of claims on data block i, plus
+                                       FSCK_EXCLUSIVE if it is not data */
+static bitmap_word_t * owned;       /* bit set for each data block claimed */
+static uint32_t * refs;             /* no. of entries for inode i, at i-1 */
+static inumber_t * parents;         /* the lowest-numbered directory with an
+                                       entry for inode i, at i-1 */
+static unsigned long next_inode;    /* the first inode of the next chunk */
+static unsigned long problems;
+static unsigned long repaired;
+static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* internal functions */
+
+static void usage(void) {
+    fprintf(stderr, "Usage: ./fsck [-r] [-j threads] <filesystem_name>\n"
+            "    -r          repair what can be repaired\n"
+            "    -j threads  no. of threads checking inodes (default: one per CPU)\n");
+}
+
+/* report a problem, unless checking again after a repair */
+
+static void fsck_problem(const char * format, ...) {
+    va_list args;
+
+    __atomic_fetch_add(&problems, 1, __ATOMIC_RELAXED);
+    if (quiet)
+        return;
+
+    pthread_mutex_lock(&print_lock);
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    pthread_mutex_unlock(&print_lock);
+}
+
+static void fsck_repaired(const char * format, ...) {
+    va_list args;
+
+    repaired++;
+    printf("repaired: ");
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+/* the same hash as dir_hash() in fs_functions.c, which decides the leaf a
+ * name goes in */
+
+static uint32_t fsck_hash(const char * name) {
+    uint32_t hash = 2166136261u;
+
+    while (*name != '\0')
+        hash = (hash ^ (unsigned char) *name++) * 16777619u;
+
+    return hash & 0x7fffffff;
+}
+
+/* the same checksum as journal_checksum() in journal.c, of the @len bytes at
+ * @buf */
+
+static uint32_t fsck_journal_checksum(const void * buf, size_t len) {
+    const unsigned char * p = buf;
+    uint32_t hash = 2166136261u;
+
+    while (len-- > 0)
+        hash = (hash ^ *p++) * 16777619u;
+
+    return hash;
+}
+
+static int fsck_name_cmp(const void * a, const void * b) {
+    return strcmp(((const file_entry_t *) a)->name, ((const file_entry_t *) b)->name);
+}
+
+/* @return          true if the @count blocks at @addr are all data blocks */
+
+static bool fsck_blocks_valid(blk_addr_t addr, blk_addr_t count) {
+    return count > 0 && addr >= BLK_DATA_START && addr < BLK_COUNT && count <= BLK_COUNT - addr;
+}
+
+/* claim the @count blocks at @addr for inode @i, which holds its @what in
+ * them; if they hold the data of a file (@shared), other files may claim them
+ * too, else a block claimed before belongs to another inode too, or twice to
+ * this one
+ *
+ * @return          true if the blocks are data blocks */
+
+static bool fsck_claim(inumber_t i, blk_addr_t addr, blk_addr_t count, const char * what, bool shared) {
+    unsigned long block, end, dups = 0;
+    uint32_t old;
+
+    if (! fsck_blocks_valid(addr, count)) {
+        fsck_problem("inode %u: %s at %u (%u blocks) is outside the data blocks\n", i, what, addr, count);
+        return false;
+    }
+
+    end = addr - BLK_DATA_START + count;
+    for (block = addr - BLK_DATA_START; block < end; block++) {
+        old = __atomic_fetch_add(&claims[block], shared ? 1 : FSCK_EXCLUSIVE + 1, __ATOMIC_RELAXED);
+        if (shared ? (old & FSCK_EXCLUSIVE) != 0 : old != 0)
+            dups++;
+    }
+
+    if (dups > 0)
+        fsck_problem("inode %u: %lu blocks of its %s at %u are claimed more than once\n", i, dups, what, addr);
+
+    return true;
+}
+
+/* record the entry for inode @child in directory @dir */
+
+static void fsck_link(inumber_t dir, inumber_t child) {
+    inumber_t parent = __atomic_load_n(&parents[child - 1], __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&refs[child - 1], 1, __ATOMIC_RELAXED);
+    while ((parent == 0 || dir < parent) &&
+           ! __atomic_compare_exchange_n(&parents[child - 1], &parent, dir, true,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/* @return          NULL if the entry @entry of a leaf, whose names hash into
+ *                  [@lo, @hi), is valid, else what is wrong with it */
+
+static const char * fsck_entry_problem(const file_entry_t * entry, uint32_t lo, uint32_t hi) {
+    uint32_t hash;
+
+    if (memchr(entry->name, '\0', FILE_NAME_MAX + 1) == NULL || entry->name[0] == '\0' ||
+        strchr(entry->name, '/') != NULL)
+        return "a bad name";
+    hash = fsck_hash(entry->name);
+    if (hash < lo || hash >= hi)
+        return "a name in the wrong leaf";
+    if (entry->inumber > INODE_COUNT || entry->inumber == ROOT_INODE_NUMBER ||
+        entry->inumber == fsck_super.snapshots)
+        return "a bad inumber";
+    if (FSCK_USED(FSCK_INODE(entry->inumber)) == 0)
+        return "an inode not in use";
+
+    return NULL;
+}
+
+/* check the leaf at @addr of directory @i, whose names hash into [@lo, @hi);
+ * @linked is NULL while checking, else the entries are being repaired: the bad
+ * ones are cleared, as are those for inodes set in @linked, and the inodes of
+ * those left are set in @linked, and their directories added to @queue
+ *
+ * @param count     incremented by the no. of valid entries */
+
+static void fsck_leaf(inumber_t i, blk_addr_t addr, uint32_t lo, uint32_t hi, unsigned long * count,
+                      bitmap_word_t * linked, inumber_t * queue, unsigned long * queued) {
+    file_entry_t * entries = (file_entry_t *) (map + BLK_POS(addr));
+    file_entry_t names[BLK_SIZE_MAX / sizeof(file_entry_t)];
+    unsigned int n = 0, j, k;
+    const char * problem;
+
+    for (j = 0; j < MAX_FILES_PER_BLOCK; j++) {
+        if (entries[j].inumber == 0)
+            continue;
+
+        problem = fsck_entry_problem(&entries[j], lo, hi);
+
+        /* a name may be used only once, and the names with the same hash are
+           all in the same leaf */
+        for (k = 0; problem == NULL && linked != NULL && k < j; k++)
+            if (entries[k].inumber != 0 && strcmp(entries[k].name, entries[j].name) == 0)
+                problem = "a name used twice";
+
+        if (linked != NULL && problem == NULL && bitmap_test(linked, entries[j].inumber - 1))
+            problem = "an inode linked elsewhere";
+
+        if (problem != NULL) {
+            if (linked == NULL) {
+                fsck_problem("inode %u: entry %u of leaf %u has %s\n", i, j, addr, problem);
+                continue;
+            }
+            fsck_repaired("inode %u: cleared entry %u of leaf %u, which had %s\n", i, j, addr, problem);
+            memset(&entries[j], 0, sizeof(file_entry_t));
+            continue;
+        }
+
+        (*count)++;
+        if (linked != NULL) {
+            bitmap_set(linked, entries[j].inumber - 1, 1);
+            if (FSCK_INODE(entries[j].inumber)->attr.type == DIR_T)
+                queue[(*queued)++] = entries[j].inumber;
+        }
+        else {
+            fsck_link(i, entries[j].inumber);
+            names[n++] = entries[j];
+        }
+    }
+
+    /* sorted, the names used twice are next to each other */
+    qsort(names, n, sizeof(file_entry_t), fsck_name_cmp);
+    for (j = 1; j < n; j++)
+        if (strcmp(names[j - 1].name, names[j].name) == 0)
+            fsck_problem("inode %u: leaf %u has the name \"%s\" twice\n", i, addr, names[j].name);
+}
+
+/* check the index block at @addr of directory @i, with @levels index levels
+ * below it, whose entries hash into [@lo, @hi); see fsck_leaf() */
+
+static void fsck_index(inumber_t i, blk_addr_t addr, unsigned int levels, uint32_t lo, uint32_t hi,
+                       unsigned long * count, bitmap_word_t * linked, inumber_t * queue, unsigned long * queued) {
+    dir_index_t * index = (dir_index_t *) (map + BLK_POS(addr)), * entries = index + 1;
+    unsigned int n = index[0].header.count, j;
+    blk_addr_t child;
+    uint32_t next;
+
+    if (n == 0 || n > DIR_INDEX_MAX) {
+        fsck_problem("inode %u: index block %u has %u entries\n", i, addr, n);
+        return;
+    }
+    if (entries[0].entry.hash != lo) {
+        fsck_problem("inode %u: index block %u starts at hash %u, not %u\n", i, addr, entries[0].entry.hash, lo);
+        return;
+    }
+
+    for (j = 0; j < n; j++) {
+        next = j + 1 < n ? entries[j + 1].entry.hash : hi;
+        if (next <= entries[j].entry.hash || next > hi) {
+            fsck_problem("inode %u: the hashes of index block %u are out of order\n", i, addr);
+            return;
+        }
+
+        child = entries[j].entry.addr;
+        if (linked == NULL && ! fsck_claim(i, child, 1, levels > 0 ? "index block" : "leaf", false))
+            continue;
+        if (linked != NULL && ! fsck_blocks_valid(child, 1))
+            continue;
+
+        if (levels > 0)
+            fsck_index(i, child, levels - 1, entries[j].entry.hash, next, count, linked, queue, queued);
+        else
+            fsck_leaf(i, child, entries[j].entry.hash, next, count, linked, queue, queued);
+    }
+}
+
+/* check the entries of directory @i, or repair them (see fsck_leaf())
+ *
+ * @return          the no. of valid entries */
+
+static unsigned long fsck_dir_entries(inumber_t i, inode_t * inode, bitmap_word_t * linked,
+                                      inumber_t * queue, unsigned long * queued) {
+    blk_addr_t addr = inode->blocks_direct[0];
+    unsigned long count = 0;
+    unsigned int levels;
+
+    if (addr == 0)
+        return 0;
+    if (linked == NULL && ! fsck_claim(i, addr, 1, (inode->flags & INODE_F_INDEX) ? "index root" : "leaf", false))
+        return 0;
+    if (linked != NULL && ! fsck_blocks_valid(addr, 1))
+        return 0;
+
+    if (inode->flags & INODE_F_INDEX) {
+        levels = ((dir_index_t *) (map + BLK_POS(addr)))[0].header.levels;
+        if (levels > DIR_LEVELS_MAX) {
+            fsck_problem("inode %u: index has %u levels\n", i, levels);
+            return 0;
+        }
+        fsck_index(i, addr, levels, 0, FSCK_HASH_END, &count, linked, queue, queued);
+    }
+    else
+        fsck_leaf(i, addr, 0, FSCK_HASH_END, &count, linked, queue, queued);
+
+    return count;
+}
+
+static void fsck_dir(inumber_t i, inode_t * inode) {
+    unsigned long count;
+
+    if (inode->flags & ~(INODE_F_INDEX | INODE_F_SNAPSHOT))
+        fsck_problem("inode %u: directory has flags 0x%x\n", i, inode->flags);
+
+    count = fsck_dir_entries(i, inode, NULL, NULL, NULL);
+    if (count != inode->attr.size)
+        fsck_problem("inode %u: directory has %lu entries, but its size is %llu\n",
+                     i, count, (unsigned long long) inode->attr.size);
+}
+
+/* check the extents of file @i; a file may be larger than the blocks it maps,
+ * as its last blocks are not allocated until they are written out (see
+ * delalloc_write()) */
+
+static void fsck_extents(inumber_t i, inode_t * inode) {
+    unsigned int n, needed, k;
+    blk_addr_t end = 0;
+    extent_t * extent;
+    uint32_t len;
+
+    if (inode->extent_count > EXTENTS_MAX) {
+        fsck_problem("inode %u: has %u extents\n", i, inode->extent_count);
+        return;
+    }
+
+    /* an extent block may be left allocated after the extents in it are gone */
+    needed = inode->extent_count > INODE_EXTENTS ? CEIL(inode->extent_count - INODE_EXTENTS, EXTENTS_PER_BLOCK) : 0;
+    for (k = 0; k < INODE_EXTENT_BLOCKS; k++) {
+        if (inode->extent_blocks[k] == 0) {
+            if (k < needed) {
+                fsck_problem("inode %u: has no extent block %u for its %u extents\n", i, k, inode->extent_count);
+                return;
+            }
+        }
+        else if (! fsck_claim(i, inode->extent_blocks[k], 1, "extent block", false) && k < needed)
+            return;
+    }
+
+    for (n = 0; n < inode->extent_count; n++) {
+        extent = FSCK_EXTENT(inode, n);
+        if (extent->len == 0 || extent->logical < end || extent->len > BLK_COUNT - extent->logical) {
+            fsck_problem("inode %u: extent %u maps %u blocks from block %u, after block %u\n",
+                         i, n, extent->len, extent->logical, end);
+            continue;
+        }
+        end = extent->logical + extent->len;
+
+        if (extent->stored != 0 && (! (inode->flags & INODE_F_COMPRESS) || extent->stored >= extent->len)) {
+            fsck_problem("inode %u: extent %u is a cluster of %u blocks stored in %u\n",
+                         i, n, extent->len, extent->stored);
+            continue;
+        }
+
+        if (! fsck_claim(i, extent->physical, EXTENT_BLKS(extent), extent->stored != 0 ? "cluster" : "extent", true))
+            continue;
+
+        /* the compressed data is exactly as long as the blocks it is in */
+        if (extent->stored != 0) {
+            memcpy(&len, map + BLK_POS(extent->physical), sizeof(len));
+            if (len == 0 || CEIL(sizeof(len) + (offset_t) len, BLK_SIZE) != extent->stored)
+                fsck_problem("inode %u: cluster at %u holds %u bytes in %u blocks\n",
+                             i, extent->physical, len, extent->stored);
+        }
+    }
+}
+
+/* check the direct and indirect blocks of file @i, which end at the first
+ * address which is not a data block, as for inode_free() */
+
+static void fsck_blocks(inumber_t i, inode_t * inode) {
+    blk_addr_t * indirect;
+    unsigned int j, k;
+
+    for (j = 0; j < BLKS_DIRECT; j++) {
+        if (! fsck_blocks_valid(inode->blocks_direct[j], 1))
+            return;
+        fsck_claim(i, inode->blocks_direct[j], 1, "block", false);
+    }
+
+    for (j = 0; j < BLKS_INDIRECT; j++) {
+        if (! fsck_blocks_valid(inode->blocks_indirect[j], 1))
+            return;
+        fsck_claim(i, inode->blocks_indirect[j], 1, "indirect block", false);
+
+        indirect = (blk_addr_t *) (map + BLK_POS(inode->blocks_indirect[j]));
+        for (k = 0; k < MAX_ADDR_PER_BLOCK; k++) {
+            if (! fsck_blocks_valid(indirect[k], 1))
+                return;
+            fsck_claim(i, indirect[k], 1, "block", false);
+        }
+    }
+}
+
+static void fsck_file(inumber_t i, inode_t * inode) {
+    if (inode->flags & INODE_F_INDEX)
+        fsck_problem("inode %u: file has flags 0x%x\n", i, inode->flags);
+
+    if (inode->flags & INODE_F_INLINE) {
+        if (inode->attr.size > INODE_INLINE_MAX)
+            fsck_problem("inode %u: inline file has size %llu\n", i, (unsigned long long) inode->attr.size);
+    }
+    else if (inode->flags & INODE_F_EXTENTS)
+        fsck_extents(i, inode);
+    else
+        fsck_blocks(i, inode);
+}
+
+static void fsck_inode(inumber_t i) {
+    inode_t * inode = FSCK_INODE(i);
+
+    if (FSCK_USED(inode) == 0)
+        return;
+    if (FSCK_USED(inode) != 1)
+        fsck_problem("inode %u: has used flag %u\n", i, FSCK_USED(inode));
+
+    /* only the inumbers of the inodes in use are kept up to date */
+    if (inode->inumber != i)
+        fsck_problem("inode %u: has inumber %u\n", i, inode->inumber);
+
+    if (inode->attr.type == DIR_T)
+        fsck_dir(i, inode);
+    else if (inode->attr.type == FILE_T)
+        fsck_file(i, inode);
+    else
+        fsck_problem("inode %u: has type %d\n", i, (int) inode->attr.type);
+}
+
+static void * fsck_thread(void * arg) {
+    unsigned long first, last, i;
+
+    (void) arg;
+
+    for (;;) {
+        first = __atomic_fetch_add(&next_inode, FSCK_CHUNK, __ATOMIC_RELAXED);
+        if (first >= INODE_COUNT)
+            return NULL;
+        last = first + FSCK_CHUNK < INODE_COUNT ? first + FSCK_CHUNK : INODE_COUNT;
+
+        for (i = first; i < last; i++)
+            fsck_inode(i + 1);
+    }
+}
+
+/* check all the inodes, with @thread_count threads, and then that each inode
+ * in use is reached from the root by exactly one entry
+ *
+ * @return          the no. of inodes in use, else -1 if the root is not a
+ *                  directory in use */
+
+static long fsck_inodes(void) {
+    pthread_t * threads = (pthread_t *) malloc(thread_count * sizeof(pthread_t));
+    unsigned char * reached;
+    unsigned long i, used = 0;
+    unsigned int t, started = 0;
+    inumber_t j, * path;
+    unsigned long depth;
+
+    memset(claims, 0, BLK_DATA_COUNT * sizeof(uint32_t));
+    memset(refs, 0, INODE_COUNT * sizeof(uint32_t));
+    memset(parents, 0, INODE_COUNT * sizeof(inumber_t));
+    next_inode = 0;
+
+    if (FSCK_USED(FSCK_INODE(ROOT_INODE_NUMBER)) == 0 || FSCK_INODE(ROOT_INODE_NUMBER)->attr.type != DIR_T) {
+        fsck_problem("the root is not a directory in use\n");
+        free(threads);
+        return -1;
+    }
+    if (FSCK_USED(FSCK_INODE(fsck_super.snapshots)) == 0 || FSCK_INODE(fsck_super.snapshots)->attr.type != DIR_T ||
+        ! (FSCK_INODE(fsck_super.snapshots)->flags & INODE_F_SNAPSHOT)) {
+        fsck_problem("the directory of snapshots is not a directory of snapshots in use\n");
+        free(threads);
+        return -1;
+    }
+
+    for (t = 0; threads != NULL && t < thread_count; t++)
+        if (pthread_create(&threads[t], NULL, fsck_thread, NULL) == 0)
+            started++;
+    if (started == 0)
+        fsck_thread(NULL);
+    for (t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+    free(threads);
+
+    /* an inode is reached if the directory with its entry is; each inode is
+       decided once, along with the path up to the first decided one */
+    reached = (unsigned char *) calloc(INODE_COUNT, 1);     /* 1 yes, 2 no */
+    path = (inumber_t *) malloc(INODE_COUNT * sizeof(inumber_t));
+    reached[ROOT_INODE_NUMBER - 1] = 1;
+    reached[fsck_super.snapshots - 1] = 1;
+
+    for (i = 0; i < INODE_COUNT; i++) {
+        if (FSCK_USED(FSCK_INODE(i + 1)) == 0)
+            continue;
+        used++;
+
+        if (i + 1 != ROOT_INODE_NUMBER && i + 1 != fsck_super.snapshots && refs[i] != 1)
+            fsck_problem("inode %lu: has %u entries\n", i + 1, refs[i]);
+
+        /* what is in a snapshot is read-only, and nothing else is */
+        if (parents[i] != 0 && ((FSCK_INODE(i + 1)->flags ^ FSCK_INODE(parents[i])->flags) & INODE_F_SNAPSHOT))
+            fsck_problem("inode %lu: is %sread-only, but its directory %u is %s\n", i + 1,
+                         (FSCK_INODE(i + 1)->flags & INODE_F_SNAPSHOT) ? "" : "not ", parents[i],
+                         (FSCK_INODE(parents[i])->flags & INODE_F_SNAPSHOT) ? "" : "not");
+
+        /* walking up a cycle meets an inode on the path again */
+        for (j = i + 1, depth = 0; j != 0 && reached[j - 1] == 0; j = parents[j - 1]) {
+            reached[j - 1] = 3;
+            path[depth++] = j;
+        }
+        while (depth > 0)
+            reached[path[--depth] - 1] = j != 0 && reached[j - 1] == 1 ? 1 : 2;
+
+        if (reached[i] != 1 && refs[i] != 0)
+            fsck_problem("inode %lu: is not reached from the root\n", i + 1);
+    }
+
+    free(path);
+    free(reached);
+    return used;
+}
+
+/* repair the directories reached from the root and from the directory of
+ * snapshots, in breadth-first order, then
+ * free the inodes in use not reached by any of their entries, and repair the
+ * used flag and inumber of the others */
+
+static void fsck_repair_tree(void) {
+    bitmap_word_t * linked = (bitmap_word_t *) calloc(BITMAP_WORDS(INODE_COUNT), sizeof(bitmap_word_t));
+    inumber_t * queue = (inumber_t *) malloc(INODE_COUNT * sizeof(inumber_t));
+    unsigned long head = 0, queued = 0, count, i;
+    inode_t * inode;
+
+    bitmap_set(linked, ROOT_INODE_NUMBER - 1, 1);
+    queue[queued++] = ROOT_INODE_NUMBER;
+    bitmap_set(linked, fsck_super.snapshots - 1, 1);
+    queue[queued++] = fsck_super.snapshots;
+
+    while (head < queued) {
+        inode = FSCK_INODE(queue[head]);
+        count = fsck_dir_entries(queue[head], inode, linked, queue, &queued);
+        if (count != inode->attr.size) {
+            inode->attr.size = count;
+            fsck_repaired("inode %u: set its size to %lu entries\n", queue[head], count);
+        }
+        head++;
+    }
+
+    for (i = 0; i < INODE_COUNT; i++) {
+        inode = FSCK_INODE(i + 1);
+        if (FSCK_USED(inode) == 0)
+            continue;
+
+        if (! bitmap_test(linked, i)) {
+            inode->used = false;
+            fsck_repaired("inode %lu: freed, as it was not reached from the root\n", i + 1);
+            continue;
+        }
+        if (FSCK_USED(inode) != 1) {
+            inode->used = true;
+            fsck_repaired("inode %lu: set its used flag\n", i + 1);
+        }
+        if (inode->inumber != i + 1) {
+            inode->inumber = i + 1;
+            fsck_repaired("inode %lu: set its inumber\n", i + 1);
+        }
+    }
+
+    free(queue);
+    free(linked);
+}
+
+/* compare the share table with the claims on each data block, a run of
+ * blocks which differ at a time, and make it the same if repairing; a block
+ * claimed by n files is shared n - 1 times, whether it was shared by a
+ * snapshot or owned twice by mistake. Then find the blocks owned, for
+ * fsck_bitmap() and fsck_counters(). */
+
+static void fsck_shares(void) {
+    share_count_t * shares = (share_count_t *) (map + BLK_SHARES_ADDR);
+    unsigned long nblocks = BLK_DATA_COUNT, block, run, i;
+    share_count_t share;
+
+    for (block = 0; block < nblocks; block += run) {
+        for (run = 0; block + run < nblocks; run++) {
+            i = block + run;
+            share = claims[i] == 0 || (claims[i] & FSCK_EXCLUSIVE) ? 0 : claims[i] - 1;
+            if (shares[i] == share)
+                break;
+            if (repair)
+                shares[i] = share;
+        }
+        if (run == 0) {
+            run = 1;
+            continue;
+        }
+
+        fsck_problem("blocks %lu-%lu have share counts which do not match the files owning them\n",
+                     BLK_DATA_START + block, BLK_DATA_START + block + run - 1);
+        if (repair)
+            fsck_repaired("blocks %lu-%lu set their share counts\n", BLK_DATA_START + block,
+                          BLK_DATA_START + block + run - 1);
+    }
+
+    memset(owned, 0, BITMAP_WORDS(nblocks) * sizeof(bitmap_word_t));
+    for (block = 0; block < nblocks; block++)
+        if (claims[block] != 0)
+            bitmap_set(owned, block, 1);
+}
+
+/* compare the free block bitmap with the blocks claimed, a run of blocks
+ * which differ at a time, and make it the same if repairing */
+
+static void fsck_bitmap(void) {
+    bitmap_word_t * bitmap = (bitmap_word_t *) (map + BLK_BITMAP_ADDR);
+    unsigned long nbits = BLK_DATA_COUNT, bit, run;
+    bool used;
+
+    for (bit = 0; bit < nbits; bit += run) {
+        /* skip the words which agree */
+        if (bit % BITMAP_WORD_BITS == 0 && bitmap[bit / BITMAP_WORD_BITS] == owned[bit / BITMAP_WORD_BITS]) {
+            run = BITMAP_WORD_BITS;
+            continue;
+        }
+
+        used = bitmap_test(owned, bit);
+        for (run = 0; bit + run < nbits && bitmap_test(owned, bit + run) == used &&
+                 bitmap_test(bitmap, bit + run) != used; run++)
+            ;
+        if (run == 0) {
+            run = 1;
+            continue;
+        }
+
+        fsck_problem("blocks %lu-%lu are %s, but marked %s in the bitmap\n",
+                     BLK_DATA_START + bit, BLK_DATA_START + bit + run - 1,
+                     used ? "in use" : "not in use", used ? "free" : "used");
+        if (repair) {
+            if (used)
+                bitmap_set(bitmap, bit, run);
+            else
+                bitmap_clear(bitmap, bit, run);
+            fsck_repaired("blocks %lu-%lu marked %s\n", BLK_DATA_START + bit,
+                          BLK_DATA_START + bit + run - 1, used ? "used" : "free");
+        }
+    }
+}
+
+/* compare the counters of the super block with the blocks claimed and the
+ * @used inodes in use, and set them if repairing */
+
+static void fsck_counters(unsigned long used) {
+    super_block_t * super = (super_block_t *) (map + BLK_SUPER_ADDR);
+    unsigned long blocks = 0, i;
+
+    for (i = 0; i < BITMAP_WORDS(BLK_DATA_COUNT); i++)
+        blocks += __builtin_popcountll(owned[i]);
+
+    if (super->block_used_count != blocks || super->block_free_count != BLK_DATA_COUNT - blocks) {
+        fsck_problem("super block counts %u blocks used and %u free, not %lu and %lu\n",
+                     super->block_used_count, super->block_free_count, blocks, BLK_DATA_COUNT - blocks);
+        if (repair) {
+            super->block_used_count = blocks;
+            super->block_free_count = BLK_DATA_COUNT - blocks;
+            fsck_repaired("set the block counts of the super block\n");
+        }
+    }
+
+    if (super->inode_free_count != INODE_COUNT - used) {
+        fsck_problem("super block counts %u inodes free, not %lu\n", super->inode_free_count, INODE_COUNT - used);
+        if (repair) {
+            super->inode_free_count = INODE_COUNT - used;
+            fsck_repaired("set the inode count of the super block\n");
+        }
+    }
+}
+
+/* @return          NULL if the geometry in the super block is the one format
+ *                  lays out for an image of @size bytes, else what is wrong
+ *                  with it */
+
+static const char * fsck_super_problem(offset_t size) {
+    if (fsck_super.magic != FS_MAGIC)
+        return "no fs magic";
+    if (fsck_super.version != FS_VERSION)
+        return "another version of the format";
+    if (BLK_SIZE < BLK_SIZE_MIN || BLK_SIZE > BLK_SIZE_MAX || (BLK_SIZE & (BLK_SIZE - 1)) != 0 ||
+        sizeof(inode_t) > BLK_SIZE)
+        return "a bad block size";
+    if (FS_SIZE != (offset_t) BLK_COUNT * BLK_SIZE || FS_SIZE > size)
+        return "a size larger than the image";
+    if (INODE_COUNT < 2 || fsck_super.root != ROOT_INODE_NUMBER ||
+        fsck_super.snapshots != SNAPSHOTS_INODE_NUMBER ||
+        fsck_super.inode_list != BLK_RESERVED_COUNT ||
+        BLK_BITMAP_ADDR != (offset_t) (fsck_super.inode_list + BLK_INODE_COUNT) * BLK_SIZE ||
+        fsck_super.share_start != fsck_super.inode_list + BLK_INODE_COUNT + BLK_BITMAP_COUNT ||
+        BLK_JOURNAL_START != fsck_super.share_start + BLK_SHARES_COUNT ||
+        BLK_DATA_START != BLK_JOURNAL_START + BLK_JOURNAL_COUNT ||
+        BLK_DATA_START >= BLK_COUNT || BLK_DATA_START + BLK_DATA_COUNT != BLK_COUNT)
+        return "a bad layout";
+
+    return NULL;
+}
+
+/* @return          true if the journal holds a whole transaction, which the
+ *                  next mount replays; a torn one is ignored by the mount as
+ *                  it is here (see journal_replay()) */
+
+static bool fsck_journal_pending(void) {
+    journal_header_t * header = (journal_header_t *) (map + BLK_POS(BLK_JOURNAL_START));
+    journal_descriptor_t * desc = (journal_descriptor_t *) (map + BLK_POS(BLK_JOURNAL_START + 1));
+    journal_commit_t * commit;
+
+    if (header->magic != JOURNAL_MAGIC || desc->magic != JOURNAL_MAGIC || desc->sequence != header->sequence ||
+        desc->count == 0 || desc->count > BLK_JOURNAL_COUNT - 3 || desc->count > JOURNAL_DESC_MAX)
+        return false;
+
+    commit = (journal_commit_t *) (map + BLK_POS(BLK_JOURNAL_START + 2 + desc->count));
+    return commit->magic == JOURNAL_MAGIC && commit->sequence == header->sequence &&
+           commit->checksum == fsck_journal_checksum(desc, (size_t) (desc->count + 1) * BLK_SIZE);
+}
+
+int main(int argc, char * argv[]) {
+    unsigned long found, left;
+    struct stat st;
+    const char * problem;
+    long used;
+    int opt, fd;
+
+    thread_count = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+
+    while ((opt = getopt(argc, argv, "rj:")) != -1) {
+        switch (opt) {
+        case 'r':
+            repair = true;
+            break;
+        case 'j':
+            thread_count = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+            return 8;
+        }
+    }
+
+    if (argc - optind != 1 || thread_count == 0) {
+        usage();
+        return 8;
+    }
+
+    fd = open(argv[optind], repair ? O_RDWR : O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0 ||
+        pread(fd, &fsck_super, sizeof(super_block_t), BLK_SUPER_ADDR) != sizeof(super_block_t)) {
+        fprintf(stderr, "fsck: cannot read %s: %s\n", argv[optind], strerror(errno));
+        return 8;
+    }
+
+    problem = fsck_super_problem(st.st_size);
+    if (problem != NULL) {
+        printf("super block: has %s\n", problem);
+        return 4;
+    }
+
+    map = (char *) mmap(NULL, FS_SIZE, repair ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "fsck: cannot map %s: %s\n", argv[optind], strerror(errno));
+        return 8;
+    }
+
+    if (fsck_journal_pending()) {
+        printf("journal: holds a transaction; mount the fs to replay it, then check it again\n");
+        return 8;
+    }
+
+    claims = (uint32_t *) malloc(BLK_DATA_COUNT * sizeof(uint32_t));
+    owned = (bitmap_word_t *) malloc(BITMAP_WORDS(BLK_DATA_COUNT) * sizeof(bitmap_word_t));
+    refs = (uint32_t *) malloc(INODE_COUNT * sizeof(uint32_t));
+    parents = (inumber_t *) malloc(INODE_COUNT * sizeof(inumber_t));
+    if (claims == NULL || owned == NULL || refs == NULL || parents == NULL) {
+        fprintf(stderr, "fsck: out of memory\n");
+        return 8;
+    }
+
+    /* the inode list is read through, one inode per block */
+    madvise(map + INODE_LIST_ADDR, (size_t) INODE_COUNT * BLK_SIZE, MADV_WILLNEED);
+
+    used = fsck_inodes();
+    left = problems;
+
+    /* the directories repaired, check again to find out what is left, and
+       which blocks are still claimed */
+    if (repair && used >= 0 && problems > 0) {
+        fsck_repair_tree();
+        found = problems;
+        problems = 0;
+        quiet = true;
+        used = fsck_inodes();
+        quiet = false;
+        left = problems;
+        problems = found;
+    }
+
+    /* these are all repaired, if repairing */
+    if (used >= 0) {
+        found = problems;
+        fsck_shares();
+        fsck_bitmap();
+        fsck_counters(used);
+        if (! repair)
+            left += problems - found;
+    }
+
+    if (repair && msync(map, FS_SIZE, MS_SYNC) != 0) {
+        fprintf(stderr, "fsck: cannot write %s: %s\n", argv[optind], strerror(errno));
+        return 8;
+    }
+
+    printf("%s: %lu inodes in use, %lu problems, %lu repaired\n", argv[optind],
+           used >= 0 ? (unsigned long) used : 0, problems, repaired);
+
+    munmap(map, FS_SIZE);
+    close(fd);
+
+    if (problems == 0)
+        return 0;
+    return left == 0 ? 1 : 4;
+}
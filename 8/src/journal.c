@@ -0,0 +1,375 @@
+#include "params.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "structs.h"
+#include "logger.h"
+#include "macros.h"
+#include "bitmap.h"
+#include "cache.h"
+#include "journal.h"
+
+/* the journal of the mounted fs */
+#define JOURNAL (BB_DATA->journal)
+
+/* byte offset of block no. @i of the journal */
+#define JOURNAL_POS(i) BLK_POS(BLK_JOURNAL_START + (i))
+
+/* internal function prototypes */
+
+uint32_t journal_checksum(uint32_t hash, const void * buf, size_t len);
+int journal_header_write(int fd, uint32_t sequence);
+int pread_all(int fd, void * buf, size_t len, offset_t pos);
+int pwrite_all(int fd, const void * buf, size_t len, offset_t pos);
+
+int journal_replay(int fd) {
+    journal_header_t header;
+    journal_descriptor_t * desc;
+    journal_commit_t * commit;
+    blk_addr_t * addrs;
+    char * buf;
+    unsigned int i;
+    int ret = 0;
+
+    if (BLK_JOURNAL_COUNT == 0)
+        return 0;
+
+    if (pread_all(fd, &header, sizeof(header), JOURNAL_POS(0)) != 0)
+        return -EIO;
+    if (header.magic != JOURNAL_MAGIC)
+        return 0;
+
+    /* the descriptor block tells how long the transaction is */
+    buf = malloc((size_t) BLK_JOURNAL_COUNT * BLK_SIZE);
+    if (buf == NULL)
+        return -EIO;
+
+    desc = (journal_descriptor_t *) buf;
+    addrs = (blk_addr_t *) (desc + 1);
+
+    if (pread_all(fd, buf, BLK_SIZE, JOURNAL_POS(1)) != 0) {
+        ret = -EIO;
+        goto out;
+    }
+    if (desc->magic != JOURNAL_MAGIC || desc->sequence != header.sequence ||
+        desc->count == 0 || desc->count > BLK_JOURNAL_COUNT - 3 || desc->count > JOURNAL_DESC_MAX)
+        goto out;
+
+    if (pread_all(fd, buf + BLK_SIZE, (size_t) (desc->count + 1) * BLK_SIZE, JOURNAL_POS(2)) != 0) {
+        ret = -EIO;
+        goto out;
+    }
+
+    /* a transaction counts only if all of it made it to the journal */
+    commit = (journal_commit_t *) (buf + (size_t) (desc->count + 1) * BLK_SIZE);
+    if (commit->magic != JOURNAL_MAGIC || commit->sequence != header.sequence ||
+        commit->checksum != journal_checksum(2166136261u, buf, (size_t) (desc->count + 1) * BLK_SIZE))
+        goto out;
+
+    for (i = 0; i < desc->count; i++) {
+        if (addrs[i] >= BLK_COUNT ||
+            pwrite_all(fd, buf + (size_t) (i + 1) * BLK_SIZE, BLK_SIZE, BLK_POS(addrs[i])) != 0) {
+            ret = -EIO;
+            goto out;
+        }
+    }
+
+    /* the transaction is in place now, so retire it */
+    if (fsync(fd) != 0 || journal_header_write(fd, header.sequence + 1) != 0) {
+        ret = -EIO;
+        goto out;
+    }
+
+    log_info("journal: replayed transaction %u, %u blocks\n", header.sequence, desc->count);
+    ret = 1;
+
+ out:
+    free(buf);
+    return ret;
+}
+
+int journal_init(int fd) {
+    journal_t * journal;
+    journal_header_t header;
+
+    if (BLK_JOURNAL_COUNT == 0)
+        return 0;
+
+    if (pread_all(fd, &header, sizeof(header), JOURNAL_POS(0)) != 0)
+        return -EIO;
+
+    journal = (journal_t *) calloc(1, sizeof(journal_t));
+    if (journal == NULL)
+        return -ENOMEM;
+
+    journal->blocks = (blk_addr_t *) malloc(JOURNAL_TXN_MAX * sizeof(blk_addr_t));
+    journal->dirty = (bitmap_word_t *) calloc(BITMAP_WORDS(BLK_COUNT), sizeof(bitmap_word_t));
+    if (journal->blocks == NULL || journal->dirty == NULL) {
+        free(journal->blocks);
+        free(journal->dirty);
+        free(journal);
+        return -ENOMEM;
+    }
+
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_cond_init(&journal->cond, NULL);
+    journal->fd = fd;
+    journal->sequence = header.magic == JOURNAL_MAGIC ? header.sequence : 1;
+
+    JOURNAL = journal;
+    return 0;
+}
+
+void journal_destroy(void) {
+    if (JOURNAL == NULL)
+        return;
+
+    pthread_mutex_destroy(&JOURNAL->lock);
+    pthread_cond_destroy(&JOURNAL->cond);
+    free(JOURNAL->blocks);
+    free(JOURNAL->dirty);
+    free(JOURNAL);
+    JOURNAL = NULL;
+}
+
+void journal_start(void) {
+    if (JOURNAL == NULL)
+        return;
+
+    pthread_mutex_lock(&JOURNAL->lock);
+    while (JOURNAL->committing)
+        pthread_cond_wait(&JOURNAL->cond, &JOURNAL->lock);
+    JOURNAL->handles++;
+    pthread_mutex_unlock(&JOURNAL->lock);
+}
+
+bool journal_stop(void) {
+    bool full;
+
+    if (JOURNAL == NULL)
+        return false;
+
+    pthread_mutex_lock(&JOURNAL->lock);
+    if (--JOURNAL->handles == 0)
+        pthread_cond_broadcast(&JOURNAL->cond);
+
+    /* commit while there is still room for the next operations */
+    full = ! JOURNAL->committing && (JOURNAL->overflow || JOURNAL->count >= JOURNAL_TXN_MAX / 2);
+    pthread_mutex_unlock(&JOURNAL->lock);
+
+    return full;
+}
+
+void journal_dirty(offset_t pos, size_t len) {
+    blk_addr_t addr, last;
+
+    if (JOURNAL == NULL || len == 0)
+        return;
+
+    pthread_mutex_lock(&JOURNAL->lock);
+
+    last = (pos + len - 1) / BLK_SIZE;
+    for (addr = pos / BLK_SIZE; addr <= last; addr++) {
+        if (bitmap_test(JOURNAL->dirty, addr))
+            continue;
+
+        /* an operation which changes more blocks than a transaction can hold,
+           or than the cache can keep pinned in one shard, cannot be made
+           atomic; its blocks are written in place */
+        if (JOURNAL->count == JOURNAL_TXN_MAX || ! cache_pin(addr)) {
+            JOURNAL->overflow = true;
+            break;
+        }
+
+        bitmap_set(JOURNAL->dirty, addr, 1);
+        JOURNAL->blocks[JOURNAL->count++] = addr;
+    }
+
+    pthread_mutex_unlock(&JOURNAL->lock);
+}
+
+void journal_freeze(void) {
+    if (JOURNAL == NULL)
+        return;
+
+    pthread_mutex_lock(&JOURNAL->lock);
+
+    /* one commit at a time */
+    while (JOURNAL->committing)
+        pthread_cond_wait(&JOURNAL->cond, &JOURNAL->lock);
+    JOURNAL->committing = true;
+
+    while (JOURNAL->handles > 0)
+        pthread_cond_wait(&JOURNAL->cond, &JOURNAL->lock);
+
+    pthread_mutex_unlock(&JOURNAL->lock);
+}
+
+int journal_commit(void) {
+    journal_descriptor_t * desc;
+    journal_commit_t * commit;
+    blk_addr_t * addrs;
+    unsigned int i, count;
+    char * buf = NULL;
+    int ret = 0;
+
+    if (JOURNAL == NULL)
+        return cache_flush();
+
+    /* the transaction cannot change any more: no operations are running, and
+       the committing thread is the only one which adds blocks now */
+    count = JOURNAL->count;
+
+    if (count > 0 && ! JOURNAL->overflow) {
+        buf = calloc(count + 2, BLK_SIZE);
+        if (buf == NULL) {
+            ret = -EIO;
+            goto out;
+        }
+
+        /* descriptor block, block copies and commit block, in one write */
+        desc = (journal_descriptor_t *) buf;
+        desc->magic = JOURNAL_MAGIC;
+        desc->sequence = JOURNAL->sequence;
+        desc->count = count;
+        addrs = (blk_addr_t *) (desc + 1);
+
+        for (i = 0; i < count; i++) {
+            addrs[i] = JOURNAL->blocks[i];
+            DISK_READ(BLK_POS(addrs[i]), buf + (size_t) (i + 1) * BLK_SIZE, BLK_SIZE);
+        }
+
+        commit = (journal_commit_t *) (buf + (size_t) (count + 1) * BLK_SIZE);
+        commit->magic = JOURNAL_MAGIC;
+        commit->sequence = JOURNAL->sequence;
+        commit->checksum = journal_checksum(2166136261u, buf, (size_t) (count + 1) * BLK_SIZE);
+
+        if (pwrite_all(JOURNAL->fd, buf, (size_t) (count + 2) * BLK_SIZE, JOURNAL_POS(1)) != 0 ||
+            fdatasync(JOURNAL->fd) != 0) {
+            ret = -EIO;
+            goto out;
+        }
+    }
+    else if (JOURNAL->overflow) {
+        log_info("journal: transaction %u too large, written in place\n", JOURNAL->sequence);
+    }
+
+    /* checkpoint: once the blocks are in place, the transaction is retired */
+    for (i = 0; i < count; i++)
+        cache_unpin(JOURNAL->blocks[i]);
+
+    if (cache_flush() != 0) {
+        ret = -EIO;
+        goto out;
+    }
+
+    if (count > 0 && ! JOURNAL->overflow) {
+        if (journal_header_write(JOURNAL->fd, JOURNAL->sequence + 1) != 0) {
+            ret = -EIO;
+            goto out;
+        }
+        JOURNAL->sequence++;
+    }
+
+ out:
+    free(buf);
+
+    /* a transaction which failed to commit stays running, so that it is
+       tried again with the next commit */
+    pthread_mutex_lock(&JOURNAL->lock);
+    if (ret == 0) {
+        for (i = 0; i < count; i++)
+            bitmap_clear(JOURNAL->dirty, JOURNAL->blocks[i], 1);
+        JOURNAL->count = 0;
+        JOURNAL->overflow = false;
+    }
+    else {
+        for (i = 0; i < count; i++)
+            cache_pin(JOURNAL->blocks[i]);
+    }
+    pthread_mutex_unlock(&JOURNAL->lock);
+
+    return ret;
+}
+
+void journal_thaw(void) {
+    if (JOURNAL == NULL)
+        return;
+
+    pthread_mutex_lock(&JOURNAL->lock);
+    JOURNAL->committing = false;
+    pthread_cond_broadcast(&JOURNAL->cond);
+    pthread_mutex_unlock(&JOURNAL->lock);
+}
+
+
+/* internal functions */
+
+/* FNV-1a hash of the @len bytes at @buf, continuing from @hash */
+
+uint32_t journal_checksum(uint32_t hash, const void * buf, size_t len) {
+    const unsigned char * p = buf;
+
+    while (len-- > 0)
+        hash = (hash ^ *p++) * 16777619u;
+
+    return hash;
+}
+
+/* write the journal header with the sequence no. @sequence, and sync it */
+
+int journal_header_write(int fd, uint32_t sequence) {
+    journal_header_t header;
+
+    header.magic = JOURNAL_MAGIC;
+    header.sequence = sequence;
+
+    if (pwrite_all(fd, &header, sizeof(header), JOURNAL_POS(0)) != 0 || fdatasync(fd) != 0)
+        return -EIO;
+
+    return 0;
+}
+
+/* read/write all the @len bytes at byte offset @pos of @fd, retrying short
+ * transfers
+ *
+ * @return          0 on success, else -EIO */
+
+int pread_all(int fd, void * buf, size_t len, offset_t pos) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = pread(fd, buf, len, pos);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -EIO;
+        buf = (char *) buf + n;
+        pos += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int pwrite_all(int fd, const void * buf, size_t len, offset_t pos) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = pwrite(fd, buf, len, pos);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -EIO;
+        buf = (const char *) buf + n;
+        pos += n;
+        len -= n;
+    }
+
+    return 0;
+}
@@ -0,0 +1,67 @@
+/* this header file exposes the metadata journal, which makes the changes of
+ * fs operations to metadata blocks reach the disk atomically */
+/* nothing else should go in here */
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <stdbool.h>
+
+#include "structs.h"
+
+/* replay the transaction left in the journal of the fs open as @fd, if it
+ * committed but was not checkpointed; this is done at mount, before anything
+ * else reads the fs
+ *
+ * @return          1 if a transaction was replayed, 0 if there was none, else
+ *                  -EIO */
+
+int journal_replay(int fd);
+
+/* start journaling the fs open as @fd; the block cache has to be set up
+ *
+ * @return          0 on success, else -ENOMEM or -EIO */
+
+int journal_init(int fd);
+
+/* stop journaling; the running transaction has to be committed first */
+
+void journal_destroy(void);
+
+/* bracket an fs operation which changes metadata, so that all its changes go
+ * into the same transaction; a transaction only commits when no operation is
+ * in progress. Operations may not nest.
+ *
+ * journal_stop() returns true if the running transaction has grown large
+ * enough that it should be committed now. */
+
+void journal_start(void);
+
+bool journal_stop(void);
+
+/* add the blocks holding the @len bytes at byte offset @pos on the fs to the
+ * running transaction; this has to be done before they are changed */
+
+void journal_dirty(offset_t pos, size_t len);
+
+/* wait for the operations in progress to finish, and hold off new ones, so
+ * that the last changes can be added to the running transaction before
+ * journal_commit() */
+
+void journal_freeze(void);
+
+/* commit the running transaction: write it to the journal with a single
+ * write, then write its blocks (and everything else in the block cache) to
+ * their place on disk. Operations are still held off afterwards, until
+ * journal_thaw(), so that what depends on the commit can be done before the
+ * next transaction starts.
+ *
+ * @return          0 on success, else -EIO */
+
+int journal_commit(void);
+
+/* let operations start again after journal_freeze() */
+
+void journal_thaw(void);
+
+#endif /* _JOURNAL_H_ */
@@ -1,9 +1,12 @@
 #include "params.h"
 
 #include <fuse.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/types.h>
@@ -12,23 +15,29 @@
 #include "logger.h"
 #include "config.h"
 
-void dump_file_table(table_entry_t ** table)
+void dump_file_table(file_table_t * table)
 {
     printf("\nDumping File table\n");
     int i;
-    for(i = 0;i<MAX_OPEN_FILES;i++)
+    for(i = 0;i<table->next_fd;i++)
         {
-            if(table[i] == NULL)
+            table_entry_t * entry = table->chunks[i / FILE_TABLE_CHUNK][i % FILE_TABLE_CHUNK];
+            if(entry == NULL)
                 printf("%d : nil\n",i);
             else
 		{
-                    printf("%d : Occupied\n",i);
+                    printf("%d : Occupied by %u\n",i,entry->file->inode.inumber);
 		}
 	}
 }
 
 
 
+int log_level = LOG_LEVEL_DEFAULT;
+
+/* the ring messages go through once log_start() is called */
+static log_ring_t *ring = NULL;
+
 FILE *log_open()
 {
     FILE *logfile;
@@ -39,24 +48,183 @@ FILE *log_open()
 	exit(EXIT_FAILURE);
     }
 
-    setvbuf(logfile, NULL, _IOLBF, 0);
+    // the flusher thread writes out many messages at a time, so there is
+    // no point in flushing each line
+    setvbuf(logfile, NULL, _IOFBF, 0);
 
     return logfile;
 }
 
-void log_msg(const char *format, ...)
+int log_level_parse(const char *name)
+{
+    if (strcmp(name, "error") == 0)
+        return LOG_ERROR;
+    if (strcmp(name, "info") == 0)
+        return LOG_INFO;
+    if (strcmp(name, "debug") == 0)
+        return LOG_DEBUG;
+
+    return -1;
+}
+
+// The ring is a bounded queue of LOG_RING_SIZE records. A record at index
+// i (mod LOG_RING_SIZE) with seq == i is free for the writer which claims
+// position i, by moving head from i to i+1. The writer fills the record
+// in, and publishes it by setting seq to i+1. The flusher writes it out,
+// and hands it on to position i+LOG_RING_SIZE. Writers never wait for
+// one another, nor for the flusher: when the ring is full, the message is
+// dropped.
+
+void log_write(int level, const char *format, ...)
 {
+    log_record_t *rec;
+    unsigned long pos, seq;
     va_list ap;
+    int len;
+
+    (void) level;
+
     va_start(ap, format);
 
-    vfprintf(BB_DATA->logfile, format, ap);
+    if (ring == NULL) {
+        if (BB_DATA->logfile != NULL)
+            vfprintf(BB_DATA->logfile, format, ap);
+        va_end(ap);
+        return;
+    }
+
+    // claim the record at head
+    pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    for (;;) {
+        rec = &ring->records[pos & (LOG_RING_SIZE - 1)];
+        seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if ((long) (seq - pos) < 0) {
+            // the flusher has yet to write out the record from the last
+            // time round
+            __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+            va_end(ap);
+            return;
+        }
+        else
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    }
+
+    len = vsnprintf(rec->text, LOG_LINE_MAX, format, ap);
+    va_end(ap);
+    rec->len = len < 0 ? 0 : (len < LOG_LINE_MAX ? len : LOG_LINE_MAX - 1);
+
+    __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+// write out the records published since the last time, in order
+//
+// @return          no. of records written
+static unsigned long log_drain(void)
+{
+    log_record_t *rec;
+    unsigned long n = 0, dropped;
+
+    for (;;) {
+        rec = &ring->records[ring->tail & (LOG_RING_SIZE - 1)];
+        if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != ring->tail + 1)
+            break;
+
+        fwrite(rec->text, 1, rec->len, ring->file);
+        __atomic_store_n(&rec->seq, ring->tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        ring->tail++;
+        n++;
+    }
+
+    dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+    if (dropped > 0)
+        fprintf(ring->file, "[%lu messages dropped]\n", dropped);
+
+    if (n > 0 || dropped > 0)
+        fflush(ring->file);
+
+    return n;
+}
+
+static void *log_flusher(void *arg)
+{
+    struct timespec delay = { 0, LOG_FLUSH_MS * 1000000L };
+    bool stop;
+
+    (void) arg;
+
+    for (;;) {
+        // look at the flag first, so that the messages logged before it
+        // was set are all written out by the last drain
+        stop = __atomic_load_n(&ring->stop, __ATOMIC_ACQUIRE);
+        if (log_drain() == 0) {
+            if (stop)
+                break;
+            nanosleep(&delay, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+int log_start(FILE *file)
+{
+    log_ring_t *r;
+    unsigned long i;
+
+    if (ring != NULL || file == NULL)
+        return -1;
+
+    // without the memory for the ring, messages are written as they are
+    // logged
+    r = (log_ring_t *) calloc(1, sizeof(log_ring_t));
+    if (r == NULL)
+        return -1;
+    r->records = (log_record_t *) malloc(LOG_RING_SIZE * sizeof(log_record_t));
+    if (r->records == NULL) {
+        free(r);
+        return -1;
+    }
+    for (i = 0; i < LOG_RING_SIZE; i++)
+        r->records[i].seq = i;
+    r->file = file;
+    ring = r;
+
+    if (pthread_create(&ring->thread, NULL, log_flusher, NULL) != 0) {
+        free(ring->records);
+        free(ring);
+        ring = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+void log_stop(void)
+{
+    log_ring_t *r = ring;
+
+    if (r == NULL)
+        return;
+
+    __atomic_store_n(&r->stop, true, __ATOMIC_RELEASE);
+    pthread_join(r->thread, NULL);
+
+    ring = NULL;
+    free(r->records);
+    free(r);
 }
 
 // struct fuse_file_info keeps information about files (surprise!).
 // This dumps all the information in a struct fuse_file_info.  The struct
 // definition, and comments, come from /usr/include/fuse/fuse_common.h
 // Duplicated here for convenience.
-void log_fi (struct fuse_file_info *fi)
+void log_dump_fi(struct fuse_file_info *fi)
 {
     /** Open flags.  Available in open() and release() */
     //	int flags;
@@ -96,7 +264,7 @@ void log_fi (struct fuse_file_info *fi)
 
 // This dumps the info from a struct stat.  The struct is defined in
 // <bits/stat.h>; this is indirectly included from <fcntl.h>
-void log_stat(struct stat *si)
+void log_dump_stat(struct stat *si)
 {
     //  dev_t     st_dev;     /* ID of device containing file */
     log_struct(si, st_dev, %lld, );
@@ -139,7 +307,7 @@ void log_stat(struct stat *si)
 
 }
 
-void log_statvfs(struct statvfs *sv)
+void log_dump_statvfs(struct statvfs *sv)
 {
     //  unsigned long  f_bsize;    /* file system block size */
     log_struct(sv, f_bsize, %ld, );
@@ -176,7 +344,7 @@ void log_statvfs(struct statvfs *sv)
 
 }
 
-void log_utime(struct utimbuf *buf)
+void log_dump_utime(struct utimbuf *buf)
 {
     //    time_t actime;
     log_struct(buf, actime, 0x%08lx, );
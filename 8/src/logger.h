@@ -8,18 +8,63 @@
 #include "structs.h"
 #include "config.h"
 
-void dump_file_table(table_entry_t ** tableptr);
+/* log levels; a message is logged if its level is at most both the level set
+   at run time (log_level) and the one compiled in (LOG_LEVEL_MAX, see
+   config.h) */
+#define LOG_ERROR 0
+#define LOG_INFO 1
+#define LOG_DEBUG 2             /* a trace of every call */
+
+extern int log_level;
+
+/* true if messages of @level are logged; when @level is above LOG_LEVEL_MAX,
+   this is a constant false, and the code it guards is compiled out */
+#define log_enabled(level) ((level) <= LOG_LEVEL_MAX && (level) <= log_level)
+
+/* log a message of @level; the arguments are only evaluated if it is
+   logged */
+#define log_at(level, ...) (log_enabled(level) ? log_write(level, __VA_ARGS__) : (void) 0)
+
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define log_info(...) log_at(LOG_INFO, __VA_ARGS__)
+#define log_msg(...) log_at(LOG_DEBUG, __VA_ARGS__)
+
+void dump_file_table(file_table_t * table);
 
 //  macro to log fields in structs.
 #define log_struct(st, field, format, typecast)                         \
     log_msg("    " #field " = " #format "\n", typecast st->field)
 
+#define log_fi(fi) (log_enabled(LOG_DEBUG) ? log_dump_fi(fi) : (void) 0)
+#define log_stat(si) (log_enabled(LOG_DEBUG) ? log_dump_stat(si) : (void) 0)
+#define log_statvfs(sv) (log_enabled(LOG_DEBUG) ? log_dump_statvfs(sv) : (void) 0)
+#define log_utime(buf) (log_enabled(LOG_DEBUG) ? log_dump_utime(buf) : (void) 0)
+
 FILE *log_open(void);
-void log_fi (struct fuse_file_info *fi);
-void log_stat(struct stat *si);
-void log_statvfs(struct statvfs *sv);
-void log_utime(struct utimbuf *buf);
 
-void log_msg(const char *format, ...);
+/* parse the name of a log level ("error", "info" or "debug")
+ *
+ * @return          the level, else -1 */
+
+int log_level_parse(const char *name);
+
+/* start the flusher thread, which writes the messages logged from now on to
+ * @file in the background; until then, and after log_stop(), messages are
+ * written to BB_DATA->logfile as they are logged
+ *
+ * @return          0 on success, else -1 */
+
+int log_start(FILE *file);
+
+/* write out the messages left in the ring, and stop the flusher thread */
+
+void log_stop(void);
+
+void log_write(int level, const char *format, ...);
+
+void log_dump_fi(struct fuse_file_info *fi);
+void log_dump_stat(struct stat *si);
+void log_dump_statvfs(struct statvfs *sv);
+void log_dump_utime(struct utimbuf *buf);
 
 #endif //_LOGGER_H_
@@ -1,45 +1,110 @@
 #ifndef _MACROS_H_
 #define _MACROS_H_
 
+#include <string.h>
+
+#include "cache.h"
+#include "journal.h"
+
 /* convenience macros */
 
+/* all disk accesses below go through DISK_READ/DISK_WRITE: when the image is
+   mmapped (MOUNT_MMAP) they are plain copies to/from the mapping, else they go
+   through the block cache (see cache.h) */
+
+/* read @len bytes at byte offset @pos on the fs into @buf */
+#define DISK_READ(pos, buf, len) (BB_DATA->map != NULL ? (void) memcpy(buf, BB_DATA->map + (pos), len) : cache_read(pos, buf, len))
+
+/* write @len bytes from @buf at byte offset @pos on the fs */
+#define DISK_WRITE(pos, buf, len) (BB_DATA->map != NULL ? (void) memcpy(BB_DATA->map + (pos), buf, len) : cache_write(pos, buf, len))
+
+/* read @len bytes at byte offset @pos on the fs into @buf, with one read */
+#define DISK_READ_BULK(pos, buf, len) (BB_DATA->map != NULL ? (void) memcpy(buf, BB_DATA->map + (pos), len) : cache_read_bulk(pos, buf, len))
+
+/* start reading the @count blocks at @addr ahead of their use; the kernel
+   does the readahead for a mapped image */
+#define DISK_PREFETCH(addr, count) (BB_DATA->map != NULL ? (void) 0 : cache_prefetch(addr, count))
+
+/* write @len bytes of metadata from @buf at byte offset @pos on the fs, as
+   part of the running journal transaction (see journal.h) */
+#define META_WRITE(pos, buf, len) (journal_dirty(pos, len), DISK_WRITE(pos, buf, len))
+
+/* fill the block at @addr with zeroes */
+#define DISK_ZERO(addr) (BB_DATA->map != NULL ? (void) memset(BB_DATA->map + BLK_POS(addr), 0, BLK_SIZE) : cache_zero(addr))
+
 /* Get the ceil integer of an integer/integer division  */
-#define CEIL(a,b) ((a%b)==0 ? (a/b) : ((a/b) + 1))
+#define CEIL(a,b) (((a)%(b))==0 ? ((a)/(b)) : (((a)/(b)) + 1))
 
 /* Write the superblock to disk */
-#define SUPER_BLOCK_WRITE(super_blk) BLK_SEEK(BLK_SUPER_ADDR), fwrite(super_blk, sizeof(super_block_t), 1, BB_DATA->fs)
+#define SUPER_BLOCK_WRITE(super_blk) META_WRITE(BLK_SUPER_ADDR, super_blk, sizeof(super_block_t))
 
-/* seek to the block given by @addr (which is a blk_addr_t) */
-#define BLK_SEEK(addr) fseek(BB_DATA->fs, (addr) * BLK_SIZE, SEEK_SET)
+/* byte offset of the block given by @addr (which is a blk_addr_t) */
+#define BLK_POS(addr) ((offset_t) (addr) * BLK_SIZE)
 
 /* read the data block at @addr into @block (must be of type void *) */
-#define BLK_READ_DATA(addr, block) BLK_SEEK(addr), fread(block, BLK_SIZE, 1, BB_DATA->fs)
+#define BLK_READ_DATA(addr, block) DISK_READ(BLK_POS(addr), block, BLK_SIZE)
 
 /* read the indirect block at @addr into @block (must be of type blk_addr_t[]) */
-#define BLK_READ_INDIRECT(addr, block) BLK_SEEK(addr), fread(block, sizeof(blk_addr_t), MAX_ADDR_PER_BLOCK, BB_DATA->fs)
+#define BLK_READ_INDIRECT(addr, block) DISK_READ(BLK_POS(addr), block, sizeof(blk_addr_t) * MAX_ADDR_PER_BLOCK)
 
 /* write the data block @block (of type void *) to disk, at block address @addr */
-#define BLK_WRITE_DATA(addr, block) BLK_SEEK(addr), fwrite(block, BLK_SIZE, 1, BB_DATA->fs)
+#define BLK_WRITE_DATA(addr, block) DISK_WRITE(BLK_POS(addr), block, BLK_SIZE)
 
 /* write the indirect block @block (of type blk_addr_t[]) to disk, at block address @addr */
-#define BLK_WRITE_INDIRECT(addr, block) BLK_SEEK(addr), fwrite(block, sizeof(blk_addr_t), MAX_ADDR_PER_BLOCK, BB_DATA->fs)
+#define BLK_WRITE_INDIRECT(addr, block) META_WRITE(BLK_POS(addr), block, sizeof(blk_addr_t) * MAX_ADDR_PER_BLOCK)
 
 /* write the inode block @block (of type inode_t *) to disk, at block address @addr */
-#define BLK_WRITE_INODE(addr, block) BLK_SEEK(addr), fwrite(block, sizeof(inode_t), 1, BB_DATA->fs)
+#define BLK_WRITE_INODE(addr, block) META_WRITE(BLK_POS(addr), block, sizeof(inode_t))
 
-/* seek to an inode on the fs, given its inumber */
-#define INODE_SEEK(i) fseek(BB_DATA->fs, INODE_LIST_ADDR + (i-1) * BLK_SIZE, SEEK_SET)
+/* maximum no. of blocks of the file represented by @inode (an inode_t *) */
+#define INODE_BLKS_MAX(inode) (((inode)->flags & INODE_F_EXTENTS) ? (offset_t) BLK_COUNT : (offset_t) FILE_BLKS_MAX)
 
-/* seek to inode @i and read it into @inode (which is a pointer to inode_t) */
-#define INODE_READ(i, inode) INODE_SEEK(i), fread(inode, sizeof(inode_t), 1, BB_DATA->fs)
+/* maximum size of the file represented by @inode (an inode_t *) */
+#define INODE_SIZE_MAX(inode) ((offset_t) BLK_SIZE * INODE_BLKS_MAX(inode))
 
-/* seek to inode @i and write @inode into it (which is a pointer to inode_t) */
-#define INODE_WRITE(i, inode) INODE_SEEK(i), fwrite(inode, sizeof(inode_t), 1, BB_DATA->fs)
+/* no. of blocks @extent (an extent_t *) takes on disk */
+#define EXTENT_BLKS(extent) ((extent)->stored != 0 ? (extent)->stored : (extent)->len)
 
-/* read the directory block at @addr into the file_entry_t array @dir */
-#define DIR_BLOCK_READ(dir, addr) BLK_SEEK(addr), fread(dir, sizeof(file_entry_t), MAX_FILES_PER_BLOCK, BB_DATA->fs)
+/* the block address block_map_range() gives the blocks of a compressed
+   cluster, which have none of their own */
+#define BLK_ADDR_COMPRESSED ((blk_addr_t) -1)
+
+/* byte offset of extent no. @i of @inode (an inode_t *), for
+   @i >= INODE_EXTENTS, in its extent blocks */
+#define EXTENT_POS(inode, i) (BLK_POS((inode)->extent_blocks[((i) - INODE_EXTENTS) / EXTENTS_PER_BLOCK]) + \
+                              ((i) - INODE_EXTENTS) % EXTENTS_PER_BLOCK * sizeof(extent_t))
+
+/* byte offset of an inode on the fs, given its inumber */
+#define INODE_POS(i) (INODE_LIST_ADDR + ((i)-1) * BLK_SIZE)
+
+/* byte offset of the inline data of inode @i (see INODE_F_INLINE) */
+#define INODE_INLINE_POS(i) (INODE_POS(i) + sizeof(inode_t))
+
+/* read inode @i into @inode (which is a pointer to inode_t), from the
+   in-memory inode table */
+#define INODE_READ(i, inode) inode_table_read(i, inode)
+
+/* write @inode (which is a pointer to inode_t) into inode @i; this only
+   updates the in-memory inode table, and the inode reaches the disk on the
+   next inode_table_flush() */
+#define INODE_WRITE(i, inode) inode_table_write(i, inode)
+
+/* take the lock on the contents (data, size and block map) of inode @i
+   shared, for reading, or exclusive, for writing; and release it */
+#define INODE_RDLOCK(i) pthread_rwlock_rdlock(&BB_DATA->inode_locks[(i) - 1])
+#define INODE_WRLOCK(i) pthread_rwlock_wrlock(&BB_DATA->inode_locks[(i) - 1])
+#define INODE_UNLOCK(i) pthread_rwlock_unlock(&BB_DATA->inode_locks[(i) - 1])
 
 /* read the directory block at @addr into the file_entry_t array @dir */
-#define DIR_BLOCK_WRITE(dir, addr) BLK_SEEK(addr), fwrite(dir, sizeof(file_entry_t), MAX_FILES_PER_BLOCK, BB_DATA->fs)
+#define DIR_BLOCK_READ(dir, addr) DISK_READ(BLK_POS(addr), dir, sizeof(file_entry_t) * MAX_FILES_PER_BLOCK)
+
+/* write the file_entry_t array @dir into the directory block at @addr */
+#define DIR_BLOCK_WRITE(dir, addr) META_WRITE(BLK_POS(addr), dir, sizeof(file_entry_t) * MAX_FILES_PER_BLOCK)
+
+/* read the directory index block at @addr into the dir_index_t array @index */
+#define DIR_INDEX_READ(index, addr) DISK_READ(BLK_POS(addr), index, sizeof(dir_index_t) * (DIR_INDEX_MAX + 1))
+
+/* write the directory index block @index to disk, at block address @addr */
+#define DIR_INDEX_WRITE(index, addr) META_WRITE(BLK_POS(addr), index, sizeof(dir_index_t) * (DIR_INDEX_MAX + 1))
 
 #endif /* _MACROS_H_ */
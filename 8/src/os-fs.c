@@ -16,23 +16,96 @@
 
 #include "fs_functions.h"
 #include "logger.h"
+#include "stats.h"
 
 // Report errors to logfile and give -errno to caller
 static int bb_error(char *str)
 {
     int ret = -errno;
 
-    log_msg("    ERROR %s: %s\n", str, strerror(errno));
+    log_error("    ERROR %s: %s\n", str, strerror(errno));
 
     return ret;
 }
 
-int bb_getattr(const char *path, struct stat *statbuf)
+// Fill in the attributes of @inode; shared by bb_getattr() and bb_readdir()
+static void bb_inode_stat(const inode_t *inode, struct stat *statbuf)
 {
-    int retstat = 0;
+    if (inode->attr.type == DIR_T) {
+        statbuf->st_mode = S_IFDIR | 0755;
+    }
+    else if (inode->attr.type == FILE_T) {
+        statbuf->st_mode = S_IFREG | 0644;
+        statbuf->st_size = inode->attr.size;
+    }
 
-    log_msg("\nbb_getattr(path=\"%s\", statbuf=0x%08x)\n",
-	  path, statbuf);
+    statbuf->st_ino = inode->inumber;
+
+    statbuf->st_uid = getuid();
+
+    statbuf->st_gid = getgid();
+
+    statbuf->st_atime = inode->attr.creation_time;
+
+    statbuf->st_ctime = inode->attr.creation_time;
+
+    statbuf->st_mtime = inode->attr.creation_time;
+}
+
+// The statistics are read from the virtual file STATS_PATH, which is not in
+// any directory.  Opening it takes a snapshot of them as text, which reads
+// of the open file then return; fi->fh points to the snapshot.
+static int bb_is_stats(const char *path)
+{
+    return path != NULL && strcmp(path, STATS_PATH) == 0;
+}
+
+static int bb_stats_open(struct fuse_file_info *fi)
+{
+    char *text;
+    int len;
+
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+	return -EACCES;
+
+    len = stats_print(NULL, 0);
+    text = (char *) malloc(len + 1);
+    if (text == NULL)
+	return -ENOMEM;
+    stats_print(text, len + 1);
+
+    // its size is not known to stat(), so it has to be read directly
+    fi->direct_io = 1;
+    fi->fh = (uintptr_t) text;
+
+    return 0;
+}
+
+static int bb_stats_read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    const char *text = (const char *) (uintptr_t) fi->fh;
+    size_t len = strlen(text);
+
+    if ((size_t) offset >= len)
+	return 0;
+    if (size > len - offset)
+	size = len - offset;
+    memcpy(buf, text + offset, size);
+
+    return size;
+}
+
+// The work of bb_getattr() and bb_fgetattr(), which each count it under
+// their own operation in the statistics
+static int bb_getattr_path(const char *path, struct stat *statbuf)
+{
+    if (bb_is_stats(path)) {
+        memset(statbuf, 0, sizeof(struct stat));
+        statbuf->st_mode = S_IFREG | 0444;
+        statbuf->st_uid = getuid();
+        statbuf->st_gid = getgid();
+        return 0;
+    }
 
     inode_t inode;
     inumber_t inumber;
@@ -44,33 +117,26 @@ int bb_getattr(const char *path, struct stat *statbuf)
         return -ENOENT;
     }
 
-    if (inode.attr.type == DIR_T) {
-        statbuf->st_mode = S_IFDIR | 0755;
-    }
-    else if (inode.attr.type == FILE_T) {
-        statbuf->st_mode = S_IFREG | 0644;
-        statbuf->st_size = inode.attr.size;
-    }
-
-    statbuf->st_ino = inode.inumber;
-
-    statbuf->st_uid = getuid();
-
-    statbuf->st_gid = getgid();
+    bb_inode_stat(&inode, statbuf);
 
-    statbuf->st_atime = inode.attr.creation_time;
+    log_stat(statbuf);
 
-    statbuf->st_ctime = inode.attr.creation_time;
+    return 0;
+}
 
-    statbuf->st_mtime = inode.attr.creation_time;
+int bb_getattr(const char *path, struct stat *statbuf)
+{
+    uint64_t start = stats_start();
 
-    log_stat(statbuf);
+    log_msg("\nbb_getattr(path=\"%s\", statbuf=0x%08x)\n",
+	  path, statbuf);
 
-    return retstat;
+    return stats_end(STATS_OP_GETATTR, start, bb_getattr_path(path, statbuf));
 }
 
 int bb_readlink(const char *path, char *link, size_t size)
 {
+    uint64_t start = stats_start();
     int retstat = 0;
 
     log_msg("bb_readlink(path=\"%s\", link=\"%s\", size=%d)\n",
@@ -83,11 +149,12 @@ int bb_readlink(const char *path, char *link, size_t size)
 	retstat = 0;
     }
 
-    return retstat;
+    return stats_end(STATS_OP_READLINK, start, retstat);
 }
 
 int bb_mknod(const char *path, mode_t mode, dev_t dev)
 {
+    uint64_t start = stats_start();
     int retstat = 0;
     char * mode_str;
 
@@ -104,11 +171,12 @@ int bb_mknod(const char *path, mode_t mode, dev_t dev)
     int fd = myopen(path, mode_str);
     myclose(fd);
 
-    return retstat;
+    return stats_end(STATS_OP_MKNOD, start, retstat);
 }
 
 int bb_mkdir(const char *path, mode_t mode)
 {
+    uint64_t start = stats_start();
     int retstat = 0;
 
     log_msg("\nbb_mkdir(path=\"%s\", mode=0%3o)\n",
@@ -117,11 +185,12 @@ int bb_mkdir(const char *path, mode_t mode)
     retstat = mymkdir(path);
     log_msg("mkdir returned: %d\n", retstat);
 
-    return retstat;
+    return stats_end(STATS_OP_MKDIR, start, retstat);
 }
 
 int bb_unlink(const char *path)
 {
+    uint64_t start = stats_start();
     int retstat = 0;
 
     log_msg("bb_unlink(path=\"%s\")\n",
@@ -133,11 +202,12 @@ int bb_unlink(const char *path)
     if (retstat < 0)
 	retstat = bb_error("bb_unlink unlink");
 
-    return retstat;
+    return stats_end(STATS_OP_UNLINK, start, retstat);
 }
 
 int bb_rmdir(const char *path)
 {
+    uint64_t start = stats_start();
     int retstat = 0;
 
     log_msg("bb_rmdir(path=\"%s\")\n",
@@ -148,11 +218,12 @@ int bb_rmdir(const char *path)
     if (retstat < 0)
 	retstat = bb_error("bb_rmdir rmdir");
 
-    return retstat;
+    return stats_end(STATS_OP_RMDIR, start, retstat);
 }
 
 int bb_symlink(const char *path, const char *link)
 {
+    uint64_t start = stats_start();
     int retstat = 0;
 
     log_msg("\nbb_symlink(path=\"%s\", link=\"%s\")\n",
@@ -162,11 +233,12 @@ int bb_symlink(const char *path, const char *link)
     if (retstat < 0)
 	retstat = bb_error("bb_symlink symlink");
 
-    return retstat;
+    return stats_end(STATS_OP_SYMLINK, start, retstat);
 }
 
 int bb_rename(const char *path, const char *newpath)
 {
+    uint64_t start = stats_start();
     int retstat = 0;
 
     log_msg("\nbb_rename(fpath=\"%s\", newpath=\"%s\")\n",
@@ -175,11 +247,12 @@ int bb_rename(const char *path, const char *newpath)
     if (retstat < 0)
 	retstat = bb_error("bb_rename rename");
 
-    return retstat;
+    return stats_end(STATS_OP_RENAME, start, retstat);
 }
 
 int bb_link(const char *path, const char *newpath)
 {
+    uint64_t start = stats_start();
     int retstat = 0;
 
     log_msg("\nbb_link(path=\"%s\", newpath=\"%s\")\n",
@@ -188,11 +261,12 @@ int bb_link(const char *path, const char *newpath)
     if (retstat < 0)
 	retstat = bb_error("bb_link link");
 
-    return retstat;
+    return stats_end(STATS_OP_LINK, start, retstat);
 }
 
 int bb_chmod(const char *path, mode_t mode)
 {
+    uint64_t start = stats_start();
     int retstat = 0;
 
     log_msg("\nbb_chmod(fpath=\"%s\", mode=0%03o)\n",
@@ -201,12 +275,13 @@ int bb_chmod(const char *path, mode_t mode)
     if (retstat < 0)
 	retstat = bb_error("bb_chmod chmod");
 
-    return retstat;
+    return stats_end(STATS_OP_CHMOD, start, retstat);
 }
 
 int bb_chown(const char *path, uid_t uid, gid_t gid)
 
 {
+    uint64_t start = stats_start();
     int retstat = 0;
 
     log_msg("\nbb_chown(path=\"%s\", uid=%d, gid=%d)\n",
@@ -215,14 +290,15 @@ int bb_chown(const char *path, uid_t uid, gid_t gid)
     if (retstat < 0)
 	retstat = bb_error("bb_chown chown");
 
-    return retstat;
+    return stats_end(STATS_OP_CHOWN, start, retstat);
 }
 
 int bb_truncate(const char *path, off_t newsize)
 {
+    uint64_t start = stats_start();
     int retstat = 0;
 
-    return 0;
+    return stats_end(STATS_OP_TRUNCATE, start, 0);
 
     log_msg("\nbb_truncate(path=\"%s\", newsize=%lld)\n",
 	    path, newsize);
@@ -230,14 +306,15 @@ int bb_truncate(const char *path, off_t newsize)
     if (retstat < 0)
 	bb_error("bb_truncate truncate");
 
-    return retstat;
+    return stats_end(STATS_OP_TRUNCATE, start, retstat);
 }
 
 int bb_utime(const char *path, struct utimbuf *ubuf)
 {
+    uint64_t start = stats_start();
     int retstat = 0;
 
-    return 0;
+    return stats_end(STATS_OP_UTIME, start, 0);
 
     log_msg("\nbb_utime(path=\"%s\", ubuf=0x%08x)\n",
 	    path, ubuf);
@@ -245,17 +322,21 @@ int bb_utime(const char *path, struct utimbuf *ubuf)
     if (retstat < 0)
 	retstat = bb_error("bb_utime utime");
 
-    return retstat;
+    return stats_end(STATS_OP_UTIME, start, retstat);
 }
 
 int bb_open(const char *path, struct fuse_file_info *fi)
 {
+    uint64_t start = stats_start();
     int retstat = 0;
     int fd;
 
     log_msg("\nbb_open(path\"%s\", fi=0x%08x)\n",
 	    path, fi);
 
+    if (bb_is_stats(path))
+	return stats_end(STATS_OP_OPEN, start, bb_stats_open(fi));
+
     char * mode_str;
     mode_t mode = fi->flags;
     if (mode & O_RDONLY) {
@@ -270,11 +351,12 @@ int bb_open(const char *path, struct fuse_file_info *fi)
     fi->fh = fd;
     log_fi(fi);
 
-    return retstat;
+    return stats_end(STATS_OP_OPEN, start, retstat);
 }
 
 int bb_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
+    uint64_t start = stats_start();
     int retstat = 0;
 
     log_msg("\nbb_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
@@ -282,17 +364,23 @@ int bb_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_
     // no need to get fpath on this one, since I work from fi->fh not the path
     log_fi(fi);
 
-    retstat = myread(fi->fh, buf, size);
-    log_msg("myread: retstat = %d, size = %d, buf = %s\n", retstat, size, buf);
-    if (retstat < 0)
-	retstat = bb_error("bb_read read");
+    if (bb_is_stats(path))
+	return stats_end(STATS_OP_READ, start, bb_stats_read(buf, size, offset, fi));
 
-    return retstat;
+    retstat = mypread(fi->fh, buf, size, offset);
+    log_msg("mypread: retstat = %d, size = %d\n", retstat, size);
+    if (retstat < 0) {
+	errno = -retstat;
+	retstat = bb_error("bb_read pread");
+    }
+
+    return stats_end(STATS_OP_READ, start, retstat);
 }
 
 int bb_write(const char *path, const char *buf, size_t size, off_t offset,
 	     struct fuse_file_info *fi)
 {
+    uint64_t start = stats_start();
     int retstat = 0;
 
     log_msg("\nbb_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
@@ -300,43 +388,68 @@ int bb_write(const char *path, const char *buf, size_t size, off_t offset,
     // no need to get fpath on this one, since I work from fi->fh not the path
     log_fi(fi);
 
-    log_msg("mywrite: retstat = %d, size = %d, buf = %s\n", retstat, size, buf);
-    retstat = mywrite(fi->fh, strdup(buf), size);
-    log_msg("mywrite: retstat = %d, size = %d, buf = %s\n", retstat, size, buf);
+    retstat = mypwrite(fi->fh, buf, size, offset);
+    log_msg("mypwrite: retstat = %d, size = %d\n", retstat, size);
 
-    if (retstat < 0)
+    if (retstat < 0) {
+	errno = -retstat;
 	retstat = bb_error("bb_write pwrite");
+    }
 
-    return retstat;
+    return stats_end(STATS_OP_WRITE, start, retstat);
 }
 
 int bb_statfs(const char *path, struct statvfs *statv)
 {
+    uint64_t start = stats_start();
     int retstat = 0;
 
     log_msg("\nbb_statfs(path=\"%s\", statv=0x%08x)\n",
 	    path, statv);
 
+    // report the geometry recorded in the super block
+    memset(statv, 0, sizeof(struct statvfs));
+    statv->f_bsize = BLK_SIZE;
+    statv->f_frsize = BLK_SIZE;
+    statv->f_blocks = BLK_DATA_COUNT;
+    // the blocks reserved for delayed allocation are as good as used
+    statv->f_bfree = BB_DATA->super_blk->block_free_count - BB_DATA->blocks_reserved;
+    statv->f_bavail = BB_DATA->super_blk->block_free_count - BB_DATA->blocks_reserved;
+    statv->f_files = INODE_COUNT;
+    statv->f_ffree = BB_DATA->super_blk->inode_free_count;
+    statv->f_favail = BB_DATA->super_blk->inode_free_count;
+    statv->f_namemax = FILE_NAME_MAX;
+
     if (retstat < 0)
 	retstat = bb_error("bb_statfs statvfs");
 
     log_statvfs(statv);
 
-    return retstat;
+    return stats_end(STATS_OP_STATFS, start, retstat);
 }
 
 int bb_flush(const char *path, struct fuse_file_info *fi)
 {
+    uint64_t start = stats_start();
     int retstat = 0;
 
     log_msg("\nbb_flush(path=\"%s\", fi=0x%08x)\n", path, fi);
     log_fi(fi);
 
-    return retstat;
+    // close(2) returns what flush does, and not what release does, so the
+    // data the file held back is written out here, where its errors are seen
+    if (! bb_is_stats(path))
+	retstat = myflush(fi->fh);
+
+    if (retstat < 0)
+	log_error("    ERROR bb_flush: %s\n", strerror(-retstat));
+
+    return stats_end(STATS_OP_FLUSH, start, retstat);
 }
 
 int bb_release(const char *path, struct fuse_file_info *fi)
 {
+    uint64_t start = stats_start();
     int retstat = 0;
 
     log_msg("\nbb_release(path=\"%s\", fi=0x%08x)\n", path, fi);
@@ -344,32 +457,35 @@ int bb_release(const char *path, struct fuse_file_info *fi)
 
     // We need to close the file.  Had we allocated any resources
     // (buffers etc) we'd need to free them here as well.
-    myclose(fi->fh);
+    if (bb_is_stats(path))
+	free((char *) (uintptr_t) fi->fh);
+    else
+	retstat = myclose(fi->fh);
 
-    return retstat;
+    return stats_end(STATS_OP_RELEASE, start, retstat);
 }
 
 int bb_fsync(const char *path, int datasync, struct fuse_file_info *fi)
 {
+    uint64_t start = stats_start();
     int retstat = 0;
 
     log_msg("\nbb_fsync(path=\"%s\", datasync=%d, fi=0x%08x)\n",
 	    path, datasync, fi);
     log_fi(fi);
 
-    if (datasync)
-	retstat = fdatasync(fi->fh);
-    else
-	retstat = fsync(fi->fh);
+    (void) datasync;
+    retstat = myfsync(fi->fh);
 
     if (retstat < 0)
-	bb_error("bb_fsync fsync");
+	log_error("    ERROR bb_fsync fsync: %s\n", strerror(-retstat));
 
-    return retstat;
+    return stats_end(STATS_OP_FSYNC, start, retstat);
 }
 
 int bb_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
 {
+    uint64_t start = stats_start();
     int retstat = 0;
 
     log_msg("\nbb_setxattr(path=\"%s\", name=\"%s\", value=\"%s\", size=%d, flags=0x%08x)\n",
@@ -378,14 +494,15 @@ int bb_setxattr(const char *path, const char *name, const char *value, size_t si
     if (retstat < 0)
 	retstat = bb_error("bb_setxattr lsetxattr");
 
-    return retstat;
+    return stats_end(STATS_OP_SETXATTR, start, retstat);
 }
 
 int bb_getxattr(const char *path, const char *name, char *value, size_t size)
 {
+    uint64_t start = stats_start();
     int retstat = 0;
 
-    return 0;
+    return stats_end(STATS_OP_GETXATTR, start, 0);
 
     log_msg("\nbb_getxattr(path = \"%s\", name = \"%s\", value = 0x%08x, size = %d)\n",
 	    path, name, value, size);
@@ -395,11 +512,12 @@ int bb_getxattr(const char *path, const char *name, char *value, size_t size)
     else
 	log_msg("    value = \"%s\"\n", value);
 
-    return retstat;
+    return stats_end(STATS_OP_GETXATTR, start, retstat);
 }
 
 int bb_listxattr(const char *path, char *list, size_t size)
 {
+    uint64_t start = stats_start();
     int retstat = 0;
     char *ptr;
 
@@ -413,11 +531,12 @@ int bb_listxattr(const char *path, char *list, size_t size)
     for (ptr = list; ptr < list + retstat; ptr += strlen(ptr)+1)
 	log_msg("    \"%s\"\n", ptr);
 
-    return retstat;
+    return stats_end(STATS_OP_LISTXATTR, start, retstat);
 }
 
 int bb_removexattr(const char *path, const char *name)
 {
+    uint64_t start = stats_start();
     int retstat = 0;
 
     log_msg("\nbb_removexattr(path=\"%s\", name=\"%s\")\n", path, name);
@@ -425,11 +544,12 @@ int bb_removexattr(const char *path, const char *name)
     if (retstat < 0)
 	retstat = bb_error("bb_removexattr lrmovexattr");
 
-    return retstat;
+    return stats_end(STATS_OP_REMOVEXATTR, start, retstat);
 }
 
 int bb_opendir(const char *path, struct fuse_file_info *fi)
 {
+    uint64_t start = stats_start();
     int retstat = 0;
 
     log_msg("\nbb_opendir(path=\"%s\", fi=0x%08x)\n", path, fi);
@@ -439,73 +559,114 @@ int bb_opendir(const char *path, struct fuse_file_info *fi)
     fi->fh = 0;
 
     if (inode.inumber > 0 && inode.inumber < INODE_COUNT + 1) {
-        return 0;
+        return stats_end(STATS_OP_OPENDIR, start, 0);
     }
     else {
-        return -ENOENT;
+        return stats_end(STATS_OP_OPENDIR, start, -ENOENT);
     }
 
     log_fi(fi);
 
-    return retstat;
+    return stats_end(STATS_OP_OPENDIR, start, retstat);
+}
+
+// what bb_readdir_fill() needs to pass an entry on to FUSE
+struct bb_readdir_buf {
+    void *buf;
+    fuse_fill_dir_t filler;
+    off_t base;
+};
+
+// dir_filler_t for bb_readdir(); the offsets of "." and "..", and in the
+// root of the directory of snapshots, come before those of the entries in
+// the directory.  Each entry goes with its
+// attributes, from the inode the listing has at hand anyway.
+static int bb_readdir_fill(void *buf, const char *name, const inode_t *inode, offset_t next)
+{
+    struct bb_readdir_buf *rb = (struct bb_readdir_buf *) buf;
+    struct stat statbuf;
+
+    memset(&statbuf, 0, sizeof(statbuf));
+    bb_inode_stat(inode, &statbuf);
+
+    return rb->filler(rb->buf, name, &statbuf, next + rb->base);
 }
 
 int bb_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
 	       struct fuse_file_info *fi)
 {
+    uint64_t start = stats_start();
     int retstat = 0;
-    char *files[100];
-
-    files[0] = ".";
-    files[1] = "..";
+    struct bb_readdir_buf rb = { buf, filler, 2 };
+    struct stat statbuf;
+    inode_t inode;
 
     log_msg("\nbb_readdir(path=\"%s\", buf=0x%08x, filler=0x%08x, offset=%lld, fi=0x%08x)\n",
 	    path, buf, filler, offset, fi);
 
-    int i, count = myreaddir(path, &files[2]) + 2;
-
-    log_msg("count: %d, files[2]: %s\n", count, files[1]);
-
-    for (i = 0; i < count; i++) {
-        log_msg("calling filler with name %s\n", files[i]);
-        if (filler(buf, files[i], NULL, 0) != 0) {
-            log_msg("    ERROR bb_readdir filler:  buffer full");
-            return -ENOMEM;
+    // the entries are passed with their offsets, so that FUSE can come back
+    // for the rest at the offset where its buffer filled up
+    if (offset < 1 && filler(buf, ".", NULL, 1) != 0)
+        return stats_end(STATS_OP_READDIR, start, 0);
+    if (offset < 2 && filler(buf, "..", NULL, 2) != 0)
+        return stats_end(STATS_OP_READDIR, start, 0);
+
+    // the directory of snapshots is not an entry of the root, so that it is
+    // not in the snapshots; it is listed all the same
+    if (strcmp(path, "/") == 0) {
+        rb.base = 3;
+        memset(&statbuf, 0, sizeof(statbuf));
+        if (offset < 3 && get_inode_from_path("/" SNAPSHOTS_NAME, &inode) != 0) {
+            bb_inode_stat(&inode, &statbuf);
+            if (filler(buf, SNAPSHOTS_NAME, &statbuf, 3) != 0)
+                return stats_end(STATS_OP_READDIR, start, 0);
         }
     }
 
+    retstat = myreaddir(path, offset > rb.base ? offset - rb.base : 0, bb_readdir_fill, &rb);
+
     log_fi(fi);
 
-    return retstat;
+    return stats_end(STATS_OP_READDIR, start, retstat);
 }
 
 int bb_releasedir(const char *path, struct fuse_file_info *fi)
 {
+    uint64_t start = stats_start();
     int retstat = 0;
 
     log_msg("\nbb_releasedir(path=\"%s\", fi=0x%08x)\n", path, fi);
     log_fi(fi);
 
-    return retstat;
+    return stats_end(STATS_OP_RELEASEDIR, start, retstat);
 }
 
 int bb_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
 {
+    uint64_t start = stats_start();
     int retstat = 0;
 
     log_msg("\nbb_fsyncdir(path=\"%s\", datasync=%d, fi=0x%08x)\n", path, datasync, fi);
     log_fi(fi);
 
-    return retstat;
+    retstat = myfsync(fi->fh);
+
+    return stats_end(STATS_OP_FSYNCDIR, start, retstat);
 }
 
 void *bb_init(struct fuse_conn_info *conn)
 {
     (void) conn;
 
+    // FUSE has put the daemon in the background by now, so the flusher
+    // thread is started here rather than in main()
+    if (log_start(BB_DATA->logfile) != 0)
+	fprintf(stderr, "could not start the log flusher; logging synchronously\n");
+
     log_msg("\nbb_init()\n");
 
-    mymount(BB_DATA->rootdir);
+    if (mymount(BB_DATA->rootdir) < 0)
+	log_error("    ERROR bb_init: could not mount %s\n", BB_DATA->rootdir);
 
     return BB_DATA;
 }
@@ -515,10 +676,14 @@ void bb_destroy(void *userdata)
     log_msg("\nbb_destroy(userdata=0x%08x)\n", userdata);
 
     myunmount(BB_DATA->rootdir);
+
+    log_stop();
+    fflush(BB_DATA->logfile);
 }
 
 int bb_access(const char *path, int mask)
 {
+    uint64_t start = stats_start();
     int retstat = 0;
 
     log_msg("\nbb_access(path=\"%s\", mask=0%o)\n",
@@ -529,22 +694,18 @@ int bb_access(const char *path, int mask)
     if (retstat < 0)
 	retstat = bb_error("bb_access access");
 
-    return retstat;
+    return stats_end(STATS_OP_ACCESS, start, retstat);
 }
 
 int bb_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *fi)
 {
-    int retstat = 0;
+    uint64_t start = stats_start();
 
     log_msg("\nbb_fgetattr(path=\"%s\", statbuf=0x%08x, fi=0x%08x)\n",
 	    path, statbuf, fi);
     log_fi(fi);
 
-    return bb_getattr(path, statbuf);
-
-    log_stat(statbuf);
-
-    return retstat;
+    return stats_end(STATS_OP_FGETATTR, start, bb_getattr_path(path, statbuf));
 }
 
 struct fuse_operations bb_oper = {
@@ -587,10 +748,33 @@ struct fuse_operations bb_oper = {
 
 void bb_usage()
 {
-    fprintf(stderr, "usage: ./os-fs <fs> <mount_point>\n");
+    fprintf(stderr, "usage: ./os-fs [--mmap] [--compress] [--log=error|info|debug] <fs> <mount_point>\n");
     exit(-1);
 }
 
+// Pull our own options out of argv, since fuse_main would reject them
+static void bb_parse_opts(int *argc, char *argv[], struct bb_state *bb_data)
+{
+    int i, j;
+
+    for (i = 1, j = 1; i < *argc; i++) {
+	if (strcmp(argv[i], "--mmap") == 0)
+	    bb_data->mount_flags |= MOUNT_MMAP;
+	else if (strcmp(argv[i], "--compress") == 0)
+	    bb_data->mount_flags |= MOUNT_COMPRESS;
+	else if (strncmp(argv[i], "--log=", 6) == 0) {
+	    log_level = log_level_parse(argv[i] + 6);
+	    if (log_level < 0)
+		bb_usage();
+	}
+	else
+	    argv[j++] = argv[i];
+    }
+
+    argv[j] = NULL;
+    *argc = j;
+}
+
 int main(int argc, char *argv[])
 {
     int i;
@@ -610,6 +794,8 @@ int main(int argc, char *argv[])
 
     bb_data->logfile = log_open();
 
+    bb_parse_opts(&argc, argv, bb_data);
+
     for (i = 1; (i < argc) && (argv[i][0] == '-'); i++)
 	if (argv[i][1] == 'o') i++;
 
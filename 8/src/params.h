@@ -4,6 +4,9 @@
 #ifndef _PARAMS_H_
 #define _PARAMS_H_
 
+// need this to get fallocate() and SEEK_HOLE, before any system header
+#define _GNU_SOURCE
+
 #include "structs.h"
 
 // The FUSE API has been changed a number of times.  So, our code
@@ -14,19 +17,63 @@
 
 
 // need this to get pwrite().  I have to use setvbuf() instead of
-// setlinebuf() later in consequence.
+// setlinebuf() later in consequence.  _GNU_SOURCE implies it.
+#ifndef _XOPEN_SOURCE
 #define _XOPEN_SOURCE 500
+#endif
+
+// mount flags, kept in bb_state.mount_flags
+#define MOUNT_MMAP 0x1      /* mmap the image instead of using the block cache */
+#define MOUNT_COMPRESS 0x2  /* compress the files created (see INODE_F_COMPRESS) */
 
 // maintain bbfs state in here
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 struct bb_state {
     FILE *logfile;
     char *rootdir;
+    int mount_flags;
     super_block_t * super_blk;
     FILE * fs;
-    table_entry_t ** openFileTable;
+    block_cache_t * cache;
+    cluster_cache_t * clusters; /* decompressed clusters of compressed files */
+    journal_t * journal;    /* NULL if mounted with MOUNT_MMAP */
+    char * map;             /* the image, if mounted with MOUNT_MMAP */
+    uint64_t * block_bitmap;    /* in-memory copy of the free block bitmap */
+    unsigned long block_rotor;  /* bitmap index to start the next search at */
+    unsigned long blocks_reserved;  /* free blocks held for delayed allocation */
+    slab_t delalloc_blocks;         /* the memory of the data held back */
+    uint64_t * block_zero;      /* bit set if a free data block reads as zeroes */
+    uint64_t * block_freed;     /* bit set if freed since the last commit */
+    share_count_t * block_shares;   /* in-memory copy of the share table */
+    unsigned long blocks_shared;    /* sum of the share counts, so that files
+                                       need not look for shared blocks when
+                                       there are none */
+    unsigned long extents_moved;    /* times blocks of a file were moved (see
+                                       file_block_map()) */
+    inode_t * inode_table;      /* in-memory copy of all inodes */
+    uint64_t * inode_bitmap;    /* bit i-1 set if inode i is used */
+    uint64_t * inode_dirty;     /* bit i-1 set if inode i has to be written */
+    unsigned long inode_rotor;
+    dcache_entry_t * dcache;
+    file_table_t * file_table;
+    stats_t * stats;
+
+    /* FUSE calls the bb_* operations from several threads at once. The locks
+       below are always taken in this order (see fs_functions.c): */
+    pthread_rwlock_t ns_lock;           /* the directory tree */
+    pthread_rwlock_t * inode_locks;     /* contents of inode i, at i-1 */
+    pthread_mutex_t alloc_lock;         /* block/inode allocation, super block,
+                                           delayed allocation, share table */
+    pthread_mutex_t inode_table_lock;   /* inode table and its bitmaps */
+    pthread_mutex_t dcache_lock;
+    pthread_mutex_t file_table_lock;    /* file_table, and the open inodes' refcounts */
 };
 #define BB_DATA ((struct bb_state *) fuse_get_context()->private_data)
 
+// the super block of the mounted fs, which holds its geometry (see config.h)
+#define FS_SUPER (BB_DATA->super_blk)
+
 #endif
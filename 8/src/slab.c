@@ -0,0 +1,57 @@
+#include <stdlib.h>
+
+#include "slab.h"
+
+/* objects, and the header of a chunk, are aligned to SLAB_ALIGN bytes */
+#define SLAB_ALIGN 16
+#define SLAB_ROUND(n) (((n) + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN)
+
+void slab_init(slab_t * slab, size_t size, unsigned int per_chunk) {
+    /* a free object holds the link to the next one */
+    slab->size = SLAB_ROUND(size < sizeof(void *) ? sizeof(void *) : size);
+    slab->per_chunk = per_chunk;
+    slab->free = NULL;
+    slab->chunks = NULL;
+}
+
+void * slab_alloc(slab_t * slab) {
+    char * chunk, * object;
+    unsigned int i;
+
+    /* carve a new chunk into objects, and put them all on the free list */
+    if (slab->free == NULL) {
+        chunk = (char *) malloc(SLAB_ROUND(sizeof(void *)) + (size_t) slab->per_chunk * slab->size);
+        if (chunk == NULL)
+            return NULL;
+
+        *(void **) chunk = slab->chunks;
+        slab->chunks = chunk;
+
+        object = chunk + SLAB_ROUND(sizeof(void *));
+        for (i = 0; i < slab->per_chunk; i++, object += slab->size) {
+            *(void **) object = slab->free;
+            slab->free = object;
+        }
+    }
+
+    object = (char *) slab->free;
+    slab->free = *(void **) object;
+    return object;
+}
+
+void slab_free(slab_t * slab, void * object) {
+    *(void **) object = slab->free;
+    slab->free = object;
+}
+
+void slab_destroy(slab_t * slab) {
+    void * chunk, * next;
+
+    for (chunk = slab->chunks; chunk != NULL; chunk = next) {
+        next = *(void **) chunk;
+        free(chunk);
+    }
+
+    slab->free = NULL;
+    slab->chunks = NULL;
+}
@@ -0,0 +1,30 @@
+/* this header file exposes the slab allocator, which hands out objects of one
+ * size from large chunks, so that objects allocated and freed at a high rate
+ * cost neither a malloc() each nor fragmentation (see slab_t in structs.h) */
+/* nothing else should go in here */
+
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include "structs.h"
+
+/* none of the functions below lock anything; callers serialise the calls on
+ * the same slab */
+
+/* set up @slab for objects of @size bytes, allocated @per_chunk at a time */
+
+void slab_init(slab_t * slab, size_t size, unsigned int per_chunk);
+
+/* @return          an object, else NULL if out of memory */
+
+void * slab_alloc(slab_t * slab);
+
+/* give @object back to @slab, which it was allocated from */
+
+void slab_free(slab_t * slab, void * object);
+
+/* free all the memory of @slab, including the objects still in use */
+
+void slab_destroy(slab_t * slab);
+
+#endif /* _SLAB_H_ */
@@ -0,0 +1,208 @@
+#include "params.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+#include "cache.h"
+#include "compress.h"
+
+/* the statistics of the mounted fs */
+#define STATS (BB_DATA->stats)
+
+/* the latency histograms are log-linear, as in HdrHistogram: values below
+ * STATS_SUB_COUNT have a bucket each, and each power of 2 above that is split
+ * into STATS_SUB_COUNT equal buckets */
+
+static unsigned int stats_bucket(uint64_t value) {
+    unsigned int exp = 0;
+
+    if (value < STATS_SUB_COUNT)
+        return value;
+
+    while ((value >> exp) >= 2 * STATS_SUB_COUNT)
+        exp++;
+
+    return (exp + 1) * STATS_SUB_COUNT + (value >> exp) - STATS_SUB_COUNT;
+}
+
+/* the highest value that falls into @bucket */
+
+static uint64_t stats_bucket_max(unsigned int bucket) {
+    unsigned int exp;
+
+    if (bucket < STATS_SUB_COUNT)
+        return bucket;
+
+    exp = bucket / STATS_SUB_COUNT - 1;
+    return ((uint64_t) (bucket % STATS_SUB_COUNT + STATS_SUB_COUNT + 1) << exp) - 1;
+}
+
+static const char * stats_op_names[STATS_OPS] = {
+    [STATS_OP_GETATTR] = "getattr",
+    [STATS_OP_READLINK] = "readlink",
+    [STATS_OP_MKNOD] = "mknod",
+    [STATS_OP_MKDIR] = "mkdir",
+    [STATS_OP_UNLINK] = "unlink",
+    [STATS_OP_RMDIR] = "rmdir",
+    [STATS_OP_SYMLINK] = "symlink",
+    [STATS_OP_RENAME] = "rename",
+    [STATS_OP_LINK] = "link",
+    [STATS_OP_CHMOD] = "chmod",
+    [STATS_OP_CHOWN] = "chown",
+    [STATS_OP_TRUNCATE] = "truncate",
+    [STATS_OP_UTIME] = "utime",
+    [STATS_OP_OPEN] = "open",
+    [STATS_OP_READ] = "read",
+    [STATS_OP_WRITE] = "write",
+    [STATS_OP_STATFS] = "statfs",
+    [STATS_OP_FLUSH] = "flush",
+    [STATS_OP_RELEASE] = "release",
+    [STATS_OP_FSYNC] = "fsync",
+    [STATS_OP_SETXATTR] = "setxattr",
+    [STATS_OP_GETXATTR] = "getxattr",
+    [STATS_OP_LISTXATTR] = "listxattr",
+    [STATS_OP_REMOVEXATTR] = "removexattr",
+    [STATS_OP_OPENDIR] = "opendir",
+    [STATS_OP_READDIR] = "readdir",
+    [STATS_OP_RELEASEDIR] = "releasedir",
+    [STATS_OP_FSYNCDIR] = "fsyncdir",
+    [STATS_OP_ACCESS] = "access",
+    [STATS_OP_FGETATTR] = "fgetattr"
+};
+
+static const char * stats_counter_names[STATS_COUNTERS] = {
+    [STATS_EXTENT_ALLOCS] = "extent_allocs",
+    [STATS_BLOCKS_ALLOCATED] = "blocks_allocated",
+    [STATS_EXTENT_FREES] = "extent_frees",
+    [STATS_BLOCKS_FREED] = "blocks_freed",
+    [STATS_INODES_ALLOCATED] = "inodes_allocated",
+    [STATS_INODES_FREED] = "inodes_freed",
+    [STATS_INLINE_PROMOTED] = "inline_promoted",
+    [STATS_DELALLOC_FLUSHES] = "delalloc_flushes",
+    [STATS_CLUSTERS_COMPRESSED] = "compressed",
+    [STATS_BLOCKS_SAVED] = "compress_saved",
+    [STATS_CLUSTERS_UNCOMPRESSED] = "uncompressed",
+    [STATS_SNAPSHOTS] = "snapshots",
+    [STATS_BLOCKS_UNSHARED] = "blocks_unshared",
+    [STATS_COMMITS] = "commits"
+};
+
+int stats_init(void) {
+    STATS = (stats_t *) calloc(1, sizeof(stats_t));
+    return STATS == NULL ? -ENOMEM : 0;
+}
+
+void stats_destroy(void) {
+    free(STATS);
+    STATS = NULL;
+}
+
+uint64_t stats_start(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int stats_end(stats_op_t op, uint64_t start, int ret) {
+    stats_op_entry_t * entry;
+
+    if (STATS == NULL)
+        return ret;
+
+    entry = &STATS->ops[op];
+    __atomic_fetch_add(&entry->calls, 1, __ATOMIC_RELAXED);
+    if (ret < 0)
+        __atomic_fetch_add(&entry->errors, 1, __ATOMIC_RELAXED);
+    else if (op == STATS_OP_READ || op == STATS_OP_WRITE)
+        __atomic_fetch_add(&entry->bytes, ret, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&entry->latency[stats_bucket(stats_start() - start)], 1, __ATOMIC_RELAXED);
+
+    return ret;
+}
+
+void stats_count(stats_counter_t counter, unsigned long n) {
+    if (STATS != NULL)
+        __atomic_fetch_add(&STATS->counters[counter], n, __ATOMIC_RELAXED);
+}
+
+/* the latency under which @fraction of the calls to @entry completed, in
+ * microseconds */
+
+static double stats_percentile(stats_op_entry_t * entry, unsigned long calls, double fraction) {
+    unsigned long seen = 0;
+    unsigned int i;
+
+    for (i = 0; i < STATS_BUCKETS; i++) {
+        seen += __atomic_load_n(&entry->latency[i], __ATOMIC_RELAXED);
+        if (seen > 0 && seen >= fraction * calls)
+            return stats_bucket_max(i) / 1000.0;
+    }
+
+    return 0;
+}
+
+/* append to @buf like snprintf(), after the @len bytes already in it */
+
+static int stats_append(char * buf, size_t size, int len, const char * format, ...) {
+    va_list ap;
+    int n;
+
+    va_start(ap, format);
+    n = vsnprintf((size_t) len < size ? buf + len : NULL, (size_t) len < size ? size - len : 0, format, ap);
+    va_end(ap);
+
+    return len + (n > 0 ? n : 0);
+}
+
+int stats_print(char * buf, size_t size) {
+    stats_op_entry_t * entry;
+    unsigned long calls, hits, misses, writes;
+    int i, len = 0;
+
+    if (size > 0)
+        buf[0] = '\0';
+    if (STATS == NULL)
+        return 0;
+
+    len = stats_append(buf, size, len, "%-12s %10s %8s %14s %10s %10s %10s %10s\n",
+                       "op", "calls", "errors", "bytes", "p50_us", "p90_us", "p99_us", "max_us");
+
+    /* the operations which have not been called are left out */
+    for (i = 0; i < STATS_OPS; i++) {
+        entry = &STATS->ops[i];
+        calls = __atomic_load_n(&entry->calls, __ATOMIC_RELAXED);
+        if (calls == 0)
+            continue;
+
+        len = stats_append(buf, size, len, "%-12s %10lu %8lu %14lu %10.1f %10.1f %10.1f %10.1f\n",
+                           stats_op_names[i], calls,
+                           __atomic_load_n(&entry->errors, __ATOMIC_RELAXED),
+                           __atomic_load_n(&entry->bytes, __ATOMIC_RELAXED),
+                           stats_percentile(entry, calls, 0.5), stats_percentile(entry, calls, 0.9),
+                           stats_percentile(entry, calls, 0.99), stats_percentile(entry, calls, 1.0));
+    }
+
+    len = stats_append(buf, size, len, "\n");
+    for (i = 0; i < STATS_COUNTERS; i++)
+        len = stats_append(buf, size, len, "%-18s %lu\n", stats_counter_names[i],
+                           __atomic_load_n(&STATS->counters[i], __ATOMIC_RELAXED));
+
+    /* a mapped image has no cache */
+    if (BB_DATA->cache != NULL) {
+        cache_stats(&hits, &misses, &writes);
+        len = stats_append(buf, size, len, "%-18s %lu\n%-18s %lu\n%-18s %lu\n",
+                           "cache_hits", hits, "cache_misses", misses, "cache_writes", writes);
+    }
+    if (BB_DATA->clusters != NULL) {
+        cluster_cache_stats(&hits, &misses);
+        len = stats_append(buf, size, len, "%-18s %lu\n%-18s %lu\n",
+                           "cluster_hits", hits, "cluster_misses", misses);
+    }
+
+    return len;
+}
@@ -0,0 +1,48 @@
+/* this header file exposes the statistics kept on the operations of os-fs.c
+ * and on the work of the fs underneath: call counts, errors, bytes moved, and
+ * latency histograms per operation, and counters of allocator calls and
+ * commits; they are read from the virtual file STATS_PATH */
+/* nothing else should go in here */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "structs.h"
+
+/* start keeping statistics; all the functions below may be called from any
+ * no. of threads at once, and do nothing before stats_init()
+ *
+ * @return          0 on success, else -ENOMEM */
+
+int stats_init(void);
+
+/* stop keeping statistics */
+
+void stats_destroy(void);
+
+/* the time an operation starts, to be passed to stats_end() */
+
+uint64_t stats_start(void);
+
+/* record a call to @op which started at @start, and returned @ret: an error
+ * if negative, else the no. of bytes moved, for reads and writes
+ *
+ * @return          @ret */
+
+int stats_end(stats_op_t op, uint64_t start, int ret);
+
+/* add @n to @counter */
+
+void stats_count(stats_counter_t counter, unsigned long n);
+
+/* print the statistics as text into @buf, which holds @size bytes, like
+ * snprintf()
+ *
+ * @return          the length of the whole text */
+
+int stats_print(char * buf, size_t size);
+
+#endif /* _STATS_H_ */
@@ -5,7 +5,10 @@
 #define _STRUCTS_H_
 
 #include "config.h"
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <time.h>
 
 typedef enum {
@@ -18,10 +21,12 @@ typedef enum {
     RW = 1
 } file_mode_t;
 
-typedef unsigned short blk_addr_t;  /* required range: [0, BLK_COUNT] */
-typedef unsigned char inumber_t;    /* required range: [0, INODE_COUNT] */
-typedef unsigned short file_size_t; /* required range: [0, FILE_SIZE_MAX] */
-typedef unsigned int offset_t;      /* required range: [0, FS_SIZE] */
+/* these are part of the on-disk format; see FS_VERSION */
+typedef uint32_t blk_addr_t;        /* required range: [0, BLK_COUNT] */
+typedef uint32_t inumber_t;         /* required range: [0, INODE_COUNT + 1] */
+typedef uint64_t file_size_t;       /* required range: [0, FILE_SIZE_MAX] */
+typedef uint64_t offset_t;          /* required range: [0, FS_SIZE] */
+typedef uint16_t share_count_t;     /* required range: [0, SNAPSHOTS_MAX] */
 
 /* file attributes structure */
 typedef struct {
@@ -31,17 +36,62 @@ typedef struct {
     file_size_t    size;            /* stores no. of files when type == DIR_T */
 } file_attr_t;
 
-/* inode structure */
+/* inode flags */
+typedef enum {
+    INODE_F_EXTENTS = 0x1,          /* blocks are mapped by extents */
+    INODE_F_INDEX = 0x2,            /* directory is indexed by a hash tree */
+    INODE_F_INLINE = 0x4,           /* data is kept in the inode's block */
+    INODE_F_COMPRESS = 0x8,         /* data is compressed as it is written out */
+    INODE_F_SNAPSHOT = 0x10         /* read-only, in the directory of
+                                       snapshots or a snapshot */
+} inode_flags_t;
+
+/* a run of @len blocks of a file, from block no. @logical onwards, stored
+   in consecutive blocks starting at block address @physical; or, if @stored is
+   not 0, a cluster of @len blocks compressed into the @stored blocks at
+   @physical, which hold the size in bytes of the compressed data as a
+   uint32_t, and then the data (see compress.h) */
+typedef struct {
+    blk_addr_t     logical;
+    blk_addr_t     physical;
+    blk_addr_t     len;
+    blk_addr_t     stored;
+} extent_t;
+
+/* inode structure; the blocks of a file are mapped either by
+   @blocks_direct/@blocks_indirect, or (with INODE_F_EXTENTS) by the
+   @extent_count extents sorted by logical block no., the first
+   INODE_EXTENTS of which are kept in @extents, and the rest in
+   @extent_blocks. A file with INODE_F_COMPRESS may have compressed extents,
+   which are written whole, and stored uncompressed the first time they are
+   written to again. A file with INODE_F_INLINE has no blocks: its data, of at
+   most INODE_INLINE_MAX bytes, follows the inode in the inode's block. A
+   directory keeps the block its entries start from in
+   @blocks_direct[0]: a single leaf, or (with INODE_F_INDEX) the root of its
+   hash tree; @attr.size is its no. of entries. A snapshot (see mysnapshot())
+   copies the inodes and directories of the tree, but not the data: the data
+   blocks and compressed clusters of its files are shared with those of the
+   files it was taken of, and a file is given blocks of its own as it is
+   written to (see inode_unshare()). */
 typedef struct {
     inumber_t      inumber;
     file_attr_t    attr;
     blk_addr_t     blocks_direct[BLKS_DIRECT];
     blk_addr_t     blocks_indirect[BLKS_INDIRECT];
     bool           used;
+    unsigned char  flags;
+    unsigned short extent_count;
+    extent_t       extents[INODE_EXTENTS];
+    blk_addr_t     extent_blocks[INODE_EXTENT_BLOCKS];
 } inode_t;
 
 /* super block structure */
 typedef struct {
+    uint32_t       magic;           /* FS_MAGIC */
+    uint32_t       version;         /* FS_VERSION */
+    uint32_t       blk_size;
+    blk_addr_t     blk_count;
+    inumber_t      inode_count;
     char           fs_name[FS_NAME_MAX + 1];
     offset_t       fs_size;
     inumber_t      root;
@@ -49,22 +99,313 @@ typedef struct {
     blk_addr_t     block_free_count;
     inumber_t      inode_free_count;
     blk_addr_t     inode_list;
-    blk_addr_t     first_free_block;
+    offset_t       block_bitmap;    /* location of the free block bitmap */
+    blk_addr_t     share_start;     /* block address of the share table */
+    blk_addr_t     journal_start;   /* block address of the journal */
+    blk_addr_t     journal_count;
+    blk_addr_t     data_start;      /* block address of the first data block */
+    blk_addr_t     data_count;
+    inumber_t      snapshots;       /* the directory of snapshots */
 } super_block_t;
 
+/* the share table holds a share_count_t for each data block: the no. of
+   files besides the first whose data is in the block, which is 0 but for the
+   blocks shared with snapshots. A block is only freed once the last file lets
+   go of it (see extent_free()). */
+
+/* the journal: a header block, then room for one transaction, which is a
+   descriptor block, copies of the blocks it changes, and a commit block. A
+   transaction is replayed at mount only if its descriptor and commit blocks
+   carry the sequence no. in the header, and the commit block's checksum
+   matches. */
+
+/* journal header, in the first block of the journal */
+typedef struct {
+    uint32_t       magic;           /* JOURNAL_MAGIC */
+    uint32_t       sequence;        /* sequence no. of the next transaction */
+} journal_header_t;
+
+/* descriptor block; the block addresses of the @count blocks of the
+   transaction follow it, in the same block */
+typedef struct {
+    uint32_t       magic;
+    uint32_t       sequence;
+    uint32_t       count;
+} journal_descriptor_t;
+
+/* commit block */
+typedef struct {
+    uint32_t       magic;
+    uint32_t       sequence;
+    uint32_t       checksum;        /* of the descriptor and block copies */
+} journal_commit_t;
+
+/* an inode open through the file table; all the fds on it share this copy,
+   which whoever changes the file keeps in step with the inode table, under the
+   inode's write lock */
+typedef struct open_inode {
+    inode_t        inode;
+    unsigned int   refcount;        /* no. of fds on it */
+    char **        delayed;         /* the blocks from @delayed_from on, which
+                                       are not allocated yet (see
+                                       delalloc_write()) */
+    unsigned int   delayed_from;
+    unsigned int   delayed_count;   /* no. of blocks at @delayed; 0 if none */
+    unsigned int   delayed_max;     /* room at @delayed */
+    struct open_inode * hash_next;
+} open_inode_t;
+
 /* File Table Entry structure  */
 typedef struct {
-    inode_t inode;
-    unsigned char refCount;
+    pthread_mutex_t lock;           /* serialises users of the fields below */
+    open_inode_t * file;            /* shared with the other fds on the file */
     offset_t file_offset;
     blk_addr_t addr;
     void * data;
+    blk_addr_t indirect_addr;       /* the indirect block decoded in @indirect */
+    blk_addr_t * indirect;          /* MAX_ADDR_PER_BLOCK entries */
+    extent_t extent;                /* the extent looked up last, if @len > 0 */
+    unsigned long extent_moves;     /* BB_DATA->extents_moved when it was */
+    unsigned int ra_next;           /* block no. a sequential read starts at */
+    unsigned int ra_window;         /* readahead window, in blocks */
+    unsigned int ra_until;          /* blocks before this have been prefetched */
 } table_entry_t;
 
-/* File entry structure in a directory */
+/* a slot in the cache of decompressed clusters */
+typedef struct {
+    blk_addr_t     addr;            /* of the compressed cluster; 0 if free */
+    size_t         len;             /* no. of bytes of @data */
+    bool           referenced;      /* CLOCK reference bit */
+    char *         data;
+} cluster_slot_t;
+
+/* the cache of decompressed clusters, by the address of their compressed
+   data; it holds few clusters, which are looked up by a scan */
+typedef struct {
+    pthread_mutex_t lock;
+    unsigned int   count;           /* no. of slots */
+    unsigned int   hand;            /* CLOCK hand */
+    size_t         slot_size;       /* max bytes of a cluster */
+    cluster_slot_t * slots;
+    char *         data;            /* @count slots of @slot_size bytes */
+    unsigned long  hits;
+    unsigned long  misses;
+} cluster_cache_t;
+
+/* a slab allocator of objects of @size bytes, which carves them out of chunks
+   of @per_chunk objects, and keeps the freed ones for reuse; chunks are only
+   freed along with the slab. Objects and chunks are linked through their first
+   word. */
+typedef struct {
+    size_t         size;
+    unsigned int   per_chunk;
+    void *         free;
+    void *         chunks;
+} slab_t;
+
+/* the open file table: the entry of fd f is at
+   chunks[f / FILE_TABLE_CHUNK][f % FILE_TABLE_CHUNK] */
+typedef struct {
+    table_entry_t ** chunks[FILE_TABLE_CHUNKS];
+    int *          free_fds;        /* stack of the fds below @next_fd not in use */
+    unsigned int   free_count;
+    int            next_fd;         /* the fds from here on have never been used */
+    open_inode_t * buckets[OPEN_INODE_BUCKETS];     /* by inumber */
+    slab_t         entries;         /* table entries, with their block buffers */
+    slab_t         inodes;          /* open inodes */
+} file_table_t;
+
+/* a slot in the block cache */
+typedef struct cache_block {
+    blk_addr_t     addr;
+    bool           valid;
+    bool           dirty;
+    bool           referenced;      /* CLOCK reference bit */
+    bool           pinned;          /* not to be written before the journal
+                                       transaction it is in commits */
+    struct cache_block * hash_next;
+    char *         data;
+} cache_block_t;
+
+/* a shard of the block cache: the blocks whose address is congruent to the
+   shard's index (modulo the no. of shards), with their own slots, CLOCK hand
+   and lock, so that threads working on different blocks seldom contend */
+typedef struct {
+    pthread_mutex_t lock;
+    unsigned int   count;           /* no. of slots */
+    unsigned int   bucket_count;
+    unsigned int   hand;            /* CLOCK hand */
+    unsigned int   dirty_count;
+    unsigned int   pinned_count;
+    int            error;           /* -EIO once a dirty block has been lost
+                                       to a failed write, until cache_flush()
+                                       reports it */
+    cache_block_t * blocks;
+    cache_block_t ** buckets;
+    unsigned long  hits;
+    unsigned long  misses;
+    unsigned long  writes;
+} cache_shard_t;
+
+/* block cache structure */
+typedef struct {
+    int            fd;              /* the storage file, for pread/pwrite */
+    unsigned int   count;           /* no. of slots */
+    unsigned int   shard_count;
+    cache_shard_t * shards;
+    cache_block_t * blocks;
+    cache_block_t ** buckets;
+    char *         data;            /* @count blocks, one per slot */
+} block_cache_t;
+
+/* the running journal transaction */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int            fd;              /* the storage file, for pread/pwrite */
+    uint32_t       sequence;        /* of the running transaction */
+    unsigned int   handles;         /* no. of operations in progress */
+    bool           committing;
+    bool           overflow;        /* too many blocks to journal */
+    unsigned int   count;           /* no. of blocks in @blocks */
+    blk_addr_t *   blocks;          /* JOURNAL_TXN_MAX blocks */
+    uint64_t *     dirty;           /* bit set for each block in @blocks */
+} journal_t;
+
+/* a message in the log ring; @seq tells who owns the slot (see logger.c) */
+typedef struct {
+    unsigned long  seq;
+    unsigned int   len;
+    char           text[LOG_LINE_MAX];
+} log_record_t;
+
+/* the log ring: any thread adds messages at @head without taking a lock, and
+   the flusher thread writes them out from @tail */
+typedef struct {
+    log_record_t * records;         /* LOG_RING_SIZE records */
+    unsigned long  head;
+    unsigned long  tail;
+    unsigned long  dropped;         /* messages dropped since the last flush */
+    bool           stop;
+    FILE *         file;
+    pthread_t      thread;
+} log_ring_t;
+
+/* the operations of os-fs.c which are timed */
+typedef enum {
+    STATS_OP_GETATTR,
+    STATS_OP_READLINK,
+    STATS_OP_MKNOD,
+    STATS_OP_MKDIR,
+    STATS_OP_UNLINK,
+    STATS_OP_RMDIR,
+    STATS_OP_SYMLINK,
+    STATS_OP_RENAME,
+    STATS_OP_LINK,
+    STATS_OP_CHMOD,
+    STATS_OP_CHOWN,
+    STATS_OP_TRUNCATE,
+    STATS_OP_UTIME,
+    STATS_OP_OPEN,
+    STATS_OP_READ,
+    STATS_OP_WRITE,
+    STATS_OP_STATFS,
+    STATS_OP_FLUSH,
+    STATS_OP_RELEASE,
+    STATS_OP_FSYNC,
+    STATS_OP_SETXATTR,
+    STATS_OP_GETXATTR,
+    STATS_OP_LISTXATTR,
+    STATS_OP_REMOVEXATTR,
+    STATS_OP_OPENDIR,
+    STATS_OP_READDIR,
+    STATS_OP_RELEASEDIR,
+    STATS_OP_FSYNCDIR,
+    STATS_OP_ACCESS,
+    STATS_OP_FGETATTR,
+    STATS_OPS                       /* no. of operations */
+} stats_op_t;
+
+/* the events of fs_functions.c which are counted */
+typedef enum {
+    STATS_EXTENT_ALLOCS,            /* calls to the block allocator */
+    STATS_BLOCKS_ALLOCATED,
+    STATS_EXTENT_FREES,
+    STATS_BLOCKS_FREED,
+    STATS_INODES_ALLOCATED,
+    STATS_INODES_FREED,
+    STATS_INLINE_PROMOTED,          /* files which grew out of their inode */
+    STATS_DELALLOC_FLUSHES,         /* allocations of data held back */
+    STATS_CLUSTERS_COMPRESSED,
+    STATS_BLOCKS_SAVED,             /* by the clusters compressed */
+    STATS_CLUSTERS_UNCOMPRESSED,    /* compressed clusters written to again */
+    STATS_SNAPSHOTS,                /* snapshots taken */
+    STATS_BLOCKS_UNSHARED,          /* shared blocks given a copy on write */
+    STATS_COMMITS,
+    STATS_COUNTERS                  /* no. of counters */
+} stats_counter_t;
+
+/* calls to one operation; all fields are updated atomically */
+typedef struct {
+    unsigned long  calls;
+    unsigned long  errors;
+    unsigned long  bytes;           /* moved by reads and writes */
+    unsigned long  latency[STATS_BUCKETS];  /* histogram, see stats.c */
+} stats_op_entry_t;
+
+typedef struct {
+    stats_op_entry_t ops[STATS_OPS];
+    unsigned long  counters[STATS_COUNTERS];
+} stats_t;
+
+/* directory entry cache entry; @inumber == 0 caches a failed lookup */
+typedef struct {
+    bool           valid;
+    inumber_t      parent;
+    inumber_t      inumber;
+    char           name[FILE_NAME_MAX + 1];
+} dcache_entry_t;
+
+/* File entry structure in a directory; a leaf block of a directory is an
+   array of these, in no particular order, with @inumber == 0 in the free
+   ones */
 typedef struct {
     char name[FILE_NAME_MAX + 1];
     inumber_t inumber;
 } file_entry_t;
 
+/* an index block of a directory is a header, then @count entries sorted by
+   hash, the first of which has hash 0; each entry leads to the block (a leaf,
+   or an index block one level down) which holds the names whose hash (see
+   dir_hash()) is at least its @hash, and below the @hash of the next entry. All
+   names with the same hash are in the same leaf. */
+typedef union {
+    struct {
+        uint32_t   count;
+        uint32_t   levels;          /* in the root: no. of index levels below */
+    } header;                       /* the first element of an index block */
+    struct {
+        uint32_t   hash;
+        blk_addr_t addr;
+    } entry;                        /* the others */
+} dir_index_t;
+
+/* called by myreaddir() for each entry listed, with @buf as passed to it,
+   and the inode of the entry; @next is the offset to resume the listing at
+   after this entry
+   @return          nonzero to stop the listing */
+typedef int (* dir_filler_t)(void * buf, const char * name, const inode_t * inode, offset_t next);
+
+/* the directories a snapshot is being copied from (see snapshot_tree()),
+   queued with the copies their entries go into; or the inodes of a snapshot
+   being freed (see snapshot_free()) */
+typedef struct {
+    inumber_t *    from;
+    inumber_t *    to;
+    unsigned long  count;
+    unsigned long  max;             /* room at @from and @to */
+    inode_t        dir;             /* the copy of the directory listed */
+    int            ret;             /* 0, else the -errno the walk stopped at */
+} snapshot_walk_t;
+
 #endif /* _STRUCTS_H_ */
@@ -1,31 +1,218 @@
+/* runs the same workload on the fs formatted with each block size in turn,
+ * and reports the write and read throughput for each, to find the block size
+ * that suits the workload best; then checks that a file written over after a
+ * snapshot was taken of it reads back right, and so does the snapshot
+ *
+ * the fs functions are called directly, without FUSE, so the fuse context
+ * they get their state from is provided here */
+
+#include "params.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include  "fs_functions.h"
-#include <math.h>
-//extern void errorExit(char * errorStr);
-
-int main()
-{
-    /* Format the disk */
-    printf("Formatting Disk....");
-    myformat("fs");
-    printf("Done\n");
-
-    /* Mount the disk */
-    printf("Mounting Disk ....");
-    if(mount("fs") == 0)
-        printf("Done.\n");
-    else {
-        fprintf(stderr,"Error mounting disk\n");
-        exit(EXIT_FAILURE);
+#include <time.h>
+#include "fs_functions.h"
+
+#define TEST_IMAGE "fs"
+#define TEST_FS_SIZE "64M"
+#define TEST_TOTAL_BYTES (16 * 1024 * 1024)
+#define TEST_FILE_BYTES (1024 * 1024)
+#define TEST_IO_BYTES (64 * 1024)
+
+/* the file of the snapshot check, and the no. and max size of the writes over
+   it, which split its extents until it has as many as it can have */
+#define TEST_SNAP_BYTES (3 * 1024 * 1024)
+#define TEST_SNAP_WRITES 300
+#define TEST_SNAP_IO_BYTES (20 * 1024)
+
+static struct bb_state test_state;
+static struct fuse_context test_context = { .private_data = &test_state };
+
+struct fuse_context * fuse_get_context(void) {
+    return &test_context;
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* write (@write == 1) or read back @nfiles files of @file_bytes bytes each
+ *
+ * @return          the no. of bytes transferred, else -1 on error */
+
+static long run_workload(int write, int nfiles, size_t file_bytes, char * buf) {
+    char path[PATH_LEN_MAX];
+    size_t done, n;
+    long total = 0;
+    int i, fd, ret;
+
+    for (i = 0; i < nfiles; i++) {
+        sprintf(path, "/f%d", i);
+        fd = myopen(path, "w");
+        if (fd < 0)
+            return -1;
+
+        for (done = 0; done < file_bytes; done += n) {
+            n = file_bytes - done < TEST_IO_BYTES ? file_bytes - done : TEST_IO_BYTES;
+            ret = write ? mypwrite(fd, buf, n, done) : mypread(fd, buf, n, done);
+            if (ret != (int) n)
+                return -1;
+        }
+
+        if (write && myfsync(fd) != 0)
+            return -1;
+        myclose(fd);
+        total += file_bytes;
+    }
+
+    return total;
+}
+
+/* @return          nonzero if the file @path holds the @len bytes at @expected */
+
+static int read_back(const char * path, const char * expected, size_t len, char * buf) {
+    int fd = myopen(path, "w"), ok;
+
+    if (fd < 0)
+        return 0;
+    ok = mypread(fd, buf, len, 0) == (int) len && memcmp(buf, expected, len) == 0;
+    myclose(fd);
+
+    return ok;
+}
+
+/* write a file, take a snapshot, write over random parts of the file, and
+ * read back both the file and its copy in the snapshot, before and after a
+ * remount, on the fs formatted with @blk_size
+ *
+ * @return          0 if both hold what they should, else -1 */
+
+static int run_snapshot_check(unsigned int blk_size) {
+    char * before = malloc(TEST_SNAP_BYTES), * after = malloc(TEST_SNAP_BYTES);
+    char * buf = malloc(TEST_SNAP_BYTES), command[256];
+    size_t pos, len, n;
+    int i, fd, ret = -1;
+
+    sprintf(command, "./format -b %u -s %s %s > /dev/null", blk_size, TEST_FS_SIZE, TEST_IMAGE);
+    if (before == NULL || after == NULL || buf == NULL || system(command) != 0 || mymount(TEST_IMAGE) != 0)
+        goto out;
+
+    srand(blk_size);
+    for (pos = 0; pos < TEST_SNAP_BYTES; pos++)
+        before[pos] = rand();
+    memcpy(after, before, TEST_SNAP_BYTES);
+
+    fd = myopen("/f", "w");
+    if (fd < 0)
+        goto unmount;
+    if (mypwrite(fd, before, TEST_SNAP_BYTES, 0) != TEST_SNAP_BYTES || mymkdir("/.snapshots/s1") != 0) {
+        myclose(fd);
+        goto unmount;
+    }
+
+    /* the bytes written over read back as the new ones, in the file only */
+    for (i = 0; i < TEST_SNAP_WRITES; i++) {
+        len = rand() % TEST_SNAP_IO_BYTES + 1;
+        pos = rand() % (TEST_SNAP_BYTES - len);
+        for (n = 0; n < len; n++)
+            after[pos + n] = rand();
+        if (mypwrite(fd, after + pos, len, pos) != (int) len) {
+            printf("%10u: write %d over the snapshot failed\n", blk_size, i);
+            myclose(fd);
+            goto unmount;
+        }
     }
+    myclose(fd);
+
+    for (i = 0; i < 2; i++) {
+        if (! read_back("/f", after, TEST_SNAP_BYTES, buf) ||
+            ! read_back("/.snapshots/s1/f", before, TEST_SNAP_BYTES, buf)) {
+            printf("%10u: the file or its snapshot reads back wrong\n", blk_size);
+            goto unmount;
+        }
+        myunmount(TEST_IMAGE);
+        if (mymount(TEST_IMAGE) != 0)
+            goto out;
+    }
+    ret = 0;
+
+ unmount:
+    myunmount(TEST_IMAGE);
+ out:
+    free(before);
+    free(after);
+    free(buf);
+    return ret;
+}
+
+int main(void) {
+    unsigned int blk_size;
+    char command[256];
+    char * buf = malloc(TEST_IO_BYTES);
+    size_t file_bytes;
+    double start, write_secs, read_secs;
+    long bytes;
+    int nfiles;
+
+    memset(buf, 'x', TEST_IO_BYTES);
 
-    for (i = 0; i < n; i++) {
-        mymkdir("/");
+    /* logging every call would dominate the timings */
+    test_state.logfile = fopen("/dev/null", "w");
+
+    printf("%10s %10s %8s %12s %12s\n", "blk_size", "file_size", "files", "write MB/s", "read MB/s");
+
+    for (blk_size = BLK_SIZE_MIN; blk_size <= BLK_SIZE_MAX; blk_size *= 2) {
+        /* Format the disk */
+        sprintf(command, "./format -b %u -s %s %s", blk_size, TEST_FS_SIZE, TEST_IMAGE);
+        if (system(command) != 0) {
+            fprintf(stderr, "Error formatting disk\n");
+            exit(EXIT_FAILURE);
+        }
+
+        /* Mount the disk */
+        if (mymount(TEST_IMAGE) != 0) {
+            fprintf(stderr, "Error mounting disk\n");
+            exit(EXIT_FAILURE);
+        }
+
+        file_bytes = TEST_FILE_BYTES;
+        nfiles = TEST_TOTAL_BYTES / file_bytes;
+
+        start = now();
+        bytes = run_workload(1, nfiles, file_bytes, buf);
+        write_secs = now() - start;
+
+        /* remount, so that the reads start with a cold cache */
+        myunmount(TEST_IMAGE);
+        mymount(TEST_IMAGE);
+
+        start = now();
+        if (bytes >= 0)
+            bytes = run_workload(0, nfiles, file_bytes, buf);
+        read_secs = now() - start;
+
+        myunmount(TEST_IMAGE);
+
+        if (bytes < 0) {
+            printf("%10u: workload failed\n", blk_size);
+            continue;
+        }
+
+        printf("%10u %10zu %8d %12.1f %12.1f\n", blk_size, file_bytes, nfiles,
+               bytes / write_secs / (1024 * 1024), bytes / read_secs / (1024 * 1024));
     }
 
-    unmount("fs");
+    free(buf);
+
+    if (run_snapshot_check(BLK_SIZE_MIN) != 0) {
+        printf("%10u: snapshot check failed\n", BLK_SIZE_MIN);
+        return EXIT_FAILURE;
+    }
+    printf("%10u: snapshot check passed\n", BLK_SIZE_MIN);
 
     return 0;
 }